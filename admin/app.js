@@ -13,6 +13,11 @@ let autoRefreshInterval = null;
 let isAutoRefreshEnabled = false;
 let lastQueryResult = null;
 let dbConnFailureCount = 0;  // Track consecutive DB connection failures
+let msgKeyColumn = null;     // 'ulid' (text keys) or 'ulid_bin' (binary keys), detected on first query
+let msgHasCodec = false;     // Whether msg has the codec column of payload compression, detected with the key
+let msgStatsAvailable = null;  // Whether the plugin maintains msg_stats, detected on the first status check
+let dbPageCursors = [];      // ULID below which each older page starts; empty = newest page
+let dbPageLastUlid = null;   // Oldest ULID on the current page, the cursor of the next one
 
 // MQTT state
 let mqttClient = null;
@@ -20,8 +25,19 @@ let mqttClient = null;
 let mqttMessagesMap = new Map();
 const MAX_TOPICS = 5000;
 const MAX_DB_RESULTS = 5000;  // Maximum rows to return from database queries
+const MAX_RESIDUAL_PAGES = 20;  // Pages scanned per load when rows need client-side topic matching
 const MQTT_TOPIC = '#';  // Subscribe to all topics
 
+// Compressed payloads are fetched decompressed through the plugin's history replay
+const HISTORY_REPLY_PREFIX = 'mqbase-admin/history/';  // Response topics of decode requests
+const HISTORY_TIMEOUT_MS = 5000;
+const HISTORY_PAGE_LIMIT = 1000;  // Rows per history page (capped by the plugin's history_max_limit)
+const HISTORY_MAX_PAGES = 20;     // History pages read to decode one result
+let historySeq = 0;
+const historyRequests = new Map();  // Response topic -> pending decode request
+const decodedPayloads = new Map();  // ULID -> decompressed payload cell (stored rows never change)
+const utf8Decoder = new TextDecoder('utf-8', { fatal: true });
+
 // =============================================================================
 // Utility Functions
 // =============================================================================
@@ -61,6 +77,13 @@ function makeCopyableCell(className, value) {
     return `<td class="${className} copyable" title="${escapedValue}"><span class="cell-text">${displayValue}</span><span class="copy-icon" onclick="event.stopPropagation(); copyToClipboard('${escapedValue}', this)" title="Copy to clipboard">📋</span></td>`;
 }
 
+// Get the display value of a result cell (BLOB payloads are shown as base64)
+function cellValue(cell) {
+    if (cell === null || cell === undefined) return null;
+    if (cell.type === 'blob') return `base64:${cell.base64 || ''}`;
+    return cell.value;
+}
+
 // Crockford's Base32 alphabet used in ULID
 const ULID_ENCODING = '0123456789ABCDEFGHJKMNPQRSTVWXYZ';
 
@@ -96,6 +119,18 @@ function formatTimestamp(date) {
     return `${yearStr}-${month}-${day} ${hours}:${minutes}:${seconds}.${milliseconds}`;
 }
 
+// Format a byte count with a binary unit, e.g. 1536 -> '1.5 KiB'
+function formatBytes(bytes) {
+    const units = ['B', 'KiB', 'MiB', 'GiB', 'TiB'];
+    let value = bytes;
+    let unit = 0;
+    while (value >= 1024 && unit < units.length - 1) {
+        value /= 1024;
+        unit++;
+    }
+    return unit === 0 ? `${value} B` : `${value.toFixed(1)} ${units[unit]}`;
+}
+
 // ULID timestamp extraction
 // ULID format: first 10 characters encode timestamp in milliseconds since Unix epoch
 function extractTimestampFromULID(ulid) {
@@ -178,6 +213,83 @@ function mqttTopicMatches(pattern, topic) {
     return ti === topicLevels.length;
 }
 
+// Escape GLOB metacharacters so a topic level is matched literally
+function globEscape(text) {
+    return text.replace(/[*?[]/g, '[$&]');
+}
+
+// Smallest string greater than every string starting with prefix
+function nextPrefix(prefix) {
+    const last = prefix.length - 1;
+    return prefix.slice(0, last) + String.fromCharCode(prefix.charCodeAt(last) + 1);
+}
+
+function sqlText(value) {
+    return { type: 'text', value: value };
+}
+
+function sqlInteger(value) {
+    return { type: 'integer', value: String(value) };
+}
+
+// Compile a topic filter into index-friendly SQL conditions with bound arguments. The text
+// before the first wildcard becomes a range on topic, served by idx_msg_topic_ulid, and the
+// remaining levels a GLOB residual. '+' levels become '*' with the number of levels pinned,
+// so '*' cannot span a '/'. exact is false when the SQL conditions are a superset
+// ('+' combined with '#') and rows still have to pass mqttTopicMatches.
+// Filters containing '%' are LIKE patterns, as before. LIKE ignores ASCII case, so the
+// range on their literal prefix is only added when the prefix has no ASCII letters.
+// Returns null for an invalid MQTT filter.
+function compileTopicFilter(filter) {
+    const conditions = [];
+    const args = [];
+    const addRange = (lo, prefix) => {
+        if (prefix) {
+            conditions.push('topic >= ?', 'topic < ?');
+            args.push(sqlText(lo), sqlText(nextPrefix(prefix)));
+        }
+    };
+    
+    if (filter.includes('%')) {
+        const prefix = filter.slice(0, filter.search(/[%_]/));
+        if (!/[A-Za-z]/.test(prefix)) {
+            addRange(prefix, prefix);
+        }
+        conditions.push('topic LIKE ?');
+        args.push(sqlText(filter));
+        return { conditions, args, exact: true };
+    }
+    
+    const wildcardAt = filter.search(/[+#]/);
+    if (wildcardAt < 0) {
+        return { conditions: ['topic = ?'], args: [sqlText(filter)], exact: true };
+    }
+    
+    const levels = filter.split('/');
+    const hashAt = levels.indexOf('#');
+    const hasPlus = levels.includes('+');
+    const invalid = levels.some((level, i) => (level.includes('#') && (level !== '#' || i !== levels.length - 1)) ||
+                                              (level.includes('+') && level !== '+'));
+    if (invalid) {
+        return null;
+    }
+    
+    // "a/b/#" also matches "a/b", so its range starts at the parent topic
+    const prefix = filter.slice(0, wildcardAt);
+    addRange(hashAt >= 0 && !hasPlus && prefix.endsWith('/') ? prefix.slice(0, -1) : prefix, prefix);
+    
+    const residual = levels.slice(0, hashAt < 0 ? levels.length : hashAt)
+        .map(level => level === '+' ? '*' : globEscape(level)).join('/');
+    if (hashAt < 0) {
+        conditions.push('topic GLOB ?', `length(topic) - length(replace(topic, '/', '')) = ?`);
+        args.push(sqlText(residual), sqlInteger(levels.length - 1));
+    } else if (hashAt > 0) {
+        conditions.push('(topic GLOB ? OR topic GLOB ?)');
+        args.push(sqlText(residual), sqlText(`${residual}/*`));
+    }
+    return { conditions, args, exact: !hasPlus || hashAt < 0 };
+}
+
 function setCookie(name, value, days) {
     const expires = new Date();
     expires.setTime(expires.getTime() + (days * 24 * 60 * 60 * 1000));
@@ -462,6 +574,8 @@ function performLogout() {
         dbTbody.innerHTML = '';
     }
     document.getElementById('dbStatusIcon').textContent = '⚫';
+    document.getElementById('dbStatusIcon').title = '';
+    msgStatsAvailable = null;
     
     // Clear broker tab data and disconnect MQTT
     mqttMessagesMap.clear();
@@ -487,7 +601,8 @@ function performLogout() {
 // Database Tab Functions
 // =============================================================================
 
-async function executeSQL(sql) {
+// Run one statement through sqld; args are Hrana values bound to the ? placeholders
+async function executeSQL(sql, args = null) {
     try {
         const headers = {
             'Content-Type': 'application/json',
@@ -504,7 +619,7 @@ async function executeSQL(sql) {
             method: 'POST',
             headers: headers,
             body: JSON.stringify({
-                stmt: [sql]
+                stmt: args ? { sql: sql, args: args } : [sql]
             })
         });
 
@@ -538,11 +653,25 @@ async function dbConnState() {
     }
     
     try {
-        // Simple query to test database connectivity
+        // Cheap query to test database connectivity: the maintained msg_stats total
+        // (plugin_opt_stats) is one key lookup, where COUNT(*) would scan an index
         // Skip session refresh - this is a background status check, not user activity
-        const result = await executeSQL(`SELECT COUNT(*) FROM msg LIMIT 1`);
+        if (msgStatsAvailable === null) {
+            const tables = await executeSQL(`SELECT name FROM sqlite_master WHERE type = 'table' AND name = 'msg_stats'`);
+            msgStatsAvailable = !!(tables.result && tables.result.rows && tables.result.rows.length > 0);
+        }
+        const result = await executeSQL(msgStatsAvailable
+            ? `SELECT rows, bytes FROM msg_stats WHERE prefix = '#'`
+            : `SELECT 1`);
         if (result.result) {
-            document.getElementById('dbStatusIcon').textContent = '🟢';
+            const icon = document.getElementById('dbStatusIcon');
+            icon.textContent = '🟢';
+            if (msgStatsAvailable) {
+                const row = result.result.rows && result.result.rows[0];
+                const rows = row ? Number(row[0].value) : 0;
+                const bytes = row ? Number(row[1].value) : 0;
+                icon.title = `${rows.toLocaleString()} messages stored (${formatBytes(bytes)})`;
+            }
             dbConnFailureCount = 0;  // Reset failure counter on success
         }
     } catch (error) {
@@ -557,6 +686,185 @@ async function dbConnState() {
     }
 }
 
+// Detect whether msg is the binary-key view (has ulid_bin), so filters and ordering
+// can use the indexed binary key instead of the computed text ULID. Also notes whether
+// rows carry a codec, i.e. payloads may be compressed.
+async function detectMsgKeyColumn() {
+    if (msgKeyColumn) return msgKeyColumn;
+    try {
+        const result = await executeSQL(`SELECT name FROM pragma_table_info('msg') WHERE name IN ('ulid_bin', 'codec')`);
+        const names = result.result && result.result.rows ? result.result.rows.map(row => row[0].value) : [];
+        msgKeyColumn = names.includes('ulid_bin') ? 'ulid_bin' : 'ulid';
+        msgHasCodec = names.includes('codec');
+    } catch (error) {
+        return 'ulid';
+    }
+    return msgKeyColumn;
+}
+
+// The ULID just below the given one, as the exclusive history start of that row
+function previousUlid(ulid) {
+    let value = 0n;
+    for (const char of ulid.toUpperCase()) {
+        value = value * 32n + BigInt(ULID_ENCODING.indexOf(char));
+    }
+    if (value > 0n) value -= 1n;
+    let result = '';
+    for (let i = 0; i < 26; i++) {
+        result = ULID_ENCODING[Number(value & 31n)] + result;
+        value >>= 5n;
+    }
+    return result;
+}
+
+// Fetch one page of stored rows, decompressed, through the plugin's history replay: sqld
+// has no decompress(), but the plugin returns replayed payloads as published. Resolves to
+// the rows (ULID -> payload bytes) with the end marker's next and count, or null without
+// history access or on timeout.
+function fetchHistoryPage(filter, since, limit) {
+    if (!mqttClient || !mqttClient.connected) {
+        return Promise.resolve(null);
+    }
+    return new Promise(resolve => {
+        const responseTopic = `${HISTORY_REPLY_PREFIX}${mqttClient.options.clientId}/${++historySeq}`;
+        const request = { rows: new Map(), resolve };
+        request.timer = setTimeout(() => finishHistoryRequest(responseTopic, null), HISTORY_TIMEOUT_MS);
+        historyRequests.set(responseTopic, request);
+        mqttClient.publish('$history/admin', '', {
+            qos: 1,
+            properties: {
+                responseTopic,
+                userProperties: { filter, since, limit: String(limit) },
+            },
+        }, err => {
+            if (err) finishHistoryRequest(responseTopic, null);
+        });
+    });
+}
+
+function finishHistoryRequest(responseTopic, end) {
+    const request = historyRequests.get(responseTopic);
+    if (!request) return;
+    historyRequests.delete(responseTopic);
+    clearTimeout(request.timer);
+    request.resolve(end ? { rows: request.rows, next: end.next, count: parseInt(end.count) || 0 } : null);
+}
+
+// Route a reply to a decode request: the rows, then history=end (or history=error)
+function handleHistoryReply(topic, payload, packet) {
+    const request = historyRequests.get(topic);
+    if (!request) return;
+    const props = packet.properties && packet.properties.userProperties ? packet.properties.userProperties : {};
+    if (props.history) {
+        finishHistoryRequest(topic, props.history === 'end' ? props : null);
+    } else if (props.ulid) {
+        request.rows.set(props.ulid, new Uint8Array(payload));
+    }
+}
+
+// Narrowest MQTT filter covering the topics: the topic itself, or their common leading
+// levels followed by #
+function historyFilter(topics) {
+    const unique = [...new Set(topics)];
+    if (unique.length === 1) return unique[0];
+    const split = unique.map(topic => topic.split('/'));
+    let common = Math.min(...split.map(levels => levels.length - 1));
+    for (const levels of split) {
+        let i = 0;
+        while (i < common && levels[i] === split[0][i]) i++;
+        common = i;
+    }
+    return common > 0 ? `${split[0].slice(0, common).join('/')}/#` : '#';
+}
+
+// Result cell for payload bytes, as sqld returns payloads stored with payload_format auto:
+// text if they are UTF-8, else a BLOB
+function payloadCell(bytes) {
+    try {
+        return { type: 'text', value: utf8Decoder.decode(bytes) };
+    } catch (error) {
+        return { type: 'blob', base64: bytesToBase64(bytes) };
+    }
+}
+
+// Replace compressed payload cells (codec not NULL) with the decompressed payload. The
+// rows are read in one history range: from just below the oldest compressed row, in ULID
+// order, continued with next until the newest one. Rows that cannot be decoded keep the
+// BLOB, shown as zstd: plus its base64.
+async function decodeCompressedRows(result) {
+    if (!result || !result.result || !result.result.rows) return;
+    const cols = result.result.cols.map(col => col.name.toLowerCase());
+    const ulidIndex = cols.indexOf('ulid');
+    const topicIndex = cols.indexOf('topic');
+    const payloadIndex = cols.indexOf('payload');
+    const codecIndex = cols.indexOf('codec');
+    if (ulidIndex < 0 || topicIndex < 0 || payloadIndex < 0 || codecIndex < 0) return;
+    
+    const pending = result.result.rows.filter(row => row[codecIndex].type !== 'null' &&
+                                                     row[payloadIndex].type === 'blob');
+    if (decodedPayloads.size > MAX_DB_RESULTS) decodedPayloads.clear();
+    const missing = pending.filter(row => !decodedPayloads.has(row[ulidIndex].value));
+    if (missing.length > 0) {
+        const ulids = missing.map(row => row[ulidIndex].value).sort();
+        const wanted = new Set(ulids);
+        const newest = ulids[ulids.length - 1];
+        const filter = historyFilter(missing.map(row => row[topicIndex].value));
+        let since = previousUlid(ulids[0]);
+        for (let pages = 0; pages < HISTORY_MAX_PAGES && wanted.size > 0; pages++) {
+            const page = await fetchHistoryPage(filter, since, HISTORY_PAGE_LIMIT);
+            if (!page) break;
+            for (const [ulid, bytes] of page.rows) {
+                if (wanted.delete(ulid)) decodedPayloads.set(ulid, payloadCell(bytes));
+            }
+            if (page.count === 0 || !page.next || page.next >= newest) break;
+            since = page.next;
+        }
+    }
+    for (const row of pending) {
+        const cell = decodedPayloads.get(row[ulidIndex].value);
+        row[payloadIndex] = cell || { type: 'text', value: `zstd:${row[payloadIndex].base64 || ''}` };
+    }
+}
+
+function bytesToBase64(bytes) {
+    // In chunks: spreading a large payload would exceed the argument limit
+    let binary = '';
+    for (let i = 0; i < bytes.length; i += 0x8000) {
+        binary += String.fromCharCode(...bytes.subarray(i, i + 0x8000));
+    }
+    return btoa(binary);
+}
+
+// Generate the binary ULID lower bound (6-byte timestamp) as a blob argument
+function timestampToUlidBlob(timestampMs) {
+    let value = Math.floor(timestampMs);
+    const bytes = new Uint8Array(6);
+    for (let i = 5; i >= 0; i--) {
+        bytes[i] = value % 256;
+        value = Math.floor(value / 256);
+    }
+    return { type: 'blob', base64: bytesToBase64(bytes) };
+}
+
+// Key argument comparable with the msg key column: the ULID text, or its 16 raw bytes
+function ulidKeyArg(ulid, keyColumn) {
+    if (keyColumn !== 'ulid_bin') {
+        return sqlText(ulid);
+    }
+    let value = 0n;
+    for (const char of ulid.toUpperCase()) {
+        value = value * 32n + BigInt(ULID_ENCODING.indexOf(char));
+    }
+    const bytes = new Uint8Array(16);
+    for (let i = 15; i >= 0; i--) {
+        bytes[i] = Number(value & 0xffn);
+        value >>= 8n;
+    }
+    return { type: 'blob', base64: bytesToBase64(bytes) };
+}
+
+// Load one page of messages, newest first. Pages are keyset-paginated on the ULID key
+// (key < cursor), so an older page costs the same as the first one.
 async function loadMessages() {
     // Skip if not logged in
     if (!mqbaseCredentials) {
@@ -571,35 +879,32 @@ async function loadMessages() {
     
     const topicFilter = document.getElementById('topicFilter').value.trim();
     const timeFilter = document.getElementById('timeFilter').value;
-    const limit = document.getElementById('limit').value;
-    
-    // Select only the essential columns: topic, payload, ulid (headers contains ulid)
-    let sql = `SELECT topic, payload, ulid FROM msg`;
+    const limit = parseInt(document.getElementById('limit').value);
+    const keyColumn = await detectMsgKeyColumn();
     
     let whereConditions = [];
+    let args = [];
+    let exact = true;
     
     // Add topic filter
     if (topicFilter) {
-        if (topicFilter.includes('%')) {
-            whereConditions.push(`topic LIKE '${topicFilter}'`);
-        } else {
-            whereConditions.push(`topic = '${topicFilter}'`);
+        const compiled = compileTopicFilter(topicFilter);
+        if (!compiled) {
+            showMessage('Invalid topic filter: + and # must fill a whole level, # only the last', 'error');
+            return;
         }
+        whereConditions.push(...compiled.conditions);
+        args.push(...compiled.args);
+        exact = compiled.exact;
     }
     
     // Add time filter using ULID prefix (ULIDs are lexicographically sortable by time)
     if (timeFilter !== 'all') {
         const days = parseInt(timeFilter);
         const cutoffMs = Date.now() - (days * 24 * 60 * 60 * 1000);
-        const cutoffPrefix = timestampToUlidPrefix(cutoffMs);
-        whereConditions.push(`ulid >= '${cutoffPrefix}'`);
-    }
-    
-    // Combine WHERE conditions with AND
-    if (whereConditions.length > 0) {
-        sql += ` WHERE ` + whereConditions.join(' AND ');
+        whereConditions.push(`${keyColumn} >= ?`);
+        args.push(keyColumn === 'ulid_bin' ? timestampToUlidBlob(cutoffMs) : sqlText(timestampToUlidPrefix(cutoffMs)));
     }
-    sql += ` ORDER BY ulid DESC LIMIT ${limit}`;
 
     // Only show loading on first load or manual refresh (not during auto-refresh)
     if (!lastQueryResult) {
@@ -607,7 +912,50 @@ async function loadMessages() {
     }
     
     try {
-        const result = await executeSQL(sql);
+        // Filters the SQL can only narrow down are matched here, continuing below the
+        // last row scanned until the page is full. nextCursor is where the older page
+        // starts: the last row shown, or the last row scanned when the scan gave up.
+        let cursor = dbPageCursors.length > 0 ? dbPageCursors[dbPageCursors.length - 1] : null;
+        let nextCursor = null;
+        let result = null;
+        let rows = [];
+        for (let pages = 0; pages < (exact ? 1 : MAX_RESIDUAL_PAGES); pages++) {
+            const conditions = cursor ? [...whereConditions, `${keyColumn} < ?`] : whereConditions;
+            const pageArgs = cursor ? [...args, ulidKeyArg(cursor, keyColumn)] : [...args];
+            let sql = `SELECT topic, payload, ulid${msgHasCodec ? ', codec' : ''} FROM msg`;
+            if (conditions.length > 0) {
+                sql += ` WHERE ` + conditions.join(' AND ');
+            }
+            sql += ` ORDER BY ${keyColumn} DESC LIMIT ?`;
+            pageArgs.push(sqlInteger(limit));
+            
+            result = await executeSQL(sql, pageArgs);
+            if (!result.result || !result.result.rows) {
+                break;
+            }
+            const topicIndex = result.result.cols.findIndex(col => col.name.toLowerCase() === 'topic');
+            const ulidIndex = result.result.cols.findIndex(col => col.name.toLowerCase() === 'ulid');
+            const pageRows = result.result.rows;
+            rows.push(...(exact ? pageRows : pageRows.filter(row => mqttTopicMatches(topicFilter, row[topicIndex].value))));
+            if (rows.length >= limit) {
+                rows = rows.slice(0, limit);
+                nextCursor = rows[limit - 1][ulidIndex].value;
+                break;
+            }
+            if (pageRows.length < limit) {
+                nextCursor = null;
+                break;
+            }
+            cursor = pageRows[pageRows.length - 1][ulidIndex].value;
+            nextCursor = cursor;
+        }
+        
+        if (result && result.result) {
+            result.result.rows = rows;
+            await decodeCompressedRows(result);
+        }
+        dbPageLastUlid = nextCursor;
+        updatePageButtons();
         
         // Compare with last result to avoid unnecessary updates
         if (hasResultChanged(result)) {
@@ -621,6 +969,34 @@ async function loadMessages() {
     }
 }
 
+// Apply the current filters from the newest page
+function applyFilter() {
+    dbPageCursors = [];
+    lastQueryResult = null;
+    loadMessages();
+}
+
+function loadOlderPage() {
+    if (!dbPageLastUlid) return;
+    dbPageCursors.push(dbPageLastUlid);
+    lastQueryResult = null;
+    loadMessages();
+}
+
+function loadNewerPage() {
+    if (dbPageCursors.length === 0) return;
+    dbPageCursors.pop();
+    lastQueryResult = null;
+    loadMessages();
+}
+
+function updatePageButtons() {
+    const newerBtn = document.getElementById('newerPageBtn');
+    const olderBtn = document.getElementById('olderPageBtn');
+    if (newerBtn) newerBtn.disabled = dbPageCursors.length === 0;
+    if (olderBtn) olderBtn.disabled = !dbPageLastUlid;
+}
+
 async function executeCustomQuery() {
     // Check if user is logged in
     if (!mqbaseCredentials) {
@@ -659,11 +1035,15 @@ async function executeCustomQuery() {
 
     // Reset last result since we're running a different query
     lastQueryResult = null;
+    dbPageCursors = [];
+    dbPageLastUlid = null;
+    updatePageButtons();
 
     showLoading();
     
     try {
         const result = await executeSQL(query);
+        await decodeCompressedRows(result);
         displayResults(result, limitEnforced);
     } catch (error) {
         showMessage(`Error: ${error.message}`, 'error');
@@ -736,7 +1116,7 @@ function displayResults(data, limitEnforced = false) {
         
         // Column 3: Payload (copyable)
         const payloadIndex = colMap['payload'];
-        const payload = payloadIndex !== undefined ? row[payloadIndex].value : 'N/A';
+        const payload = payloadIndex !== undefined ? cellValue(row[payloadIndex]) : 'N/A';
         html += makeCopyableCell('payload', payload);
         
         // Column 4: Headers (ulid)
@@ -785,8 +1165,7 @@ function clearFilter() {
     document.getElementById('topicFilter').value = '';
     document.getElementById('timeFilter').value = '7';
     document.getElementById('customQuery').value = '';
-    lastQueryResult = null; // Reset comparison cache
-    loadMessages();
+    applyFilter();
 }
 
 function toggleAutoRefresh(forceOff = false) {
@@ -806,8 +1185,8 @@ function toggleAutoRefresh(forceOff = false) {
         customQueryField.disabled = true;
         executeBtn.disabled = true;
         
-        // Immediately load messages before starting the interval
-        loadMessages();
+        // Immediately load the newest messages before starting the interval
+        applyFilter();
         
         startAutoRefresh();
     } else {
@@ -826,8 +1205,10 @@ function startAutoRefresh() {
     }
     
     // Set up new interval - refresh every 3 seconds
+    // Older pages do not change, only the newest one is refreshed
     autoRefreshInterval = setInterval(() => {
-        if (isAutoRefreshEnabled && document.getElementById('database-tab').classList.contains('active')) {
+        if (isAutoRefreshEnabled && dbPageCursors.length === 0 &&
+            document.getElementById('database-tab').classList.contains('active')) {
             loadMessages();
         }
     }, 3000);
@@ -1598,6 +1979,10 @@ async function initMqttConnection() {
         });
 
         mqttClient.on('message', (topic, payload, packet) => {
+            if (topic.startsWith(HISTORY_REPLY_PREFIX)) {
+                handleHistoryReply(topic, payload, packet);
+                return;
+            }
             const payloadStr = payload.toString();
             
             // Empty payload with retain flag means the retained message is being cleared
@@ -2357,7 +2742,7 @@ function setupEventListeners() {
         topicFilter.addEventListener('keypress', (e) => {
             if (e.key === 'Enter') {
                 e.preventDefault();
-                loadMessages();
+                applyFilter();
             }
         });
     }
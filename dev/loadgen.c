@@ -0,0 +1,781 @@
+// mqBase load generator: open-loop MQTT publisher that measures persistence latency.
+//
+// Publisher threads share a fixed schedule (message n is due at start + n / rate), so a
+// slow broker shows up as latency instead of silently lowering the offered load. Each
+// message is timed from its scheduled send time to
+//   - delivery to a subscriber (publish -> subscriber), and
+//   - the first poll of the database that returns its row (publish -> row visible).
+// Rows are matched to messages through the "ulid" user property the plugin adds to every
+// delivered message, so payload compression or binary keys do not matter.
+//
+// Build (needs libmosquitto-dev and libsqlite3-dev):
+//   cc -O2 -Wall -o dev/loadgen dev/loadgen.c -lmosquitto -lsqlite3 -lpthread
+//
+// Usage: see loadgen -?
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+#include <mqtt_protocol.h>
+#include <sqlite3.h>
+
+#define TOPIC_ROOT "loadgen"
+#define MISC_INTERVAL_NS 100000000LL    // mosquitto_loop_misc (keepalive) every 100ms
+#define MAX_POLL_TIMEOUT_NS 10000000LL  // Service sockets at least every 10ms
+#define DRAIN_IDLE_NS 1000000000LL      // Stop waiting once nothing arrived for a second
+#define MAX_DBS 64                      // -D databases, one per plugin shard
+
+struct config {
+    const char *host;
+    int port;
+    const char *user;
+    const char *pass;
+    int connections;
+    int threads;
+    double rate;                // Messages per second, all publishers together
+    int duration;               // Seconds
+    int topics;                 // Topic cardinality
+    int payload_min;
+    int payload_max;
+    int qos_weight[3];
+    double retained_ratio;
+    double delete_ratio;        // Fraction of sends that are retained deletes (empty payload)
+    const char *db_paths[MAX_DBS];  // Poll these databases for row visibility, one per shard
+    int db_count;
+    int poll_ms;
+    int drain_sec;
+    int json;
+};
+
+static struct config cfg = {
+    .host = "127.0.0.1",
+    .port = 1883,
+    .connections = 100,
+    .threads = 4,
+    .rate = 1000,
+    .duration = 10,
+    .topics = 1000,
+    .payload_min = 64,
+    .payload_max = 64,
+    .qos_weight = { 100, 0, 0 },
+    .poll_ms = 5,
+    .drain_sec = 10,
+};
+
+// Per-message timings in CLOCK_MONOTONIC nanoseconds, 0 = did not happen
+struct sample {
+    int64_t sent_ns;            // Scheduled send time
+    int64_t received_ns;        // Written by the subscriber thread
+    int64_t stored_ns;          // Written by the poller thread
+    int is_delete;
+};
+
+static struct sample *samples = NULL;
+static int64_t total_messages = 0;
+static char run_id[9];
+static char topic_prefix[64];
+static int64_t start_ns = 0;
+static atomic_int_fast64_t sent_count = 0;
+static atomic_int_fast64_t publish_errors = 0;
+static atomic_int_fast64_t reconnects = 0;
+static atomic_int_fast64_t max_lag_ns = 0;            // Worst time a send started after its schedule
+static atomic_int_fast64_t received_count = 0;
+static atomic_int_fast64_t stored_count = 0;
+static atomic_int_fast64_t last_activity_ns = 0;
+static atomic_bool stop_requested = false;
+
+// ulid -> message sequence, filled by the subscriber and read by the poller
+struct ulid_slot {
+    char ulid[27];
+    int64_t seq;
+};
+
+static struct ulid_slot *ulid_map = NULL;
+static size_t ulid_map_mask = 0;
+static pthread_mutex_t ulid_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static uint64_t hash_ulid(const char *ulid) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < 26 && ulid[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)ulid[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static void ulid_map_put(const char *ulid, int64_t seq) {
+    size_t i = hash_ulid(ulid) & ulid_map_mask;
+    pthread_mutex_lock(&ulid_map_mutex);
+    while (ulid_map[i].ulid[0] != '\0' && strcmp(ulid_map[i].ulid, ulid) != 0) {
+        i = (i + 1) & ulid_map_mask;
+    }
+    snprintf(ulid_map[i].ulid, sizeof(ulid_map[i].ulid), "%s", ulid);
+    ulid_map[i].seq = seq;
+    pthread_mutex_unlock(&ulid_map_mutex);
+}
+
+static int64_t ulid_map_get(const char *ulid) {
+    size_t i = hash_ulid(ulid) & ulid_map_mask;
+    int64_t seq = -1;
+    pthread_mutex_lock(&ulid_map_mutex);
+    while (ulid_map[i].ulid[0] != '\0') {
+        if (strcmp(ulid_map[i].ulid, ulid) == 0) {
+            seq = ulid_map[i].seq;
+            break;
+        }
+        i = (i + 1) & ulid_map_mask;
+    }
+    pthread_mutex_unlock(&ulid_map_mutex);
+    return seq;
+}
+
+// Crockford base32 text ULID to its 16 bytes. Returns 0 on success.
+static int ulid_to_bytes(const char *ulid, unsigned char out[16]) {
+    static const char alphabet[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+    unsigned __int128 v = 0;
+    for (int i = 0; i < 26; i++) {
+        char c = ulid[i] >= 'a' && ulid[i] <= 'z' ? (char)(ulid[i] - 'a' + 'A') : ulid[i];
+        const char *p = c != '\0' ? strchr(alphabet, c) : NULL;
+        if (p == NULL) {
+            return -1;
+        }
+        v = (v << 5) | (unsigned)(p - alphabet);
+    }
+    for (int i = 15; i >= 0; i--) {
+        out[i] = (unsigned char)v;
+        v >>= 8;
+    }
+    return 0;
+}
+
+static void on_connect(struct mosquitto *mosq, void *obj, int rc, int flags, const mosquitto_property *props) {
+    (void)mosq;
+    (void)flags;
+    (void)props;
+    *(int *)obj = rc == 0 ? 1 : -1;
+}
+
+static struct mosquitto *client_connect(const char *id, int *connected) {
+    struct mosquitto *mosq = mosquitto_new(id, true, connected);
+    if (mosq == NULL) {
+        return NULL;
+    }
+    mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+    mosquitto_connect_v5_callback_set(mosq, on_connect);
+    if (cfg.user[0] != '\0') {
+        mosquitto_username_pw_set(mosq, cfg.user, cfg.pass);
+    }
+    int rc = mosquitto_connect_bind_v5(mosq, cfg.host, cfg.port, 60, NULL, NULL);
+    if (rc != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "%s: connect failed: %s\n", id, mosquitto_strerror(rc));
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+    return mosq;
+}
+
+struct publisher {
+    pthread_t thread;
+    int index;
+    struct mosquitto **conns;
+    int *connected;
+    int conn_count;
+    struct pollfd *pfds;
+};
+
+// Read, write and keepalive for all connections of a publisher, waiting at most timeout_ns
+static void publisher_service(struct publisher *p, int64_t timeout_ns, int64_t *last_misc) {
+    for (int c = 0; c < p->conn_count; c++) {
+        p->pfds[c].fd = mosquitto_socket(p->conns[c]);
+        p->pfds[c].events = POLLIN | (mosquitto_want_write(p->conns[c]) ? POLLOUT : 0);
+        p->pfds[c].revents = 0;
+    }
+    struct timespec timeout = { timeout_ns / 1000000000LL, timeout_ns % 1000000000LL };
+    int ready = ppoll(p->pfds, (nfds_t)p->conn_count, &timeout, NULL);
+
+    int64_t now = now_ns();
+    int misc = now - *last_misc >= MISC_INTERVAL_NS;
+    if (misc) {
+        *last_misc = now;
+    }
+    for (int c = 0; c < p->conn_count; c++) {
+        struct mosquitto *mosq = p->conns[c];
+        int rc = MOSQ_ERR_SUCCESS;
+        if (ready > 0 && (p->pfds[c].revents & (POLLIN | POLLERR | POLLHUP))) {
+            rc = mosquitto_loop_read(mosq, 1);
+        }
+        if (rc == MOSQ_ERR_SUCCESS && ready > 0 && (p->pfds[c].revents & POLLOUT)) {
+            rc = mosquitto_loop_write(mosq, 1);
+        }
+        if (rc == MOSQ_ERR_SUCCESS && misc) {
+            rc = mosquitto_loop_misc(mosq);
+        }
+        if (rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_AGAIN && !atomic_load(&stop_requested)) {
+            atomic_fetch_add(&reconnects, 1);
+            p->connected[c] = 0;
+            mosquitto_reconnect(mosq);
+        }
+    }
+}
+
+static int pick_qos(uint64_t r) {
+    int total = cfg.qos_weight[0] + cfg.qos_weight[1] + cfg.qos_weight[2];
+    int x = total > 0 ? (int)(r % (uint64_t)total) : 0;
+    if (x < cfg.qos_weight[0]) {
+        return 0;
+    }
+    return x < cfg.qos_weight[0] + cfg.qos_weight[1] ? 1 : 2;
+}
+
+static void publish_message(struct publisher *p, int64_t seq, int64_t due, uint64_t *rng, char *payload) {
+    char topic[128];
+    snprintf(topic, sizeof(topic), "%s/t%" PRId64, topic_prefix, seq % cfg.topics);
+    struct mosquitto *mosq = p->conns[(seq / cfg.threads) % p->conn_count];
+
+    int qos = pick_qos(xorshift(rng));
+    double r = (double)(xorshift(rng) >> 11) / (double)(1ULL << 53);
+    samples[seq].sent_ns = due;
+
+    int rc;
+    if (r < cfg.delete_ratio) {
+        // An empty retained publish clears the topic; the plugin deletes its latest row
+        samples[seq].is_delete = 1;
+        rc = mosquitto_publish_v5(mosq, NULL, topic, 0, NULL, qos, true, NULL);
+    } else {
+        int size = cfg.payload_min;
+        if (cfg.payload_max > cfg.payload_min) {
+            size += (int)(xorshift(rng) % (uint64_t)(cfg.payload_max - cfg.payload_min + 1));
+        }
+        int len = snprintf(payload, (size_t)cfg.payload_max + 64, "{\"r\":\"%s\",\"s\":%" PRId64 ",\"pad\":\"", run_id, seq);
+        while (len < size - 2) {
+            payload[len++] = 'x';
+        }
+        payload[len++] = '"';
+        payload[len++] = '}';
+        rc = mosquitto_publish_v5(mosq, NULL, topic, len, payload, qos, r < cfg.delete_ratio + cfg.retained_ratio, NULL);
+    }
+    if (rc != MOSQ_ERR_SUCCESS) {
+        atomic_fetch_add(&publish_errors, 1);
+        samples[seq].sent_ns = 0;
+        return;
+    }
+    atomic_fetch_add(&sent_count, 1);
+}
+
+// Publisher thread k sends messages k, k + threads, k + 2 * threads, ... on schedule
+static void *publisher_main(void *arg) {
+    struct publisher *p = arg;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)p->index * 0xbf58476d1ce4e5b9ULL) ^ (uint64_t)now_ns();
+    char *payload = malloc((size_t)cfg.payload_max + 64);
+    int64_t last_misc = now_ns();
+    if (payload == NULL) {
+        return NULL;
+    }
+
+    for (int64_t seq = p->index; seq < total_messages && !atomic_load(&stop_requested);) {
+        int64_t due = start_ns + (int64_t)((double)seq * 1e9 / cfg.rate);
+        int64_t now = now_ns();
+        if (now < due) {
+            publisher_service(p, due - now < MAX_POLL_TIMEOUT_NS ? due - now : MAX_POLL_TIMEOUT_NS, &last_misc);
+            continue;
+        }
+
+        int64_t lag = now - due;
+        int64_t worst = atomic_load(&max_lag_ns);
+        while (lag > worst && !atomic_compare_exchange_weak(&max_lag_ns, &worst, lag)) {
+        }
+        publish_message(p, seq, due, &rng, payload);
+        seq += cfg.threads;
+        if ((seq / cfg.threads) % 64 == 0) {
+            publisher_service(p, 0, &last_misc);
+        }
+    }
+
+    // Flush queued packets and give QoS 1/2 handshakes time to complete
+    int64_t settle = now_ns() + MISC_INTERVAL_NS;
+    int64_t deadline = now_ns() + (int64_t)cfg.drain_sec * 1000000000LL;
+    for (int64_t now = now_ns(); now < deadline && !atomic_load(&stop_requested); now = now_ns()) {
+        int pending = 0;
+        for (int c = 0; c < p->conn_count; c++) {
+            pending |= mosquitto_want_write(p->conns[c]);
+        }
+        if (!pending && now >= settle) {
+            break;
+        }
+        publisher_service(p, MAX_POLL_TIMEOUT_NS, &last_misc);
+    }
+    free(payload);
+    return NULL;
+}
+
+static void on_subscriber_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg,
+                                  const mosquitto_property *props) {
+    (void)mosq;
+    (void)obj;
+    int64_t now = now_ns();
+    if (msg->payloadlen == 0) {
+        return;
+    }
+
+    // {"r":"<run>","s":<seq>,...
+    const char *s = memchr(msg->payload, 's', (size_t)msg->payloadlen);
+    while (s != NULL && strncmp(s, "s\":", 3) != 0) {
+        s = memchr(s + 1, 's', (size_t)msg->payloadlen - (size_t)(s + 1 - (const char *)msg->payload));
+    }
+    int64_t seq = s != NULL ? strtoll(s + 3, NULL, 10) : -1;
+    if (seq < 0 || seq >= total_messages || samples[seq].received_ns != 0) {
+        return;
+    }
+    samples[seq].received_ns = now;
+    atomic_fetch_add(&received_count, 1);
+    atomic_store(&last_activity_ns, now);
+
+    char *name = NULL;
+    char *value = NULL;
+    for (const mosquitto_property *p = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+         p != NULL;
+         p = mosquitto_property_read_string_pair(p, MQTT_PROP_USER_PROPERTY, &name, &value, true)) {
+        if (strcmp(name, "ulid") == 0) {
+            ulid_map_put(value, seq);
+        }
+        free(name);
+        free(value);
+        name = value = NULL;
+    }
+}
+
+struct pending_row {
+    char ulid[27];
+    int64_t seen_ns;
+};
+
+// Poll one database for new rows of this run and record when each became visible. Each
+// shard's rows are in its own file, so every file is polled with its own cursor.
+static void *poller_main(void *arg) {
+    const char *path = arg;
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_busy_timeout(db, 1000);
+
+    // Binary-key layouts expose the indexed key as ulid_bin in the msg view
+    int binary = sqlite3_prepare_v2(db, "SELECT ulid_bin FROM msg LIMIT 0", -1, &stmt, NULL) == SQLITE_OK;
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    char sql[256];
+    snprintf(sql, sizeof(sql), "SELECT ulid FROM msg WHERE %s > ?1 AND topic >= ?2 AND topic < ?3 ORDER BY %s",
+             binary ? "ulid_bin" : "ulid", binary ? "ulid_bin" : "ulid");
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Cannot query %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    char topic_lo[80];
+    char topic_hi[80];
+    snprintf(topic_lo, sizeof(topic_lo), "%s/", topic_prefix);
+    snprintf(topic_hi, sizeof(topic_hi), "%s0", topic_prefix);    // '0' sorts right after '/'
+    char last[27] = "00000000000000000000000000";
+
+    // Rows seen before the subscriber reported their ulid are retried on later polls
+    size_t pending_capacity = 1024;
+    size_t pending_count = 0;
+    struct pending_row *pending = malloc(pending_capacity * sizeof(*pending));
+
+    while (!atomic_load(&stop_requested) && pending != NULL) {
+        int64_t now = now_ns();
+        unsigned char bound[16];
+        if (binary && ulid_to_bytes(last, bound) == 0) {
+            sqlite3_bind_blob(stmt, 1, bound, 16, SQLITE_TRANSIENT);
+        } else {
+            sqlite3_bind_text(stmt, 1, last, -1, SQLITE_TRANSIENT);
+        }
+        sqlite3_bind_text(stmt, 2, topic_lo, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, topic_hi, -1, SQLITE_STATIC);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *ulid = (const char *)sqlite3_column_text(stmt, 0);
+            if (ulid == NULL || strlen(ulid) != 26) {
+                continue;
+            }
+            snprintf(last, sizeof(last), "%s", ulid);
+            if (pending_count == pending_capacity) {
+                struct pending_row *grown = realloc(pending, pending_capacity * 2 * sizeof(*pending));
+                if (grown == NULL) {
+                    continue;
+                }
+                pending = grown;
+                pending_capacity *= 2;
+            }
+            snprintf(pending[pending_count].ulid, sizeof(pending[pending_count].ulid), "%s", ulid);
+            pending[pending_count].seen_ns = now;
+            pending_count++;
+        }
+        sqlite3_reset(stmt);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < pending_count; i++) {
+            int64_t seq = ulid_map_get(pending[i].ulid);
+            if (seq < 0) {
+                pending[kept++] = pending[i];
+            } else if (samples[seq].stored_ns == 0) {
+                samples[seq].stored_ns = pending[i].seen_ns;
+                atomic_fetch_add(&stored_count, 1);
+                atomic_store(&last_activity_ns, now);
+            }
+        }
+        pending_count = kept;
+
+        struct timespec pause = { cfg.poll_ms / 1000, (cfg.poll_ms % 1000) * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+
+    free(pending);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return NULL;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+struct latency_summary {
+    int64_t count;
+    double p50_ms;
+    double p99_ms;
+    double p999_ms;
+    double max_ms;
+};
+
+static double percentile_ms(const int64_t *sorted, int64_t n, double pct) {
+    int64_t rank = (int64_t)((pct / 100.0) * (double)n + 0.999999) - 1;
+    if (rank < 0) {
+        rank = 0;
+    }
+    return sorted[rank < n ? rank : n - 1] / 1e6;
+}
+
+// stored selects publish -> row visible, otherwise publish -> subscriber
+static struct latency_summary summarize(int stored) {
+    struct latency_summary s = { 0, 0, 0, 0, 0 };
+    int64_t *values = malloc((size_t)(total_messages > 0 ? total_messages : 1) * sizeof(int64_t));
+    if (values == NULL) {
+        return s;
+    }
+    for (int64_t i = 0; i < total_messages; i++) {
+        int64_t at = stored ? samples[i].stored_ns : samples[i].received_ns;
+        if (samples[i].sent_ns != 0 && at != 0) {
+            values[s.count++] = at > samples[i].sent_ns ? at - samples[i].sent_ns : 0;
+        }
+    }
+    if (s.count > 0) {
+        qsort(values, (size_t)s.count, sizeof(int64_t), cmp_int64);
+        s.p50_ms = percentile_ms(values, s.count, 50);
+        s.p99_ms = percentile_ms(values, s.count, 99);
+        s.p999_ms = percentile_ms(values, s.count, 99.9);
+        s.max_ms = values[s.count - 1] / 1e6;
+    }
+    free(values);
+    return s;
+}
+
+static void report(double elapsed_sec) {
+    int64_t sent = atomic_load(&sent_count);
+    int64_t deletes = 0;
+    for (int64_t i = 0; i < total_messages; i++) {
+        deletes += samples[i].sent_ns != 0 && samples[i].is_delete;
+    }
+    int64_t expected = sent - deletes;
+    struct latency_summary sub = summarize(0);
+    struct latency_summary row = summarize(1);
+    double achieved = elapsed_sec > 0 ? sent / elapsed_sec : 0;
+
+    if (cfg.json) {
+        printf("{\"run\":\"%s\",\"offered_rate\":%.0f,\"achieved_rate\":%.0f,\"sent\":%" PRId64 ",\"deletes\":%" PRId64
+               ",\"publish_errors\":%" PRId64 ",\"reconnects\":%" PRId64 ",\"max_schedule_lag_ms\":%.3f",
+               run_id, cfg.rate, achieved, sent, deletes, (int64_t)atomic_load(&publish_errors),
+               (int64_t)atomic_load(&reconnects), atomic_load(&max_lag_ns) / 1e6);
+        printf(",\"subscriber\":{\"count\":%" PRId64 ",\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+               sub.count, sub.p50_ms, sub.p99_ms, sub.p999_ms, sub.max_ms);
+        if (cfg.db_count > 0) {
+            printf(",\"row_visible\":{\"count\":%" PRId64 ",\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+                   row.count, row.p50_ms, row.p99_ms, row.p999_ms, row.max_ms);
+        }
+        printf("}\n");
+        return;
+    }
+
+    printf("Run %s: %d connections on %d threads, %d topics, payload %d-%d bytes\n",
+           run_id, cfg.connections, cfg.threads, cfg.topics, cfg.payload_min, cfg.payload_max);
+    printf("Sent:      %" PRId64 " (%" PRId64 " deletes) in %.2fs, %.0f msg/s of %.0f offered\n",
+           sent, deletes, elapsed_sec, achieved, cfg.rate);
+    printf("           worst schedule lag %.1fms, %" PRId64 " publish errors, %" PRId64 " reconnects\n",
+           atomic_load(&max_lag_ns) / 1e6, (int64_t)atomic_load(&publish_errors), (int64_t)atomic_load(&reconnects));
+    printf("Received:  %" PRId64 " of %" PRId64 " (%.2f%%)\n", sub.count, expected,
+           expected > 0 ? 100.0 * sub.count / expected : 0.0);
+    if (cfg.db_count > 0) {
+        printf("Stored:    %" PRId64 " of %" PRId64 " (%.2f%%)\n", row.count, expected,
+               expected > 0 ? 100.0 * row.count / expected : 0.0);
+    }
+    printf("\nLatency (ms)               p50      p99    p99.9      max\n");
+    printf("publish -> subscriber %8.2f %8.2f %8.2f %8.2f\n", sub.p50_ms, sub.p99_ms, sub.p999_ms, sub.max_ms);
+    if (cfg.db_count > 0) {
+        printf("publish -> row visible %7.2f %8.2f %8.2f %8.2f   (poll every %dms)\n",
+               row.p50_ms, row.p99_ms, row.p999_ms, row.max_ms, cfg.poll_ms);
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -h host          Broker host (default: MQTT_BROKER or 127.0.0.1)\n"
+        "  -p port          Broker port (default: MQTT_PORT or 1883)\n"
+        "  -u user -P pass  Credentials (default: MQTT_USER / MQTT_PASS or test / test)\n"
+        "  -c connections   Publisher connections (default 100)\n"
+        "  -t threads       Publisher threads (default 4)\n"
+        "  -r rate          Messages per second offered, open loop (default 1000)\n"
+        "  -d seconds       Test duration (default 10)\n"
+        "  -T topics        Topic cardinality (default 1000)\n"
+        "  -s min[:max]     Payload size in bytes (default 64)\n"
+        "  -q w0,w1,w2      QoS 0/1/2 weights (default 100,0,0)\n"
+        "  -R ratio         Fraction of messages published retained (default 0)\n"
+        "  -X ratio         Fraction of sends that are retained deletes (default 0)\n"
+        "  -D path          Database file to poll for publish -> row latency, repeat once per shard\n"
+        "  -i ms            Database poll interval (default 5)\n"
+        "  -w seconds       Longest wait for outstanding deliveries and rows (default 10)\n"
+        "  -j               Print the result as one JSON object\n",
+        argv0);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    atomic_store(&stop_requested, true);
+}
+
+int main(int argc, char **argv) {
+    // Same environment defaults as stress-test.sh
+    const char *env = getenv("MQTT_BROKER");
+    cfg.host = env != NULL ? env : cfg.host;
+    env = getenv("MQTT_PORT");
+    cfg.port = env != NULL ? atoi(env) : cfg.port;
+    env = getenv("MQTT_USER");
+    cfg.user = env != NULL ? env : "test";
+    env = getenv("MQTT_PASS");
+    cfg.pass = env != NULL ? env : "test";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:P:c:t:r:d:T:s:q:R:X:D:i:w:j")) != -1) {
+        switch (opt) {
+        case 'h': cfg.host = optarg; break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'u': cfg.user = optarg; break;
+        case 'P': cfg.pass = optarg; break;
+        case 'c': cfg.connections = atoi(optarg); break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'd': cfg.duration = atoi(optarg); break;
+        case 'T': cfg.topics = atoi(optarg); break;
+        case 's':
+            if (sscanf(optarg, "%d:%d", &cfg.payload_min, &cfg.payload_max) < 2) {
+                cfg.payload_max = cfg.payload_min;
+            }
+            break;
+        case 'q':
+            sscanf(optarg, "%d,%d,%d", &cfg.qos_weight[0], &cfg.qos_weight[1], &cfg.qos_weight[2]);
+            break;
+        case 'R': cfg.retained_ratio = atof(optarg); break;
+        case 'X': cfg.delete_ratio = atof(optarg); break;
+        case 'D':
+            if (cfg.db_count == MAX_DBS) {
+                fprintf(stderr, "At most %d databases can be polled\n", MAX_DBS);
+                return 1;
+            }
+            cfg.db_paths[cfg.db_count++] = optarg;
+            break;
+        case 'i': cfg.poll_ms = atoi(optarg); break;
+        case 'w': cfg.drain_sec = atoi(optarg); break;
+        case 'j': cfg.json = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.threads < 1 || cfg.connections < cfg.threads || cfg.rate <= 0 || cfg.duration < 1 ||
+        cfg.topics < 1 || cfg.payload_min < 0 || cfg.payload_max < cfg.payload_min || cfg.poll_ms < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    // The payload carries the run id and sequence number
+    if (cfg.payload_max < 48) {
+        cfg.payload_max = 48;
+    }
+    if (cfg.payload_min < 48) {
+        cfg.payload_min = 48;
+    }
+
+    total_messages = (int64_t)(cfg.rate * cfg.duration);
+    samples = calloc((size_t)total_messages, sizeof(*samples));
+    size_t map_capacity = 1;
+    while (map_capacity < (size_t)total_messages * 2) {
+        map_capacity <<= 1;
+    }
+    ulid_map = calloc(map_capacity, sizeof(*ulid_map));
+    ulid_map_mask = map_capacity - 1;
+    if (samples == NULL || ulid_map == NULL) {
+        fprintf(stderr, "Out of memory for %" PRId64 " messages\n", total_messages);
+        return 1;
+    }
+
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    snprintf(run_id, sizeof(run_id), "%08" PRIx32, (uint32_t)xorshift(&seed));
+    snprintf(topic_prefix, sizeof(topic_prefix), TOPIC_ROOT "/%s", run_id);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    mosquitto_lib_init();
+
+    // Subscriber first, so it sees every message
+    char id[64];
+    int sub_connected = 0;
+    snprintf(id, sizeof(id), "loadgen-%s-sub", run_id);
+    struct mosquitto *sub = client_connect(id, &sub_connected);
+    if (sub == NULL) {
+        return 1;
+    }
+    mosquitto_message_v5_callback_set(sub, on_subscriber_message);
+    mosquitto_loop_start(sub);
+    while (sub_connected == 0) {
+        usleep(1000);
+    }
+    if (sub_connected < 0) {
+        fprintf(stderr, "Subscriber connection refused\n");
+        return 1;
+    }
+    char filter[80];
+    snprintf(filter, sizeof(filter), "%s/#", topic_prefix);
+    int sub_qos = cfg.qos_weight[2] > 0 ? 2 : cfg.qos_weight[1] > 0 ? 1 : 0;
+    mosquitto_subscribe_v5(sub, NULL, filter, sub_qos, 0, NULL);
+
+    // Publisher connections, spread over the threads
+    struct publisher *pubs = calloc((size_t)cfg.threads, sizeof(*pubs));
+    for (int t = 0; t < cfg.threads && pubs != NULL; t++) {
+        struct publisher *p = &pubs[t];
+        p->index = t;
+        p->conn_count = cfg.connections / cfg.threads + (t < cfg.connections % cfg.threads);
+        p->conns = calloc((size_t)p->conn_count, sizeof(*p->conns));
+        p->connected = calloc((size_t)p->conn_count, sizeof(*p->connected));
+        p->pfds = calloc((size_t)p->conn_count, sizeof(*p->pfds));
+        if (p->conns == NULL || p->connected == NULL || p->pfds == NULL) {
+            fprintf(stderr, "Out of memory for connections\n");
+            return 1;
+        }
+        for (int c = 0; c < p->conn_count; c++) {
+            snprintf(id, sizeof(id), "loadgen-%s-%d-%d", run_id, t, c);
+            p->conns[c] = client_connect(id, &p->connected[c]);
+            if (p->conns[c] == NULL) {
+                return 1;
+            }
+        }
+        // Wait for the CONNACKs before the schedule starts
+        int64_t last_misc = now_ns();
+        for (int waiting = 1; waiting;) {
+            publisher_service(p, MAX_POLL_TIMEOUT_NS, &last_misc);
+            waiting = 0;
+            for (int c = 0; c < p->conn_count; c++) {
+                if (p->connected[c] < 0) {
+                    fprintf(stderr, "Connection refused for publisher %d/%d\n", t, c);
+                    return 1;
+                }
+                waiting |= p->connected[c] == 0;
+            }
+        }
+    }
+
+    pthread_t pollers[MAX_DBS];
+    int pollers_running[MAX_DBS] = { 0 };
+    for (int i = 0; i < cfg.db_count; i++) {
+        pollers_running[i] = pthread_create(&pollers[i], NULL, poller_main, (void *)cfg.db_paths[i]) == 0;
+    }
+
+    start_ns = now_ns() + 100000000LL;
+    atomic_store(&last_activity_ns, start_ns);
+    for (int t = 0; t < cfg.threads; t++) {
+        pthread_create(&pubs[t].thread, NULL, publisher_main, &pubs[t]);
+    }
+    for (int t = 0; t < cfg.threads; t++) {
+        pthread_join(pubs[t].thread, NULL);
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    // Wait for deliveries and rows still in flight
+    int64_t expected = atomic_load(&sent_count);
+    int64_t deadline = now_ns() + (int64_t)cfg.drain_sec * 1000000000LL;
+    while (!atomic_load(&stop_requested) && now_ns() < deadline &&
+           now_ns() - atomic_load(&last_activity_ns) < DRAIN_IDLE_NS) {
+        int64_t deletes = 0;
+        for (int64_t i = 0; i < total_messages; i++) {
+            deletes += samples[i].is_delete;
+        }
+        if (atomic_load(&received_count) >= expected - deletes &&
+            (cfg.db_count == 0 || atomic_load(&stored_count) >= expected - deletes)) {
+            break;
+        }
+        usleep(20000);
+    }
+    atomic_store(&stop_requested, true);
+    for (int i = 0; i < cfg.db_count; i++) {
+        if (pollers_running[i]) {
+            pthread_join(pollers[i], NULL);
+        }
+    }
+    // The subscriber thread writes the samples until its loop has stopped
+    mosquitto_disconnect(sub);
+    mosquitto_loop_stop(sub, false);
+    mosquitto_destroy(sub);
+
+    report(elapsed);
+
+    for (int t = 0; t < cfg.threads; t++) {
+        for (int c = 0; c < pubs[t].conn_count; c++) {
+            mosquitto_disconnect(pubs[t].conns[c]);
+            mosquitto_destroy(pubs[t].conns[c]);
+        }
+        free(pubs[t].conns);
+        free(pubs[t].connected);
+        free(pubs[t].pfds);
+    }
+    free(pubs);
+    free(samples);
+    free(ulid_map);
+    mosquitto_lib_cleanup();
+    return 0;
+}
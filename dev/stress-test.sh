@@ -105,12 +105,24 @@ log_success() { echo -e "${GREEN}✓${NC} $1"; }
 log_warn() { echo -e "${YELLOW}⚠${NC} $1"; }
 log_error() { echo -e "${RED}✗${NC} $1"; }
 
-# Query database and return count
-db_count() {
+# Run one statement and print the first column of its first row (empty on error)
+db_scalar() {
     curl -s -u "$DB_USER:$DB_PASS" -X POST "$DB_URL/" \
         -H "Content-Type: application/json" \
-        -d '{"statements": ["SELECT COUNT(*) FROM msg"]}' | \
-        jq -r '.[0].results.rows[0][0]' 2>/dev/null || echo "0"
+        -d "{\"statements\": [\"$1\"]}" | \
+        jq -r '.[0].results.rows[0][0] // empty' 2>/dev/null
+}
+
+# Query database and return count. Reads the msg_stats total kept by the plugin
+# (plugin_opt_stats), one key lookup, and falls back to COUNT(*), a full index scan
+# that competes with ingest, when the table does not exist.
+db_count() {
+    local count
+    count=$(db_scalar "SELECT ifnull((SELECT rows FROM msg_stats WHERE prefix = '#'), 0)")
+    if [ -z "$count" ]; then
+        count=$(db_scalar "SELECT COUNT(*) FROM msg")
+    fi
+    echo "${count:-0}"
 }
 
 # ULID Crockford Base32 decoding table
@@ -1,6 +1,7 @@
 #!/bin/bash
 # Test script for both Docker image variants
-# Builds each image with --no-cache, starts container, and runs test suite
+# Builds each image with --no-cache, then for each dev/test*.conf starts a fresh container
+# with that config and runs the test suite against it
 #
 # Usage: ./test-images.sh [--trixie-only] [--distroless-only]
 
@@ -112,10 +113,11 @@ wait_for_container() {
 
 run_tests() {
     local image_type="$1"
+    local conf="$2"
     
     log_info "Running test suite for $image_type image..."
     
-    if bash "$SCRIPT_DIR/test.sh"; then
+    if TEST_CONF="$conf" bash "$SCRIPT_DIR/test.sh"; then
         log_pass "$image_type: All tests passed!"
         return 0
     else
@@ -124,6 +126,44 @@ run_tests() {
     fi
 }
 
+# Run the suite in a fresh container of an image for each broker config
+test_configs() {
+    local image="$1"
+    local image_type="$2"
+    local conf
+    local result=0
+    
+    for conf in "$SCRIPT_DIR"/test*.conf; do
+        # Stop any existing container
+        cleanup_container
+        
+        # Start container
+        log_info "Starting $image_type container with $(basename "$conf")..."
+        docker run -d \
+            --name "$CONTAINER_NAME" \
+            -p 1883:1883 \
+            -p 8080:8080 \
+            -p 9001:9001 \
+            -v "$conf:/mosquitto/config/mosquitto.conf:ro" \
+            -e MQBASE_MQTT_USER="${MQTT_USER}:${MQTT_PASS}" \
+            -e MQBASE_USER="${ADMIN_USER}:${ADMIN_PASS}" \
+            "$image"
+        
+        # Wait for container to be ready
+        if ! wait_for_container; then
+            cleanup_container
+            return 1
+        fi
+        
+        # Run tests
+        if ! run_tests "$image_type, $(basename "$conf")" "$conf"; then
+            result=1
+        fi
+        cleanup_container
+    done
+    return $result
+}
+
 test_trixie_image() {
     log_section "Testing debian:trixie-slim Image"
     
@@ -135,34 +175,7 @@ test_trixie_image() {
     fi
     log_pass "debian:trixie-slim image built successfully"
     
-    # Stop any existing container
-    cleanup_container
-    
-    # Start container
-    log_info "Starting debian:trixie-slim container..."
-    docker run -d \
-        --name "$CONTAINER_NAME" \
-        -p 1883:1883 \
-        -p 8080:8080 \
-        -p 9001:9001 \
-        -e MQBASE_MQTT_USER="${MQTT_USER}:${MQTT_PASS}" \
-        -e MQBASE_USER="${ADMIN_USER}:${ADMIN_PASS}" \
-        mqbase:latest
-    
-    # Wait for container to be ready
-    if ! wait_for_container; then
-        cleanup_container
-        return 1
-    fi
-    
-    # Run tests
-    if run_tests "debian:trixie-slim"; then
-        cleanup_container
-        return 0
-    else
-        cleanup_container
-        return 1
-    fi
+    test_configs mqbase:latest "debian:trixie-slim"
 }
 
 test_distroless_image() {
@@ -176,34 +189,7 @@ test_distroless_image() {
     fi
     log_pass "distroless/base-debian13 image built successfully"
     
-    # Stop any existing container
-    cleanup_container
-    
-    # Start container (distroless uses different env var format)
-    log_info "Starting distroless container..."
-    docker run -d \
-        --name "$CONTAINER_NAME" \
-        -p 1883:1883 \
-        -p 8080:8080 \
-        -p 9001:9001 \
-        -e MQBASE_MQTT_USER="${MQTT_USER}:${MQTT_PASS}" \
-        -e MQBASE_USER="${ADMIN_USER}:${ADMIN_PASS}" \
-        mqbase:latest-distroless
-    
-    # Wait for container to be ready
-    if ! wait_for_container; then
-        cleanup_container
-        return 1
-    fi
-    
-    # Run tests
-    if run_tests "distroless/base-debian13"; then
-        cleanup_container
-        return 0
-    else
-        cleanup_container
-        return 1
-    fi
+    test_configs mqbase:latest-distroless "distroless/base-debian13"
 }
 
 # Main execution
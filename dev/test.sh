@@ -8,7 +8,10 @@
 #
 # Exclusion patterns: cmd/# (transient commands not persisted)
 #
-# Test user can only publish to +/test/# topics (see mosquitto/config/dynsec.json)
+# Test user can only publish to +/test/# topics and $history/# requests (see mosquitto/config/dynsec.json)
+#
+# The broker under test runs with TEST_CONF (default: dev/test.conf). Sections for optional
+# plugin features only run when the feature is enabled there.
 
 set -e
 
@@ -23,6 +26,7 @@ DB_URL="${DB_URL:-http://127.0.0.1:8080/db-admin}"
 DB_USER="${DB_USER:-admin}"
 DB_PASS="${DB_PASS:-admin}"
 ADMIN_URL="${ADMIN_URL:-http://127.0.0.1:8080}"
+TEST_CONF="${TEST_CONF:-$(dirname "${BASH_SOURCE[0]}")/test.conf}"
 
 # Colors for output
 RED='\033[0;31m'
@@ -75,6 +79,11 @@ check_mqttjs_tools() {
     fi
 }
 
+# Value of a plugin option in the broker config under test (empty if unset)
+conf_opt() {
+    sed -n "s/^plugin_opt_$1 //p" "$TEST_CONF" | tail -n 1
+}
+
 # =========================================================================
 # Database Helper Functions
 # =========================================================================
@@ -167,12 +176,76 @@ db_execute() {
         -d "{\"stmt\": [\"$sql\"]}"
 }
 
+# Take the database write lock in a sqld stream and print the stream's baton (empty if the
+# lock was not taken). The batch worker then waits for it, up to its 3 s busy timeout, and
+# new messages queue up until db_unlock.
+db_lock() {
+    curl -s -X POST "$DB_URL/v2/pipeline" \
+        -u "$DB_USER:$DB_PASS" \
+        -H "Content-Type: application/json" \
+        -d '{"baton": null, "requests": [{"type": "execute", "stmt": {"sql": "BEGIN IMMEDIATE"}}]}' | \
+        jq -r 'select(.results[0].type == "ok") | .baton // empty'
+}
+
+# Release the lock taken by db_lock
+db_unlock() {
+    local baton="$1"
+    curl -s -X POST "$DB_URL/v2/pipeline" \
+        -u "$DB_USER:$DB_PASS" \
+        -H "Content-Type: application/json" \
+        -d "{\"baton\": \"$baton\", \"requests\": [{\"type\": \"execute\", \"stmt\": {\"sql\": \"ROLLBACK\"}}, {\"type\": \"close\"}]}" > /dev/null
+}
+
 # Check HTTP endpoint returns expected status
 http_status() {
     local url="$1"
     curl -s -o /dev/null -w "%{http_code}" "$url"
 }
 
+# =========================================================================
+# History Replay Helper Functions
+# =========================================================================
+
+# Send a $history request (MQTT v5) and print each reply as "<user properties> <payload>".
+# Waits for the given number of replies (rows plus the end marker), at most 5 seconds.
+# Extra arguments are passed to mosquitto_pub, e.g. -D publish user-property limit 2
+history_query() {
+    local replies="$1"
+    shift
+    local reply_topic="data/test/history_reply_${TEST_ID}"
+    local out="/tmp/history_${TEST_ID}.txt"
+    timeout 5 mosquitto_sub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -V 5 \
+        -t "$reply_topic" -C "$replies" -F '%P %p' > "$out" 2>/dev/null &
+    local sub_pid=$!
+    sleep 1
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -V 5 -t '$history/q' -n \
+        -D publish response-topic "$reply_topic" "$@"
+    wait $sub_pid 2>/dev/null || true
+    cat "$out"
+    rm -f "$out"
+}
+
+# =========================================================================
+# Metrics Helper Functions
+# =========================================================================
+
+# Retained $SYS/broker/mqbase/<name> metric, readable by the admin user
+sys_metric() {
+    timeout 3 mosquitto_sub -h "$BROKER" -p "$PORT" -u "$ADMIN_USER" -P "$ADMIN_PASS" \
+        -t "\$SYS/broker/mqbase/$1" -C 1 2>/dev/null
+}
+
+# Wait for a metric to grow past a value, at most two metric intervals. Prints the last value.
+sys_metric_above() {
+    local name="$1" before="${2:-0}" value i
+    for i in $(seq 1 25); do
+        value=$(sys_metric "$name")
+        [ "${value:-0}" -gt "$before" ] && break
+        sleep 1
+    done
+    echo "$value"
+}
+
 # =========================================================================
 # Script Start
 # =========================================================================
@@ -188,6 +261,7 @@ echo "User: $USER"
 echo "DB URL: $DB_URL"
 echo "DB User: $DB_USER"
 echo "Admin URL: $ADMIN_URL"
+echo "Broker config: $TEST_CONF"
 echo "Test ID: $TEST_ID"
 echo "========================================"
 
@@ -735,6 +809,25 @@ else
     log_fail "Binary payload not stored"
 fi
 
+# -----------------------------------------
+# Test 28b: Raw binary payload with NUL bytes
+# -----------------------------------------
+echo ""
+echo "--- Test 28b: Raw binary payload with NUL bytes ---"
+TOPIC_RAW="data/test/raw_binary_$TEST_ID"
+RAW_FILE=$(mktemp)
+printf 'bin\000ary\001\002\377' > "$RAW_FILE"
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_RAW" -f "$RAW_FILE" -q 1
+rm -f "$RAW_FILE"
+sleep 0.5
+
+RAW_LEN=$(db_execute "SELECT length(CAST(payload AS BLOB)) FROM msg WHERE topic = '$TOPIC_RAW'" | jq -r '.result.rows[0][0].value')
+if [ "$RAW_LEN" = "10" ]; then
+    log_pass "Raw binary payload stored without truncation (10 bytes)"
+else
+    log_fail "Raw binary payload length mismatch (expected 10, got '$RAW_LEN')"
+fi
+
 # =========================================================================
 # SECTION 7: Topic Exclusion Patterns
 # =========================================================================
@@ -775,6 +868,23 @@ else
     log_fail "+/test/exclude/# pattern was persisted (should be excluded)"
 fi
 
+# -----------------------------------------
+# Test 30b: # also matches the parent level
+# -----------------------------------------
+echo ""
+echo "--- Test 30b: +/test/exclude/# excludes data/test/exclude itself ---"
+TOPIC_EXCL_PARENT="data/test/exclude"
+COUNT_BEFORE=$(db_count)
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_EXCL_PARENT" -m '{"should_exclude":true}' -q 1
+sleep 0.5
+COUNT_AFTER=$(db_count)
+
+if [ "$COUNT_AFTER" -eq "$COUNT_BEFORE" ]; then
+    log_pass "+/test/exclude/# pattern correctly excluded the parent level"
+else
+    log_fail "Parent level $TOPIC_EXCL_PARENT was persisted (# should match it)"
+fi
+
 # -----------------------------------------
 # Test 31: data/test/# NOT excluded
 # -----------------------------------------
@@ -1006,6 +1116,599 @@ else
     log_pass "Anonymous connection correctly rejected"
 fi
 
+# =========================================================================
+# SECTION 12: History Replay ($history/...)
+# =========================================================================
+log_section "Section 12: History Replay"
+# mosquitto.conf has: plugin_opt_history true, plugin_opt_history_acl admin=#,test=data/test/#
+TOPIC_HIST="data/test/history_$TEST_ID/a"
+TOPIC_HIST_DENIED="x/test/history_$TEST_ID/a"
+for i in 1 2 3; do
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_HIST" -m "{\"hist\":$i,\"id\":\"$TEST_ID\"}" -q 1
+done
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_HIST_DENIED" -m "{\"hist\":0,\"id\":\"$TEST_ID\"}" -q 1
+sleep 0.5
+
+# -----------------------------------------
+# Test 41: Replay of an exact topic
+# -----------------------------------------
+echo ""
+echo "--- Test 41: History replay of an exact topic ---"
+REPLIES=$(history_query 4 -D publish user-property filter "$TOPIC_HIST" -D publish user-property limit 10)
+ROWS=$(echo "$REPLIES" | grep -c "topic:$TOPIC_HIST " || true)
+ORDER=$(echo "$REPLIES" | grep -o '"hist":[0-9]' | tr -d '\n')
+
+if [ "$ROWS" = "3" ] && [ "$ORDER" = '"hist":1"hist":2"hist":3' ] && echo "$REPLIES" | grep -q "history:end count:3"; then
+    log_pass "3 rows replayed in order, followed by the end marker"
+else
+    log_fail "Unexpected history replies: $REPLIES"
+fi
+
+# -----------------------------------------
+# Test 42: Paging with the next cursor
+# -----------------------------------------
+echo ""
+echo "--- Test 42: History paging with next ---"
+REPLIES=$(history_query 3 -D publish user-property filter "$TOPIC_HIST" -D publish user-property limit 2)
+NEXT=$(echo "$REPLIES" | grep -o "next:[0-9A-Z]*" | cut -d: -f2)
+REPLIES_2=""
+if [ -n "$NEXT" ]; then
+    REPLIES_2=$(history_query 2 -D publish user-property filter "$TOPIC_HIST" -D publish user-property since "$NEXT")
+fi
+
+if echo "$REPLIES" | grep -q "count:2" && echo "$REPLIES_2" | grep -q '"hist":3' && echo "$REPLIES_2" | grep -q "count:1"; then
+    log_pass "Second page starts after next ($NEXT)"
+else
+    log_fail "Paging failed: first page '$REPLIES', second page '$REPLIES_2'"
+fi
+
+# -----------------------------------------
+# Test 43: Wildcard replay skips topics outside the grants
+# -----------------------------------------
+echo ""
+echo "--- Test 43: Wildcard history replay filtered by history_acl ---"
+REPLIES=$(history_query 4 -D publish user-property filter "+/test/history_$TEST_ID/#")
+
+if echo "$REPLIES" | grep -q "history:end count:3" && ! echo "$REPLIES" | grep -q "topic:$TOPIC_HIST_DENIED"; then
+    log_pass "Only the granted topic was replayed"
+else
+    log_fail "Wildcard replay returned unexpected rows: $REPLIES"
+fi
+
+# -----------------------------------------
+# Test 44: Topic outside the grants refused
+# -----------------------------------------
+echo ""
+echo "--- Test 44: History replay refused without a grant ---"
+REPLIES=$(history_query 1 -D publish user-property filter "$TOPIC_HIST_DENIED")
+
+if echo "$REPLIES" | grep -q "reason:not authorized" && ! echo "$REPLIES" | grep -q '"hist":0'; then
+    log_pass "Request for $TOPIC_HIST_DENIED refused"
+else
+    log_fail "Request outside the grants was not refused: $REPLIES"
+fi
+
+# =========================================================================
+# SECTION 13: Ingest Journal
+# =========================================================================
+log_section "Section 13: Ingest Journal"
+# mosquitto.conf has: plugin_opt_journal true
+
+# -----------------------------------------
+# Test 45: Stored journal position advances with each batch
+# -----------------------------------------
+echo ""
+echo "--- Test 45: msg_journal position advances with stored messages ---"
+TOPIC_JOURNAL="data/test/journal_$TEST_ID"
+POSITION_AFTER=""
+if [ "$(conf_opt journal)" != "true" ]; then
+    log_skip "plugin_opt_journal is not enabled in $TEST_CONF"
+else
+POSITION_BEFORE=$(db_execute "SELECT position FROM msg_journal" | jq -r '.result.rows[0][0].value // empty')
+for i in 1 2 3 4 5; do
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_JOURNAL" -m "{\"journal\":$i,\"id\":\"$TEST_ID\"}" -q 1
+done
+sleep 0.5
+POSITION_AFTER=$(db_execute "SELECT position FROM msg_journal" | jq -r '.result.rows[0][0].value // empty')
+COUNT=$(db_find_topic "$TOPIC_JOURNAL")
+
+if [ -n "$POSITION_AFTER" ] && [ "$POSITION_AFTER" -gt "${POSITION_BEFORE:-0}" ] && [ "$COUNT" = "5" ]; then
+    log_pass "5 messages stored, journal position $POSITION_BEFORE -> $POSITION_AFTER"
+else
+    log_fail "Journal position '$POSITION_BEFORE' -> '$POSITION_AFTER' with $COUNT of 5 messages stored"
+fi
+fi
+
+# -----------------------------------------
+# Test 46: Entries of a failed commit are stored from the journal
+# -----------------------------------------
+echo ""
+echo "--- Test 46: Messages of a failed commit are stored once the commits succeed ---"
+# While the trigger exists, the journal position update of every batch rolls the
+# transaction back, so its COMMIT fails
+TOPIC_COMMIT_FAIL="data/test/commit_fail_$TEST_ID"
+TRIGGER_COMMIT_FAIL="test_commit_fail_$TEST_ID"
+if [ "$(conf_opt journal)" != "true" ] || [ -z "$POSITION_AFTER" ]; then
+    log_skip "Needs plugin_opt_journal true and a stored journal position"
+else
+    COMMIT_ERRORS_BEFORE=$(sys_metric errors/commit)
+    RESULT=$(db_execute "CREATE TRIGGER $TRIGGER_COMMIT_FAIL BEFORE UPDATE ON msg_journal BEGIN SELECT RAISE(ROLLBACK, 'forced commit failure'); END")
+    if echo "$RESULT" | jq -e '.error' > /dev/null 2>&1; then
+        log_fail "Could not create the failing trigger: $RESULT"
+    else
+        for i in 1 2 3; do
+            mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_COMMIT_FAIL" -m "{\"commit_fail\":$i,\"id\":\"$TEST_ID\"}" -q 1
+        done
+        sleep 1.5
+        COUNT_FAILING=$(db_find_topic "$TOPIC_COMMIT_FAIL")
+        db_execute "DROP TRIGGER IF EXISTS $TRIGGER_COMMIT_FAIL" > /dev/null
+        for i in $(seq 1 20); do
+            COUNT=$(db_find_topic "$TOPIC_COMMIT_FAIL")
+            [ "$COUNT" = "3" ] && break
+            sleep 0.5
+        done
+        COMMIT_ERRORS_AFTER=$(sys_metric_above errors/commit "${COMMIT_ERRORS_BEFORE:-0}")
+        sleep 1
+        COUNT=$(db_find_topic "$TOPIC_COMMIT_FAIL")
+        if [ "$COUNT_FAILING" = "0" ] && [ "$COUNT" = "3" ] && [ "${COMMIT_ERRORS_AFTER:-0}" -gt "${COMMIT_ERRORS_BEFORE:-0}" ]; then
+            log_pass "3 messages stored once after failed commits (errors/commit ${COMMIT_ERRORS_BEFORE:-0} -> $COMMIT_ERRORS_AFTER)"
+        else
+            log_fail "$COUNT_FAILING rows while commits failed, $COUNT of 3 after, errors/commit '${COMMIT_ERRORS_BEFORE}' -> '${COMMIT_ERRORS_AFTER}'"
+        fi
+    fi
+fi
+
+# =========================================================================
+# SECTION 14: Expired Data Archive
+# =========================================================================
+log_section "Section 14: Expired Data Archive"
+# test.conf has: plugin_opt_archive_path /mosquitto/data/archive,
+# plugin_opt_retention_rules data/test/archive/#=1, plugin_opt_retention_interval 10
+
+# ULID of a timestamp in milliseconds, with a random part
+ulid_at() {
+    local ms="$1" alphabet="0123456789ABCDEFGHJKMNPQRSTVWXYZ" ulid="" i
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        ulid="${alphabet:$((ms % 32)):1}$ulid"
+        ms=$((ms / 32))
+    done
+    for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16; do
+        ulid="$ulid${alphabet:$((RANDOM % 32)):1}"
+    done
+    echo "$ulid"
+}
+
+# -----------------------------------------
+# Test 47: Expired row is archived, then deleted
+# -----------------------------------------
+echo ""
+echo "--- Test 47: Expired row is archived before retention deletes it ---"
+if [ -z "$(conf_opt archive_path)" ]; then
+    log_skip "plugin_opt_archive_path is not set in $TEST_CONF"
+else
+TOPIC_ARCHIVE="data/test/archive/$TEST_ID"
+ULID_ARCHIVE=$(ulid_at $(( ($(date +%s) - 3 * 86400) * 1000 )))
+ARCHIVED_BEFORE=$(sys_metric retention/archived)
+db_execute "INSERT INTO msg (ulid, topic, payload, retain, qos) VALUES ('$ULID_ARCHIVE', '$TOPIC_ARCHIVE', 'expired', 0, 0)" > /dev/null
+COUNT=$(db_find_topic "$TOPIC_ARCHIVE")
+if [ "$COUNT" != "1" ]; then
+    log_fail "Could not insert a 3-day-old row for $TOPIC_ARCHIVE (found $COUNT)"
+else
+    # The next retention pass starts within retention_interval, metrics follow every 10s
+    for i in $(seq 1 30); do
+        COUNT=$(db_find_topic "$TOPIC_ARCHIVE")
+        [ "$COUNT" = "0" ] && break
+        sleep 1
+    done
+    ARCHIVED_AFTER=$(sys_metric_above retention/archived "${ARCHIVED_BEFORE:-0}")
+    if [ "$COUNT" = "0" ] && [ "${ARCHIVED_AFTER:-0}" -gt "${ARCHIVED_BEFORE:-0}" ]; then
+        log_pass "Row deleted after archiving, retention/archived ${ARCHIVED_BEFORE:-0} -> $ARCHIVED_AFTER"
+    else
+        log_fail "Row count $COUNT after retention, retention/archived '${ARCHIVED_BEFORE}' -> '${ARCHIVED_AFTER}'"
+    fi
+fi
+fi
+
+# =========================================================================
+# SECTION 15: Store on Change
+# =========================================================================
+log_section "Section 15: Store on Change"
+# test.conf has: plugin_opt_store_on_change data/test/onchange/#=1
+
+# Rows of a topic, oldest first, as one line of payloads
+db_payloads() {
+    db_execute "SELECT payload FROM msg WHERE topic = '$1' ORDER BY ulid" | jq -r '[.result.rows[][0].value] | join(",")'
+}
+
+# -----------------------------------------
+# Test 48: Identical republish skipped, changed payload stored
+# -----------------------------------------
+echo ""
+echo "--- Test 48: Unchanged payloads are skipped, changed ones stored ---"
+TOPIC_ONCHANGE="data/test/onchange/$TEST_ID"
+if [ -z "$(conf_opt store_on_change)" ]; then
+    log_skip "plugin_opt_store_on_change is not set in $TEST_CONF"
+else
+UNCHANGED_BEFORE=$(sys_metric rows/unchanged)
+# Separate publishes, so the repeats reach later batches than the rows they repeat
+for payload in on on off off on; do
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_ONCHANGE" -m "$payload" -q 1
+    sleep 0.2
+done
+sleep 0.5
+PAYLOADS=$(db_payloads "$TOPIC_ONCHANGE")
+UNCHANGED_AFTER=$(sys_metric_above rows/unchanged "${UNCHANGED_BEFORE:-0}")
+if [ "$PAYLOADS" = "on,off,on" ] && [ "${UNCHANGED_AFTER:-0}" -ge $(( ${UNCHANGED_BEFORE:-0} + 2 )) ]; then
+    log_pass "Stored on,off,on of on,on,off,off,on (rows/unchanged ${UNCHANGED_BEFORE:-0} -> $UNCHANGED_AFTER)"
+else
+    log_fail "Stored '$PAYLOADS' instead of on,off,on, rows/unchanged '${UNCHANGED_BEFORE}' -> '${UNCHANGED_AFTER}'"
+fi
+
+# -----------------------------------------
+# Test 49: Heartbeat stores an unchanged payload
+# -----------------------------------------
+echo ""
+echo "--- Test 49: Unchanged payload stored again after the heartbeat ---"
+log_info "Waiting 61s for the 1-minute heartbeat..."
+sleep 61
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_ONCHANGE" -m "on" -q 1
+sleep 0.5
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_ONCHANGE" -m "on" -q 1
+sleep 0.5
+PAYLOADS=$(db_payloads "$TOPIC_ONCHANGE")
+if [ "$PAYLOADS" = "on,off,on,on" ]; then
+    log_pass "Heartbeat row stored once, the repeat after it skipped"
+else
+    log_fail "Stored '$PAYLOADS' instead of on,off,on,on"
+fi
+fi
+
+# =========================================================================
+# SECTION 16: Partitioned Storage
+# =========================================================================
+log_section "Section 16: Partitioned Storage"
+# test-partition.conf has: plugin_opt_partition day, plugin_opt_retention_days 365
+
+# -----------------------------------------
+# Test 50: Rows land in the partition of their day
+# -----------------------------------------
+echo ""
+echo "--- Test 50: Rows are stored in today's partition ---"
+TOPIC_PARTITION="data/test/partition_$TEST_ID"
+PARTITION=""
+if [ "$(conf_opt partition)" != "day" ]; then
+    log_skip "plugin_opt_partition is not day in $TEST_CONF"
+else
+for i in 1 2 3; do
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_PARTITION" -m "{\"partition\":$i,\"id\":\"$TEST_ID\"}" -q 1
+done
+sleep 0.5
+# Partitions are UTC days, named <table>_pYYYYMMDD
+PARTITION=$(db_execute "SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB '*_p$(date -u +%Y%m%d)'" | jq -r '.result.rows[0][0].value // empty')
+COUNT=""
+if [ -n "$PARTITION" ]; then
+    COUNT=$(db_execute "SELECT COUNT(*) FROM $PARTITION WHERE topic = '$TOPIC_PARTITION'" | jq -r '.result.rows[0][0].value')
+fi
+if [ "$COUNT" = "3" ]; then
+    log_pass "3 messages stored in $PARTITION"
+else
+    log_fail "Found '$COUNT' of 3 messages in today's partition '$PARTITION'"
+fi
+
+# -----------------------------------------
+# Test 51: The msg view returns the partition's rows
+# -----------------------------------------
+echo ""
+echo "--- Test 51: msg view returns partitioned rows ---"
+MSG_TYPE=$(db_execute "SELECT type FROM sqlite_master WHERE name = 'msg'" | jq -r '.result.rows[0][0].value // empty')
+COUNT=$(db_find_topic "$TOPIC_PARTITION")
+if [ "$MSG_TYPE" = "view" ] && [ "$COUNT" = "3" ]; then
+    log_pass "msg is a view and returns all 3 messages"
+else
+    log_fail "msg is a '$MSG_TYPE' returning $COUNT of 3 messages"
+fi
+fi
+
+# -----------------------------------------
+# Test 52: Retention drops an expired partition
+# -----------------------------------------
+echo ""
+echo "--- Test 52: Retention drops a partition older than the retention ---"
+# Two partitions from 2020 are created behind the plugin's back. A failed commit makes the
+# worker reload its partition list; the next check (at most a minute later) drops the first
+# one, whose successor starts before the cutoff, and keeps the second, whose successor is today.
+if [ -z "$PARTITION" ] || [ "$(conf_opt journal)" != "true" ]; then
+    log_skip "Needs today's partition from Test 50 and plugin_opt_journal true"
+else
+    PARTITION_OLD="${PARTITION%_p*}_p20200101"
+    PARTITION_NEXT="${PARTITION%_p*}_p20200102"
+    TRIGGER_RELOAD="test_partition_reload_$TEST_ID"
+    DROPPED_BEFORE=$(sys_metric retention/partitions_dropped)
+    db_execute "CREATE TABLE IF NOT EXISTS $PARTITION_OLD AS SELECT * FROM $PARTITION WHERE 0" > /dev/null
+    db_execute "CREATE TABLE IF NOT EXISTS $PARTITION_NEXT AS SELECT * FROM $PARTITION WHERE 0" > /dev/null
+    # 2020-01-01T12:00:00Z
+    db_execute "INSERT INTO $PARTITION_OLD (ulid, topic, payload, retain, qos) VALUES ('$(ulid_at 1577880000000)', '$TOPIC_PARTITION', 'expired', 0, 0)" > /dev/null
+    db_execute "CREATE TRIGGER $TRIGGER_RELOAD BEFORE UPDATE ON msg_journal BEGIN SELECT RAISE(ROLLBACK, 'forced commit failure'); END" > /dev/null
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_PARTITION" -m "reload" -q 1
+    sleep 1
+    db_execute "DROP TRIGGER IF EXISTS $TRIGGER_RELOAD" > /dev/null
+    log_info "Waiting up to 75s for the partition check..."
+    for i in $(seq 1 75); do
+        OLD_LEFT=$(db_execute "SELECT COUNT(*) FROM sqlite_master WHERE name = '$PARTITION_OLD'" | jq -r '.result.rows[0][0].value')
+        [ "$OLD_LEFT" = "0" ] && break
+        sleep 1
+    done
+    NEXT_LEFT=$(db_execute "SELECT COUNT(*) FROM sqlite_master WHERE name = '$PARTITION_NEXT'" | jq -r '.result.rows[0][0].value')
+    DROPPED_AFTER=$(sys_metric_above retention/partitions_dropped "${DROPPED_BEFORE:-0}")
+    COUNT=$(db_find_topic "$TOPIC_PARTITION")
+    if [ "$OLD_LEFT" = "0" ] && [ "$NEXT_LEFT" = "1" ] && [ "$COUNT" = "4" ] &&
+       [ "${DROPPED_AFTER:-0}" -gt "${DROPPED_BEFORE:-0}" ]; then
+        log_pass "$PARTITION_OLD dropped, $PARTITION_NEXT kept, msg view still returns today's 4 rows"
+    else
+        log_fail "$PARTITION_OLD left: $OLD_LEFT, $PARTITION_NEXT left: $NEXT_LEFT, $COUNT of 4 rows in msg, partitions_dropped '${DROPPED_BEFORE}' -> '${DROPPED_AFTER}'"
+    fi
+fi
+
+# =========================================================================
+# SECTION 17: Insert/Delete Coalescing
+# =========================================================================
+log_section "Section 17: Insert/Delete Coalescing"
+
+# -----------------------------------------
+# Test 53: Retained message cleared within one batch
+# -----------------------------------------
+echo ""
+echo "--- Test 53: Insert and delete in one batch cancel each other ---"
+# While the worker waits on the lock with a batch of one message, the retained message and
+# its clearing queue up behind it and reach the next batch together
+TOPIC_COALESCE="data/test/coalesce_$TEST_ID"
+TOPIC_COALESCE_WAIT="data/test/coalesce_wait_$TEST_ID"
+DELETED_BEFORE=$(sys_metric rows/deleted)
+ERRORS_BEFORE="$(sys_metric errors/insert) $(sys_metric errors/delete) $(sys_metric errors/commit)"
+BATON=$(db_lock)
+if [ -z "$BATON" ]; then
+    log_skip "Could not take the database write lock through $DB_URL/v2/pipeline"
+else
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_COALESCE_WAIT" -m "wait" -q 1
+    sleep 0.2
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_COALESCE" -m '{"msg":"cleared"}' -q 1 -r -V 5
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_COALESCE" -r -n -V 5
+    db_unlock "$BATON"
+    sleep 0.5
+    COUNT=$(db_find_topic "$TOPIC_COALESCE")
+    COUNT_WAIT=$(db_find_topic "$TOPIC_COALESCE_WAIT")
+    # Let the next metrics publish (every 10 s) include the batch
+    sleep 11
+    DELETED_AFTER=$(sys_metric rows/deleted)
+    ERRORS_AFTER="$(sys_metric errors/insert) $(sys_metric errors/delete) $(sys_metric errors/commit)"
+    if [ "$COUNT" = "0" ] && [ "$COUNT_WAIT" = "1" ] && [ "$DELETED_AFTER" = "$DELETED_BEFORE" ] &&
+       [ "$ERRORS_AFTER" = "$ERRORS_BEFORE" ]; then
+        log_pass "No row stored or deleted for the cleared message, no errors"
+    else
+        log_fail "$COUNT rows left (waiting message: $COUNT_WAIT), rows/deleted '$DELETED_BEFORE' -> '$DELETED_AFTER', errors (insert delete commit) '$ERRORS_BEFORE' -> '$ERRORS_AFTER'"
+    fi
+fi
+
+# =========================================================================
+# SECTION 18: JSON Field Extraction
+# =========================================================================
+log_section "Section 18: JSON Field Extraction"
+# test.conf has: plugin_opt_extract data/test/extract/#=$.a.b[1].value:ex_nested:real,
+# ...=$.name:ex_name:text, ...=$.count:ex_count:integer
+
+# msg_fields columns ex_nested|ex_name|ex_count of a topic's row, NULL for SQL NULL
+db_fields() {
+    db_execute "SELECT ex_nested, ex_name, ex_count FROM msg_fields WHERE topic = '$1'" | \
+        jq -r '.result.rows[0] | map(.value // "NULL" | tostring) | join("|")'
+}
+
+TOPIC_EXTRACT="data/test/extract/$TEST_ID"
+if [ -z "$(conf_opt extract)" ]; then
+    log_skip "plugin_opt_extract is not set in $TEST_CONF"
+else
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_EXTRACT/nested" -q 1 \
+    -m '{"a":{"x":{"value":1},"b":[{"value":2},{"value":21.5}]},"value":3}'
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_EXTRACT/escaped" -q 1 \
+    -m '{"note":"\"name\":\"wrong\"","inner":{"name":"inner"},"name":"a\"b\\c\u0041"}'
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_EXTRACT/types" -q 1 \
+    -m '{"count":"42","name":17,"a":{"b":[0,{"value":"warm"}]}}'
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_EXTRACT/missing" -q 1 \
+    -m '{"other":1,"a":{"b":[{"value":2}]}}'
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_EXTRACT/invalid" -q 1 \
+    -m '{name: "x", count: 5}'
+sleep 0.5
+fi
+
+# -----------------------------------------
+# Test 54: Nested keys and array indexes
+# -----------------------------------------
+echo ""
+echo "--- Test 54: Nested path extracted into a real column ---"
+if [ -z "$(conf_opt extract)" ]; then
+    log_skip "plugin_opt_extract is not set in $TEST_CONF"
+else
+FIELDS=$(db_fields "$TOPIC_EXTRACT/nested")
+if [ "$FIELDS" = "21.5|NULL|NULL" ]; then
+    log_pass "\$.a.b[1].value = 21.5, other columns NULL"
+else
+    log_fail "Expected 21.5|NULL|NULL, got '$FIELDS'"
+fi
+fi
+
+# -----------------------------------------
+# Test 55: Escaped strings
+# -----------------------------------------
+echo ""
+echo "--- Test 55: Escaped string unescaped, keys inside strings and objects ignored ---"
+if [ -z "$(conf_opt extract)" ]; then
+    log_skip "plugin_opt_extract is not set in $TEST_CONF"
+else
+FIELDS=$(db_fields "$TOPIC_EXTRACT/escaped")
+EXPECTED='NULL|a"b\cA|NULL'
+if [ "$FIELDS" = "$EXPECTED" ]; then
+    log_pass "\$.name = a\"b\\cA"
+else
+    log_fail "Expected '$EXPECTED', got '$FIELDS'"
+fi
+fi
+
+# -----------------------------------------
+# Test 56: Numbers and strings converted by column type
+# -----------------------------------------
+echo ""
+echo "--- Test 56: Numeric string to integer, number to text, word to NULL ---"
+if [ -z "$(conf_opt extract)" ]; then
+    log_skip "plugin_opt_extract is not set in $TEST_CONF"
+else
+FIELDS=$(db_fields "$TOPIC_EXTRACT/types")
+if [ "$FIELDS" = "NULL|17|42" ]; then
+    log_pass "\"warm\" -> NULL real, 17 -> '17' text, \"42\" -> 42 integer"
+else
+    log_fail "Expected NULL|17|42, got '$FIELDS'"
+fi
+fi
+
+# -----------------------------------------
+# Test 57: Missing keys and invalid JSON
+# -----------------------------------------
+echo ""
+echo "--- Test 57: No msg_fields row without values or for invalid JSON ---"
+if [ -z "$(conf_opt extract)" ]; then
+    log_skip "plugin_opt_extract is not set in $TEST_CONF"
+else
+MISSING_ROWS=$(db_execute "SELECT COUNT(*) FROM msg_fields WHERE topic = '$TOPIC_EXTRACT/missing'" | jq -r '.result.rows[0][0].value')
+INVALID_ROWS=$(db_execute "SELECT COUNT(*) FROM msg_fields WHERE topic = '$TOPIC_EXTRACT/invalid'" | jq -r '.result.rows[0][0].value')
+STORED=$(( $(db_find_topic "$TOPIC_EXTRACT/missing") + $(db_find_topic "$TOPIC_EXTRACT/invalid") ))
+if [ "$MISSING_ROWS" = "0" ] && [ "$INVALID_ROWS" = "0" ] && [ "$STORED" = "2" ]; then
+    log_pass "Both messages stored, neither has a msg_fields row"
+else
+    log_fail "msg_fields rows: missing keys $MISSING_ROWS, invalid JSON $INVALID_ROWS; $STORED of 2 messages stored"
+fi
+fi
+
+# =========================================================================
+# SECTION 19: Rollups
+# =========================================================================
+log_section "Section 19: Rollups"
+# test.conf has: plugin_opt_rollup data/test/rollup/#=$.v
+
+# -----------------------------------------
+# Test 58: One-minute bucket of the published values
+# -----------------------------------------
+echo ""
+echo "--- Test 58: msg_rollup_1m row has count/min/max/avg of the minute ---"
+# With the journal, one value's batch fails to commit a few times first (see Test 46); its
+# value must still be counted once
+TOPIC_ROLLUP="data/test/rollup/$TEST_ID"
+TRIGGER_ROLLUP="test_rollup_fail_$TEST_ID"
+if [ -z "$(conf_opt rollup)" ]; then
+    log_skip "plugin_opt_rollup is not set in $TEST_CONF"
+else
+# All values in one minute: start early enough in it
+SECOND=$((10#$(date +%S)))
+if [ "$SECOND" -gt 40 ]; then
+    sleep $((61 - SECOND))
+fi
+for v in 10 20; do
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_ROLLUP" -m "{\"v\":$v}" -q 1
+done
+EXPECTED="3|10|60|30"
+if [ "$(conf_opt journal)" = "true" ]; then
+    EXPECTED="4|10|60|30"
+    sleep 0.5
+    db_execute "CREATE TRIGGER $TRIGGER_ROLLUP BEFORE UPDATE ON msg_journal BEGIN SELECT RAISE(ROLLBACK, 'forced commit failure'); END" > /dev/null
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_ROLLUP" -m '{"v":30}' -q 1
+    sleep 1.5
+    db_execute "DROP TRIGGER IF EXISTS $TRIGGER_ROLLUP" > /dev/null
+fi
+mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$TOPIC_ROLLUP" -m '{"v":60}' -q 1
+log_info "Waiting for the minute to close (up to 75s)..."
+ROLLUP=""
+for i in $(seq 1 75); do
+    ROLLUP=$(db_execute "SELECT count, min, max, avg FROM msg_rollup_1m WHERE topic = '$TOPIC_ROLLUP'" | \
+        jq -r '.result.rows[0] // empty | map(.value | tostring) | join("|")')
+    [ -n "$ROLLUP" ] && break
+    sleep 1
+done
+if [ "$ROLLUP" = "$EXPECTED" ]; then
+    log_pass "count|min|max|avg = $ROLLUP"
+else
+    log_fail "Expected count|min|max|avg $EXPECTED, got '$ROLLUP'"
+fi
+fi
+
+# =========================================================================
+# SECTION 20: Queue Policies
+# =========================================================================
+log_section "Section 20: Queue Policies"
+# test-spill.conf and test-drop.conf have: plugin_opt_queue_size 32, no journal, and
+# plugin_opt_queue_policy spill or drop_newest
+
+# Publish 100 messages (one per line, from one client) while the batch worker waits on the
+# database lock with a batch of one message, so the 32-entry queue overflows
+queue_overflow() {
+    local topic="$1" baton
+    baton=$(db_lock)
+    [ -n "$baton" ] || return 1
+    mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "${topic}_wait" -m "wait" -q 1
+    sleep 0.2
+    seq 1 100 | mosquitto_pub -h "$BROKER" -p "$PORT" -u "$USER" -P "$PASS" -t "$topic" -l -q 1
+    db_unlock "$baton"
+}
+
+# -----------------------------------------
+# Test 59: Spilled messages are stored after the stall
+# -----------------------------------------
+echo ""
+echo "--- Test 59: Queue overflow spilled to disk and drained into the table ---"
+TOPIC_SPILL="data/test/spill_$TEST_ID"
+if [ "$(conf_opt queue_policy)" != "spill" ] || [ "$(conf_opt journal)" = "true" ]; then
+    log_skip "Needs plugin_opt_queue_policy spill without the journal in $TEST_CONF"
+else
+SPILLED_BEFORE=$(sys_metric queue/spilled)
+if ! queue_overflow "$TOPIC_SPILL"; then
+    log_skip "Could not take the database write lock through $DB_URL/v2/pipeline"
+else
+    for i in $(seq 1 20); do
+        COUNT=$(db_find_topic "$TOPIC_SPILL")
+        [ "$COUNT" = "100" ] && break
+        sleep 0.5
+    done
+    SPILLED_AFTER=$(sys_metric_above queue/spilled "${SPILLED_BEFORE:-0}")
+    if [ "$COUNT" = "100" ] && [ "${SPILLED_AFTER:-0}" -gt "${SPILLED_BEFORE:-0}" ]; then
+        log_pass "All 100 messages stored, queue/spilled ${SPILLED_BEFORE:-0} -> $SPILLED_AFTER"
+    else
+        log_fail "$COUNT of 100 messages stored, queue/spilled '${SPILLED_BEFORE}' -> '${SPILLED_AFTER}'"
+    fi
+fi
+fi
+
+# -----------------------------------------
+# Test 60: drop_newest rejects the overflow and counts it
+# -----------------------------------------
+echo ""
+echo "--- Test 60: Queue overflow dropped and counted in queue/dropped_newest ---"
+TOPIC_DROP="data/test/drop_$TEST_ID"
+if [ "$(conf_opt queue_policy)" != "drop_newest" ] || [ "$(conf_opt journal)" = "true" ]; then
+    log_skip "Needs plugin_opt_queue_policy drop_newest without the journal in $TEST_CONF"
+else
+DROPPED_BEFORE=$(sys_metric queue/dropped_newest)
+if ! queue_overflow "$TOPIC_DROP"; then
+    log_skip "Could not take the database write lock through $DB_URL/v2/pipeline"
+else
+    # Let the next metrics publish (every 10 s) include every drop
+    sleep 11
+    COUNT=$(db_find_topic "$TOPIC_DROP")
+    DROPPED_AFTER=$(sys_metric queue/dropped_newest)
+    DROPPED=$(( ${DROPPED_AFTER:-0} - ${DROPPED_BEFORE:-0} ))
+    if [ "$DROPPED" -gt 0 ] && [ $((COUNT + DROPPED)) -eq 100 ]; then
+        log_pass "$COUNT messages stored, $DROPPED counted in queue/dropped_newest"
+    else
+        log_fail "$COUNT of 100 messages stored, queue/dropped_newest '${DROPPED_BEFORE}' -> '${DROPPED_AFTER}'"
+    fi
+fi
+fi
+
 else
     # Skip MQTT/TCP tests
     log_warn "mosquitto_pub/mosquitto_sub not found - skipping MQTT/TCP tests"
@@ -1027,9 +1730,9 @@ if $HAS_MQTTJS; then
     WS_OPTS="-h $BROKER -p $WS_PORT -C ws -u $USER -P $PASS"
 
 # =========================================================================
-# SECTION 12: WebSocket Connectivity
+# SECTION 21: WebSocket Connectivity
 # =========================================================================
-log_section "Section 12: WebSocket Connectivity"
+log_section "Section 21: WebSocket Connectivity"
 
 # -----------------------------------------
 # Test WS-1: Basic WebSocket connection
@@ -1103,9 +1806,9 @@ else
 fi
 
 # =========================================================================
-# SECTION 13: WebSocket Subscribe and Cross-Protocol Message Flow
+# SECTION 22: WebSocket Subscribe and Cross-Protocol Message Flow
 # =========================================================================
-log_section "Section 13: Cross-Protocol Message Flow"
+log_section "Section 22: Cross-Protocol Message Flow"
 
 # -----------------------------------------
 # Test WS-4: Publish via MQTT, receive via WebSocket
@@ -1170,9 +1873,9 @@ else
 fi
 
 # =========================================================================
-# SECTION 14: WebSocket Topic Exclusion
+# SECTION 23: WebSocket Topic Exclusion
 # =========================================================================
-log_section "Section 14: WebSocket Topic Exclusion"
+log_section "Section 23: WebSocket Topic Exclusion"
 
 # -----------------------------------------
 # Test WS-6: Excluded topic via WebSocket
@@ -1194,9 +1897,9 @@ else
 fi
 
 # =========================================================================
-# SECTION 15: WebSocket Batch Publishing
+# SECTION 24: WebSocket Batch Publishing
 # =========================================================================
-log_section "Section 15: WebSocket Batch Publishing"
+log_section "Section 24: WebSocket Batch Publishing"
 
 # -----------------------------------------
 # Test WS-7: Multiple rapid messages via WebSocket
@@ -20,19 +20,41 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #define MAX_PROCS 3
 
-static volatile int running = 1;
+#define DB_PATH "/mosquitto/data/dbs/default/data"
+#define SQLD_HTTP_PORT 8000
+#define READY_POLL_MS 20            /* Readiness probe interval */
+#define READY_TIMEOUT_MS 60000      /* Start mosquitto anyway after this long */
+#define PREWARM_DB_BYTES (256LL << 20)  /* Database bytes read ahead; the WAL is read whole */
+
+/* SQLite lock bytes: the main database's pending/reserved/shared range, and the
+ * WAL-index recovery lock in the -shm file */
+#define SQLITE_PENDING_BYTE 0x40000000
+#define SQLITE_LOCK_BYTES 514
+#define SQLITE_SHM_RECOVER_LOCK 122
+
+#define EVENT_SIGNAL MAX_PROCS      /* epoll tag of the signalfd; child i is tagged i */
+
+static int running = 1;
 static pid_t pids[MAX_PROCS] = {0};
+static int pidfds[MAX_PROCS] = {-1, -1, -1};
 static const char *proc_names[MAX_PROCS] = {"nginx", "sqld", "mosquitto"};
+static sigset_t child_sigmask;      /* Signal mask restored in children before exec */
 
-void signal_handler(int sig) {
-    (void)sig;
+/* Forward a termination signal to all children and leave the supervision loop */
+void stop_services(int sig) {
     running = 0;
     for (int i = 0; i < MAX_PROCS; i++) {
         if (pids[i] > 0) {
-            kill(pids[i], SIGTERM);
+            kill(pids[i], sig);
         }
     }
 }
@@ -268,6 +290,7 @@ int copy_file(const char *src, const char *dst) {
 pid_t start_process(const char *path, char *const argv[]) {
     pid_t pid = fork();
     if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
         execv(path, argv);
         fprintf(stderr, "Failed to exec %s: %s\n", path, strerror(errno));
         _exit(1);
@@ -275,14 +298,141 @@ pid_t start_process(const char *path, char *const argv[]) {
     return pid;
 }
 
+/* Watch child i through a pidfd, so its exit wakes the supervision loop directly.
+ * Kernels without pidfd_open (before 5.3) are covered by SIGCHLD on the signalfd. */
+void watch_process(int epfd, int i) {
+#ifdef SYS_pidfd_open
+    int fd = (int)syscall(SYS_pidfd_open, pids[i], 0);
+    if (fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+            pidfds[i] = fd;
+        } else {
+            close(fd);
+        }
+    }
+#else
+    (void)epfd;
+    (void)i;
+#endif
+}
+
+/* Reap every exited child, including orphans reparented to us as PID 1.
+ * Supervision ends when one of the services exits. */
+void reap_children(void) {
+    int status;
+    pid_t died;
+    while ((died = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < MAX_PROCS; i++) {
+            if (pids[i] == died) {
+                fprintf(stderr, "mqbase-init: %s (pid %d) exited with status %d\n", 
+                        proc_names[i], died, WEXITSTATUS(status));
+                pids[i] = -1;
+                if (pidfds[i] >= 0) {
+                    close(pidfds[i]);  /* Also removes it from the epoll set */
+                    pidfds[i] = -1;
+                }
+                running = 0;
+                break;
+            }
+        }
+    }
+}
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns 1 if sqld's HTTP listener accepts a connection and answers a request */
+int sqld_http_ready(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 0;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(SQLD_HTTP_PORT) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 200000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    
+    int ready = 0;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        const char req[] = "GET /health HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n";
+        char resp[16];
+        if (write(fd, req, sizeof(req) - 1) == (ssize_t)(sizeof(req) - 1) &&
+            read(fd, resp, 5) == 5 && strncmp(resp, "HTTP/", 5) == 0) {
+            ready = 1;
+        }
+    }
+    close(fd);
+    return ready;
+}
+
+/* Returns 1 if another process holds a lock on path that excludes readers
+ * (F_GETLK ignores our own locks; we hold none) */
+int file_write_locked(const char *path, off_t start, off_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct flock fl = { .l_type = F_RDLCK, .l_whence = SEEK_SET, .l_start = start, .l_len = len };
+    int locked = fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+    close(fd);
+    return locked;
+}
+
+/* sqld is ready once it serves HTTP, the database exists, and no connection is
+ * writing it exclusively or recovering its WAL */
+int sqld_ready(void) {
+    struct stat st;
+    return sqld_http_ready() && stat(DB_PATH, &st) == 0 &&
+           !file_write_locked(DB_PATH, SQLITE_PENDING_BYTE, SQLITE_LOCK_BYTES) &&
+           !file_write_locked(DB_PATH "-shm", SQLITE_SHM_RECOVER_LOCK, 1);
+}
+
+/* Start kernel readahead of the WAL and the start of the database, so sqld's WAL
+ * recovery and the plugin's first queries read from the page cache */
+void prewarm_database(void) {
+    const char *files[2] = { DB_PATH "-wal", DB_PATH };
+    const off_t limits[2] = { 0, PREWARM_DB_BYTES };   /* 0 = whole file */
+    for (int i = 0; i < 2; i++) {
+        int fd = open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, limits[i], POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+}
+
+/* Make database files world-writable so mosquitto (running as nobody) can access them.
+ * SQLite creates -wal and -shm with the database's mode, so this is needed once per file. */
+void fix_db_permissions(void) {
+    chmod("/mosquitto/data/dbs/default/data", 0666);
+    chmod("/mosquitto/data/dbs/default/data-shm", 0666);
+    chmod("/mosquitto/data/dbs/default/data-wal", 0666);
+    chmod("/mosquitto/data/dbs/default/.sentinel", 0666);
+    chmod("/mosquitto/data/dbs/default/stats.json", 0666);
+    chmod("/mosquitto/data/dbs/default/wallog", 0666);
+}
+
 int main(int argc, char *argv[]) {
     (void)argc;
     (void)argv;
     
-    /* Setup signal handlers */
-    signal(SIGTERM, signal_handler);
-    signal(SIGINT, signal_handler);
-    signal(SIGCHLD, SIG_DFL);
+    /* Signals are read from a signalfd in the supervision loop, so block them here
+     * (children get the original mask back before exec) */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &child_sigmask);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigfd < 0 || epfd < 0) {
+        fprintf(stderr, "mqbase-init: Failed to set up supervision: %s\n", strerror(errno));
+        return 1;
+    }
+    struct epoll_event sigev = { .events = EPOLLIN, .data.u32 = EVENT_SIGNAL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &sigev);
     
     fprintf(stderr, "mqbase-init: Starting services...\n");
     
@@ -313,9 +463,18 @@ int main(int argc, char *argv[]) {
     /* Make dynsec.json writable (it's read-only from COPY in Dockerfile) */
     chmod("/mosquitto/config/dynsec.json", 0666);
     
+    /* On a restart the database already exists: read it ahead while the services start */
+    struct stat db_st;
+    int warm_restart = stat(DB_PATH, &db_st) == 0;
+    if (warm_restart) {
+        fix_db_permissions();
+        prewarm_database();
+    }
+    
     /* Start nginx */
     char *nginx_argv[] = {"/usr/sbin/nginx", "-g", "daemon off;", NULL};
     pids[0] = start_process("/usr/sbin/nginx", nginx_argv);
+    watch_process(epfd, 0);
     fprintf(stderr, "mqbase-init: Started nginx (pid %d)\n", pids[0]);
     
     /* Start sqld - serves HTTP API for database queries
@@ -327,43 +486,65 @@ int main(int argc, char *argv[]) {
         "--enable-http-console",
         NULL};
     pids[1] = start_process("/usr/local/bin/sqld", sqld_argv);
+    watch_process(epfd, 1);
     fprintf(stderr, "mqbase-init: Started sqld (pid %d)\n", pids[1]);
     
-    /* Wait for sqld to initialize and create the database directory structure */
-    sleep(2);
-    
-    /* Make database files world-writable so mosquitto (running as nobody) can access them */
-    chmod("/mosquitto/data/dbs/default/data", 0666);
-    chmod("/mosquitto/data/dbs/default/data-shm", 0666);
-    chmod("/mosquitto/data/dbs/default/data-wal", 0666);
-    chmod("/mosquitto/data/dbs/default/.sentinel", 0666);
-    chmod("/mosquitto/data/dbs/default/stats.json", 0666);
-    chmod("/mosquitto/data/dbs/default/wallog", 0666);
-    
-    /* Start mosquitto - plugin opens the same database sqld manages */
+    /* Mosquitto - plugin opens the same database sqld manages. On a restart it starts
+     * right away, so the plugin opens the database, prepares its statements and warms
+     * its cache while sqld recovers. SQLite's locks order their access, and the plugin
+     * retries a database busy with recovery for up to 60 s (READY_TIMEOUT_MS here)
+     * before it refuses to start. On first start it waits until sqld has created the database. */
     char *mosquitto_argv[] = {"/usr/sbin/mosquitto", "-c", "/mosquitto/config/mosquitto.conf", NULL};
-    pids[2] = start_process("/usr/sbin/mosquitto", mosquitto_argv);
-    fprintf(stderr, "mqbase-init: Started mosquitto (pid %d)\n", pids[2]);
-    
-    fprintf(stderr, "mqbase-init: All services started\n");
+    long long started_ms = now_ms();
+    int sqld_up = 0;
+    int announced = 0;
     
-    /* Monitor processes */
+    /* Supervise: signals and child exits arrive through epoll; until sqld is ready
+     * the loop also wakes every READY_POLL_MS to probe it */
     while (running) {
-        int status;
-        pid_t died = waitpid(-1, &status, WNOHANG);
+        if (!sqld_up) {
+            long long waited_ms = now_ms() - started_ms;
+            if (sqld_ready()) {
+                sqld_up = 1;
+                fprintf(stderr, "mqbase-init: sqld ready after %lld ms\n", waited_ms);
+            } else if (waited_ms >= READY_TIMEOUT_MS) {
+                sqld_up = 1;
+                fprintf(stderr, "mqbase-init: sqld not ready after %lld ms, starting anyway\n", waited_ms);
+            }
+            if (sqld_up) {
+                fix_db_permissions();
+            }
+        }
+        if (pids[2] == 0 && (warm_restart || sqld_up)) {
+            pids[2] = start_process("/usr/sbin/mosquitto", mosquitto_argv);
+            watch_process(epfd, 2);
+            fprintf(stderr, "mqbase-init: Started mosquitto (pid %d)\n", pids[2]);
+        }
+        if (sqld_up && !announced) {
+            fprintf(stderr, "mqbase-init: All services started\n");
+            announced = 1;
+        }
         
-        if (died > 0) {
-            for (int i = 0; i < MAX_PROCS; i++) {
-                if (pids[i] == died) {
-                    fprintf(stderr, "mqbase-init: %s (pid %d) exited with status %d\n", 
-                            proc_names[i], died, WEXITSTATUS(status));
-                    running = 0;
-                    break;
+        struct epoll_event events[MAX_PROCS + 1];
+        int n = epoll_wait(epfd, events, MAX_PROCS + 1, sqld_up ? -1 : READY_POLL_MS);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "mqbase-init: epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u32 != EVENT_SIGNAL) {
+                reap_children();
+                continue;
+            }
+            struct signalfd_siginfo si;
+            while (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                if (si.ssi_signo == SIGCHLD) {
+                    reap_children();
+                } else {
+                    stop_services((int)si.ssi_signo);
                 }
             }
         }
-        
-        usleep(100000);  /* 100ms */
     }
     
     /* Cleanup - send SIGTERM to all */
@@ -0,0 +1,61 @@
+// Minimal stand-ins for the broker functions the plugin calls, so the benchmark can
+// link the plugin without a running mosquitto. Set BENCH_VERBOSE=1 to see plugin logs.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mosquitto_broker.h"
+
+void mosquitto_log_printf(int level, const char *fmt, ...) {
+    static int verbose = -1;
+    if (verbose < 0) {
+        verbose = getenv("BENCH_VERBOSE") != NULL;
+    }
+    if (!verbose) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "[%d] ", level);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+int mosquitto_callback_register(mosquitto_plugin_id_t *identifier, int event,
+                                MOSQ_FUNC_generic_callback cb_func, const void *event_data, void *userdata) {
+    (void)identifier;
+    (void)event;
+    (void)cb_func;
+    (void)event_data;
+    (void)userdata;
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_callback_unregister(mosquitto_plugin_id_t *identifier, int event,
+                                  MOSQ_FUNC_generic_callback cb_func, const void *event_data) {
+    (void)identifier;
+    (void)event;
+    (void)cb_func;
+    (void)event_data;
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_broker_publish_copy(const char *clientid, const char *topic, int payloadlen,
+                                  const void *payload, int qos, bool retain, mosquitto_property *properties) {
+    (void)clientid;
+    (void)topic;
+    (void)payloadlen;
+    (void)payload;
+    (void)qos;
+    (void)retain;
+    (void)properties;
+    return MOSQ_ERR_SUCCESS;
+}
+
+const char *mosquitto_client_id(const struct mosquitto *client) {
+    (void)client;
+    return NULL;
+}
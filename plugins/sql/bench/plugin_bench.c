@@ -0,0 +1,287 @@
+// Benchmarks for the plugin's hot paths.
+//
+// The plugin source is compiled into this binary so its static functions can be timed
+// directly. Each result is printed as one JSON object per line:
+//   {"bench":"flush_batch","variant":"multi_row","batch":1000,"ns_per_op":812.4,"ops":100000}
+// where ns_per_op is per row for flush benchmarks.
+//
+// Usage: plugin_bench [-n rows_per_config] [-d dir] [-b bench] [-o key=value ...]
+// -b runs only the named benchmark (ulid, topic_rules, extract_headers, flush_batch).
+// -o passes extra plugin options (e.g. -o ulid_format=binary -o topic_dictionary=true).
+
+#include "../libsql_plugin.c"
+
+#define BENCH_DEFAULT_ROWS 100000
+#define BENCH_MAX_OPTS 16
+#define BENCH_FUNCTION_OPS 1000000  // Calls per configuration of the function benchmarks
+#define BENCH_TOPICS 4096           // Distinct topics, well above the per-thread decision cache
+
+static const int bench_batch_sizes[] = { 100, 500, 1000, 2000, 5000 };
+static const int bench_pattern_counts[] = { 1, 10, 50, 100, 500 };
+static const int bench_property_counts[] = { 0, 1, 4, 8, 16, 32 };
+
+static volatile unsigned long bench_sink;   // Keeps results of timed calls alive
+static char bench_dir[256];
+static char bench_db_path[320];
+static char bench_spill_path[320];
+static struct mosquitto_opt bench_extra_opts[BENCH_MAX_OPTS];
+static int bench_extra_count = 0;
+
+static double bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_emit(const char *bench, const char *variant, const char *param, long value,
+                       double ns_per_op, long ops) {
+    printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"%s\":%ld,\"ns_per_op\":%.1f,\"ops\":%ld}\n",
+           bench, variant, param, value, ns_per_op, ops);
+    fflush(stdout);
+}
+
+static void bench_remove_db(void) {
+    char path[400];
+    unlink(bench_db_path);
+    snprintf(path, sizeof(path), "%s-wal", bench_db_path);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s-shm", bench_db_path);
+    unlink(path);
+}
+
+// Start the plugin on a fresh database (db_path, or the scratch file if NULL), then stop
+// shard 0's worker thread and open the shard on this thread so the benchmark can drive
+// flush_batch itself
+static int bench_plugin_start(const char *bulk, const char *db_path_opt) {
+    struct mosquitto_opt opts[BENCH_MAX_OPTS + 3] = {
+        { "db_path", db_path_opt != NULL ? (char *)db_path_opt : bench_db_path },
+        { "spill_path", bench_spill_path },
+        { "bulk_insert", (char *)bulk },
+    };
+    int count = 3;
+    for (int i = 0; i < bench_extra_count; i++) {
+        opts[count++] = bench_extra_opts[i];
+    }
+
+    bench_remove_db();
+    if (mosquitto_plugin_init(NULL, NULL, opts, count) != MOSQ_ERR_SUCCESS ||
+        atomic_load(&shards[0].ready) != 1) {
+        fprintf(stderr, "plugin init failed for %s\n", bench_db_path);
+        return -1;
+    }
+
+    if (atomic_load(&shards[0].running)) {
+        atomic_store(&shards[0].running, 0);
+        queue_wakeup(&shards[0]);
+        pthread_join(shards[0].thread, NULL);
+    }
+    atomic_store(&shards[0].wakeup_pending, false);
+    shard_open(&shards[0]);
+    return msg_db != NULL ? 0 : -1;
+}
+
+static void bench_plugin_stop(void) {
+    shard_close();
+    mosquitto_plugin_cleanup(NULL, NULL, 0);
+    bench_remove_db();
+}
+
+// Queue count insert entries shaped like typical sensor traffic
+static void bench_enqueue_rows(int count) {
+    static unsigned long seq = 0;
+    char ulid[27];
+    char topic[64];
+    char payload[96];
+
+    for (int i = 0; i < count; i++, seq++) {
+        ulid_generate(ulid_thread_generator(), ulid);
+        snprintf(topic, sizeof(topic), "bench/site%lu/sensor/temp", seq % 100);
+        int len = snprintf(payload, sizeof(payload),
+                           "{\"seq\":%lu,\"value\":%lu.%lu,\"unit\":\"C\",\"status\":\"ok\"}",
+                           seq, seq % 40, seq % 10);
+        enqueue_message(&shards[0], ulid, topic, payload, (size_t)len, NULL, 0, 0, (int)(seq % 3));
+    }
+}
+
+static void bench_ulid(long ops) {
+    char ulid[27];
+    unsigned char raw[16];
+    struct ulid_generator gen;
+    
+    ulid_generator_init(&gen, ULID_PARANOID);
+    double start = bench_now_ns();
+    for (long i = 0; i < ops; i++) {
+        ulid_generate(&gen, ulid);
+    }
+    bench_emit("ulid_generate", "unlocked", "threads", 1, (bench_now_ns() - start) / ops, ops);
+    
+    // As on_message_callback calls it
+    start = bench_now_ns();
+    for (long i = 0; i < ops; i++) {
+        ulid_generate(ulid_thread_generator(), ulid);
+    }
+    bench_emit("ulid_generate", "per_thread", "threads", 1, (bench_now_ns() - start) / ops, ops);
+    
+    ulid_decode(raw, ulid);
+    start = bench_now_ns();
+    for (long i = 0; i < ops; i++) {
+        memcpy(raw + 8, &i, sizeof(i));    // Whole-word store, so the load is forwarded
+        ulid_encode(ulid, raw);
+        bench_sink += (unsigned char)ulid[25];
+    }
+    bench_emit("ulid_encode", "text", "bytes", 16, (bench_now_ns() - start) / ops, ops);
+}
+
+// is_topic_excluded against count compiled patterns, for topics that miss the per-thread
+// decision cache (uncached) and for a working set that fits in it (cached)
+static void bench_topic_rules(int count, long ops) {
+    static char topics[BENCH_TOPICS][64];
+    char pattern[64];
+    
+    sqlite3_str *patterns = sqlite3_str_new(NULL);
+    for (int i = 0; i < count; i++) {
+        // A mix of exact, single-level and multi-level wildcard rules
+        switch (i % 3) {
+        case 0: snprintf(pattern, sizeof(pattern), "site%d/+/temp", i); break;
+        case 1: snprintf(pattern, sizeof(pattern), "site%d/line/#", i); break;
+        default: snprintf(pattern, sizeof(pattern), "site%d/line/sensor%d", i, i); break;
+        }
+        sqlite3_str_appendf(patterns, "%s%s", i > 0 ? "," : "", pattern);
+    }
+    char *list = sqlite3_str_finish(patterns);
+    free_topic_rules();
+    parse_topic_patterns(list, TOPIC_RULE_EXCLUDE);
+    atomic_fetch_add(&topic_rules_generation, 1);
+    sqlite3_free(list);
+    
+    for (int i = 0; i < BENCH_TOPICS; i++) {
+        snprintf(topics[i], sizeof(topics[i]), "site%d/line/sensor%d", i % (count * 2), i);
+    }
+    
+    const char *variants[2] = { "uncached", "cached" };
+    int working_sets[2] = { BENCH_TOPICS, 64 };
+    for (int v = 0; v < 2; v++) {
+        unsigned long excluded = 0;
+        double start = bench_now_ns();
+        for (long i = 0; i < ops; i++) {
+            excluded += is_topic_excluded(topics[i % working_sets[v]]);
+        }
+        bench_emit("is_topic_excluded", variants[v], "patterns", count, (bench_now_ns() - start) / ops, ops);
+        bench_sink += excluded;
+    }
+    free_topic_rules();
+}
+
+static void bench_extract_headers(int count, long ops) {
+    mosquitto_property *props = NULL;
+    char name[32];
+    char value[32];
+    
+    // A content type first, so the user properties are not at the head of the list
+    mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, "application/json");
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "header-%d", i);
+        snprintf(value, sizeof(value), "value-%d-%08x", i, (unsigned)(i * 2654435761u));
+        mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, name, value);
+    }
+    
+    const char *formats[2] = { "text", "binary" };
+    for (int f = 0; f < 2; f++) {
+        headers_format = f == 0 ? HEADERS_FORMAT_TEXT : HEADERS_FORMAT_BINARY;
+        size_t len = 0;
+        double start = bench_now_ns();
+        for (long i = 0; i < ops; i++) {
+            const char *headers = extract_headers(props, &len);
+            bench_sink += headers != NULL ? len : 0;
+        }
+        bench_emit("extract_headers", formats[f], "properties", count, (bench_now_ns() - start) / ops, ops);
+    }
+    headers_format = HEADERS_FORMAT_TEXT;
+    mosquitto_property_free_all(&props);
+}
+
+// Time flush_batch for batches of the given size until rows rows have been written
+static void bench_flush_batch(const char *variant, const char *bulk, const char *db_path_opt, int batch, long rows) {
+    if (bench_plugin_start(bulk, db_path_opt) != 0) {
+        return;
+    }
+
+    long rounds = rows / batch > 3 ? rows / batch : 3;
+    double total_ns = 0;
+    for (long r = 0; r < rounds; r++) {
+        bench_enqueue_rows(batch);
+        double start = bench_now_ns();
+        flush_batch();
+        total_ns += bench_now_ns() - start;
+    }
+
+    bench_emit("flush_batch", variant, "batch", batch, total_ns / (rounds * batch), rounds * batch);
+    bench_plugin_stop();
+}
+
+int main(int argc, char **argv) {
+    long rows = BENCH_DEFAULT_ROWS;
+    const char *dir = NULL;
+    const char *only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rows = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && strchr(argv[i + 1], '=') != NULL &&
+                   bench_extra_count < BENCH_MAX_OPTS) {
+            char *key = argv[++i];
+            char *value = strchr(key, '=');
+            *value++ = '\0';
+            bench_extra_opts[bench_extra_count].key = key;
+            bench_extra_opts[bench_extra_count].value = value;
+            bench_extra_count++;
+        } else {
+            fprintf(stderr, "Usage: %s [-n rows_per_config] [-d dir] [-b bench] [-o key=value ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (dir != NULL) {
+        snprintf(bench_dir, sizeof(bench_dir), "%s", dir);
+    } else {
+        snprintf(bench_dir, sizeof(bench_dir), "/tmp/mqbase-bench-XXXXXX");
+        if (mkdtemp(bench_dir) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+    }
+    snprintf(bench_db_path, sizeof(bench_db_path), "%s/bench.db", bench_dir);
+    snprintf(bench_spill_path, sizeof(bench_spill_path), "%s/bench.spill", bench_dir);
+
+    if (only == NULL || strcmp(only, "ulid") == 0) {
+        bench_ulid(BENCH_FUNCTION_OPS);
+    }
+    if (only == NULL || strcmp(only, "topic_rules") == 0) {
+        for (size_t i = 0; i < sizeof(bench_pattern_counts) / sizeof(bench_pattern_counts[0]); i++) {
+            bench_topic_rules(bench_pattern_counts[i], BENCH_FUNCTION_OPS);
+        }
+    }
+    if (only == NULL || strcmp(only, "extract_headers") == 0) {
+        for (size_t i = 0; i < sizeof(bench_property_counts) / sizeof(bench_property_counts[0]); i++) {
+            bench_extract_headers(bench_property_counts[i], BENCH_FUNCTION_OPS);
+        }
+    }
+    if (only == NULL || strcmp(only, "flush_batch") == 0) {
+        // The on-disk database runs in WAL mode with synchronous=NORMAL, as in production
+        for (size_t i = 0; i < sizeof(bench_batch_sizes) / sizeof(bench_batch_sizes[0]); i++) {
+            bench_flush_batch("row_at_a_time", "false", NULL, bench_batch_sizes[i], rows);
+            bench_flush_batch("multi_row", "true", NULL, bench_batch_sizes[i], rows);
+            bench_flush_batch("memory_row_at_a_time", "false", ":memory:", bench_batch_sizes[i], rows);
+            bench_flush_batch("memory_multi_row", "true", ":memory:", bench_batch_sizes[i], rows);
+        }
+    }
+
+    if (dir == NULL) {
+        rmdir(bench_dir);
+    }
+    return 0;
+}
@@ -8,9 +8,18 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "mosquitto_broker.h"
 #include "mosquitto_plugin.h"
@@ -19,6 +28,11 @@
 
 #include "sqlite3.h"
 
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
 // Conditional debug logging - compiles to nothing in release builds
 // Enable with -DDEBUG_LOGGING in CFLAGS for verbose output
 #ifdef DEBUG_LOGGING
@@ -32,153 +46,914 @@
 #define ULID_PARANOID  (1 << 1)
 #define ULID_SECURE    (1 << 2)
 
-// Maximum number of exclusion patterns
-#define MAX_EXCLUDE_PATTERNS 64
-#define MAX_EXCLUDE_HEADERS 64
+// Topic rule flags stored in the topic trie
+#define TOPIC_RULE_EXCLUDE (1u << 0)
+#define TOPIC_RULE_INCLUDE (1u << 1)
+#define TOPIC_RULE_RETENTION (1u << 2)
+#define TOPIC_RULE_EXTRACT (1u << 3)
+#define TOPIC_RULE_ROLLUP (1u << 4)
+#define TOPIC_RULE_ON_CHANGE (1u << 5)
+
+// Per-thread cache of recent topic exclusion decisions
+#define TOPIC_DECISION_CACHE_SIZE 256     // Entries per thread, must be a power of two
+#define TOPIC_DECISION_TOPIC_MAX 112      // Longer topics bypass the cache
 
 // Batch insert configuration (defaults, can be overridden via config)
 #define DEFAULT_BATCH_SIZE 100           // Flush when queue reaches this size
 #define DEFAULT_FLUSH_INTERVAL_MS 50     // Flush at least every 50ms
-#define MAX_QUEUE_SIZE 15000             // Maximum queue size before blocking
+#define DEFAULT_BATCH_SIZE_MIN 10        // Adaptive batching: lower bound for the flush threshold
+#define DEFAULT_FLUSH_INTERVAL_MIN_MS 5  // Adaptive batching: lower bound for the flush interval
+#define DEFAULT_TARGET_LATENCY_MS 100    // Adaptive batching: persistence delay target
+#define BATCH_REPORT_INTERVAL_SEC 60
+#define DEFAULT_QUEUE_SIZE 16384         // Queued entries before the queue policy applies
+#define MAX_QUEUE_SIZE (1 << 20)         // Upper bound for plugin_opt_queue_size
+
+// Queue backpressure policies (what happens when the queue is full)
+#define QUEUE_POLICY_DROP_OLDEST 0   // Evict the oldest queued entries
+#define QUEUE_POLICY_DROP_NEWEST 1   // Reject the incoming entry
+#define QUEUE_POLICY_BLOCK       2   // Wait up to queue_block_ms for room, then reject
+#define QUEUE_POLICY_SHED_QOS0   3   // Reserve headroom for QoS 1/2 and deletes, reject QoS 0 first
+#define QUEUE_POLICY_SPILL       4   // Append overflow to a disk journal replayed by the worker
+
+#define DEFAULT_QUEUE_BLOCK_MS 100       // Longest a producer waits for room
+#define DEFAULT_QOS0_WATERMARK 75        // shed_qos0: percent of capacity usable by QoS 0
+#define DEFAULT_SPILL_PATH "/mosquitto/data/dbs/default/spill"
+#define DEFAULT_SPILL_MAX_BYTES (1ULL << 30)
+#define DEFAULT_JOURNAL_PATH "/mosquitto/data/dbs/default/journal"
+#define DEFAULT_JOURNAL_SEGMENT_SIZE (64ULL << 20)
+#define DEFAULT_JOURNAL_MAX_BYTES (4ULL << 30)
+#define QUEUE_REPORT_INTERVAL_SEC 10
+
+// Ring slots and hot counters are padded to a cache line to avoid false sharing
+#define CACHE_LINE_SIZE 64
 
 // Data retention configuration
 #define DEFAULT_RETENTION_DAYS 0         // 0 = disabled (keep all messages)
-#define RETENTION_CHECK_INTERVAL_SEC 86400 // Check every day
+#define DEFAULT_RETENTION_INTERVAL_SEC 3600  // Start a retention pass at most once an hour
+#define DEFAULT_RETENTION_CHUNK 1000     // Rows deleted per retention statement/transaction
+#define DEFAULT_RETENTION_BUDGET_MS 20   // Retention work allowed per worker cycle
+#define RETENTION_PROGRESS_INTERVAL_SEC 10
+
+// WAL checkpointing. With plugin_opt_checkpoint managed (the default) commits never
+// checkpoint; a checkpoint thread does it from its own connection to each shard.
+#define CHECKPOINT_MANAGED 1
+#define CHECKPOINT_AUTO 0                       // SQLite's auto-checkpoint inside COMMIT
+#define DEFAULT_CHECKPOINT_PAGES 1000           // WAL frames that trigger a PASSIVE checkpoint
+#define DEFAULT_CHECKPOINT_INTERVAL_MS 1000     // A WAL with new commits is checkpointed at least this often
+#define DEFAULT_CHECKPOINT_WAL_LIMIT (64ULL << 20)  // WAL size that escalates to RESTART/TRUNCATE
+#define CHECKPOINT_BUSY_MS 100                  // Longest RESTART/TRUNCATE wait for readers
+#define CHECKPOINT_BACKOFF_INTERVALS 10         // Intervals without escalation after a busy one
+
+// History replay (plugin_opt_history): requests published to $history/... are answered
+// from a read-only connection per shard and streamed back from the broker's tick
+#define HISTORY_PREFIX "$history/"
+#define DEFAULT_HISTORY_LIMIT 100           // Rows per request without a limit property
+#define DEFAULT_HISTORY_MAX_LIMIT 1000      // Largest limit a request may ask for
+#define DEFAULT_HISTORY_RATE 1000           // Replies published per second, 0 = unlimited
+#define HISTORY_MAX_PENDING 256             // Queued requests before new ones are refused
+#define HISTORY_OUTBOX_LIMIT 1024           // Replies read ahead of the tick
+#define HISTORY_PAGE_ROWS 256               // Rows read ahead per request
+#define HISTORY_STREAM_ROWS 16              // Smallest page of one topic's stream
+#define HISTORY_MAX_STREAMS 1024            // Topics merged per request before scanning instead
+#define HISTORY_MAX_PROBES 8192             // Topic index seeks per request before scanning instead
+
+// Metrics published on $SYS topics from the broker's tick
+#define DEFAULT_METRICS_INTERVAL_SEC 10  // 0 = do not publish
+#define METRICS_TOPIC_PREFIX "$SYS/broker/mqbase/"
+#define METRIC_HIST_SUB_BITS 3           // 8 linear sub-buckets per power of two (<= 12.5% error)
+#define METRIC_HIST_MAX_BITS 41          // Larger values are counted in the last bucket
+#define METRIC_HIST_BUCKETS ((METRIC_HIST_MAX_BITS - METRIC_HIST_SUB_BITS + 1) << METRIC_HIST_SUB_BITS)
+
+// Payload storage formats
+#define PAYLOAD_FORMAT_TEXT 0   // Always store as TEXT (explicit length, binary-safe bytes)
+#define PAYLOAD_FORMAT_BLOB 1   // Always store as BLOB
+#define PAYLOAD_FORMAT_AUTO 2   // TEXT for valid UTF-8 without NUL bytes, BLOB otherwise
+
+static int payload_format = PAYLOAD_FORMAT_TEXT;
+
+// Payload compression (zstd, built with WITH_ZSTD=yes). Compressed rows store the payload
+// as a zstd frame BLOB and the codec column holds the dictionary id (0 = no dictionary);
+// codec is NULL for payloads stored as-is.
+#define CODEC_NONE -1
+#define DEFAULT_COMPRESSION_LEVEL 3
+#define DEFAULT_COMPRESSION_MIN_BYTES 64
+#define DEFAULT_COMPRESSION_DICT_SIZE (16 * 1024)
+#define DEFAULT_COMPRESSION_TRAIN_SAMPLES 1000
+#define COMPRESSION_SAMPLE_MAX (16 * 1024)      // Larger payloads are not used for training
+#define MAX_COMPRESSION_DICTS 32
+static int compression_enabled = 0;
+static int compression_level = DEFAULT_COMPRESSION_LEVEL;
+static int compression_min_bytes = DEFAULT_COMPRESSION_MIN_BYTES;
+static int compression_dict_size = DEFAULT_COMPRESSION_DICT_SIZE;
+static int compression_train_samples = DEFAULT_COMPRESSION_TRAIN_SAMPLES;
+static char *compression_dict_prefixes = NULL;  // Comma-separated topic prefixes to train dictionaries for
+
+// ULID key storage formats
+#define ULID_FORMAT_TEXT 0      // ulid text primary key - 26-char Crockford string
+#define ULID_FORMAT_BINARY 1    // ulid blob primary key, WITHOUT ROWID - raw 16 bytes
+
+#define MIGRATE_CHUNK_ROWS 50000  // Rows copied per transaction when migrating the msg table
+#define OPEN_BUSY_TIMEOUT_MS 60000  // Longest wait at open while another process recovers the database
+#define OPEN_BUSY_RETRY_MS 100      // Pause between attempts to read a busy database at open
+#define TOPIC_CACHE_MAX 1000000   // Topic dictionary entries cached in memory before a reset
+#define CHANGE_PAYLOAD_MAX 4096   // Longest payload store_on_change keeps to compare; longer ones are always stored
+#define DEFAULT_STATS_LEVELS 1    // Topic levels that make up a msg_stats prefix
+#define STATS_TOTAL_PREFIX "#"    // msg_stats row for the whole store (no topic can be "#")
+#define STATS_MINUTES 1440        // msg_stats_minute rows kept
+
+// Storage layout. The physical table is msg for the original layout (text keys, topic
+// strings); any other layout writes to its own table and exposes a msg view instead.
+static int ulid_format = ULID_FORMAT_TEXT;
+static int topic_dictionary = 0;  // Store topic ids from the topic table instead of strings
+static int layout_migrate = 0;    // Convert an existing original-layout msg table on startup
+static int latest_enabled = 0;    // Maintain msg_latest, the newest stored row per topic
+static int stats_enabled = 0;     // Maintain msg_stats and msg_stats_minute in each transaction
+static int stats_levels = DEFAULT_STATS_LEVELS;  // Leading topic levels per msg_stats row, 0 = total only
+static const char *msg_table = "msg";  // msg, msg_bin, msg_tid or msg_bin_tid
+static const char *topic_column = "topic";  // topic or topic_id
+
+// Time-partitioned storage: rows go to <msg_table>_pYYYYMMDD tables chosen from the ULID
+// timestamp, the msg view is a UNION ALL over them and retention drops whole partitions
+#define PARTITION_NONE 0
+#define PARTITION_DAY 1
+#define PARTITION_WEEK 2
+#define PARTITION_CHECK_INTERVAL_SEC 60
+#define MAX_PARTITIONS 500        // SQLite's default compound SELECT limit for the view
+static int partition_mode = PARTITION_NONE;
 
-// Configurable batch parameters
+// Configurable batch parameters. With adaptive batching these are the upper bounds
+// and the batch controller picks the effective values in between.
 static int batch_size = DEFAULT_BATCH_SIZE;
 static int flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+static int batch_size_min = DEFAULT_BATCH_SIZE_MIN;
+static int flush_interval_min_ms = DEFAULT_FLUSH_INTERVAL_MIN_MS;
+static int target_latency_ms = DEFAULT_TARGET_LATENCY_MS;
+static int adaptive_batch = 1;
+
+// Persistence delay histogram bucket bounds (ms); the last bucket is unbounded
+#define DELAY_BUCKETS 12
+static const int delay_bucket_ms[DELAY_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 5000 };
+
+// Adaptive batch controller state (batch worker only; the producers' flush threshold is
+// the shard's effective_batch)
+struct batch_controller {
+    double interval_ms;         // Effective flush interval
+    double rate_per_ms;         // Arrival rate estimate (EWMA of drained rows per ms)
+    double commit_ms;           // Commit duration estimate (EWMA)
+    unsigned long long last_flush_us;
+    unsigned long long delays[DELAY_BUCKETS];   // Oldest-entry delay per batch since the last report
+    unsigned long long batches;
+    unsigned long long rows;
+    time_t last_report;
+};
+
+static __thread struct batch_controller batch_ctl;
+
+// Multi-row INSERT chunk sizes, largest first. Runs of consecutive inserts in a batch
+// are written with one cached statement per full chunk; the rest go row by row.
+#define INSERT_CHUNK_COUNT 3
+static int insert_columns = 6;  // ulid, topic, payload, retain, qos, headers, then codec with compression
+static const int insert_chunk_rows[INSERT_CHUNK_COUNT] = { 256, 64, 16 };
+static int bulk_insert = 0;     // Use the multi-row statements (plugin_opt_bulk_insert)
+
+#define DEFAULT_DB_PATH "/mosquitto/data/dbs/default/data"
+static char *db_path = NULL;    // plugin_opt_db_path, DEFAULT_DB_PATH if unset
 
 // Data retention parameters
-static int retention_days = DEFAULT_RETENTION_DAYS;
-static time_t last_retention_check = 0;
+static int retention_days = DEFAULT_RETENTION_DAYS;   // Default for topics no retention rule matches
+static int retention_interval_sec = DEFAULT_RETENTION_INTERVAL_SEC;
+static int retention_chunk = DEFAULT_RETENTION_CHUNK;
+static int retention_budget_ms = DEFAULT_RETENTION_BUDGET_MS;
+static char *archive_path = NULL;   // plugin_opt_archive_path: rows are copied here before they expire
+
+// Progress of the current incremental retention pass (batch worker only)
+struct retention_pass {
+    int active;
+    char *topic;                // Last topic walked by the rules path (NULL = start)
+    unsigned long long cutoff_ms;   // Delete upper bound without rules
+    unsigned long long started_us;
+    unsigned long long busy_us;     // Time spent deleting in this pass
+    long long scanned;
+    long long topics;           // Topics walked by the rules path
+    long long deleted;
+    long long archived;
+    int split;                  // The last chunk stopped early: at the end of an archive day,
+                                // or within a topic with more expired rows
+    time_t started;
+    time_t last_progress;
+};
 
+static __thread struct retention_pass retention;
+static __thread time_t last_retention_pass = 0;
+static __thread int archive_day = -1;              // Day of the attached archive file, -1 if none
+static __thread int archive_partition_day = -1;    // Partition being archived ahead of its drop
+static __thread char archive_cursor[27];           // Last key of that partition archived so far
+
+// The 80-bit random part is a 16-bit tag field followed by 64 random bits. Each thread
+// owns a generator, so ULIDs are monotonic within a thread and the tag keeps them unique
+// across threads without a lock. The tag is 15 bits (the field's top bit stays clear for
+// ULID_PARANOID), taken from a counter per generator: after 32768 generators the tags
+// wrap, and two threads sharing a tag then rely on their independently seeded 64 random
+// bits, like plain ULIDs do, which only collide with negligible probability.
 struct ulid_generator {
-    unsigned char last[16];
     unsigned long long last_ts;
+    unsigned long long last_rand;   // Low 64 bits of the random part
+    unsigned long long rng;         // splitmix64 state
+    unsigned int tag;               // High 16 bits of the random part
     int flags;
-    unsigned char i, j;
-    unsigned char s[256];
 };
 
-static struct ulid_generator ulid_gen;
+static atomic_uint ulid_thread_tags = 0;
+static __thread struct ulid_generator thread_ulid_gen;
+static __thread int thread_ulid_ready = 0;
 
 static mosquitto_plugin_id_t *mosq_pid = NULL;
 
-static sqlite3 *msg_db = NULL;
-static sqlite3_stmt *insert_stmt = NULL;
-static sqlite3_stmt *delete_stmt = NULL;
-static sqlite3_stmt *find_latest_stmt = NULL;    // For fallback delete (find most recent ULID)
-static sqlite3_stmt *retention_delete_stmt = NULL; // For retention cleanup
+// Database connection and statements. Like all batch worker state these are thread-local:
+// each shard's worker opens its own database in shard_open.
+static __thread sqlite3 *msg_db = NULL;
+static __thread sqlite3_stmt *insert_stmt = NULL;
+static __thread sqlite3_stmt *insert_chunk_stmts[INSERT_CHUNK_COUNT];  // Multi-row inserts, see insert_chunk_rows
+static __thread sqlite3_stmt *delete_stmt = NULL;
+static __thread sqlite3_stmt *delete_latest_stmt = NULL;  // For fallback delete (most recent ULID for topic)
+static __thread sqlite3_stmt *retention_delete_stmt = NULL; // Retention: delete the oldest chunk below the cutoff
+static __thread sqlite3_stmt *retention_topic_stmt = NULL;  // Retention rules: next topic after the cursor
+static __thread sqlite3_stmt *retention_scan_stmt = NULL;   // Retention rules: oldest keys of a topic below a cutoff
+static __thread sqlite3_stmt *retention_row_stmt = NULL;    // Retention rules: delete one key
+static __thread sqlite3_stmt *retention_cursor_stmt = NULL; // Retention rules: store the topic cursor
+static __thread sqlite3_stmt *archive_oldest_stmt = NULL;   // Archive: oldest key below the cutoff
+static __thread sqlite3_stmt *archive_chunk_stmt = NULL;    // Archive: copy the oldest chunk below a cutoff
+static __thread sqlite3_stmt *archive_row_stmt = NULL;      // Archive: copy one row by key
+
+// One partition table and its write statements, prepared when first written to. The
+// statement globals above point at the active partition's statements.
+struct msg_partition {
+    int day;            // First day covered (days since the epoch, UTC); it ends where the next one starts
+    char name[64];
+    int prepared;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *insert_chunk_stmts[INSERT_CHUNK_COUNT];
+    sqlite3_stmt *delete_stmt;
+    sqlite3_stmt *delete_latest_stmt;
+};
+
+static __thread struct msg_partition **partitions = NULL;  // Sorted by day
+static __thread int partition_count = 0;
+static __thread int partition_capacity = 0;
+static __thread struct msg_partition *active_partition = NULL;
+static __thread time_t last_partition_check = 0;
+static __thread sqlite3_stmt *topic_find_stmt = NULL;      // Topic dictionary lookup (name -> id)
+static __thread sqlite3_stmt *topic_insert_stmt = NULL;    // Topic dictionary insert
+static __thread sqlite3_stmt *latest_upsert_stmt = NULL;   // msg_latest write-through
+static __thread sqlite3_stmt *latest_find_stmt = NULL;     // msg_latest lookup (topic -> ulid)
+static __thread sqlite3_stmt *latest_delete_stmt = NULL;   // msg_latest removal when its row is deleted
+static __thread sqlite3_stmt *stats_upsert_stmt = NULL;    // msg_stats: add a prefix's deltas
+static __thread sqlite3_stmt *stats_empty_stmt = NULL;     // msg_stats: drop a prefix without rows
+static __thread sqlite3_stmt *stats_bounds_stmt = NULL;    // msg_stats: clamp ULID bounds after deletes
+static __thread sqlite3_stmt *stats_minute_stmt = NULL;    // msg_stats_minute: add this minute's counts
+static __thread sqlite3_stmt *topic_name_stmt = NULL;      // Topic dictionary reverse lookup (id -> name)
+static __thread sqlite3_stmt *journal_position_stmt = NULL; // msg_journal: store the committed journal position
+
+// Topic exclusion/inclusion rules, compiled into a level trie at init
+struct topic_trie_node {
+    char *level;                        // Literal level name (NULL for root/wildcards)
+    size_t level_len;
+    struct topic_trie_node **children;  // Literal children, sorted by level
+    int child_count;
+    int child_capacity;
+    struct topic_trie_node *plus;       // '+' child
+    struct topic_trie_node *hash;       // '#' child
+    unsigned flags;                     // TOPIC_RULE_* of patterns ending here
+    int retention_days;                 // With TOPIC_RULE_RETENTION: days to keep, 0 = forever
+    uint64_t field_mask;                // With TOPIC_RULE_EXTRACT/ROLLUP: bit i = rule i of the trie
+    int heartbeat_min;                  // With TOPIC_RULE_ON_CHANGE: store unchanged payloads this often, 0 = never
+};
+
+static struct topic_trie_node *topic_rules = NULL;
+static int topic_rule_count = 0;
+static struct topic_trie_node *retention_rules = NULL;  // Per-pattern retention, batch worker only
+static int retention_rule_count = 0;
+static int retention_min_days = 0;      // Shortest finite retention over the default and all rules
+static struct topic_trie_node *change_rules = NULL;     // store_on_change patterns, batch worker only
+static int change_rule_count = 0;
+
+// JSON field extraction (plugin_opt_extract): pattern=path:column:type[:index] rules
+#define MAX_EXTRACT_FIELDS 64
+#define EXTRACT_REAL 0
+#define EXTRACT_INTEGER 1
+#define EXTRACT_TEXT 2
+struct extract_column {
+    char *name;
+    int type;           // EXTRACT_*
+    int indexed;        // Also index the column's values
+};
+struct extract_field {
+    char *path;         // $, $.a.b, $.a[0], ...
+    int column;         // Index into extract_columns
+};
+static struct topic_trie_node *extract_rules = NULL;   // Batch worker only
+static struct extract_field extract_fields[MAX_EXTRACT_FIELDS];
+static int extract_field_count = 0;
+static struct extract_column extract_columns[MAX_EXTRACT_FIELDS];
+static int extract_column_count = 0;
+
+// Rollups (plugin_opt_rollup): pattern[=path] rules selecting numeric values to aggregate
+// per topic into 1-minute and 1-hour buckets
+#define MAX_ROLLUP_RULES 64
+#define ROLLUP_LEVELS 2
+static const int rollup_widths[ROLLUP_LEVELS] = { 60, 3600 };      // Bucket width in seconds
+static const char *const rollup_tables[ROLLUP_LEVELS] = { "msg_rollup_1m", "msg_rollup_1h" };
+static struct topic_trie_node *rollup_rules = NULL;    // Batch worker only
+static char *rollup_paths[MAX_ROLLUP_RULES];            // JSON path of each rule, $ = whole payload
+static int rollup_rule_count = 0;
+static int rollup_retention_days[ROLLUP_LEVELS] = { 0, 0 }; // 0 = keep forever
+
+struct topic_decision {
+    uint64_t hash;
+    unsigned generation;                // 0 = empty, stale if != topic_rules_generation
+    uint16_t len;
+    uint8_t excluded;
+    char topic[TOPIC_DECISION_TOPIC_MAX];
+};
+
+static __thread struct topic_decision topic_decision_cache[TOPIC_DECISION_CACHE_SIZE];
+static atomic_uint topic_rules_generation = 0;  // Bumped whenever the rules are rebuilt
 
-// Topic exclusion patterns
-static char *exclude_patterns[MAX_EXCLUDE_PATTERNS];
-static int exclude_pattern_count = 0;
+// Header exclusion set (user property names to exclude from storage), open addressing
+struct header_name {
+    char *name;         // NULL for an empty slot
+    size_t len;
+    uint64_t hash;
+};
 
-// Header exclusion list (user property names to exclude from storage)
-static char *exclude_headers[MAX_EXCLUDE_HEADERS];
+static struct header_name *exclude_headers = NULL;
+static size_t exclude_header_capacity = 0;  // Power of two
 static int exclude_header_count = 0;
 static int headers_disabled = 0;  // Set to 1 if exclude_headers contains '#'
 
-// ULID generator mutex for thread safety
-static pthread_mutex_t ulid_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Header storage format
+#define HEADERS_FORMAT_TEXT   0   // name=value;name=value (TEXT)
+#define HEADERS_FORMAT_BINARY 1   // Length-prefixed name/value pairs (BLOB)
+static int headers_format = HEADERS_FORMAT_TEXT;
 
 // Operation types for queue entries
 #define OP_INSERT 0
 #define OP_DELETE 1
 #define OP_DELETE_FALLBACK 2  // Delete most recent for topic (no specific ULID)
+#define OP_CANCELLED 3        // Coalesced away within its batch, nothing to write
 
-// Message queue entry for batch inserts and deletes
+// Message queue entry for batch inserts and deletes.
+// Entries live in a single slab block: the struct is followed by the topic,
+// payload and headers strings, which the pointers below refer to.
 struct msg_entry {
     int operation;      // OP_INSERT, OP_DELETE, or OP_DELETE_FALLBACK
     char ulid[27];
     char *topic;
     char *payload;
     char *headers;
+    size_t payload_len;     // Payload length in bytes (payload may contain NUL bytes)
+    size_t headers_len;     // Headers length in bytes (binary headers may contain NUL bytes)
+    size_t data_len;        // Inline data bytes after the struct (queue byte accounting)
     int retain;
     int qos;
-    struct msg_entry *next;
+    int slab_class;     // Size class of the block, -1 if malloc'd directly
+    int codec;          // CODEC_NONE, or the dictionary id of the compressed payload (0 = none)
+    int extract_row;    // Row of the batch's extracted field values, -1 if none
+    unsigned long long journal_end;     // Ingest journal position after the entry's record, 0 if not journaled
+};
+
+// Bounded lock-free ring (per-slot sequence numbers, Vyukov style). Used for the
+// message queue, where broker threads produce and batch_worker consumes, and as
+// the free list of each slab size class.
+struct queue_slot {
+    atomic_size_t seq;
+    void *ptr;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct entry_ring {
+    struct queue_slot *slots;
+    size_t mask;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;   // Next slot to enqueue
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;   // Next slot to dequeue
+    _Alignas(CACHE_LINE_SIZE) atomic_int size;      // Approximate depth
+};
+
+// Queue capacity and backpressure configuration. The limits apply to each shard's queue.
+static int queue_policy = QUEUE_POLICY_DROP_OLDEST;
+static int queue_limit = DEFAULT_QUEUE_SIZE;    // Max queued entries
+static size_t queue_max_bytes = 0;              // Max queued data bytes, 0 = unlimited
+static int queue_block_ms = DEFAULT_QUEUE_BLOCK_MS;
+static int qos0_watermark = DEFAULT_QOS0_WATERMARK;
+
+// Entries affected by each backpressure action since startup
+struct queue_drop_stats {
+    atomic_ullong dropped_oldest;   // Evicted by drop_oldest
+    atomic_ullong dropped_newest;   // Rejected by drop_newest (or a full ring)
+    atomic_ullong dropped_qos0;     // QoS 0 rejected by shed_qos0
+    atomic_ullong block_timeouts;   // Rejected after waiting queue_block_ms
+    atomic_ullong spilled;          // Written to the spill journal
+    atomic_ullong spill_failed;     // Rejected because the journal was full or failed
+    atomic_ullong journal_failed;   // Not in the ingest journal because it was full or failed
+};
+
+static const char *const queue_drop_names[] = {
+    "dropped_oldest", "dropped_newest", "dropped_qos0", "block_timeouts", "spilled", "spill_failed",
+    "journal_failed"
+};
+#define QUEUE_DROP_COUNTERS (sizeof(queue_drop_names) / sizeof(queue_drop_names[0]))
+_Static_assert(sizeof(struct queue_drop_stats) == QUEUE_DROP_COUNTERS * sizeof(atomic_ullong),
+               "queue_drop_names must list every queue_drop_stats counter");
+
+static struct queue_drop_stats queue_drops;
+static unsigned long long queue_drops_reported[QUEUE_DROP_COUNTERS];
+static time_t last_queue_report = 0;
+
+// Log-linear histogram (HDR style): values below 2^METRIC_HIST_SUB_BITS have a bucket each,
+// every larger power of two is split into 2^METRIC_HIST_SUB_BITS equal buckets. Counts are
+// cumulative and written by the batch worker; published is the tick's previous snapshot.
+struct metric_histogram {
+    atomic_ullong counts[METRIC_HIST_BUCKETS];
+    atomic_ullong sum;
+    unsigned long long published[METRIC_HIST_BUCKETS];
+};
+
+// Hot-path counters since startup. Everything except enqueued (the queue's tail position)
+// and the queue drops is updated by the batch worker only.
+struct plugin_metrics {
+    struct metric_histogram batch_rows;     // Entries per flush
+    struct metric_histogram commit_us;      // BEGIN to COMMIT
+    struct metric_histogram latency_us;     // ULID timestamp to COMMIT, per inserted row
+    struct metric_histogram checkpoint_us;  // wal_checkpoint duration, any mode
+    atomic_ullong rows_inserted;
+    atomic_ullong rows_deleted;
+    atomic_ullong rows_unchanged;           // store_on_change inserts skipped
+    atomic_ullong insert_errors;
+    atomic_ullong delete_errors;
+    atomic_ullong commit_errors;
+    atomic_ullong retention_deleted;
+    atomic_ullong retention_archived;
+    atomic_ullong retention_us;
+    atomic_ullong partitions_dropped;
+    atomic_ullong checkpoints;
+    atomic_ullong checkpoint_escalations;   // RESTART or TRUNCATE
+    atomic_ullong checkpoint_busy;          // Checkpoints that could not finish
+    atomic_size_t queue_high_water;         // Deepest queue seen by a flush since the last publish
+    size_t published_enqueued;              // Tick only
+    time_t last_publish;                    // Tick only
+};
+
+static struct plugin_metrics metrics;
+static int metrics_interval_sec = DEFAULT_METRICS_INTERVAL_SEC;
+
+// Spill journal (queue_policy spill), one per shard. Records are appended under the shard's spill_mutex by broker
+// threads and read back in order by the batch worker. While a journal is being replayed,
+// new entries are appended to it too, so inserts and deletes keep their order.
+#define SPILL_RECORD_MAGIC 0x4c495053u  // "SPIL"
+
+struct spill_record {
+    uint32_t magic;
+    uint8_t operation;
+    uint8_t retain;
+    uint8_t qos;
+    uint8_t has_headers;
+    uint32_t topic_len;
+    uint32_t headers_len;
+    uint64_t payload_len;
+    char ulid[27];
+};
+
+static char *spill_path = NULL;         // Shard 0's journal, other shards add -shard<N>
+static unsigned long long spill_max_bytes = DEFAULT_SPILL_MAX_BYTES;
+
+// Ingest journal (plugin_opt_journal), one directory of segment files per shard. Every
+// queued entry is copied into the mapped tail segment under the shard's journal_mutex, so
+// queue order is journal order, and stays there until the batch that wrote it has committed.
+// Producers go on appending to the journal alone while the queue is full; the batch worker
+// then reads those records back in order. Records use the spill record header, are 8-byte
+// aligned and never span segments: the zeroed rest of a segment means "continue in the next".
+// The magic is stored last, so a record torn by a crash is not replayed. msg_journal holds
+// the position up to which the database has every entry, updated in each batch transaction.
+#define JOURNAL_RECORD_MAGIC 0x4c4e524au    // "JRNL"
+#define JOURNAL_ALIGN 8
+#define JOURNAL_RETRY_MS 100                // Pause in journal reads after an entry allocation or commit failed
+
+static int journal_enabled = 0;
+static char *journal_path = NULL;       // Shard 0's segment directory, other shards add -shard<N>
+static unsigned long long journal_segment_size = DEFAULT_JOURNAL_SEGMENT_SIZE;
+static unsigned long long journal_max_bytes = DEFAULT_JOURNAL_MAX_BYTES;
+
+// Slab size classes for queue entries (block size includes struct msg_entry).
+// Blocks are recycled through each class's free ring once their batch has been
+// committed, so steady-state operation does not call malloc/free per message.
+#define SLAB_CLASS_COUNT 5
+#define SLAB_REPORT_INTERVAL_SEC 60
+static const size_t slab_block_size[SLAB_CLASS_COUNT] = { 256, 1024, 4096, 16384, 65536 };
+static const size_t slab_free_capacity[SLAB_CLASS_COUNT] = { 16384, 16384, 4096, 1024, 256 };
+
+struct slab_class {
+    struct entry_ring free;
+    atomic_int allocated;   // Blocks currently owned by this class (free + in use)
+    atomic_int in_use;      // Blocks currently holding a queued entry
+    atomic_int high_water;  // Maximum of in_use since startup
+};
+
+static struct slab_class slab_classes[SLAB_CLASS_COUNT];
+static atomic_int slab_oversize_count = 0;      // Entries too large for any class
+static int slab_reported_high_water[SLAB_CLASS_COUNT];
+static time_t last_slab_report = 0;
+
+// Storage shards (plugin_opt_shards). Each shard is a database file with its own queue,
+// spill journal and batch worker; topics are hashed to a shard, so all inserts and deletes
+// of a topic keep their order on a single writer. Broker threads use the queue fields,
+// the rest of the worker state is thread-local to the shard's worker.
+#define MAX_SHARDS 64
+
+struct shard {
+    int index;
+    char *db_path;
+    struct entry_ring queue;    // Sized to the next power of two above queue_limit
+    _Alignas(CACHE_LINE_SIZE) atomic_bool wakeup_pending;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t queue_bytes;    // Inline data bytes queued
+    atomic_int effective_batch;     // Flush threshold used by producers
+    int event_fd;                   // Batch worker wakeup (eventfd)
+    pthread_t thread;
+    atomic_int running;
+    atomic_int ready;               // Set by the worker after shard_open: 1 = database open, -1 = not
+    int layout_refused;             // Set before ready: the database does not fit the configured layout
+    int unreadable;                 // Set before ready: the database stayed busy or unreadable at open
+    char *spill_path;
+    int spill_fd;
+    pthread_mutex_t spill_mutex;
+    off_t spill_write_offset;       // End of complete records (guarded by spill_mutex)
+    off_t spill_read_offset;        // Next record to replay (batch worker)
+    atomic_bool spill_active;
+    char *journal_dir;
+    pthread_mutex_t journal_mutex;
+    char *journal_map;              // Mapped tail segment (guarded by journal_mutex)
+    unsigned long long journal_map_index;       // Segment number of journal_map
+    unsigned long long journal_segment_bytes;   // Size of every segment file
+    unsigned long long journal_write_pos;   // End of complete records (guarded by journal_mutex)
+    unsigned long long journal_backlog_pos; // First record that is not in the queue (guarded by journal_mutex)
+    atomic_bool journal_backlog;    // Records after journal_backlog_pos are waiting to be read back
+    atomic_ullong journal_first_pos;        // Start of the oldest segment on disk
+    // Batch worker only
+    unsigned long long journal_read_pos;    // Next backlog record to read
+    unsigned long long journal_read_segment;
+    int journal_read_fd;
+    int journal_reading;            // journal_read_pos has been taken from journal_backlog_pos
+    unsigned long long journal_committed_pos;   // End of the last record whose batch committed
+    int journal_rewound;            // A failed commit restarted the backlog at journal_committed_pos
+    char *wal_path;                 // NULL for in-memory databases
+    atomic_int wal_frames;          // Frames in the WAL after the last commit (wal hook)
+    atomic_uint wal_commits;        // Commits seen by the wal hook
+    atomic_bool checkpoint_pending; // Checkpoint thread already woken for wal_frames
+    atomic_int checkpoint_frames_left;  // WAL frames the last checkpoint could not copy back
+    // Checkpoint thread only
+    sqlite3 *checkpoint_db;
+    int checkpoint_page_size;
+    unsigned int checkpoint_commits;        // wal_commits at the last checkpoint
+    unsigned long long last_checkpoint_us;
+    unsigned long long escalate_after_us;   // Backoff after a busy RESTART/TRUNCATE
+};
+
+static struct shard *shards = NULL;
+static int shard_count = 1;
+static int shard_levels = 0;        // Leading topic levels hashed to pick a shard, 0 = whole topic
+static __thread struct shard *shard_self = NULL;  // The shard this thread's batch worker state belongs to
+static __thread unsigned long long journal_retry_us = 0;  // No journal reads before (allocation or commit failed)
+
+static int checkpoint_mode = CHECKPOINT_MANAGED;
+static int checkpoint_pages = DEFAULT_CHECKPOINT_PAGES;
+static int checkpoint_interval_ms = DEFAULT_CHECKPOINT_INTERVAL_MS;
+static unsigned long long checkpoint_wal_limit = DEFAULT_CHECKPOINT_WAL_LIMIT;
+static pthread_t checkpoint_thread;
+static atomic_int checkpoint_running = 0;
+static int checkpoint_event_fd = -1;
+
+// " (shard N)" for worker log lines when there is more than one shard, "" otherwise
+static const char *shard_label(void) {
+    static __thread char label[24];
+    if (shard_count <= 1 || shard_self == NULL) {
+        return "";
+    }
+    snprintf(label, sizeof(label), " (shard %d)", shard_self->index);
+    return label;
+}
+
+// Worker-owned drain buffer
+static __thread struct msg_entry **batch_entries = NULL;  // batch_capacity entries
+static __thread size_t batch_capacity = 0;
+
+// Per-batch topic map used to coalesce inserts and deletes before they reach SQLite.
+// Sized for batch_capacity entries at init; each batch only clears the prefix it uses.
+struct coalesce_slot {
+    uint64_t hash;
+    int first;          // Index of an entry with this topic (the key), -1 if the slot is empty
+    int latest;         // Index of the newest insert for the topic, -1 if none
 };
 
-// Message queue for batch processing
-static struct msg_entry *msg_queue_head = NULL;
-static struct msg_entry *msg_queue_tail = NULL;
-static int msg_queue_size = 0;
-static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
-static pthread_t batch_thread;
-static atomic_int batch_thread_running = 0;
+static __thread struct coalesce_slot *coalesce_slots = NULL;
+static __thread int *coalesce_prev = NULL;   // Per entry: previous insert with the same topic, -1 if none
+static __thread struct msg_entry **latest_entries = NULL;  // plugin_opt_latest: newest insert per topic of a batch
 
 // Forward declarations
 static void flush_batch(void);
 static void *batch_worker(void *arg);
+static void shard_open(struct shard *s);
+static void shard_close(void);
+static int wal_commit_hook(void *arg, sqlite3 *db, const char *name, int frames);
+static int partition_select(const char *ulid, int create);
+static int partition_name_day(const char *date);
+static int ulid_day(const char *ulid);
+static void partition_activate(struct msg_partition *p);
+static void partition_reload(void);
+static void partition_maintain(int force);
+
+// FNV-1a 64-bit hash
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_string(const char *str) {
+    return hash_bytes(str, strlen(str));
+}
+
+// Shard for a topic: a hash of its first shard_levels levels (all of it when 0), so
+// every message and delete of a topic goes through the same queue and worker
+static struct shard *shard_for_topic(const char *topic) {
+    if (shard_count <= 1) {
+        return &shards[0];
+    }
+    size_t len = strlen(topic);
+    if (shard_levels > 0) {
+        const char *p = topic;
+        for (int level = 0; level < shard_levels && p != NULL; level++) {
+            p = strchr(p, '/');
+            if (p != NULL && level + 1 < shard_levels) {
+                p++;
+            }
+        }
+        if (p != NULL) {
+            len = (size_t)(p - topic);
+        }
+    }
+    return &shards[hash_bytes(topic, len) % (uint64_t)shard_count];
+}
+
+static int trie_level_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// Binary search the literal children. Returns the child, or NULL with *pos set to the insert position.
+static struct topic_trie_node *trie_find_child(const struct topic_trie_node *node, const char *level,
+                                               size_t len, int *pos) {
+    int lo = 0;
+    int hi = node->child_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const struct topic_trie_node *child = node->children[mid];
+        int cmp = trie_level_cmp(level, len, child->level, child->level_len);
+        if (cmp == 0) {
+            return node->children[mid];
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    if (pos != NULL) {
+        *pos = lo;
+    }
+    return NULL;
+}
 
-// MQTT topic matching with wildcards (+ and #)
-// Returns 1 if topic matches pattern, 0 otherwise
-static int topic_matches_pattern(const char *pattern, const char *topic) {
-    const char *p = pattern;
-    const char *t = topic;
+static struct topic_trie_node *trie_add_child(struct topic_trie_node *node, const char *level, size_t len) {
+    int pos;
+    struct topic_trie_node *child = trie_find_child(node, level, len, &pos);
+    if (child != NULL) {
+        return child;
+    }
     
-    while (*p && *t) {
-        if (*p == '#') {
-            // # matches everything from here to the end
-            return 1;
-        } else if (*p == '+') {
-            // + matches a single level (until next / or end)
-            while (*t && *t != '/') {
-                t++;
+    if (node->child_count == node->child_capacity) {
+        int new_capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+        struct topic_trie_node **children = realloc(node->children, new_capacity * sizeof(*children));
+        if (children == NULL) {
+            return NULL;
+        }
+        node->children = children;
+        node->child_capacity = new_capacity;
+    }
+    
+    child = calloc(1, sizeof(*child));
+    if (child == NULL) {
+        return NULL;
+    }
+    child->level = strndup(level, len);
+    if (child->level == NULL) {
+        free(child);
+        return NULL;
+    }
+    child->level_len = len;
+    
+    memmove(&node->children[pos + 1], &node->children[pos], (node->child_count - pos) * sizeof(*node->children));
+    node->children[pos] = child;
+    node->child_count++;
+    return child;
+}
+
+static void trie_free(struct topic_trie_node *node) {
+    if (node == NULL) {
+        return;
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        trie_free(node->children[i]);
+    }
+    trie_free(node->plus);
+    trie_free(node->hash);
+    free(node->children);
+    free(node->level);
+    free(node);
+}
+
+// Add a subscription-style pattern to the trie.
+// Returns the node the pattern ends at, or NULL if the pattern is invalid or allocation fails.
+static struct topic_trie_node *trie_insert_node(struct topic_trie_node *root, const char *pattern) {
+    struct topic_trie_node *node = root;
+    const char *level = pattern;
+    
+    for (;;) {
+        const char *end = strchr(level, '/');
+        size_t len = end ? (size_t)(end - level) : strlen(level);
+        struct topic_trie_node **wildcard = NULL;
+        
+        if (len == 1 && level[0] == '#') {
+            // '#' is only valid as the last level
+            if (end != NULL) {
+                return NULL;
             }
-            p++;
-            // If pattern has more after +, it should be a /
-            if (*p && *p != '/') {
-                return 0;
+            wildcard = &node->hash;
+        } else if (len == 1 && level[0] == '+') {
+            wildcard = &node->plus;
+        } else if (memchr(level, '+', len) != NULL || memchr(level, '#', len) != NULL) {
+            // Wildcards must occupy a whole level
+            return NULL;
+        }
+        
+        if (wildcard != NULL) {
+            if (*wildcard == NULL) {
+                *wildcard = calloc(1, sizeof(struct topic_trie_node));
             }
-        } else if (*p == *t) {
-            p++;
-            t++;
+            node = *wildcard;
         } else {
-            return 0;
+            node = trie_add_child(node, level, len);
+        }
+        if (node == NULL) {
+            return NULL;
+        }
+        
+        if (end == NULL) {
+            break;
         }
+        level = end + 1;
+    }
+    return node;
+}
+
+// Add a pattern with the given TOPIC_RULE_* flags. Returns 0 on success, -1 if invalid.
+static int trie_insert(struct topic_trie_node *root, const char *pattern, unsigned flags) {
+    struct topic_trie_node *node = trie_insert_node(root, pattern);
+    if (node == NULL) {
+        return -1;
+    }
+    node->flags |= flags;
+    return 0;
+}
+
+// Collect the flags of every pattern matching the topic levels starting at level.
+// level is NULL once all levels are consumed. Cost is O(levels), branching only on wildcards.
+static unsigned trie_match(const struct topic_trie_node *node, const char *level) {
+    if (level == NULL) {
+        // "a/#" also matches the parent level "a"
+        return node->flags | (node->hash != NULL ? node->hash->flags : 0);
     }
     
-    // Check end conditions
-    if (*p == '#') {
-        return 1;
+    const char *end = strchr(level, '/');
+    size_t len = end ? (size_t)(end - level) : strlen(level);
+    const char *next = end ? end + 1 : NULL;
+    unsigned flags = 0;
+    
+    // '#' matches this level and everything below it
+    if (node->hash != NULL) {
+        flags |= node->hash->flags;
     }
-    if (*p == '\0' && *t == '\0') {
-        return 1;
+    if (node->plus != NULL) {
+        flags |= trie_match(node->plus, next);
+    }
+    const struct topic_trie_node *child = trie_find_child(node, level, len, NULL);
+    if (child != NULL) {
+        flags |= trie_match(child, next);
     }
-    // Handle pattern ending with /+ matching topic without trailing level
-    if (*p == '/' && *(p+1) == '+' && *(p+2) == '\0' && *t == '\0') {
-        return 0; // topic/foo doesn't match topic/foo/+
+    return flags;
+}
+
+// Longest retention (in days, INT_MAX = forever) of the retention patterns matching the
+// topic levels starting at level, or -1 if none match
+static int trie_match_retention(const struct topic_trie_node *node, const char *level) {
+    if (level == NULL) {
+        int days = -1;
+        if (node->flags & TOPIC_RULE_RETENTION) {
+            days = node->retention_days > 0 ? node->retention_days : INT_MAX;
+        }
+        int d;
+        if (node->hash != NULL && (d = trie_match_retention(node->hash, NULL)) > days) {
+            days = d;
+        }
+        return days;
     }
     
-    return 0;
+    const char *end = strchr(level, '/');
+    size_t len = end ? (size_t)(end - level) : strlen(level);
+    const char *next = end ? end + 1 : NULL;
+    int days = -1;
+    int d;
+    
+    if (node->hash != NULL && (d = trie_match_retention(node->hash, NULL)) > days) {
+        days = d;
+    }
+    if (node->plus != NULL && (d = trie_match_retention(node->plus, next)) > days) {
+        days = d;
+    }
+    const struct topic_trie_node *child = trie_find_child(node, level, len, NULL);
+    if (child != NULL && (d = trie_match_retention(child, next)) > days) {
+        days = d;
+    }
+    return days;
+}
+
+static int topic_rules_exclude(const char *topic) {
+    unsigned flags = trie_match(topic_rules, topic);
+    // Inclusion rules override exclusions
+    return (flags & TOPIC_RULE_EXCLUDE) && !(flags & TOPIC_RULE_INCLUDE);
 }
 
 // Check if topic should be excluded from persistence
 static int is_topic_excluded(const char *topic) {
-    for (int i = 0; i < exclude_pattern_count; i++) {
-        if (topic_matches_pattern(exclude_patterns[i], topic)) {
-            return 1;
-        }
+    if (topic_rules == NULL) {
+        return 0;
     }
-    return 0;
+    
+    size_t len = strlen(topic);
+    if (len >= TOPIC_DECISION_TOPIC_MAX) {
+        return topic_rules_exclude(topic);
+    }
+    
+    unsigned generation = atomic_load_explicit(&topic_rules_generation, memory_order_relaxed);
+    uint64_t hash = hash_bytes(topic, len);
+    struct topic_decision *cached = &topic_decision_cache[hash & (TOPIC_DECISION_CACHE_SIZE - 1)];
+    if (cached->generation == generation && cached->hash == hash &&
+        cached->len == len && memcmp(cached->topic, topic, len) == 0) {
+        return cached->excluded;
+    }
+    
+    int excluded = topic_rules_exclude(topic);
+    cached->generation = generation;
+    cached->hash = hash;
+    cached->len = (uint16_t)len;
+    cached->excluded = (uint8_t)excluded;
+    memcpy(cached->topic, topic, len);
+    return excluded;
 }
 
-// Parse comma-separated exclusion patterns
-static void parse_exclude_patterns(const char *patterns_str) {
+// Parse comma-separated topic patterns into the rule trie with the given flag
+static void parse_topic_patterns(const char *patterns_str, unsigned flag) {
     if (patterns_str == NULL || *patterns_str == '\0') {
         return;
     }
     
+    if (topic_rules == NULL) {
+        topic_rules = calloc(1, sizeof(struct topic_trie_node));
+        if (topic_rules == NULL) {
+            return;
+        }
+    }
+    
     char *patterns_copy = strdup(patterns_str);
     if (patterns_copy == NULL) {
         return;
     }
     
-    char *token = strtok(patterns_copy, ",");
-    while (token != NULL && exclude_pattern_count < MAX_EXCLUDE_PATTERNS) {
+    char *saveptr = NULL;
+    char *token = strtok_r(patterns_copy, ",", &saveptr);
+    while (token != NULL) {
         // Trim leading whitespace
         while (*token == ' ') token++;
         // Trim trailing whitespace
@@ -189,231 +964,645 @@ static void parse_exclude_patterns(const char *patterns_str) {
         }
         
         if (*token != '\0') {
-            exclude_patterns[exclude_pattern_count] = strdup(token);
-            if (exclude_patterns[exclude_pattern_count] != NULL) {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Excluding topic pattern: %s", exclude_patterns[exclude_pattern_count]);
-                exclude_pattern_count++;
+            if (trie_insert(topic_rules, token, flag) == 0) {
+                LOG_DEBUG("%s topic pattern: %s", flag == TOPIC_RULE_INCLUDE ? "Including" : "Excluding", token);
+                topic_rule_count++;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid topic pattern: %s", token);
             }
         }
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
     
     free(patterns_copy);
 }
 
-// Free exclusion patterns
-static void free_exclude_patterns(void) {
-    for (int i = 0; i < exclude_pattern_count; i++) {
-        free(exclude_patterns[i]);
-        exclude_patterns[i] = NULL;
+// Free topic rules and invalidate cached decisions
+static void free_topic_rules(void) {
+    trie_free(topic_rules);
+    topic_rules = NULL;
+    topic_rule_count = 0;
+    atomic_fetch_add(&topic_rules_generation, 1);
+    trie_free(retention_rules);
+    retention_rules = NULL;
+    retention_rule_count = 0;
+    trie_free(extract_rules);
+    extract_rules = NULL;
+    for (int i = 0; i < extract_field_count; i++) {
+        free(extract_fields[i].path);
     }
-    exclude_pattern_count = 0;
+    for (int i = 0; i < extract_column_count; i++) {
+        free(extract_columns[i].name);
+    }
+    extract_field_count = 0;
+    extract_column_count = 0;
+    trie_free(change_rules);
+    change_rules = NULL;
+    change_rule_count = 0;
+    trie_free(rollup_rules);
+    rollup_rules = NULL;
+    for (int i = 0; i < rollup_rule_count; i++) {
+        free(rollup_paths[i]);
+    }
+    rollup_rule_count = 0;
 }
 
-// Parse comma-separated header exclusion list
-// Special value '#' disables header storage completely
-static void parse_exclude_headers(const char *headers_str) {
-    if (headers_str == NULL || *headers_str == '\0') {
+// Parse comma-separated pattern=days retention rules (days 0 = keep forever).
+// When several rules match a topic the longest retention wins.
+static void parse_retention_rules(const char *rules_str) {
+    if (rules_str == NULL || *rules_str == '\0') {
         return;
     }
     
-    // Check for special '#' value to disable all header storage
-    if (strcmp(headers_str, "#") == 0) {
-        headers_disabled = 1;
-        mosquitto_log_printf(MOSQ_LOG_INFO, "Header storage disabled (exclude_headers=#)");
-        return;
+    if (retention_rules == NULL) {
+        retention_rules = calloc(1, sizeof(struct topic_trie_node));
+        if (retention_rules == NULL) {
+            return;
+        }
     }
     
-    char *headers_copy = strdup(headers_str);
-    if (headers_copy == NULL) {
+    char *rules_copy = strdup(rules_str);
+    if (rules_copy == NULL) {
         return;
     }
     
-    char *token = strtok(headers_copy, ",");
-    while (token != NULL && exclude_header_count < MAX_EXCLUDE_HEADERS) {
-        // Trim leading whitespace
+    char *saveptr = NULL;
+    char *token = strtok_r(rules_copy, ",", &saveptr);
+    while (token != NULL) {
         while (*token == ' ') token++;
-        // Trim trailing whitespace
-        char *end = token + strlen(token) - 1;
-        while (end > token && *end == ' ') {
+        char *eq = strrchr(token, '=');
+        char *days_end = NULL;
+        long days = eq ? strtol(eq + 1, &days_end, 10) : -1;
+        if (eq != NULL) {
+            char *end = eq;
+            while (end > token && end[-1] == ' ') {
+                end--;
+            }
             *end = '\0';
-            end--;
         }
         
-        // Check for '#' in the list
-        if (strcmp(token, "#") == 0) {
-            headers_disabled = 1;
-            mosquitto_log_printf(MOSQ_LOG_INFO, "Header storage disabled (exclude_headers contains #)");
-            free(headers_copy);
+        struct topic_trie_node *node = NULL;
+        if (eq != NULL && days >= 0 && days <= 3650 && days_end != eq + 1 &&
+            (*days_end == '\0' || *days_end == ' ')) {
+            node = trie_insert_node(retention_rules, token);
+        }
+        if (node != NULL) {
+            node->flags |= TOPIC_RULE_RETENTION;
+            node->retention_days = (int)days;
+            retention_rule_count++;
+            LOG_DEBUG("Retention rule: %s keeps %ld days", token, days);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid retention rule: %s", token);
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    
+    free(rules_copy);
+}
+
+// Parse comma-separated pattern[=minutes] store_on_change rules: a payload equal to the
+// topic's last stored one is skipped, except once every minutes (heartbeat) if given.
+// When several rules match a topic the shortest heartbeat wins.
+static void parse_change_rules(const char *rules_str) {
+    if (rules_str == NULL || *rules_str == '\0') {
+        return;
+    }
+    
+    if (change_rules == NULL) {
+        change_rules = calloc(1, sizeof(struct topic_trie_node));
+        if (change_rules == NULL) {
             return;
         }
+    }
+    
+    char *rules_copy = strdup(rules_str);
+    if (rules_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *token = strtok_r(rules_copy, ",", &saveptr);
+    while (token != NULL) {
+        while (*token == ' ') token++;
+        char *eq = strrchr(token, '=');
+        char *minutes_end = NULL;
+        long minutes = eq ? strtol(eq + 1, &minutes_end, 10) : 0;
+        char *end = eq != NULL ? eq : token + strlen(token);
+        while (end > token && end[-1] == ' ') {
+            end--;
+        }
+        *end = '\0';
         
-        if (*token != '\0') {
-            exclude_headers[exclude_header_count] = strdup(token);
-            if (exclude_headers[exclude_header_count] != NULL) {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Excluding header: %s", exclude_headers[exclude_header_count]);
-                exclude_header_count++;
+        struct topic_trie_node *node = NULL;
+        if (eq == NULL || (minutes >= 0 && minutes <= 525600 && minutes_end != eq + 1 &&
+                           (*minutes_end == '\0' || *minutes_end == ' '))) {
+            node = trie_insert_node(change_rules, token);
+        }
+        if (node != NULL) {
+            int heartbeat = (int)minutes;
+            if (!(node->flags & TOPIC_RULE_ON_CHANGE) ||
+                (heartbeat > 0 && (node->heartbeat_min == 0 || heartbeat < node->heartbeat_min))) {
+                node->heartbeat_min = heartbeat;
             }
+            node->flags |= TOPIC_RULE_ON_CHANGE;
+            change_rule_count++;
+            LOG_DEBUG("Store-on-change rule: %s heartbeat %ld minutes", token, minutes);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid store_on_change rule: %s", token);
         }
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
     
-    free(headers_copy);
+    free(rules_copy);
 }
 
-// Check if a header name should be excluded
-static int is_header_excluded(const char *header_name) {
-    for (int i = 0; i < exclude_header_count; i++) {
-        if (strcmp(exclude_headers[i], header_name) == 0) {
-            return 1;
+// Match a topic against the store_on_change rules from level on. Returns -1 if none
+// matches, else the shortest heartbeat in minutes (INT_MAX = never).
+static int trie_match_change(const struct topic_trie_node *node, const char *level) {
+    if (level == NULL) {
+        int minutes = -1;
+        if (node->flags & TOPIC_RULE_ON_CHANGE) {
+            minutes = node->heartbeat_min > 0 ? node->heartbeat_min : INT_MAX;
+        }
+        int m;
+        if (node->hash != NULL && (m = trie_match_change(node->hash, NULL)) >= 0 && (minutes < 0 || m < minutes)) {
+            minutes = m;
         }
+        return minutes;
     }
-    return 0;
-}
-
-// Free header exclusion list
-static void free_exclude_headers(void) {
-    for (int i = 0; i < exclude_header_count; i++) {
-        free(exclude_headers[i]);
-        exclude_headers[i] = NULL;
+    
+    const char *end = strchr(level, '/');
+    size_t len = end ? (size_t)(end - level) : strlen(level);
+    const char *next = end ? end + 1 : NULL;
+    int minutes = -1;
+    int m;
+    
+    if (node->hash != NULL && (m = trie_match_change(node->hash, NULL)) >= 0 && (minutes < 0 || m < minutes)) {
+        minutes = m;
     }
-    exclude_header_count = 0;
+    if (node->plus != NULL && (m = trie_match_change(node->plus, next)) >= 0 && (minutes < 0 || m < minutes)) {
+        minutes = m;
+    }
+    const struct topic_trie_node *child = trie_find_child(node, level, len, NULL);
+    if (child != NULL && (m = trie_match_change(child, next)) >= 0 && (minutes < 0 || m < minutes)) {
+        minutes = m;
+    }
+    return minutes;
 }
 
-// Returns unix epoch microseconds.
-static unsigned long long platform_utime(int coarse) {
-	// CLOCK_REALTIME_COARSE has a resolution of 1ms, which is sufficient for this purpose. It's also much faster.
-	struct timespec tv[1];
-	clock_gettime(coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, tv);
-	return tv->tv_sec * 1000000ULL + tv->tv_nsec / 1000ULL;
+// Days to keep messages on a topic, 0 = forever
+static int topic_retention_days(const char *topic) {
+    int days = retention_rules != NULL ? trie_match_retention(retention_rules, topic) : -1;
+    if (days < 0) {
+        return retention_days;
+    }
+    return days == INT_MAX ? 0 : days;
 }
 
-// Gather entropy from the operating system. Returns 0 on success.
-static int platform_entropy(void *buf, int len) {
-    return syscall(SYS_getrandom, buf, len, 0) != len;
+// Rules (field_mask bits) of the extract or rollup patterns matching the topic levels
+// starting at level
+static uint64_t trie_match_fields(const struct topic_trie_node *node, const char *level) {
+    if (level == NULL) {
+        return node->field_mask | (node->hash != NULL ? node->hash->field_mask : 0);
+    }
+    
+    const char *end = strchr(level, '/');
+    size_t len = end ? (size_t)(end - level) : strlen(level);
+    const char *next = end ? end + 1 : NULL;
+    uint64_t mask = 0;
+    
+    if (node->hash != NULL) {
+        mask |= node->hash->field_mask;
+    }
+    if (node->plus != NULL) {
+        mask |= trie_match_fields(node->plus, next);
+    }
+    const struct topic_trie_node *child = trie_find_child(node, level, len, NULL);
+    if (child != NULL) {
+        mask |= trie_match_fields(child, next);
+    }
+    return mask;
 }
 
-int ulid_generator_init(struct ulid_generator *g, int flags) {
-    g->last_ts = 0;
-    g->flags = flags;
-    g->i = g->j = 0;
-    for (int i = 0; i < 256; i++) {
-        g->s[i] = i;
-    }
-
-    /* RC4 is used to fill the random segment of ULIDs. It's tiny,
-     * simple, perfectly sufficient for the task (assuming it's seeded
-     * properly), and doesn't require fixed-width integers. It's not the
-     * fastest option, but it's plenty fast for the task.
-     *
-     * Besides, when we're in a serious hurry in normal operation (not
-     * in "relaxed" mode), we're incrementing the random field much more
-     * often than generating fresh random bytes.
-     */
-
-    int initstyle = 1;
-    unsigned char key[256] = {0};
-    if (!platform_entropy(key, 256)) {
-        // Mix entropy into the RC4 state.
-        for (int i = 0, j = 0; i < 256; i++) {
-            j = (j + g->s[i] + key[i]) & 0xff;
-            int tmp = g->s[i];
-            g->s[i] = g->s[j];
-            g->s[j] = tmp;
-        }
-        initstyle = 0;
-    } else if (!(flags & ULID_SECURE)) {
-        // Failed to read entropy from OS, so generate some.
-        unsigned long n = 0;
-        unsigned long long now;
-        unsigned long long start = platform_utime(0);
-        do {
-            struct {
-                clock_t clk;
-                unsigned long long ts;
-                long n;
-                void *stackgap;
-            } noise;
-            noise.ts = now = platform_utime(0);
-            noise.clk = clock();
-            noise.stackgap = &noise;
-            noise.n = n;
-            unsigned char *k = (unsigned char *)&noise;
-            for (int i = 0, j = 0; i < 256; i++) {
-                j = (j + g->s[i] + k[i % sizeof(noise)]) & 0xff;
-                int tmp = g->s[i];
-                g->s[i] = g->s[j];
-                g->s[j] = tmp;
+// Column of an extraction rule, added (unindexed) on first use. Returns its index, or -1
+// if the name is invalid, the column exists with another type, or there are too many.
+static int extract_column_for(const char *name, int type) {
+    static const char word[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+    if (name[0] == '\0' || strchr(word, name[0]) == NULL || strchr(word + 53, name[0]) != NULL ||
+        strspn(name, word) != strlen(name) || sqlite3_stricmp(name, "ulid") == 0 || sqlite3_stricmp(name, "topic") == 0) {
+        return -1;
+    }
+    for (int i = 0; i < extract_column_count; i++) {
+        if (sqlite3_stricmp(extract_columns[i].name, name) == 0) {
+            if (extract_columns[i].type != type) {
+                return -1;
             }
-        } while (n++ < 1UL << 16 || now - start < 500000ULL);
+            return i;
+        }
     }
-    return initstyle;
+    if (extract_column_count == MAX_EXTRACT_FIELDS) {
+        return -1;
+    }
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        return -1;
+    }
+    extract_columns[extract_column_count].name = copy;
+    extract_columns[extract_column_count].type = type;
+    extract_columns[extract_column_count].indexed = 0;
+    return extract_column_count++;
 }
 
-void ulid_encode(char str[27], const unsigned char ulid[16]) {
-    static const char set[256] = {
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a
-    };
-    str[ 0] = set[ ulid[ 0] >> 5];
-    str[ 1] = set[ ulid[ 0] >> 0];
-    str[ 2] = set[ ulid[ 1] >> 3];
-    str[ 3] = set[(ulid[ 1] << 2 | ulid[ 2] >> 6) & 0x1f];
-    str[ 4] = set[ ulid[ 2] >> 1];
-    str[ 5] = set[(ulid[ 2] << 4 | ulid[ 3] >> 4) & 0x1f];
-    str[ 6] = set[(ulid[ 3] << 1 | ulid[ 4] >> 7) & 0x1f];
-    str[ 7] = set[ ulid[ 4] >> 2];
-    str[ 8] = set[(ulid[ 4] << 3 | ulid[ 5] >> 5) & 0x1f];
-    str[ 9] = set[ ulid[ 5] >> 0];
-    str[10] = set[ ulid[ 6] >> 3];
-    str[11] = set[(ulid[ 6] << 2 | ulid[ 7] >> 6) & 0x1f];
-    str[12] = set[ ulid[ 7] >> 1];
-    str[13] = set[(ulid[ 7] << 4 | ulid[ 8] >> 4) & 0x1f];
-    str[14] = set[(ulid[ 8] << 1 | ulid[ 9] >> 7) & 0x1f];
-    str[15] = set[ ulid[ 9] >> 2];
-    str[16] = set[(ulid[ 9] << 3 | ulid[10] >> 5) & 0x1f];
-    str[17] = set[ ulid[10] >> 0];
-    str[18] = set[ ulid[11] >> 3];
-    str[19] = set[(ulid[11] << 2 | ulid[12] >> 6) & 0x1f];
-    str[20] = set[ ulid[12] >> 1];
-    str[21] = set[(ulid[12] << 4 | ulid[13] >> 4) & 0x1f];
-    str[22] = set[(ulid[13] << 1 | ulid[14] >> 7) & 0x1f];
-    str[23] = set[ ulid[14] >> 2];
-    str[24] = set[(ulid[14] << 3 | ulid[15] >> 5) & 0x1f];
-    str[25] = set[ ulid[15] >> 0];
+// Parse comma-separated pattern=path:column:type[:index] extraction rules. type is real,
+// integer or text; index also indexes the column's values. Several rules may fill the
+// same column (with the same type); the first one that finds a value wins.
+static void parse_extract_rules(const char *rules_str) {
+    if (rules_str == NULL || *rules_str == '\0') {
+        return;
+    }
+    
+    if (extract_rules == NULL) {
+        extract_rules = calloc(1, sizeof(struct topic_trie_node));
+        if (extract_rules == NULL) {
+            return;
+        }
+    }
+    
+    char *rules_copy = strdup(rules_str);
+    if (rules_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *token = strtok_r(rules_copy, ",", &saveptr);
+    while (token != NULL) {
+        while (*token == ' ') token++;
+        char *end = token + strlen(token);
+        while (end > token && end[-1] == ' ') {
+            *--end = '\0';
+        }
+        
+        // pattern= on the left, then :column:type[:index] from the right, so the path may
+        // contain ':'
+        char *rule = strdup(token);
+        char *eq = strchr(token, '=');
+        char *path = eq != NULL ? eq + 1 : NULL;
+        char *parts[3] = { NULL, NULL, NULL };   // Last colon-separated parts, rightmost last
+        int part_count = 0;
+        for (; path != NULL && part_count < 3; part_count++) {
+            char *colon = strrchr(path, ':');
+            if (colon == NULL) {
+                break;
+            }
+            *colon = '\0';
+            parts[2 - part_count] = colon + 1;
+        }
+        int indexed = part_count > 0 && strcmp(parts[2], "index") == 0;
+        if (!indexed && part_count == 3) {
+            // path:column:type; the first split belonged to the path
+            parts[0][-1] = ':';
+        }
+        const char *column_name = indexed ? parts[0] : parts[1];
+        const char *type_name = indexed ? parts[1] : parts[2];
+        
+        int column = -1;
+        int columns_before = extract_column_count;
+        if (path != NULL && path[0] == '$' && column_name != NULL && type_name != NULL) {
+            int type = strcmp(type_name, "real") == 0 ? EXTRACT_REAL :
+                       strcmp(type_name, "integer") == 0 ? EXTRACT_INTEGER :
+                       strcmp(type_name, "text") == 0 ? EXTRACT_TEXT : -1;
+            if (type >= 0) {
+                column = extract_column_for(column_name, type);
+            }
+        }
+        
+        struct topic_trie_node *node = NULL;
+        if (column >= 0 && extract_field_count < MAX_EXTRACT_FIELDS) {
+            *eq = '\0';
+            node = trie_insert_node(extract_rules, token);
+        }
+        if (node != NULL && (extract_fields[extract_field_count].path = strdup(path)) != NULL) {
+            extract_fields[extract_field_count].column = column;
+            extract_columns[column].indexed |= indexed;
+            node->flags |= TOPIC_RULE_EXTRACT;
+            node->field_mask |= 1ULL << extract_field_count;
+            extract_field_count++;
+            LOG_DEBUG("Extract rule: %s %s -> %s", token, path, extract_columns[column].name);
+        } else {
+            // A column added for this rule alone would have no rule filling it
+            if (extract_column_count > columns_before) {
+                extract_column_count--;
+                free(extract_columns[extract_column_count].name);
+                extract_columns[extract_column_count].name = NULL;
+            }
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid extract rule: %s", rule ? rule : token);
+        }
+        free(rule);
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    
+    free(rules_copy);
+}
+
+// Parse comma-separated pattern[=path] rollup rules. Without a path the payload itself
+// is the value. When several rules match a topic the first one that yields a number wins.
+static void parse_rollup_rules(const char *rules_str) {
+    if (rules_str == NULL || *rules_str == '\0') {
+        return;
+    }
+    
+    if (rollup_rules == NULL) {
+        rollup_rules = calloc(1, sizeof(struct topic_trie_node));
+        if (rollup_rules == NULL) {
+            return;
+        }
+    }
+    
+    char *rules_copy = strdup(rules_str);
+    if (rules_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *token = strtok_r(rules_copy, ",", &saveptr);
+    while (token != NULL) {
+        while (*token == ' ') token++;
+        char *end = token + strlen(token);
+        while (end > token && end[-1] == ' ') {
+            *--end = '\0';
+        }
+        char *eq = strchr(token, '=');
+        const char *path = eq != NULL ? eq + 1 : "$";
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+        
+        struct topic_trie_node *node = NULL;
+        if (path[0] == '$' && rollup_rule_count < MAX_ROLLUP_RULES) {
+            node = trie_insert_node(rollup_rules, token);
+        }
+        if (node != NULL && (rollup_paths[rollup_rule_count] = strdup(path)) != NULL) {
+            node->flags |= TOPIC_RULE_ROLLUP;
+            node->field_mask |= 1ULL << rollup_rule_count;
+            rollup_rule_count++;
+            LOG_DEBUG("Rollup rule: %s %s", token, path);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid rollup rule: %s%s%s", token,
+                                eq != NULL ? "=" : "", eq != NULL ? path : "");
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    
+    free(rules_copy);
+}
+
+// Lowest finite retention among the default and the rules (0 if everything is kept forever)
+static int collect_retention_min(const struct topic_trie_node *node, int min_days) {
+    if (node == NULL) {
+        return min_days;
+    }
+    if ((node->flags & TOPIC_RULE_RETENTION) && node->retention_days > 0 &&
+        (min_days == 0 || node->retention_days < min_days)) {
+        min_days = node->retention_days;
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        min_days = collect_retention_min(node->children[i], min_days);
+    }
+    min_days = collect_retention_min(node->plus, min_days);
+    return collect_retention_min(node->hash, min_days);
+}
+
+// Find a name's slot in the header set: the matching entry, or the empty slot where it would go
+static struct header_name *header_set_slot(struct header_name *slots, size_t capacity,
+                                           const char *name, size_t len, uint64_t hash) {
+    size_t mask = capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct header_name *slot = &slots[i];
+        if (slot->name == NULL ||
+            (slot->hash == hash && slot->len == len && memcmp(slot->name, name, len) == 0)) {
+            return slot;
+        }
+    }
+}
+
+// Add a header name to the exclusion set, keeping it at most half full.
+// Returns 0 if added, 1 if already present, -1 on allocation failure.
+static int add_excluded_header(const char *name) {
+    if ((size_t)(exclude_header_count + 1) * 2 > exclude_header_capacity) {
+        size_t new_capacity = exclude_header_capacity ? exclude_header_capacity * 2 : 16;
+        struct header_name *new_slots = calloc(new_capacity, sizeof(struct header_name));
+        if (new_slots == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < exclude_header_capacity; i++) {
+            struct header_name *old = &exclude_headers[i];
+            if (old->name != NULL) {
+                *header_set_slot(new_slots, new_capacity, old->name, old->len, old->hash) = *old;
+            }
+        }
+        free(exclude_headers);
+        exclude_headers = new_slots;
+        exclude_header_capacity = new_capacity;
+    }
+    
+    size_t len = strlen(name);
+    uint64_t hash = hash_bytes(name, len);
+    struct header_name *slot = header_set_slot(exclude_headers, exclude_header_capacity, name, len, hash);
+    if (slot->name != NULL) {
+        return 1;
+    }
+    slot->name = strdup(name);
+    if (slot->name == NULL) {
+        return -1;
+    }
+    slot->len = len;
+    slot->hash = hash;
+    exclude_header_count++;
+    return 0;
+}
+
+// Parse comma-separated header exclusion list
+// Special value '#' disables header storage completely
+static void parse_exclude_headers(const char *headers_str) {
+    if (headers_str == NULL || *headers_str == '\0') {
+        return;
+    }
+    
+    // Check for special '#' value to disable all header storage
+    if (strcmp(headers_str, "#") == 0) {
+        headers_disabled = 1;
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Header storage disabled (exclude_headers=#)");
+        return;
+    }
+    
+    char *headers_copy = strdup(headers_str);
+    if (headers_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *token = strtok_r(headers_copy, ",", &saveptr);
+    while (token != NULL) {
+        // Trim leading whitespace
+        while (*token == ' ') token++;
+        // Trim trailing whitespace
+        char *end = token + strlen(token) - 1;
+        while (end > token && *end == ' ') {
+            *end = '\0';
+            end--;
+        }
+        
+        // Check for '#' in the list
+        if (strcmp(token, "#") == 0) {
+            headers_disabled = 1;
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Header storage disabled (exclude_headers contains #)");
+            free(headers_copy);
+            return;
+        }
+        
+        if (*token != '\0' && add_excluded_header(token) == 0) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Excluding header: %s", token);
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    
+    free(headers_copy);
+}
+
+// Check if a header name (not necessarily NUL-terminated) should be excluded
+static int is_header_excluded(const char *name, size_t len) {
+    if (exclude_header_count == 0) {
+        return 0;
+    }
+    struct header_name *slot = header_set_slot(exclude_headers, exclude_header_capacity,
+                                               name, len, hash_bytes(name, len));
+    return slot->name != NULL;
+}
+
+// Free header exclusion set
+static void free_exclude_headers(void) {
+    for (size_t i = 0; i < exclude_header_capacity; i++) {
+        free(exclude_headers[i].name);
+    }
+    free(exclude_headers);
+    exclude_headers = NULL;
+    exclude_header_capacity = 0;
+    exclude_header_count = 0;
+}
+
+// Returns unix epoch microseconds.
+static unsigned long long platform_utime(int coarse) {
+	// CLOCK_REALTIME_COARSE has a resolution of 1ms, which is sufficient for this purpose. It's also much faster.
+	struct timespec tv[1];
+	clock_gettime(coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, tv);
+	return tv->tv_sec * 1000000ULL + tv->tv_nsec / 1000ULL;
+}
+
+// Gather entropy from the operating system. Returns 0 on success.
+static int platform_entropy(void *buf, int len) {
+    return syscall(SYS_getrandom, buf, len, 0) != len;
+}
+
+static unsigned long long splitmix64(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+int ulid_generator_init(struct ulid_generator *g, int flags) {
+    g->last_ts = 0;
+    g->last_rand = 0;
+    g->flags = flags;
+
+    // ULID_PARANOID keeps the top random bit clear, which the 15-bit tag always does
+    g->tag = atomic_fetch_add(&ulid_thread_tags, 1) & 0x7fff;
+
+    /* splitmix64 fills the random segment of ULIDs: one multiply-xorshift
+     * round per new millisecond, which is all the task needs once the
+     * state is seeded properly. Within a millisecond (not in "relaxed"
+     * mode) the random field is incremented instead.
+     */
+
+    int initstyle = 1;
+    if (!platform_entropy(&g->rng, sizeof(g->rng))) {
+        initstyle = 0;
+    } else if (!(flags & ULID_SECURE)) {
+        // Failed to read entropy from OS, so generate some.
+        unsigned long n = 0;
+        unsigned long long now;
+        unsigned long long start = platform_utime(0);
+        g->rng = 0;
+        do {
+            now = platform_utime(0);
+            g->rng ^= now ^ (unsigned long long)clock() ^ (unsigned long long)(uintptr_t)&n ^ n;
+            splitmix64(&g->rng);
+        } while (n++ < 1UL << 16 || now - start < 500000ULL);
+    }
+    return initstyle;
+}
+
+// This thread's generator, seeded on first use, so generation needs no lock
+static struct ulid_generator *ulid_thread_generator(void) {
+    if (!thread_ulid_ready) {
+        if (ulid_generator_init(&thread_ulid_gen, ULID_PARANOID) != 0) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to init ULID generator");
+        }
+        thread_ulid_ready = 1;
+    }
+    return &thread_ulid_gen;
+}
+
+// All 1024 two-digit Crockford base32 pairs, so each lookup encodes 10 bits
+#define ULID_PAIRS(a) a"0" a"1" a"2" a"3" a"4" a"5" a"6" a"7" a"8" a"9" a"A" a"B" a"C" a"D" a"E" a"F" \
+                      a"G" a"H" a"J" a"K" a"M" a"N" a"P" a"Q" a"R" a"S" a"T" a"V" a"W" a"X" a"Y" a"Z"
+static const char ulid_pairs[2048 + 1] =
+    ULID_PAIRS("0") ULID_PAIRS("1") ULID_PAIRS("2") ULID_PAIRS("3") ULID_PAIRS("4") ULID_PAIRS("5")
+    ULID_PAIRS("6") ULID_PAIRS("7") ULID_PAIRS("8") ULID_PAIRS("9") ULID_PAIRS("A") ULID_PAIRS("B")
+    ULID_PAIRS("C") ULID_PAIRS("D") ULID_PAIRS("E") ULID_PAIRS("F") ULID_PAIRS("G") ULID_PAIRS("H")
+    ULID_PAIRS("J") ULID_PAIRS("K") ULID_PAIRS("M") ULID_PAIRS("N") ULID_PAIRS("P") ULID_PAIRS("Q")
+    ULID_PAIRS("R") ULID_PAIRS("S") ULID_PAIRS("T") ULID_PAIRS("V") ULID_PAIRS("W") ULID_PAIRS("X")
+    ULID_PAIRS("Y") ULID_PAIRS("Z");
+#undef ULID_PAIRS
+
+// Two digits for bits shift .. shift + 9 of v
+#define ULID_PAIR(out, v, shift) memcpy((out), ulid_pairs + 2 * ((v) >> (shift) & 0x3ff), 2)
+
+// Eight digits for the low 40 bits of v
+static inline void ulid_encode40(char *out, unsigned long long v) {
+    ULID_PAIR(out, v, 30);
+    ULID_PAIR(out + 2, v, 20);
+    ULID_PAIR(out + 4, v, 10);
+    ULID_PAIR(out + 6, v, 0);
+}
+
+// The ten digits of a 48-bit millisecond timestamp
+static inline void ulid_encode_timestamp(char out[10], unsigned long long ts) {
+    ULID_PAIR(out, ts, 40);
+    ulid_encode40(out + 2, ts);
+}
+
+// Encode from 64-bit words: 48-bit timestamp, 16 high and 64 low random bits
+static inline void ulid_encode_words(char str[27], unsigned long long ts,
+                                     unsigned long long rand_hi, unsigned long long rand_lo) {
+    ulid_encode_timestamp(str, ts);
+    ulid_encode40(str + 10, rand_hi << 24 | rand_lo >> 40);
+    ulid_encode40(str + 18, rand_lo);
     str[26] = 0;
 }
 
+void ulid_encode(char str[27], const unsigned char ulid[16]) {
+    unsigned long long hi;
+    unsigned long long lo;
+    memcpy(&hi, ulid, 8);
+    memcpy(&lo, ulid + 8, 8);
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    hi = __builtin_bswap64(hi);
+    lo = __builtin_bswap64(lo);
+#endif
+    ulid_encode_words(str, hi >> 16, hi & 0xffff, lo);
+}
+
 int ulid_decode(unsigned char ulid[16], const char *s) {
     static const signed char v[] = {
           -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
@@ -449,27 +1638,27 @@ int ulid_decode(unsigned char ulid[16], const char *s) {
           -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
           -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1
     };
-    if (v[(int)s[0]] > 7)
+    if (v[(unsigned char)s[0]] > 7)
         return 1;
     for (int i = 0; i < 26; i++)
-        if (v[(int)s[i]] == -1)
+        if (v[(unsigned char)s[i]] == -1)
             return 2;
-    ulid[ 0] = v[(int)s[ 0]] << 5 | v[(int)s[ 1]] >> 0;
-    ulid[ 1] = v[(int)s[ 2]] << 3 | v[(int)s[ 3]] >> 2;
-    ulid[ 2] = v[(int)s[ 3]] << 6 | v[(int)s[ 4]] << 1 | v[(int)s[ 5]] >> 4;
-    ulid[ 3] = v[(int)s[ 5]] << 4 | v[(int)s[ 6]] >> 1;
-    ulid[ 4] = v[(int)s[ 6]] << 7 | v[(int)s[ 7]] << 2 | v[(int)s[ 8]] >> 3;
-    ulid[ 5] = v[(int)s[ 8]] << 5 | v[(int)s[ 9]] >> 0;
-    ulid[ 6] = v[(int)s[10]] << 3 | v[(int)s[11]] >> 2;
-    ulid[ 7] = v[(int)s[11]] << 6 | v[(int)s[12]] << 1 | v[(int)s[13]] >> 4;
-    ulid[ 8] = v[(int)s[13]] << 4 | v[(int)s[14]] >> 1;
-    ulid[ 9] = v[(int)s[14]] << 7 | v[(int)s[15]] << 2 | v[(int)s[16]] >> 3;
-    ulid[10] = v[(int)s[16]] << 5 | v[(int)s[17]] >> 0;
-    ulid[11] = v[(int)s[18]] << 3 | v[(int)s[19]] >> 2;
-    ulid[12] = v[(int)s[19]] << 6 | v[(int)s[20]] << 1 | v[(int)s[21]] >> 4;
-    ulid[13] = v[(int)s[21]] << 4 | v[(int)s[22]] >> 1;
-    ulid[14] = v[(int)s[22]] << 7 | v[(int)s[23]] << 2 | v[(int)s[24]] >> 3;
-    ulid[15] = v[(int)s[24]] << 5 | v[(int)s[25]] >> 0;
+    ulid[ 0] = v[(unsigned char)s[ 0]] << 5 | v[(unsigned char)s[ 1]] >> 0;
+    ulid[ 1] = v[(unsigned char)s[ 2]] << 3 | v[(unsigned char)s[ 3]] >> 2;
+    ulid[ 2] = v[(unsigned char)s[ 3]] << 6 | v[(unsigned char)s[ 4]] << 1 | v[(unsigned char)s[ 5]] >> 4;
+    ulid[ 3] = v[(unsigned char)s[ 5]] << 4 | v[(unsigned char)s[ 6]] >> 1;
+    ulid[ 4] = v[(unsigned char)s[ 6]] << 7 | v[(unsigned char)s[ 7]] << 2 | v[(unsigned char)s[ 8]] >> 3;
+    ulid[ 5] = v[(unsigned char)s[ 8]] << 5 | v[(unsigned char)s[ 9]] >> 0;
+    ulid[ 6] = v[(unsigned char)s[10]] << 3 | v[(unsigned char)s[11]] >> 2;
+    ulid[ 7] = v[(unsigned char)s[11]] << 6 | v[(unsigned char)s[12]] << 1 | v[(unsigned char)s[13]] >> 4;
+    ulid[ 8] = v[(unsigned char)s[13]] << 4 | v[(unsigned char)s[14]] >> 1;
+    ulid[ 9] = v[(unsigned char)s[14]] << 7 | v[(unsigned char)s[15]] << 2 | v[(unsigned char)s[16]] >> 3;
+    ulid[10] = v[(unsigned char)s[16]] << 5 | v[(unsigned char)s[17]] >> 0;
+    ulid[11] = v[(unsigned char)s[18]] << 3 | v[(unsigned char)s[19]] >> 2;
+    ulid[12] = v[(unsigned char)s[19]] << 6 | v[(unsigned char)s[20]] << 1 | v[(unsigned char)s[21]] >> 4;
+    ulid[13] = v[(unsigned char)s[21]] << 4 | v[(unsigned char)s[22]] >> 1;
+    ulid[14] = v[(unsigned char)s[22]] << 7 | v[(unsigned char)s[23]] << 2 | v[(unsigned char)s[24]] >> 3;
+    ulid[15] = v[(unsigned char)s[24]] << 5 | v[(unsigned char)s[25]] >> 0;
     return 0;
 }
 
@@ -477,564 +1666,7124 @@ unsigned long long ulid_generate(struct ulid_generator *g, char str[27]) {
     unsigned long long ts = platform_utime(1) / 1000;
 
     if (!(g->flags & ULID_RELAXED) && g->last_ts == ts) {
-        // Chance of 80-bit overflow is so small that it's not considered.
-        for (int i = 15; i > 5; i--) {
-            if (++g->last[i]) {
-                break;
-            }
-        }
-        ulid_encode(str, g->last);
-
-        return ts;
-    }
-
-    // Fill out timestamp.
-    g->last_ts = ts;
-    g->last[0] = ts >> 40;
-    g->last[1] = ts >> 32;
-    g->last[2] = ts >> 24;
-    g->last[3] = ts >> 16;
-    g->last[4] = ts >>  8;
-    g->last[5] = ts >>  0;
-
-    // Fill out random section.
-    for (int k = 0; k < 10; k++) {
-        g->i = (g->i + 1) & 0xff;
-        g->j = (g->j + g->s[g->i]) & 0xff;
-        int tmp = g->s[g->i];
-        g->s[g->i] = g->s[g->j];
-        g->s[g->j] = tmp;
-        g->last[6 + k] = g->s[(g->s[g->i] + g->s[g->j]) & 0xff];
-    }
-
-    if (g->flags & ULID_PARANOID) {
-        g->last[6] &= 0x7f;
+        // Chance of 64-bit overflow is so small that it's not considered.
+        g->last_rand++;
+    } else {
+        g->last_ts = ts;
+        g->last_rand = splitmix64(&g->rng);
     }
 
-    ulid_encode(str, g->last);
+    ulid_encode_words(str, ts & 0xffffffffffffULL, g->tag, g->last_rand);
 
     return ts;
 }
 
-// Enqueue a message for batch insert
-static void enqueue_message(const char *ulid, const char *topic, const char *payload, 
-                           size_t payloadlen, const char *headers, int retain, int qos) {
-    struct msg_entry *entry = malloc(sizeof(struct msg_entry));
-    if (entry == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message entry");
-        return;
-    }
-    
-    entry->operation = OP_INSERT;
-    memcpy(entry->ulid, ulid, 27);
-    entry->topic = strdup(topic);
-    entry->payload = strndup(payload, payloadlen);
-    entry->headers = NULL;  // Initialize to NULL first
-    entry->retain = retain;
-    entry->qos = qos;
-    entry->next = NULL;
-    
-    // Check mandatory allocations first
-    if (entry->topic == NULL || entry->payload == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message strings");
-        free(entry->topic);
-        free(entry->payload);
-        free(entry);
-        return;
+// Reset ring slot sequence numbers (must run before any producer or consumer)
+static void ring_init(struct entry_ring *ring) {
+    for (size_t i = 0; i <= ring->mask; i++) {
+        atomic_store_explicit(&ring->slots[i].seq, i, memory_order_relaxed);
+        ring->slots[i].ptr = NULL;
     }
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->size, 0);
+}
+
+// Try to append a pointer to the ring. Returns 0 on success, -1 if the ring is full.
+static int ring_push(struct entry_ring *ring, void *ptr) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct queue_slot *slot;
     
-    // Now handle optional headers - if strdup fails, log warning but continue
-    if (headers != NULL) {
-        entry->headers = strdup(headers);
-        if (entry->headers == NULL) {
-            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to allocate headers string, message stored without headers");
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
         }
     }
     
-    pthread_mutex_lock(&queue_mutex);
+    slot->ptr = ptr;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&ring->size, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Take the oldest pointer from the ring. Returns NULL if the ring is empty.
+static void *ring_pop(struct entry_ring *ring) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct queue_slot *slot;
     
-    // Enforce maximum queue size to prevent unbounded memory growth
-    if (msg_queue_size >= MAX_QUEUE_SIZE) {
-        mosquitto_log_printf(MOSQ_LOG_WARNING, "Message queue full (%d), dropping oldest entry", MAX_QUEUE_SIZE);
-        // Drop oldest entry from head
-        struct msg_entry *old = msg_queue_head;
-        if (old != NULL) {
-            msg_queue_head = old->next;
-            if (msg_queue_head == NULL) {
-                msg_queue_tail = NULL;
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
             }
-            msg_queue_size--;
-            free(old->topic);
-            free(old->payload);
-            free(old->headers);
-            free(old);
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
         }
     }
     
-    // Add to queue
-    if (msg_queue_tail == NULL) {
-        msg_queue_head = msg_queue_tail = entry;
-    } else {
-        msg_queue_tail->next = entry;
-        msg_queue_tail = entry;
+    void *ptr = slot->ptr;
+    atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+    atomic_fetch_sub_explicit(&ring->size, 1, memory_order_relaxed);
+    return ptr;
+}
+
+// Wake a shard's batch worker. At most one eventfd write per worker cycle.
+static void queue_wakeup(struct shard *s) {
+    if (s->event_fd >= 0 && !atomic_exchange(&s->wakeup_pending, true)) {
+        uint64_t one = 1;
+        if (write(s->event_fd, &one, sizeof(one)) < 0) {
+            atomic_store(&s->wakeup_pending, false);
+        }
     }
-    msg_queue_size++;
-    
-    // Signal the batch worker if queue is getting full
-    if (msg_queue_size >= batch_size) {
-        pthread_cond_signal(&queue_cond);
+}
+
+// Allocate the free rings of all slab classes. Returns 0 on success.
+static int slab_init(void) {
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        struct slab_class *sc = &slab_classes[c];
+        sc->free.slots = aligned_alloc(CACHE_LINE_SIZE, slab_free_capacity[c] * sizeof(struct queue_slot));
+        if (sc->free.slots == NULL) {
+            return -1;
+        }
+        sc->free.mask = slab_free_capacity[c] - 1;
+        ring_init(&sc->free);
+        atomic_store(&sc->allocated, 0);
+        atomic_store(&sc->in_use, 0);
+        atomic_store(&sc->high_water, 0);
+        slab_reported_high_water[c] = 0;
     }
-    
-    pthread_mutex_unlock(&queue_mutex);
+    return 0;
 }
 
-// Enqueue a delete operation for batch processing
-// If ulid is NULL, will delete the most recent message for the topic
-static void enqueue_delete(const char *topic, const char *ulid) {
-    struct msg_entry *entry = malloc(sizeof(struct msg_entry));
-    if (entry == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate delete entry");
-        return;
+// Release all cached blocks and the free rings
+static void slab_cleanup(void) {
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        struct slab_class *sc = &slab_classes[c];
+        if (sc->free.slots == NULL) {
+            continue;
+        }
+        void *block;
+        while ((block = ring_pop(&sc->free)) != NULL) {
+            free(block);
+        }
+        free(sc->free.slots);
+        sc->free.slots = NULL;
+    }
+}
+
+// Get a block able to hold a msg_entry followed by data_len bytes of inline data
+static struct msg_entry *entry_alloc(size_t data_len) {
+    size_t needed = sizeof(struct msg_entry) + data_len;
+    int c = 0;
+    while (c < SLAB_CLASS_COUNT && slab_block_size[c] < needed) {
+        c++;
     }
     
-    if (ulid != NULL) {
-        entry->operation = OP_DELETE;
-        memcpy(entry->ulid, ulid, 27);
-    } else {
-        entry->operation = OP_DELETE_FALLBACK;
-        entry->ulid[0] = '\0';
+    if (c == SLAB_CLASS_COUNT || slab_classes[c].free.slots == NULL) {
+        struct msg_entry *entry = malloc(needed);
+        if (entry != NULL) {
+            entry->slab_class = -1;
+            atomic_fetch_add(&slab_oversize_count, 1);
+        }
+        return entry;
     }
-    entry->topic = strdup(topic);
-    entry->payload = NULL;
-    entry->headers = NULL;
-    entry->retain = 0;
-    entry->qos = 0;
-    entry->next = NULL;
     
-    if (entry->topic == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate delete topic string");
+    struct slab_class *sc = &slab_classes[c];
+    struct msg_entry *entry = ring_pop(&sc->free);
+    if (entry == NULL) {
+        entry = malloc(slab_block_size[c]);
+        if (entry == NULL) {
+            return NULL;
+        }
+        atomic_fetch_add(&sc->allocated, 1);
+    }
+    entry->slab_class = c;
+    
+    int in_use = atomic_fetch_add(&sc->in_use, 1) + 1;
+    int hw = atomic_load_explicit(&sc->high_water, memory_order_relaxed);
+    while (in_use > hw && !atomic_compare_exchange_weak(&sc->high_water, &hw, in_use)) {
+    }
+    return entry;
+}
+
+// Return an entry's block to its size class (or free it if the class cache is full)
+static void free_msg_entry(struct msg_entry *entry) {
+    if (entry->slab_class < 0) {
         free(entry);
         return;
     }
     
-    pthread_mutex_lock(&queue_mutex);
-    
-    // Add to queue
-    if (msg_queue_tail == NULL) {
-        msg_queue_head = msg_queue_tail = entry;
-    } else {
-        msg_queue_tail->next = entry;
-        msg_queue_tail = entry;
+    struct slab_class *sc = &slab_classes[entry->slab_class];
+    atomic_fetch_sub(&sc->in_use, 1);
+    if (ring_push(&sc->free, entry) != 0) {
+        atomic_fetch_sub(&sc->allocated, 1);
+        free(entry);
     }
-    msg_queue_size++;
-    
-    // Signal the batch worker immediately for delete operations
-    pthread_cond_signal(&queue_cond);
-    
-    pthread_mutex_unlock(&queue_mutex);
 }
 
-// Flush queued messages to database as a batch
-static void flush_batch(void) {
-    struct msg_entry *batch_head = NULL;
-    int batch_count = 0;
-    
-    pthread_mutex_lock(&queue_mutex);
-    if (msg_queue_size == 0) {
-        pthread_mutex_unlock(&queue_mutex);
+// Log slab high-water marks when they have grown (or unconditionally if force is set)
+static void log_slab_usage(int force) {
+    time_t now = time(NULL);
+    if (!force && now - last_slab_report < SLAB_REPORT_INTERVAL_SEC) {
         return;
     }
+    last_slab_report = now;
     
-    // Take all messages from queue
-    batch_head = msg_queue_head;
-    batch_count = msg_queue_size;
-    msg_queue_head = msg_queue_tail = NULL;
-    msg_queue_size = 0;
-    pthread_mutex_unlock(&queue_mutex);
-    
-    if (batch_count == 0 || msg_db == NULL) {
+    int changed = force;
+    int hw[SLAB_CLASS_COUNT];
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        hw[c] = atomic_load(&slab_classes[c].high_water);
+        if (hw[c] != slab_reported_high_water[c]) {
+            slab_reported_high_water[c] = hw[c];
+            changed = 1;
+        }
+    }
+    if (!changed) {
         return;
     }
     
-    // Begin transaction for batch operations
-    char *err_msg = NULL;
-    int rc = sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, &err_msg);
-    if (rc != SQLITE_OK) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to begin transaction: %s", err_msg);
-        sqlite3_free(err_msg);
-        // Fall through and try individual operations anyway
+    mosquitto_log_printf(MOSQ_LOG_INFO,
+        "Entry slab high-water (blocks): 256B=%d 1K=%d 4K=%d 16K=%d 64K=%d, oversize allocations=%d",
+        hw[0], hw[1], hw[2], hw[3], hw[4], atomic_load(&slab_oversize_count));
+}
+
+// Take the oldest entry from a shard's queue. Returns NULL if the queue is empty.
+static struct msg_entry *queue_pop(struct shard *s) {
+    struct msg_entry *entry = ring_pop(&s->queue);
+    if (entry != NULL) {
+        atomic_fetch_sub_explicit(&s->queue_bytes, entry->data_len, memory_order_relaxed);
+    }
+    return entry;
+}
+
+// Whether an entry of data_len bytes fits within percent of the queue's capacity
+static int queue_has_room(struct shard *s, size_t data_len, int percent) {
+    size_t depth = (size_t)atomic_load_explicit(&s->queue.size, memory_order_relaxed);
+    if (depth * 100 >= (size_t)queue_limit * percent) {
+        return 0;
+    }
+    if (queue_max_bytes > 0) {
+        size_t bytes = atomic_load_explicit(&s->queue_bytes, memory_order_relaxed);
+        // An entry always fits into an empty queue, however large it is
+        if (depth > 0 && (bytes + data_len) * 100 > queue_max_bytes * percent) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Wait up to queue_block_ms for room, waking the batch worker. Returns 1 if room was made.
+static int queue_wait_for_room(struct shard *s, size_t data_len, int percent) {
+    unsigned long long deadline = platform_utime(1) + queue_block_ms * 1000ULL;
+    while (!queue_has_room(s, data_len, percent)) {
+        if (!atomic_load(&s->running) || platform_utime(1) >= deadline) {
+            return 0;
+        }
+        queue_wakeup(s);
+        struct timespec pause = { 0, 200000 };
+        nanosleep(&pause, NULL);
     }
+    return 1;
+}
+
+// Append an entry to a shard's spill journal. Returns 0 on success, -1 if it was not written.
+static int spill_entry(struct shard *s, const struct msg_entry *entry) {
+    struct spill_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = SPILL_RECORD_MAGIC;
+    rec.operation = (uint8_t)entry->operation;
+    rec.retain = (uint8_t)entry->retain;
+    rec.qos = (uint8_t)entry->qos;
+    rec.has_headers = entry->headers != NULL;
+    rec.topic_len = (uint32_t)strlen(entry->topic);
+    rec.headers_len = (uint32_t)entry->headers_len;
+    rec.payload_len = entry->payload_len;
+    memcpy(rec.ulid, entry->ulid, sizeof(rec.ulid));
     
-    // Process all entries in batch
-    struct msg_entry *entry = batch_head;
-    int insert_count = 0;
-    int delete_count = 0;
-    while (entry != NULL) {
-        if (entry->operation == OP_INSERT) {
-            // Insert operation
-            if (insert_stmt != NULL) {
-                sqlite3_bind_text(insert_stmt, 1, entry->ulid, -1, SQLITE_STATIC);
-                sqlite3_bind_text(insert_stmt, 2, entry->topic, -1, SQLITE_STATIC);
-                sqlite3_bind_text(insert_stmt, 3, entry->payload, -1, SQLITE_STATIC);
-                sqlite3_bind_int(insert_stmt, 4, entry->retain);
-                sqlite3_bind_int(insert_stmt, 5, entry->qos);
-                if (entry->headers) {
-                    sqlite3_bind_text(insert_stmt, 6, entry->headers, -1, SQLITE_STATIC);
-                } else {
-                    sqlite3_bind_null(insert_stmt, 6);
-                }
-                
-                rc = sqlite3_step(insert_stmt);
-                if (rc == SQLITE_DONE) {
-                    insert_count++;
-                } else {
-                    mosquitto_log_printf(MOSQ_LOG_ERR, "Batch insert failed for topic %s: %s", 
-                                       entry->topic, sqlite3_errmsg(msg_db));
-                }
-                sqlite3_reset(insert_stmt);
+    struct iovec iov[4] = {
+        { &rec, sizeof(rec) },
+        { entry->topic, rec.topic_len },
+        { entry->payload, entry->payload_len },
+        { entry->headers, entry->headers_len },
+    };
+    size_t total = sizeof(rec) + rec.topic_len + entry->payload_len + entry->headers_len;
+    
+    int rc = -1;
+    pthread_mutex_lock(&s->spill_mutex);
+    if (s->spill_fd >= 0 && (unsigned long long)s->spill_write_offset + total <= spill_max_bytes) {
+        // Written at the committed end, so a failed partial write is simply overwritten
+        if (pwritev(s->spill_fd, iov, 4, s->spill_write_offset) == (ssize_t)total) {
+            s->spill_write_offset += total;
+            atomic_store(&s->spill_active, true);
+            rc = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->spill_mutex);
+    return rc;
+}
+
+// Path of segment seg in a shard's journal directory
+static void journal_segment_path(const struct shard *s, unsigned long long seg, char *buf, size_t size) {
+    snprintf(buf, size, "%s/%016llx.seg", s->journal_dir, seg);
+}
+
+// Map segment seg of a shard's journal as its tail, creating the file if needed, and unmap
+// the previous tail. Blocks are allocated up front, so a full disk fails here instead of
+// faulting a later write into the mapping. Returns 0 on success.
+static int journal_map_segment(struct shard *s, unsigned long long seg) {
+    char path[PATH_MAX];
+    journal_segment_path(s, seg, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to open journal segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+    int err = posix_fallocate(fd, 0, (off_t)s->journal_segment_bytes);
+    if (err != 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate journal segment %s: %s", path, strerror(err));
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, s->journal_segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to map journal segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (s->journal_map != NULL) {
+        munmap(s->journal_map, s->journal_segment_bytes);
+    }
+    s->journal_map = map;
+    s->journal_map_index = seg;
+    return 0;
+}
+
+// Bytes a journal record of the given body length takes up
+static unsigned long long journal_record_size(unsigned long long body_len) {
+    return (sizeof(struct spill_record) + body_len + JOURNAL_ALIGN - 1) & ~(unsigned long long)(JOURNAL_ALIGN - 1);
+}
+
+// Copy an entry into a shard's journal, then queue it unless the journal already has a
+// backlog or the queue is full. Returns 0 if the entry was queued, 1 if it was left to the
+// backlog (the entry is freed), -1 if the journal is full or cannot be written, and -2 if
+// the entry does not fit in a segment.
+static int journal_append(struct shard *s, struct msg_entry *entry) {
+    struct spill_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.operation = (uint8_t)entry->operation;
+    rec.retain = (uint8_t)entry->retain;
+    rec.qos = (uint8_t)entry->qos;
+    rec.has_headers = entry->headers != NULL;
+    rec.topic_len = (uint32_t)strlen(entry->topic);
+    rec.headers_len = (uint32_t)entry->headers_len;
+    rec.payload_len = entry->payload_len;
+    memcpy(rec.ulid, entry->ulid, sizeof(rec.ulid));
+    unsigned long long seg_size = s->journal_segment_bytes;
+    unsigned long long size = journal_record_size(rec.topic_len + rec.payload_len + rec.headers_len);
+    if (size > seg_size) {
+        return -2;
+    }
+    
+    int rc = -1;
+    pthread_mutex_lock(&s->journal_mutex);
+    unsigned long long pos = s->journal_write_pos;
+    unsigned long long seg = pos / seg_size;
+    if (pos % seg_size + size > seg_size) {
+        seg++;
+        pos = seg * seg_size;
+    }
+    int writable = s->journal_map != NULL;
+    if (writable && seg != s->journal_map_index) {
+        // Continue in the next segment, unless that goes over journal_max_bytes
+        writable = (seg + 1) * seg_size - atomic_load(&s->journal_first_pos) <= journal_max_bytes &&
+                   journal_map_segment(s, seg) == 0;
+        if (writable) {
+            s->journal_write_pos = pos;
+        }
+    }
+    if (writable) {
+        char *record = s->journal_map + pos % seg_size;
+        char *data = record + sizeof(rec);
+        memcpy(record, &rec, sizeof(rec));
+        memcpy(data, entry->topic, rec.topic_len);
+        data += rec.topic_len;
+        if (entry->payload_len > 0) {
+            memcpy(data, entry->payload, entry->payload_len);
+            data += entry->payload_len;
+        }
+        if (entry->headers_len > 0) {
+            memcpy(data, entry->headers, entry->headers_len);
+        }
+        // The magic goes in last: a record without it ends the journal on replay
+        atomic_thread_fence(memory_order_release);
+        uint32_t magic = JOURNAL_RECORD_MAGIC;
+        memcpy(record, &magic, sizeof(magic));
+        s->journal_write_pos = pos + size;
+        entry->journal_end = pos + size;
+        
+        if (!atomic_load(&s->journal_backlog) && queue_has_room(s, entry->data_len, 100) &&
+            ring_push(&s->queue, entry) == 0) {
+            atomic_fetch_add_explicit(&s->queue_bytes, entry->data_len, memory_order_relaxed);
+            rc = 0;
+        } else {
+            if (!atomic_load(&s->journal_backlog)) {
+                s->journal_backlog_pos = pos;
+                atomic_store(&s->journal_backlog, true);
             }
-        } else if (entry->operation == OP_DELETE) {
-            // Delete with specific ULID
-            if (delete_stmt != NULL) {
-                sqlite3_bind_text(delete_stmt, 1, entry->topic, -1, SQLITE_STATIC);
-                sqlite3_bind_text(delete_stmt, 2, entry->ulid, -1, SQLITE_STATIC);
-                
-                rc = sqlite3_step(delete_stmt);
-                if (rc == SQLITE_DONE) {
-                    int changes = sqlite3_changes(msg_db);
-                    if (changes > 0) {
-                        delete_count++;
-                        mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted message for topic: %s (ulid: %s)", 
-                                            entry->topic, entry->ulid);
-                    }
-                } else {
-                    mosquitto_log_printf(MOSQ_LOG_ERR, "Delete failed for topic %s: %s", 
-                                       entry->topic, sqlite3_errmsg(msg_db));
+            rc = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->journal_mutex);
+    
+    if (rc == 1) {
+        free_msg_entry(entry);
+    }
+    return rc;
+}
+
+// Apply the queue policy to an entry the journal could not take while it has a backlog.
+// Queued or spilled, the entry would overtake the backlog, and the older entries are
+// already durable in the journal, so the entry waits for journal space (block, and the
+// entries shed_qos0 protects) or is rejected. rc is journal_append's result; the entry
+// is consumed.
+static void journal_overflow(struct shard *s, struct msg_entry *entry, int rc) {
+    if (rc == -1 && (queue_policy == QUEUE_POLICY_BLOCK ||
+                     (queue_policy == QUEUE_POLICY_SHED_QOS0 && !(entry->operation == OP_INSERT && entry->qos == 0)))) {
+        // The worker frees segments as it stores the backlog
+        unsigned long long deadline = platform_utime(1) + queue_block_ms * 1000ULL;
+        while (rc == -1 && atomic_load(&s->running) && platform_utime(1) < deadline) {
+            queue_wakeup(s);
+            struct timespec pause = { 0, 200000 };
+            nanosleep(&pause, NULL);
+            rc = journal_append(s, entry);
+        }
+        if (rc >= 0) {
+            queue_wakeup(s);
+            return;
+        }
+        atomic_fetch_add(&queue_drops.block_timeouts, 1);
+    } else if (queue_policy == QUEUE_POLICY_SHED_QOS0) {
+        atomic_fetch_add(&queue_drops.dropped_qos0, 1);
+    } else {
+        atomic_fetch_add(&queue_drops.dropped_newest, 1);
+    }
+    atomic_fetch_add(&queue_drops.journal_failed, 1);
+    free_msg_entry(entry);
+}
+
+// Append an entry to a shard's queue, applying the queue policy when it is full.
+// The entry is consumed: queued, spilled, or freed and counted as dropped.
+static void queue_append(struct shard *s, struct msg_entry *entry) {
+    // Keep order behind entries that are already in the spill journal
+    if (atomic_load(&s->spill_active)) {
+        if (spill_entry(s, entry) == 0) {
+            atomic_fetch_add(&queue_drops.spilled, 1);
+        } else {
+            atomic_fetch_add(&queue_drops.spill_failed, 1);
+        }
+        free_msg_entry(entry);
+        return;
+    }
+    
+    // With the ingest journal the queue is only a window onto it: when it is full, entries
+    // stay in the journal until the worker reads them back
+    if (s->journal_dir != NULL) {
+        int rc = journal_append(s, entry);
+        if (rc == 1) {
+            queue_wakeup(s);
+        }
+        if (rc >= 0) {
+            return;
+        }
+        if (atomic_load(&s->journal_backlog)) {
+            journal_overflow(s, entry, rc);
+            return;
+        }
+        atomic_fetch_add(&queue_drops.journal_failed, 1);
+    }
+    
+    size_t data_len = entry->data_len;
+    if (!queue_has_room(s, data_len, 100) || queue_policy == QUEUE_POLICY_SHED_QOS0) {
+        switch (queue_policy) {
+        case QUEUE_POLICY_DROP_OLDEST:
+            while (!queue_has_room(s, data_len, 100)) {
+                struct msg_entry *old = queue_pop(s);
+                if (old == NULL) {
+                    break;
                 }
-                sqlite3_reset(delete_stmt);
+                free_msg_entry(old);
+                atomic_fetch_add(&queue_drops.dropped_oldest, 1);
             }
-        } else if (entry->operation == OP_DELETE_FALLBACK) {
-            // Delete most recent message for topic (fallback when no ULID provided)
-            if (find_latest_stmt != NULL) {
-                sqlite3_bind_text(find_latest_stmt, 1, entry->topic, -1, SQLITE_STATIC);
-                if (sqlite3_step(find_latest_stmt) == SQLITE_ROW) {
-                    const char *found_ulid = (const char *)sqlite3_column_text(find_latest_stmt, 0);
-                    if (delete_stmt != NULL && found_ulid != NULL) {
-                        sqlite3_bind_text(delete_stmt, 1, entry->topic, -1, SQLITE_STATIC);
-                        sqlite3_bind_text(delete_stmt, 2, found_ulid, -1, SQLITE_TRANSIENT);
-                        
-                        rc = sqlite3_step(delete_stmt);
-                        if (rc == SQLITE_DONE && sqlite3_changes(msg_db) > 0) {
-                            delete_count++;
-                            mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted most recent message for topic: %s (ulid: %s)", 
-                                                entry->topic, found_ulid);
-                        }
-                        sqlite3_reset(delete_stmt);
-                    }
-                } else {
-                    mosquitto_log_printf(MOSQ_LOG_WARNING, "No message found to delete for topic: %s", entry->topic);
+            break;
+        case QUEUE_POLICY_DROP_NEWEST:
+            free_msg_entry(entry);
+            atomic_fetch_add(&queue_drops.dropped_newest, 1);
+            return;
+        case QUEUE_POLICY_SHED_QOS0:
+            // QoS 0 inserts may only use the capacity below the watermark
+            if (entry->operation == OP_INSERT && entry->qos == 0) {
+                if (!queue_has_room(s, data_len, qos0_watermark)) {
+                    free_msg_entry(entry);
+                    atomic_fetch_add(&queue_drops.dropped_qos0, 1);
+                    return;
                 }
-                sqlite3_reset(find_latest_stmt);
+                break;
+            }
+            if (queue_has_room(s, data_len, 100)) {
+                break;
+            }
+            // Protected entries wait for room like the block policy
+            // fall through
+        case QUEUE_POLICY_BLOCK:
+            if (!queue_wait_for_room(s, data_len, 100)) {
+                free_msg_entry(entry);
+                atomic_fetch_add(&queue_drops.block_timeouts, 1);
+                return;
+            }
+            break;
+        case QUEUE_POLICY_SPILL:
+            if (spill_entry(s, entry) == 0) {
+                atomic_fetch_add(&queue_drops.spilled, 1);
+            } else {
+                atomic_fetch_add(&queue_drops.spill_failed, 1);
+            }
+            free_msg_entry(entry);
+            queue_wakeup(s);
+            return;
+        }
+    }
+    
+    while (ring_push(&s->queue, entry) != 0) {
+        // Concurrent producers filled the last ring slots after the room check
+        struct msg_entry *old = queue_policy == QUEUE_POLICY_DROP_OLDEST ? queue_pop(s) : NULL;
+        if (old == NULL) {
+            free_msg_entry(entry);
+            atomic_fetch_add(&queue_drops.dropped_newest, 1);
+            return;
+        }
+        free_msg_entry(old);
+        atomic_fetch_add(&queue_drops.dropped_oldest, 1);
+    }
+    atomic_fetch_add_explicit(&s->queue_bytes, data_len, memory_order_relaxed);
+}
+
+// Log backpressure counters when they have changed (or unconditionally if force is set)
+static void log_queue_drops(int force) {
+    time_t now = time(NULL);
+    if (!force && now - last_queue_report < QUEUE_REPORT_INTERVAL_SEC) {
+        return;
+    }
+    last_queue_report = now;
+    
+    const atomic_ullong *counters = (const atomic_ullong *)&queue_drops;
+    unsigned long long values[QUEUE_DROP_COUNTERS];
+    unsigned long long total = 0;
+    int changed = force;
+    for (size_t i = 0; i < QUEUE_DROP_COUNTERS; i++) {
+        values[i] = atomic_load(&counters[i]);
+        total += values[i];
+        if (values[i] != queue_drops_reported[i]) {
+            queue_drops_reported[i] = values[i];
+            changed = 1;
+        }
+    }
+    if (!changed || total == 0) {
+        return;
+    }
+    
+    mosquitto_log_printf(force ? MOSQ_LOG_INFO : MOSQ_LOG_WARNING,
+        "Message queue backpressure (limit %d entries, %zu bytes): %s=%llu %s=%llu %s=%llu %s=%llu %s=%llu %s=%llu %s=%llu",
+        queue_limit, queue_max_bytes,
+        queue_drop_names[0], values[0], queue_drop_names[1], values[1], queue_drop_names[2], values[2],
+        queue_drop_names[3], values[3], queue_drop_names[4], values[4], queue_drop_names[5], values[5],
+        queue_drop_names[6], values[6]);
+}
+
+// Enqueue a message for batch insert on its topic's shard
+static void enqueue_message(struct shard *s, const char *ulid, const char *topic, const char *payload, 
+                           size_t payloadlen, const char *headers, size_t headers_len,
+                           int retain, int qos) {
+    size_t topic_len = strlen(topic);
+    size_t data_len = topic_len + 1 + payloadlen + 1 + (headers != NULL ? headers_len + 1 : 0);
+    
+    struct msg_entry *entry = entry_alloc(data_len);
+    if (entry == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message entry");
+        return;
+    }
+    
+    entry->operation = OP_INSERT;
+    entry->data_len = data_len;
+    memcpy(entry->ulid, ulid, 27);
+    entry->retain = retain;
+    entry->qos = qos;
+    entry->codec = CODEC_NONE;
+    entry->journal_end = 0;
+    
+    // Copy topic, payload and headers into the block right after the struct
+    char *data = (char *)(entry + 1);
+    entry->topic = data;
+    memcpy(data, topic, topic_len + 1);
+    data += topic_len + 1;
+    
+    entry->payload = data;
+    entry->payload_len = payloadlen;
+    memcpy(data, payload, payloadlen);
+    data[payloadlen] = '\0';
+    data += payloadlen + 1;
+    
+    entry->headers = NULL;
+    entry->headers_len = 0;
+    if (headers != NULL) {
+        entry->headers = data;
+        entry->headers_len = headers_len;
+        memcpy(data, headers, headers_len);
+        data[headers_len] = '\0';
+    }
+    
+    queue_append(s, entry);
+    
+    // Wake the batch worker once the flush threshold is reached
+    if (atomic_load_explicit(&s->queue.size, memory_order_relaxed) >=
+        atomic_load_explicit(&s->effective_batch, memory_order_relaxed)) {
+        queue_wakeup(s);
+    }
+}
+
+// Enqueue a delete operation for batch processing
+// If ulid is NULL, will delete the most recent message for the topic
+static void enqueue_delete(struct shard *s, const char *topic, const char *ulid) {
+    size_t topic_len = strlen(topic);
+    struct msg_entry *entry = entry_alloc(topic_len + 1);
+    if (entry == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate delete entry");
+        return;
+    }
+    
+    if (ulid != NULL) {
+        entry->operation = OP_DELETE;
+        snprintf(entry->ulid, sizeof(entry->ulid), "%s", ulid);
+    } else {
+        entry->operation = OP_DELETE_FALLBACK;
+        entry->ulid[0] = '\0';
+    }
+    entry->data_len = topic_len + 1;
+    entry->topic = (char *)(entry + 1);
+    memcpy(entry->topic, topic, topic_len + 1);
+    entry->payload = NULL;
+    entry->payload_len = 0;
+    entry->headers = NULL;
+    entry->headers_len = 0;
+    entry->retain = 0;
+    entry->qos = 0;
+    entry->codec = CODEC_NONE;
+    entry->journal_end = 0;
+    
+    queue_append(s, entry);
+    
+    // Wake the batch worker immediately for delete operations
+    queue_wakeup(s);
+}
+
+// Check whether a payload is valid UTF-8 without embedded NUL bytes
+static int payload_is_text(const unsigned char *p, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        unsigned char c = p[i];
+        if (c == 0) {
+            return 0;
+        }
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t n;
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+        } else {
+            return 0;
+        }
+        if (i + n >= len) {
+            return 0;
+        }
+        for (size_t k = 1; k <= n; k++) {
+            if ((p[i + k] & 0xc0) != 0x80) {
+                return 0;
+            }
+        }
+        // Reject overlong 3/4-byte forms, surrogates and code points above U+10FFFF
+        if ((c == 0xe0 && p[i + 1] < 0xa0) || (c == 0xed && p[i + 1] > 0x9f) ||
+            (c == 0xf0 && p[i + 1] < 0x90) || (c == 0xf4 && p[i + 1] > 0x8f)) {
+            return 0;
+        }
+        i += n + 1;
+    }
+    return 1;
+}
+
+// Bind an entry's payload using its explicit length, as TEXT or BLOB per payload_format.
+// Compressed payloads are always BLOBs.
+static int bind_payload(sqlite3_stmt *stmt, int idx, const struct msg_entry *entry) {
+    int as_blob = entry->codec != CODEC_NONE || payload_format == PAYLOAD_FORMAT_BLOB ||
+                  (payload_format == PAYLOAD_FORMAT_AUTO &&
+                   !payload_is_text((const unsigned char *)entry->payload, entry->payload_len));
+    if (as_blob) {
+        return sqlite3_bind_blob64(stmt, idx, entry->payload, entry->payload_len, SQLITE_STATIC);
+    }
+    return sqlite3_bind_text64(stmt, idx, entry->payload, entry->payload_len, SQLITE_STATIC, SQLITE_UTF8);
+}
+
+// Open-addressing hash map from topic string to a 64-bit value (linear probing).
+// Owned and used by the batch worker thread only.
+struct topic_map_entry {
+    char *key;          // NULL for an empty slot
+    uint64_t hash;
+    int64_t value;
+};
+
+struct topic_map {
+    struct topic_map_entry *slots;
+    size_t capacity;    // Power of two
+    size_t count;
+};
+
+// Topic dictionary cache (topic name -> topic.id)
+static __thread struct topic_map topic_ids;
+
+// Find a key's slot: the matching entry, or the empty slot where it would go
+static struct topic_map_entry *topic_map_slot(struct topic_map *map, const char *key, uint64_t hash) {
+    size_t mask = map->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct topic_map_entry *e = &map->slots[i];
+        if (e->key == NULL || (e->hash == hash && strcmp(e->key, key) == 0)) {
+            return e;
+        }
+    }
+}
+
+// Look up a topic. Returns a pointer to its value, or NULL if absent.
+static int64_t *topic_map_get(struct topic_map *map, const char *key) {
+    if (map->count == 0) {
+        return NULL;
+    }
+    struct topic_map_entry *e = topic_map_slot(map, key, hash_string(key));
+    return e->key != NULL ? &e->value : NULL;
+}
+
+static void topic_map_clear(struct topic_map *map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        free(map->slots[i].key);
+    }
+    free(map->slots);
+    map->slots = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+// Insert or update a topic. Returns 0 on success, -1 on allocation failure.
+static int topic_map_put(struct topic_map *map, const char *key, int64_t value) {
+    // Keep the load factor below 70%
+    if ((map->count + 1) * 10 > map->capacity * 7) {
+        size_t new_capacity = map->capacity ? map->capacity * 2 : 1024;
+        struct topic_map_entry *new_slots = calloc(new_capacity, sizeof(struct topic_map_entry));
+        if (new_slots == NULL) {
+            return -1;
+        }
+        struct topic_map old = *map;
+        map->slots = new_slots;
+        map->capacity = new_capacity;
+        for (size_t i = 0; i < old.capacity; i++) {
+            if (old.slots[i].key != NULL) {
+                *topic_map_slot(map, old.slots[i].key, old.slots[i].hash) = old.slots[i];
             }
         }
-        
-        entry = entry->next;
+        free(old.slots);
+    }
+    
+    uint64_t hash = hash_string(key);
+    struct topic_map_entry *e = topic_map_slot(map, key, hash);
+    if (e->key == NULL) {
+        e->key = strdup(key);
+        if (e->key == NULL) {
+            return -1;
+        }
+        e->hash = hash;
+        map->count++;
+    }
+    e->value = value;
+    return 0;
+}
+
+// Prepare topic dictionary statements and warm the in-memory cache from the topic table
+static void prepare_topic_dictionary(void) {
+    if (sqlite3_prepare_v2(msg_db, "SELECT id FROM topic WHERE name = ?1", -1, &topic_find_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "INSERT INTO topic (name) VALUES (?1)", -1, &topic_insert_stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare topic dictionary statements: %s", sqlite3_errmsg(msg_db));
+        return;
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(msg_db, "SELECT id, name FROM topic", -1, &stmt, 0) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW && topic_ids.count < TOPIC_CACHE_MAX) {
+            topic_map_put(&topic_ids, (const char *)sqlite3_column_text(stmt, 1), sqlite3_column_int64(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Topic dictionary loaded: %zu topics", topic_ids.count);
+}
+
+// Resolve a topic to its dictionary id, adding it to the topic table if create is set.
+// Returns the id, or -1 if the topic is unknown (create=0) or on error.
+static int64_t resolve_topic_id(const char *topic, int create) {
+    int64_t *cached = topic_map_get(&topic_ids, topic);
+    if (cached != NULL) {
+        return *cached;
+    }
+    if (topic_find_stmt == NULL || topic_insert_stmt == NULL) {
+        return -1;
+    }
+    
+    int64_t id = -1;
+    sqlite3_bind_text(topic_find_stmt, 1, topic, -1, SQLITE_STATIC);
+    if (sqlite3_step(topic_find_stmt) == SQLITE_ROW) {
+        id = sqlite3_column_int64(topic_find_stmt, 0);
+    }
+    sqlite3_reset(topic_find_stmt);
+    
+    if (id < 0 && create) {
+        sqlite3_bind_text(topic_insert_stmt, 1, topic, -1, SQLITE_STATIC);
+        if (sqlite3_step(topic_insert_stmt) == SQLITE_DONE) {
+            id = sqlite3_last_insert_rowid(msg_db);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to add topic %s to dictionary: %s", topic, sqlite3_errmsg(msg_db));
+        }
+        sqlite3_reset(topic_insert_stmt);
+    }
+    
+    if (id >= 0) {
+        if (topic_ids.count >= TOPIC_CACHE_MAX) {
+            topic_map_clear(&topic_ids);
+        }
+        topic_map_put(&topic_ids, topic, id);
+    }
+    return id;
+}
+
+// Bind an entry's topic as a string or, with the topic dictionary, as its id.
+// Returns SQLITE_OK, or SQLITE_NOTFOUND if the topic has no id (and create is not set).
+static int bind_topic(sqlite3_stmt *stmt, int idx, const char *topic, int create) {
+    if (!topic_dictionary) {
+        return sqlite3_bind_text(stmt, idx, topic, -1, SQLITE_STATIC);
+    }
+    int64_t id = resolve_topic_id(topic, create);
+    if (id < 0) {
+        return SQLITE_NOTFOUND;
+    }
+    return sqlite3_bind_int64(stmt, idx, id);
+}
+
+// Bind a text ULID as the configured key format. Returns SQLITE_OK, or SQLITE_MISMATCH
+// if the ULID cannot be decoded for the binary layout.
+static int bind_ulid(sqlite3_stmt *stmt, int idx, const char *ulid) {
+    if (ulid_format == ULID_FORMAT_BINARY) {
+        unsigned char bin[16];
+        if (ulid_decode(bin, ulid) != 0) {
+            return SQLITE_MISMATCH;
+        }
+        return sqlite3_bind_blob(stmt, idx, bin, sizeof(bin), SQLITE_TRANSIENT);
+    }
+    return sqlite3_bind_text(stmt, idx, ulid, -1, SQLITE_STATIC);
+}
+
+// Read a ULID key column (text or 16-byte blob) as Crockford text
+static void column_ulid_text(sqlite3_stmt *stmt, int col, char out[27]) {
+    if (sqlite3_column_type(stmt, col) == SQLITE_BLOB && sqlite3_column_bytes(stmt, col) == 16) {
+        ulid_encode(out, sqlite3_column_blob(stmt, col));
+    } else {
+        const unsigned char *text = sqlite3_column_text(stmt, col);
+        snprintf(out, 27, "%s", text ? (const char *)text : "");
+    }
+}
+
+static void bind_headers(sqlite3_stmt *stmt, int idx, const struct msg_entry *entry) {
+    if (entry->headers && headers_format == HEADERS_FORMAT_BINARY) {
+        sqlite3_bind_blob64(stmt, idx, entry->headers, entry->headers_len, SQLITE_STATIC);
+    } else if (entry->headers) {
+        sqlite3_bind_text64(stmt, idx, entry->headers, entry->headers_len, SQLITE_STATIC, SQLITE_UTF8);
+    } else {
+        sqlite3_bind_null(stmt, idx);
+    }
+}
+
+static void bind_codec(sqlite3_stmt *stmt, int idx, const struct msg_entry *entry) {
+    if (entry->codec != CODEC_NONE) {
+        sqlite3_bind_int64(stmt, idx, (unsigned)entry->codec);
+    } else {
+        sqlite3_bind_null(stmt, idx);
+    }
+}
+
+// Last-value cache (plugin_opt_latest). msg_latest holds the newest stored row of each
+// topic and is written in the same transaction as the history rows; deleting that row
+// removes the topic from msg_latest. The batch worker keeps the topic -> ULID mapping in
+// memory, so fallback deletes become deletes by key. The same per-topic entries hold a
+// copy of the last stored payload for store_on_change.
+struct latest_topic {
+    unsigned char ulid[16];         // msg_latest row, all zero: none
+    int ulid_known;                 // ulid is valid (else ask msg_latest)
+    unsigned char *payload;         // store_on_change: last stored payload, NULL = unknown
+    size_t payload_len;
+    uint64_t payload_hash;          // its hash, checked before the bytes
+    unsigned long long stored_ms;   // and its ULID timestamp
+};
+
+static __thread struct topic_map latest_map;        // topic -> index into latest_topics
+static __thread struct latest_topic *latest_topics = NULL;
+static __thread size_t latest_topic_count = 0;
+static __thread size_t latest_topic_capacity = 0;
+
+static void latest_clear(void) {
+    topic_map_clear(&latest_map);
+    for (size_t i = 0; i < latest_topic_count; i++) {
+        free(latest_topics[i].payload);
+    }
+    free(latest_topics);
+    latest_topics = NULL;
+    latest_topic_count = latest_topic_capacity = 0;
+}
+
+// A topic's cache entry, added if create is set. NULL if absent or out of memory.
+static struct latest_topic *latest_topic_for(const char *topic, int create) {
+    int64_t *index = topic_map_get(&latest_map, topic);
+    if (index != NULL) {
+        return &latest_topics[*index];
+    }
+    if (!create) {
+        return NULL;
+    }
+    
+    if (latest_topic_count >= TOPIC_CACHE_MAX) {
+        latest_clear();
+    }
+    if (latest_topic_count == latest_topic_capacity) {
+        size_t capacity = latest_topic_capacity ? latest_topic_capacity * 2 : 1024;
+        void *grown = realloc(latest_topics, capacity * sizeof(*latest_topics));
+        if (grown == NULL) {
+            return NULL;
+        }
+        latest_topics = grown;
+        latest_topic_capacity = capacity;
+    }
+    if (topic_map_put(&latest_map, topic, (int64_t)latest_topic_count) != 0) {
+        return NULL;
+    }
+    struct latest_topic *t = &latest_topics[latest_topic_count++];
+    memset(t, 0, sizeof(*t));
+    return t;
+}
+
+// Record a topic's msg_latest ULID in memory (NULL: the topic has no row)
+static void latest_remember(const char *topic, const char *ulid) {
+    unsigned char bin[16] = { 0 };
+    if (ulid != NULL && ulid_decode(bin, ulid) != 0) {
+        return;
+    }
+    struct latest_topic *t = latest_topic_for(topic, 1);
+    if (t != NULL) {
+        memcpy(t->ulid, bin, sizeof(bin));
+        t->ulid_known = 1;
+    }
+}
+
+// Find the ULID of a topic's msg_latest row, from memory or the table.
+// Returns 1 and fills ulid if the topic has a row, 0 otherwise.
+static int latest_lookup(const char *topic, char ulid[27]) {
+    static const unsigned char none[16];
+    struct latest_topic *t = latest_topic_for(topic, 0);
+    if (t != NULL && t->ulid_known) {
+        if (memcmp(t->ulid, none, sizeof(none)) == 0) {
+            return 0;
+        }
+        ulid_encode(ulid, t->ulid);
+        return 1;
+    }
+    if (latest_find_stmt == NULL) {
+        return 0;
+    }
+    
+    int found = 0;
+    sqlite3_bind_text(latest_find_stmt, 1, topic, -1, SQLITE_STATIC);
+    if (sqlite3_step(latest_find_stmt) == SQLITE_ROW) {
+        column_ulid_text(latest_find_stmt, 0, ulid);
+        found = 1;
+    }
+    sqlite3_reset(latest_find_stmt);
+    latest_remember(topic, found ? ulid : NULL);
+    return found;
+}
+
+// Write an inserted entry through to msg_latest unless the topic already has a newer row
+static void latest_store(const struct msg_entry *entry) {
+    char current[27];
+    if (latest_upsert_stmt == NULL ||
+        (latest_lookup(entry->topic, current) && strcmp(current, entry->ulid) >= 0)) {
+        return;
+    }
+    sqlite3_bind_text(latest_upsert_stmt, 1, entry->topic, -1, SQLITE_STATIC);
+    sqlite3_bind_text(latest_upsert_stmt, 2, entry->ulid, -1, SQLITE_STATIC);
+    bind_payload(latest_upsert_stmt, 3, entry);
+    sqlite3_bind_int(latest_upsert_stmt, 4, entry->retain);
+    sqlite3_bind_int(latest_upsert_stmt, 5, entry->qos);
+    bind_headers(latest_upsert_stmt, 6, entry);
+    bind_codec(latest_upsert_stmt, 7, entry);
+    if (sqlite3_step(latest_upsert_stmt) == SQLITE_DONE) {
+        latest_remember(entry->topic, entry->ulid);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to update msg_latest for topic %s: %s",
+                            entry->topic, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(latest_upsert_stmt);
+}
+
+// A row of topic was deleted: drop the topic's msg_latest row if it was that one
+static void latest_forget(const char *topic, const char *ulid) {
+    unsigned char bin[16];
+    char current[27];
+    if (latest_delete_stmt == NULL || ulid_decode(bin, ulid) != 0 || !latest_lookup(topic, current)) {
+        return;
+    }
+    char canonical[27];
+    ulid_encode(canonical, bin);
+    if (strcmp(canonical, current) != 0) {
+        return;
+    }
+    sqlite3_bind_text(latest_delete_stmt, 1, topic, -1, SQLITE_STATIC);
+    sqlite3_bind_text(latest_delete_stmt, 2, canonical, -1, SQLITE_STATIC);
+    if (sqlite3_step(latest_delete_stmt) == SQLITE_DONE) {
+        latest_remember(topic, NULL);
+    }
+    sqlite3_reset(latest_delete_stmt);
+}
+
+// Create msg_latest, prepare its statements and warm the in-memory map from it
+static void prepare_latest(void) {
+    char *err_msg = NULL;
+    if (sqlite3_exec(msg_db,
+            "CREATE TABLE IF NOT EXISTS msg_latest ("
+            "topic TEXT PRIMARY KEY, ulid TEXT NOT NULL, payload TEXT NOT NULL, retain INTEGER NOT NULL DEFAULT 0, "
+            "qos INTEGER NOT NULL DEFAULT 0, headers TEXT, codec INTEGER) WITHOUT ROWID;",
+            NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg_latest table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+    if (sqlite3_prepare_v2(msg_db,
+            "INSERT INTO msg_latest (topic, ulid, payload, retain, qos, headers, codec) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7) "
+            "ON CONFLICT (topic) DO UPDATE SET ulid = excluded.ulid, payload = excluded.payload, retain = excluded.retain, "
+            "qos = excluded.qos, headers = excluded.headers, codec = excluded.codec WHERE excluded.ulid > msg_latest.ulid",
+            -1, &latest_upsert_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "SELECT ulid FROM msg_latest WHERE topic = ?1", -1, &latest_find_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "DELETE FROM msg_latest WHERE topic = ?1 AND ulid = ?2", -1,
+                           &latest_delete_stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare msg_latest statements: %s", sqlite3_errmsg(msg_db));
+        return;
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(msg_db, "SELECT topic, ulid FROM msg_latest", -1, &stmt, 0) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW && latest_topic_count < TOPIC_CACHE_MAX) {
+            latest_remember((const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1));
+        }
+        sqlite3_finalize(stmt);
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Last-value cache loaded%s: %zu topics", shard_label(), latest_topic_count);
+}
+
+// Maintained counters (plugin_opt_stats). msg_stats has one row per topic prefix (the
+// first stats_levels levels, ending in '/' when the topic has more) and the "#" row for
+// the whole store, each with its row count, stored payload and header bytes and first and
+// last ULID. msg_stats_minute counts inserts and deletes per minute. The batch worker
+// collects the changes of a transaction in memory and writes them just before its COMMIT,
+// so the counters always match the committed rows and reading them costs one key lookup.
+// After deletes the "#" bounds are exact; a prefix's bounds are clamped to them, so they
+// only bound the prefix's rows.
+#define STATS_ROW_BYTES "length(CAST(payload AS BLOB)) + ifnull(length(CAST(headers AS BLOB)), 0)"
+
+struct stats_delta {
+    const char *prefix;     // Owned by stats_map
+    long long rows;
+    long long bytes;
+    char first[27];         // Oldest ULID inserted, "" if none
+    char last[27];          // Newest ULID inserted, "" if none
+    int dirty;
+};
+
+static __thread struct topic_map stats_map;         // prefix -> index into stats_deltas
+static __thread struct stats_delta *stats_deltas = NULL;
+static __thread size_t *stats_dirty = NULL;         // Deltas changed since the last write
+static __thread size_t stats_delta_count = 0;
+static __thread size_t stats_delta_capacity = 0;
+static __thread size_t stats_dirty_count = 0;
+static __thread struct stats_delta stats_total;
+static __thread long long stats_inserts = 0;        // For msg_stats_minute
+static __thread long long stats_deletes = 0;
+static __thread long long stats_pruned_minute = 0;  // Minute msg_stats_minute was last pruned in
+
+// Forget the changes collected since the last write
+static void stats_reset(void) {
+    for (size_t i = 0; i < stats_dirty_count; i++) {
+        struct stats_delta *d = &stats_deltas[stats_dirty[i]];
+        d->rows = d->bytes = 0;
+        d->first[0] = d->last[0] = '\0';
+        d->dirty = 0;
+    }
+    stats_dirty_count = 0;
+    memset(&stats_total, 0, sizeof(stats_total));
+    stats_inserts = stats_deletes = 0;
+}
+
+static void stats_clear(void) {
+    stats_reset();
+    topic_map_clear(&stats_map);
+    free(stats_deltas);
+    free(stats_dirty);
+    stats_deltas = NULL;
+    stats_dirty = NULL;
+    stats_delta_count = stats_delta_capacity = 0;
+}
+
+// The delta of a topic's prefix, NULL if the topic is unknown or memory ran out
+static struct stats_delta *stats_delta_for(const char *topic) {
+    if (topic == NULL || stats_levels <= 0) {
+        return NULL;
+    }
+    size_t len = 0;
+    int levels = 0;
+    while (topic[len] != '\0') {
+        if (topic[len++] == '/' && ++levels == stats_levels) {
+            break;
+        }
+    }
+    char buf[256];
+    char *prefix = len < sizeof(buf) ? buf : malloc(len + 1);
+    if (prefix == NULL) {
+        return NULL;
+    }
+    memcpy(prefix, topic, len);
+    prefix[len] = '\0';
+    
+    struct stats_delta *d = NULL;
+    int64_t *index = topic_map_get(&stats_map, prefix);
+    if (index != NULL) {
+        d = &stats_deltas[*index];
+    } else {
+        if (stats_delta_count == stats_delta_capacity) {
+            size_t capacity = stats_delta_capacity ? stats_delta_capacity * 2 : 64;
+            struct stats_delta *grown = realloc(stats_deltas, capacity * sizeof(*grown));
+            size_t *grown_dirty = grown != NULL ? realloc(stats_dirty, capacity * sizeof(*grown_dirty)) : NULL;
+            if (grown != NULL) {
+                stats_deltas = grown;
+            }
+            if (grown_dirty != NULL) {
+                stats_dirty = grown_dirty;
+                stats_delta_capacity = capacity;
+            }
+        }
+        if (stats_delta_count < stats_delta_capacity &&
+            topic_map_put(&stats_map, prefix, (int64_t)stats_delta_count) == 0) {
+            d = &stats_deltas[stats_delta_count++];
+            memset(d, 0, sizeof(*d));
+            d->prefix = topic_map_slot(&stats_map, prefix, hash_string(prefix))->key;
+        }
+    }
+    if (prefix != buf) {
+        free(prefix);
+    }
+    if (d != NULL && !d->dirty) {
+        d->dirty = 1;
+        stats_dirty[stats_dirty_count++] = (size_t)(d - stats_deltas);
+    }
+    return d;
+}
+
+// Count rows of a topic: inserted (rows > 0, with the oldest and newest ULID among them)
+// or deleted (rows < 0, ULIDs NULL)
+static void stats_count(const char *topic, long long rows, long long bytes, const char *first, const char *last) {
+    if (stats_upsert_stmt == NULL) {
+        return;
+    }
+    struct stats_delta *targets[2] = { &stats_total, stats_delta_for(topic) };
+    for (int i = 0; i < 2; i++) {
+        struct stats_delta *d = targets[i];
+        if (d == NULL) {
+            continue;
+        }
+        d->rows += rows;
+        d->bytes += bytes;
+        if (first != NULL && (d->first[0] == '\0' || strcmp(first, d->first) < 0)) {
+            snprintf(d->first, sizeof(d->first), "%s", first);
+        }
+        if (last != NULL && strcmp(last, d->last) > 0) {
+            snprintf(d->last, sizeof(d->last), "%s", last);
+        }
+    }
+    if (rows > 0) {
+        stats_inserts += rows;
+    } else {
+        stats_deletes -= rows;
+    }
+}
+
+static void stats_insert(const struct msg_entry *entry) {
+    stats_count(entry->topic, 1, (long long)(entry->payload_len + (entry->headers ? entry->headers_len : 0)),
+                entry->ulid, entry->ulid);
+}
+
+// Step a delete statement to completion. With stats on, deletes return each row's
+// stored bytes, preceded by its topic column unless the caller knows the topic.
+// Returns the last sqlite3_step result.
+static int stats_step_delete(sqlite3_stmt *stmt, const char *topic) {
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *row_topic = topic;
+        if (row_topic == NULL && !topic_dictionary) {
+            row_topic = (const char *)sqlite3_column_text(stmt, 0);
+        } else if (row_topic == NULL && topic_name_stmt != NULL) {
+            sqlite3_bind_int64(topic_name_stmt, 1, sqlite3_column_int64(stmt, 0));
+            if (sqlite3_step(topic_name_stmt) == SQLITE_ROW) {
+                row_topic = (const char *)sqlite3_column_text(topic_name_stmt, 0);
+            }
+        }
+        stats_count(row_topic, -1, -sqlite3_column_int64(stmt, topic != NULL ? 0 : 1), NULL, NULL);
+        if (topic_name_stmt != NULL) {
+            sqlite3_reset(topic_name_stmt);
+        }
+    }
+    return rc;
+}
+
+// Count every row of a table, grouped by topic: in (sign > 0) when seeding msg_stats,
+// out (sign < 0) before the table is dropped. Returns 0 on success, -1 on error.
+static int stats_scan(const char *table, int sign) {
+    char sql[512];
+    snprintf(sql, sizeof(sql),
+        "SELECT %s, count(*), sum(" STATS_ROW_BYTES "), min(m.ulid), max(m.ulid) FROM %s m%s GROUP BY m.%s",
+        topic_dictionary ? "t.name" : "m.topic", table, topic_dictionary ? " JOIN topic t ON t.id = m.topic_id" : "",
+        topic_column);
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(msg_db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to count %s for msg_stats: %s", table, sqlite3_errmsg(msg_db));
+        return -1;
+    }
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        char first[27], last[27];
+        column_ulid_text(stmt, 3, first);
+        column_ulid_text(stmt, 4, last);
+        stats_count((const char *)sqlite3_column_text(stmt, 0), sign * sqlite3_column_int64(stmt, 1),
+                    sign * sqlite3_column_int64(stmt, 2), sign > 0 ? first : NULL, sign > 0 ? last : NULL);
+    }
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to count %s for msg_stats: %s", table, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// min(ulid) or max(ulid) of a table as text, "" if it is empty
+static void stats_table_bound(const char *table, const char *fn, char out[27]) {
+    char sql[128];
+    sqlite3_stmt *stmt = NULL;
+    out[0] = '\0';
+    snprintf(sql, sizeof(sql), "SELECT %s(ulid) FROM %s", fn, table);
+    if (sqlite3_prepare_v2(msg_db, sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW &&
+        sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        column_ulid_text(stmt, 0, out);
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void stats_upsert(const char *prefix, const struct stats_delta *d) {
+    sqlite3_bind_text(stats_upsert_stmt, 1, prefix, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stats_upsert_stmt, 2, d->rows);
+    sqlite3_bind_int64(stats_upsert_stmt, 3, d->bytes);
+    if (d->first[0] != '\0') {
+        sqlite3_bind_text(stats_upsert_stmt, 4, d->first, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stats_upsert_stmt, 5, d->last, -1, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(stats_upsert_stmt, 4);
+        sqlite3_bind_null(stats_upsert_stmt, 5);
+    }
+    if (sqlite3_step(stats_upsert_stmt) != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to update msg_stats for %s: %s", prefix, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(stats_upsert_stmt);
+    
+    if (d->rows < 0) {
+        sqlite3_bind_text(stats_empty_stmt, 1, prefix, -1, SQLITE_STATIC);
+        sqlite3_step(stats_empty_stmt);
+        sqlite3_reset(stats_empty_stmt);
+    }
+}
+
+// Write the collected changes to msg_stats and msg_stats_minute. Runs inside the
+// transaction that made them, just before its COMMIT.
+static void stats_write(void) {
+    if (stats_upsert_stmt == NULL || (stats_dirty_count == 0 && stats_total.rows == 0 && stats_total.bytes == 0 &&
+                                      stats_total.first[0] == '\0')) {
+        stats_reset();
+        return;
+    }
+    for (size_t i = 0; i < stats_dirty_count; i++) {
+        struct stats_delta *d = &stats_deltas[stats_dirty[i]];
+        stats_upsert(d->prefix, d);
+    }
+    stats_upsert(STATS_TOTAL_PREFIX, &stats_total);
+    
+    if (stats_deletes > 0) {
+        // Deletes can remove the oldest or newest row: re-read the exact bounds (one key
+        // lookup per end) and clamp every row's bounds to them
+        char first[27] = "", last[27] = "";
+        int count = partition_mode != PARTITION_NONE ? partition_count : 1;
+        for (int i = 0; i < count && first[0] == '\0'; i++) {
+            stats_table_bound(partition_mode != PARTITION_NONE ? partitions[i]->name : msg_table, "min", first);
+        }
+        for (int i = count - 1; i >= 0 && last[0] == '\0'; i--) {
+            stats_table_bound(partition_mode != PARTITION_NONE ? partitions[i]->name : msg_table, "max", last);
+        }
+        if (first[0] != '\0') {
+            sqlite3_bind_text(stats_bounds_stmt, 1, first, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stats_bounds_stmt, 2, last, -1, SQLITE_STATIC);
+            sqlite3_step(stats_bounds_stmt);
+            sqlite3_reset(stats_bounds_stmt);
+        }
+    }
+    
+    if (stats_inserts > 0 || stats_deletes > 0) {
+        long long minute = (long long)time(NULL) / 60;
+        sqlite3_bind_int64(stats_minute_stmt, 1, minute);
+        sqlite3_bind_int64(stats_minute_stmt, 2, stats_inserts);
+        sqlite3_bind_int64(stats_minute_stmt, 3, stats_deletes);
+        if (sqlite3_step(stats_minute_stmt) != SQLITE_DONE) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to update msg_stats_minute: %s", sqlite3_errmsg(msg_db));
+        }
+        sqlite3_reset(stats_minute_stmt);
+        if (minute != stats_pruned_minute) {
+            char sql[128];
+            snprintf(sql, sizeof(sql), "DELETE FROM msg_stats_minute WHERE minute <= %lld", minute - STATS_MINUTES);
+            sqlite3_exec(msg_db, sql, NULL, 0, NULL);
+            stats_pruned_minute = minute;
+        }
+    }
+    
+    stats_reset();
+    if (stats_delta_count > TOPIC_CACHE_MAX) {
+        stats_clear();
+    }
+}
+
+// Create msg_stats and msg_stats_minute and prepare their statements. A new msg_stats is
+// seeded from the rows already stored, in the transaction that creates it; that costs one
+// scan of every message table, once.
+static void prepare_stats(void) {
+    char *err_msg = NULL;
+    sqlite3_stmt *stmt = NULL;
+    int exists = 0;
+    sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if (sqlite3_prepare_v2(msg_db, "SELECT 1 FROM sqlite_master WHERE name = 'msg_stats' AND type = 'table'",
+                           -1, &stmt, 0) == SQLITE_OK) {
+        exists = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    if (sqlite3_exec(msg_db,
+            "CREATE TABLE IF NOT EXISTS msg_stats ("
+            "prefix TEXT PRIMARY KEY, rows INTEGER NOT NULL DEFAULT 0, bytes INTEGER NOT NULL DEFAULT 0, "
+            "first_ulid TEXT, last_ulid TEXT) WITHOUT ROWID;"
+            "CREATE TABLE IF NOT EXISTS msg_stats_minute ("
+            "minute INTEGER PRIMARY KEY, inserts INTEGER NOT NULL DEFAULT 0, deletes INTEGER NOT NULL DEFAULT 0);",
+            NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg_stats tables: %s", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+        return;
+    }
+    if (sqlite3_prepare_v2(msg_db,
+            "INSERT INTO msg_stats (prefix, rows, bytes, first_ulid, last_ulid) VALUES (?1, ?2, ?3, ?4, ?5) "
+            "ON CONFLICT (prefix) DO UPDATE SET rows = rows + excluded.rows, bytes = bytes + excluded.bytes, "
+            "first_ulid = coalesce(min(first_ulid, excluded.first_ulid), first_ulid, excluded.first_ulid), "
+            "last_ulid = coalesce(max(last_ulid, excluded.last_ulid), last_ulid, excluded.last_ulid)",
+            -1, &stats_upsert_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "DELETE FROM msg_stats WHERE prefix = ?1 AND rows <= 0", -1,
+                           &stats_empty_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db,
+            "UPDATE msg_stats SET first_ulid = max(first_ulid, ?1), last_ulid = min(last_ulid, ?2) "
+            "WHERE first_ulid < ?1 OR last_ulid > ?2", -1, &stats_bounds_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db,
+            "INSERT INTO msg_stats_minute (minute, inserts, deletes) VALUES (?1, ?2, ?3) "
+            "ON CONFLICT (minute) DO UPDATE SET inserts = inserts + excluded.inserts, deletes = deletes + excluded.deletes",
+            -1, &stats_minute_stmt, 0) != SQLITE_OK ||
+        (topic_dictionary &&
+         sqlite3_prepare_v2(msg_db, "SELECT name FROM topic WHERE id = ?1", -1, &topic_name_stmt, 0) != SQLITE_OK)) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare msg_stats statements: %s", sqlite3_errmsg(msg_db));
+        sqlite3_finalize(stats_upsert_stmt);
+        stats_upsert_stmt = NULL;
+        sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+        return;
+    }
+    
+    if (!exists) {
+        int rc = 0;
+        int count = partition_mode != PARTITION_NONE ? partition_count : 1;
+        for (int i = 0; i < count && rc == 0; i++) {
+            rc = stats_scan(partition_mode != PARTITION_NONE ? partitions[i]->name : msg_table, 1);
+        }
+        long long rows = stats_total.rows;
+        stats_inserts = 0;
+        stats_write();
+        mosquitto_log_printf(MOSQ_LOG_INFO, "msg_stats seeded%s from %lld stored messages", shard_label(), rows);
+    }
+    if (sqlite3_exec(msg_db, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg_stats: %s", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+        sqlite3_finalize(stats_upsert_stmt);
+        stats_upsert_stmt = NULL;
+    }
+}
+
+// JSON field extraction (plugin_opt_extract). For topics matching an extract rule the
+// batch worker reads the configured JSON paths from the payload once, before compression,
+// and writes the values to typed columns of msg_fields in the same transaction as the
+// message. msg_fields is keyed by (topic, ulid), so "topic X over the last hour" is a
+// primary key range scan; columns declared with :index get their own index.
+#define JSON_MAX_DEPTH 64
+
+struct extract_value {
+    int type;               // SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT
+    int64_t i;
+    double r;
+    size_t text_offset;     // Into extract_text
+    size_t text_len;
+};
+
+static __thread struct extract_value *extract_values = NULL;  // extract_column_count per row
+static __thread size_t extract_row_count = 0;
+static __thread size_t extract_row_capacity = 0;
+static __thread char *extract_text = NULL;                     // Text values of the batch
+static __thread size_t extract_text_len = 0;
+static __thread size_t extract_text_capacity = 0;
+static __thread sqlite3_stmt *fields_insert_stmt = NULL;
+static __thread sqlite3_stmt *fields_delete_stmt = NULL;      // One row by topic and key
+static __thread sqlite3_stmt *fields_expire_stmt = NULL;      // Oldest rows below a key
+static __thread sqlite3_stmt *fields_row_stmt = NULL;         // One row by key (retention rules)
+
+static const char *json_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// End of the string whose opening quote is at p (just past the closing quote), NULL if unterminated
+static const char *json_string_end(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+// End of the JSON value starting at p, NULL if it is malformed
+static const char *json_skip(const char *p, const char *end, int depth) {
+    if (p >= end || depth > JSON_MAX_DEPTH) {
+        return NULL;
+    }
+    if (*p == '"') {
+        return json_string_end(p, end);
+    }
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p = json_ws(p + 1, end);
+        if (p < end && *p == close) {
+            return p + 1;
+        }
+        for (;;) {
+            if (close == '}') {
+                if (p >= end || *p != '"' || (p = json_string_end(p, end)) == NULL) {
+                    return NULL;
+                }
+                p = json_ws(p, end);
+                if (p >= end || *p != ':') {
+                    return NULL;
+                }
+                p = json_ws(p + 1, end);
+            }
+            if ((p = json_skip(p, end, depth + 1)) == NULL) {
+                return NULL;
+            }
+            p = json_ws(p, end);
+            if (p < end && *p == ',') {
+                p = json_ws(p + 1, end);
+            } else {
+                return p < end && *p == close ? p + 1 : NULL;
+            }
+        }
+    }
+    // Number, true, false or null
+    const char *start = p;
+    while (p < end && strchr(",:]} \t\r\n\"{[", *p) == NULL) {
+        p++;
+    }
+    return p > start ? p : NULL;
+}
+
+// Find the value at path ($, $.a.b, $.a[2].c) in a JSON document. Returns its start and
+// sets *value_end, or returns NULL if the path is absent or the document is malformed.
+static const char *json_find(const char *p, const char *end, const char *path, const char **value_end) {
+    p = json_ws(p, end);
+    for (path++; *path != '\0';) {
+        if (*path == '.') {
+            const char *key = ++path;
+            size_t key_len = strcspn(key, ".[");
+            path += key_len;
+            if (p >= end || *p != '{') {
+                return NULL;
+            }
+            p = json_ws(p + 1, end);
+            const char *found = NULL;
+            while (found == NULL && p < end && *p == '"') {
+                const char *key_end = json_string_end(p, end);
+                if (key_end == NULL) {
+                    return NULL;
+                }
+                int match = (size_t)(key_end - p - 2) == key_len && memcmp(p + 1, key, key_len) == 0;
+                p = json_ws(key_end, end);
+                if (p >= end || *p != ':') {
+                    return NULL;
+                }
+                p = json_ws(p + 1, end);
+                if (match) {
+                    found = p;
+                } else if ((p = json_skip(p, end, 0)) == NULL) {
+                    return NULL;
+                } else if ((p = json_ws(p, end)) < end && *p == ',') {
+                    p = json_ws(p + 1, end);
+                } else {
+                    return NULL;
+                }
+            }
+            if (found == NULL) {
+                return NULL;
+            }
+        } else if (*path == '[') {
+            char *index_end;
+            long index = strtol(path + 1, &index_end, 10);
+            if (index_end == path + 1 || *index_end != ']' || index < 0) {
+                return NULL;
+            }
+            path = index_end + 1;
+            if (p >= end || *p != '[') {
+                return NULL;
+            }
+            p = json_ws(p + 1, end);
+            for (long i = 0; i < index; i++) {
+                if ((p = json_skip(p, end, 0)) == NULL || (p = json_ws(p, end)) >= end || *p != ',') {
+                    return NULL;
+                }
+                p = json_ws(p + 1, end);
+            }
+            if (p >= end || *p == ']') {
+                return NULL;
+            }
+        } else {
+            return NULL;
+        }
+    }
+    *value_end = json_skip(p, end, 0);
+    return *value_end != NULL ? p : NULL;
+}
+
+// Make room for len more bytes of text values. Returns 0 on success.
+static int extract_text_reserve(size_t len) {
+    if (extract_text_len + len <= extract_text_capacity) {
+        return 0;
+    }
+    size_t capacity = extract_text_capacity ? extract_text_capacity : 4096;
+    while (capacity < extract_text_len + len) {
+        capacity *= 2;
+    }
+    char *grown = realloc(extract_text, capacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    extract_text = grown;
+    extract_text_capacity = capacity;
+    return 0;
+}
+
+static int hex_digit(char c) {
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+static long json_hex4(const char *p, const char *end) {
+    long v = 0;
+    for (int i = 0; i < 4; i++) {
+        int d = p + i < end ? hex_digit(p[i]) : -1;
+        if (d < 0) {
+            return -1;
+        }
+        v = v * 16 + d;
+    }
+    return v;
+}
+
+// Append the unescaped contents of the JSON string [p, end) (quotes included) to
+// extract_text. Returns the length appended, or -1 on a bad escape.
+static long json_unescape(const char *p, const char *end) {
+    // Unescaped text is never longer than the escaped form
+    if (extract_text_reserve((size_t)(end - p)) != 0) {
+        return -1;
+    }
+    char *out = extract_text + extract_text_len;
+    char *start = out;
+    for (p++, end--; p < end; p++) {
+        if (*p != '\\') {
+            *out++ = *p;
+            continue;
+        }
+        if (++p >= end) {
+            return -1;
+        }
+        switch (*p) {
+            case '"': case '\\': case '/': *out++ = *p; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                long cp = json_hex4(p + 1, end);
+                p += 4;
+                if (cp >= 0xd800 && cp < 0xdc00 && p + 6 < end && p[1] == '\\' && p[2] == 'u') {
+                    long low = json_hex4(p + 3, end);
+                    if (low >= 0xdc00 && low < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                    }
+                }
+                if (cp < 0 || (cp >= 0xd800 && cp < 0xe000)) {
+                    return -1;
+                }
+                // Six escaped bytes (\uXXXX) become at most four UTF-8 bytes
+                if (cp < 0x80) {
+                    *out++ = (char)cp;
+                } else if (cp < 0x800) {
+                    *out++ = (char)(0xc0 | cp >> 6);
+                    *out++ = (char)(0x80 | (cp & 0x3f));
+                } else if (cp < 0x10000) {
+                    *out++ = (char)(0xe0 | cp >> 12);
+                    *out++ = (char)(0x80 | (cp >> 6 & 0x3f));
+                    *out++ = (char)(0x80 | (cp & 0x3f));
+                } else {
+                    *out++ = (char)(0xf0 | cp >> 18);
+                    *out++ = (char)(0x80 | (cp >> 12 & 0x3f));
+                    *out++ = (char)(0x80 | (cp >> 6 & 0x3f));
+                    *out++ = (char)(0x80 | (cp & 0x3f));
+                }
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+    return out - start;
+}
+
+// Convert the JSON value [p, end) for a column of the given type. Numeric columns take
+// numbers, booleans (1/0) and numeric strings; text columns take strings (unescaped) and
+// the JSON text of anything else. null and values that do not convert stay NULL.
+static void extract_convert(const char *p, const char *end, int type, struct extract_value *v) {
+    size_t len = (size_t)(end - p);
+    if (len == 4 && memcmp(p, "null", 4) == 0) {
+        return;
+    }
+    if (type == EXTRACT_TEXT) {
+        long text_len = -1;
+        if (*p == '"') {
+            text_len = json_unescape(p, end);
+        } else if (extract_text_reserve(len) == 0) {
+            memcpy(extract_text + extract_text_len, p, len);
+            text_len = (long)len;
+        }
+        if (text_len >= 0) {
+            v->type = SQLITE_TEXT;
+            v->text_offset = extract_text_len;
+            v->text_len = (size_t)text_len;
+            extract_text_len += (size_t)text_len;
+        }
+        return;
+    }
+    
+    if (*p == '"') {
+        p++;
+        end--;
+        len -= 2;
+    }
+    char num[64];
+    if (len == 0 || len >= sizeof(num)) {
+        return;
+    }
+    memcpy(num, p, len);
+    num[len] = '\0';
+    char *num_end;
+    if (strcmp(num, "true") == 0 || strcmp(num, "false") == 0) {
+        v->type = type == EXTRACT_INTEGER ? SQLITE_INTEGER : SQLITE_FLOAT;
+        v->i = num[0] == 't';
+        v->r = (double)v->i;
+        return;
+    }
+    if (type == EXTRACT_INTEGER) {
+        errno = 0;
+        long long i = strtoll(num, &num_end, 10);
+        if (*num_end == '\0' && errno == 0) {
+            v->type = SQLITE_INTEGER;
+            v->i = i;
+            return;
+        }
+    }
+    double r = strtod(num, &num_end);
+    // Finite numbers only (r - r is NaN for infinities and NaN)
+    if (*num_end == '\0' && r - r == 0) {
+        v->type = SQLITE_FLOAT;
+        v->r = r;
+    }
+}
+
+// Extract the configured fields of every insert in a batch. Runs before compression,
+// while the payloads are still the published bytes.
+static void extract_batch(struct msg_entry **entries, int batch_count) {
+    if (fields_insert_stmt == NULL) {
+        return;
+    }
+    extract_row_count = 0;
+    extract_text_len = 0;
+    for (int i = 0; i < batch_count; i++) {
+        struct msg_entry *entry = entries[i];
+        entry->extract_row = -1;
+        uint64_t mask = entry->operation == OP_INSERT ? trie_match_fields(extract_rules, entry->topic) : 0;
+        if (mask == 0) {
+            continue;
+        }
+        if (extract_row_count == extract_row_capacity) {
+            size_t capacity = extract_row_capacity ? extract_row_capacity * 2 : 256;
+            struct extract_value *grown = realloc(extract_values,
+                                                  capacity * extract_column_count * sizeof(*grown));
+            if (grown == NULL) {
+                continue;
+            }
+            extract_values = grown;
+            extract_row_capacity = capacity;
+        }
+        
+        struct extract_value *row = &extract_values[extract_row_count * extract_column_count];
+        int found = 0;
+        for (int c = 0; c < extract_column_count; c++) {
+            row[c].type = SQLITE_NULL;
+        }
+        for (int f = 0; f < extract_field_count; f++) {
+            struct extract_value *v = &row[extract_fields[f].column];
+            const char *value_end;
+            const char *value;
+            if (!(mask & (1ULL << f)) || v->type != SQLITE_NULL ||
+                (value = json_find(entry->payload, entry->payload + entry->payload_len, extract_fields[f].path,
+                                   &value_end)) == NULL) {
+                continue;
+            }
+            extract_convert(value, value_end, extract_columns[extract_fields[f].column].type, v);
+            found |= v->type != SQLITE_NULL;
+        }
+        if (found) {
+            entry->extract_row = (int)extract_row_count++;
+        }
+    }
+}
+
+// Write an inserted entry's extracted values to msg_fields
+static void fields_insert(const struct msg_entry *entry) {
+    if (fields_insert_stmt == NULL || entry->extract_row < 0) {
+        return;
+    }
+    const struct extract_value *row = &extract_values[(size_t)entry->extract_row * extract_column_count];
+    sqlite3_bind_text(fields_insert_stmt, 1, entry->topic, -1, SQLITE_STATIC);
+    sqlite3_bind_text(fields_insert_stmt, 2, entry->ulid, -1, SQLITE_STATIC);
+    for (int c = 0; c < extract_column_count; c++) {
+        const struct extract_value *v = &row[c];
+        if (v->type == SQLITE_INTEGER) {
+            sqlite3_bind_int64(fields_insert_stmt, c + 3, v->i);
+        } else if (v->type == SQLITE_FLOAT) {
+            sqlite3_bind_double(fields_insert_stmt, c + 3, v->r);
+        } else if (v->type == SQLITE_TEXT) {
+            sqlite3_bind_text64(fields_insert_stmt, c + 3, extract_text + v->text_offset, v->text_len,
+                                SQLITE_STATIC, SQLITE_UTF8);
+        } else {
+            sqlite3_bind_null(fields_insert_stmt, c + 3);
+        }
+    }
+    if (sqlite3_step(fields_insert_stmt) != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to write msg_fields for topic %s: %s",
+                            entry->topic, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(fields_insert_stmt);
+}
+
+// A message was deleted: drop its msg_fields row
+static void fields_forget(const char *topic, const char *ulid) {
+    unsigned char bin[16];
+    if (fields_delete_stmt == NULL || ulid_decode(bin, ulid) != 0) {
+        return;
+    }
+    char canonical[27];
+    ulid_encode(canonical, bin);
+    sqlite3_bind_text(fields_delete_stmt, 1, topic, -1, SQLITE_STATIC);
+    sqlite3_bind_text(fields_delete_stmt, 2, canonical, -1, SQLITE_STATIC);
+    sqlite3_step(fields_delete_stmt);
+    sqlite3_reset(fields_delete_stmt);
+}
+
+// Delete up to limit msg_fields rows (-1 = all) older than cutoff_ms
+static void fields_expire(unsigned long long cutoff_ms, int limit) {
+    if (fields_expire_stmt == NULL) {
+        return;
+    }
+    char cutoff_prefix[10];
+    ulid_encode_timestamp(cutoff_prefix, cutoff_ms);
+    sqlite3_bind_text(fields_expire_stmt, 1, cutoff_prefix, 10, SQLITE_TRANSIENT);
+    sqlite3_bind_int(fields_expire_stmt, 2, limit);
+    if (sqlite3_step(fields_expire_stmt) != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to expire msg_fields rows: %s", sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(fields_expire_stmt);
+}
+
+static const char *extract_type_name(int type) {
+    return type == EXTRACT_INTEGER ? "INTEGER" : type == EXTRACT_TEXT ? "TEXT" : "REAL";
+}
+
+// Create msg_fields, add the configured columns and indexes it lacks, and prepare its
+// statements. Columns of removed rules are kept (NULL in new rows).
+static void prepare_fields(void) {
+    char *err_msg = NULL;
+    if (sqlite3_exec(msg_db,
+            "CREATE TABLE IF NOT EXISTS msg_fields (topic TEXT NOT NULL, ulid TEXT NOT NULL, "
+            "PRIMARY KEY (topic, ulid)) WITHOUT ROWID;"
+            "CREATE INDEX IF NOT EXISTS idx_msg_fields_ulid ON msg_fields (ulid);",
+            NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg_fields table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+    
+    sqlite3_str *insert = sqlite3_str_new(msg_db);
+    sqlite3_str_appendall(insert, "INSERT OR REPLACE INTO msg_fields (topic, ulid");
+    for (int c = 0; c < extract_column_count; c++) {
+        const struct extract_column *col = &extract_columns[c];
+        sqlite3_stmt *stmt = NULL;
+        const char *declared = NULL;
+        if (sqlite3_prepare_v2(msg_db, "SELECT type FROM pragma_table_info('msg_fields') WHERE name = ?1 COLLATE NOCASE",
+                               -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, col->name, -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                declared = (const char *)sqlite3_column_text(stmt, 0);
+                if (declared != NULL && sqlite3_stricmp(declared, extract_type_name(col->type)) != 0) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "msg_fields column %s is %s, not %s; values keep its affinity",
+                                        col->name, declared, extract_type_name(col->type));
+                }
+            }
+        }
+        char sql[256];
+        int rc = SQLITE_OK;
+        if (declared == NULL) {
+            snprintf(sql, sizeof(sql), "ALTER TABLE msg_fields ADD COLUMN %s %s", col->name, extract_type_name(col->type));
+            rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
+        }
+        sqlite3_finalize(stmt);
+        if (rc == SQLITE_OK && col->indexed) {
+            snprintf(sql, sizeof(sql), "CREATE INDEX IF NOT EXISTS idx_msg_fields_%s ON msg_fields (%s) WHERE %s IS NOT NULL",
+                     col->name, col->name, col->name);
+            rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
+        }
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to add msg_fields column %s: %s", col->name, err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_free(sqlite3_str_finish(insert));
+            return;
+        }
+        sqlite3_str_appendf(insert, ", %s", col->name);
+    }
+    sqlite3_str_appendall(insert, ") VALUES (?1, ?2");
+    for (int c = 0; c < extract_column_count; c++) {
+        sqlite3_str_appendf(insert, ", ?%d", c + 3);
+    }
+    sqlite3_str_appendall(insert, ")");
+    char *insert_sql = sqlite3_str_finish(insert);
+    
+    if (insert_sql == NULL ||
+        sqlite3_prepare_v2(msg_db, insert_sql, -1, &fields_insert_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "DELETE FROM msg_fields WHERE topic = ?1 AND ulid = ?2", -1,
+                           &fields_delete_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db,
+            "DELETE FROM msg_fields WHERE ulid IN (SELECT ulid FROM msg_fields WHERE ulid < ?1 ORDER BY ulid LIMIT ?2)",
+            -1, &fields_expire_stmt, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "DELETE FROM msg_fields WHERE ulid = ?1", -1, &fields_row_stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare msg_fields statements: %s", sqlite3_errmsg(msg_db));
+        sqlite3_finalize(fields_insert_stmt);
+        fields_insert_stmt = NULL;
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "msg_fields ready%s: %d columns", shard_label(), extract_column_count);
+    }
+    sqlite3_free(insert_sql);
+}
+
+static void fields_cleanup(void) {
+    sqlite3_finalize(fields_insert_stmt);
+    sqlite3_finalize(fields_delete_stmt);
+    sqlite3_finalize(fields_expire_stmt);
+    sqlite3_finalize(fields_row_stmt);
+    fields_insert_stmt = fields_delete_stmt = fields_expire_stmt = fields_row_stmt = NULL;
+    free(extract_values);
+    free(extract_text);
+    extract_values = NULL;
+    extract_text = NULL;
+    extract_row_count = extract_row_capacity = 0;
+    extract_text_len = extract_text_capacity = 0;
+}
+
+// Bind one row of an insert statement, starting at parameter base + 1.
+// Returns SQLITE_OK, or the bind_topic error if the topic has no id.
+static int bind_insert_row(sqlite3_stmt *stmt, int base, const struct msg_entry *entry) {
+    bind_ulid(stmt, base + 1, entry->ulid);
+    int rc = bind_topic(stmt, base + 2, entry->topic, 1);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    bind_payload(stmt, base + 3, entry);
+    sqlite3_bind_int(stmt, base + 4, entry->retain);
+    sqlite3_bind_int(stmt, base + 5, entry->qos);
+    bind_headers(stmt, base + 6, entry);
+    if (insert_columns > 6) {
+        bind_codec(stmt, base + 7, entry);
+    }
+    return SQLITE_OK;
+}
+
+// Insert entries one statement execution at a time. Returns the number of rows inserted.
+static int insert_rows(struct msg_entry **entries, int count) {
+    int inserted = 0;
+    if (insert_stmt == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        struct msg_entry *entry = entries[i];
+        if (bind_insert_row(insert_stmt, 0, entry) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Batch insert failed for topic %s: no topic id", entry->topic);
+            atomic_fetch_add_explicit(&metrics.insert_errors, 1, memory_order_relaxed);
+            sqlite3_reset(insert_stmt);
+            continue;
+        }
+        
+        int rc = sqlite3_step(insert_stmt);
+        if (rc == SQLITE_DONE) {
+            inserted++;
+            stats_insert(entry);
+            fields_insert(entry);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Batch insert failed for topic %s: %s", 
+                               entry->topic, sqlite3_errmsg(msg_db));
+            atomic_fetch_add_explicit(&metrics.insert_errors, 1, memory_order_relaxed);
+        }
+        sqlite3_reset(insert_stmt);
+    }
+    return inserted;
+}
+
+// Insert a run of entries, using the cached multi-row statements for full chunks.
+// A chunk that fails as a whole is retried row by row, so only the bad rows are lost
+// and each failure is logged. Returns the number of rows inserted.
+static int insert_entries(struct msg_entry **entries, int count) {
+    int inserted = 0;
+    int i = 0;
+    
+    for (int c = 0; bulk_insert && c < INSERT_CHUNK_COUNT; c++) {
+        sqlite3_stmt *stmt = insert_chunk_stmts[c];
+        int rows = insert_chunk_rows[c];
+        if (stmt == NULL) {
+            continue;
+        }
+        while (count - i >= rows) {
+            int rc = SQLITE_OK;
+            for (int r = 0; r < rows && rc == SQLITE_OK; r++) {
+                rc = bind_insert_row(stmt, r * insert_columns, entries[i + r]);
+            }
+            if (rc == SQLITE_OK) {
+                rc = sqlite3_step(stmt);
+            }
+            sqlite3_reset(stmt);
+            
+            if (rc == SQLITE_DONE) {
+                inserted += rows;
+                for (int r = 0; r < rows; r++) {
+                    stats_insert(entries[i + r]);
+                    fields_insert(entries[i + r]);
+                }
+            } else {
+                inserted += insert_rows(&entries[i], rows);
+            }
+            i += rows;
+        }
+    }
+    
+    return inserted + insert_rows(&entries[i], count - i);
+}
+
+// Prepare the cached multi-row insert statements for a table
+static void prepare_insert_chunks(const char *table, sqlite3_stmt **stmts) {
+    for (int c = 0; c < INSERT_CHUNK_COUNT; c++) {
+        sqlite3_str *sql = sqlite3_str_new(msg_db);
+        sqlite3_str_appendf(sql, "insert into %s (ulid, %s, payload, retain, qos, headers%s) values ",
+                            table, topic_column, insert_columns > 6 ? ", codec" : "");
+        for (int r = 0; r < insert_chunk_rows[c]; r++) {
+            sqlite3_str_appendall(sql, r == 0 ? "(?,?,?,?,?,?" : ",(?,?,?,?,?,?");
+            sqlite3_str_appendall(sql, insert_columns > 6 ? ",?)" : ")");
+        }
+        char *stmt_sql = sqlite3_str_finish(sql);
+        if (stmt_sql == NULL ||
+            sqlite3_prepare_v3(msg_db, stmt_sql, -1, SQLITE_PREPARE_PERSISTENT, &stmts[c], 0) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to prepare %d-row insert statement: %s",
+                                insert_chunk_rows[c], sqlite3_errmsg(msg_db));
+            stmts[c] = NULL;
+        }
+        sqlite3_free(stmt_sql);
+    }
+}
+
+// Millisecond timestamp of a text ULID, or 0 if it is not a valid ULID
+static unsigned long long ulid_timestamp_ms(const char *ulid) {
+    unsigned char bin[16];
+    if (ulid_decode(bin, ulid) != 0) {
+        return 0;
+    }
+    unsigned long long ts = 0;
+    for (int i = 0; i < 6; i++) {
+        ts = (ts << 8) | bin[i];
+    }
+    return ts;
+}
+
+// Rollups (plugin_opt_rollup). The batch worker keeps each matching topic's open 1-minute
+// and 1-hour bucket in memory and writes a bucket to msg_rollup_1m/msg_rollup_1h once it
+// is closed: when the topic's first value of a later bucket arrives, or by the clock
+// (ROLLUP_GRACE_SEC after its end) for a topic that went quiet. Writes merge into an
+// existing row, so late values, restarts and the open buckets written at shutdown add up.
+#define ROLLUP_GRACE_SEC 5
+
+struct rollup_bucket {
+    long long start;    // Unix time of the bucket start
+    long long count;    // 0 = no bucket open
+    double min;
+    double max;
+    double sum;
+    double last;
+    unsigned long long last_ms;     // Timestamp of the newest value (from its ULID)
+};
+
+struct rollup_state {
+    const char *topic;  // Key in rollup_map
+    struct rollup_bucket open[ROLLUP_LEVELS];
+};
+
+struct rollup_closed {
+    const char *topic;
+    int level;
+    struct rollup_bucket bucket;
+};
+
+// Open buckets of a topic before the current batch added to them
+struct rollup_undo {
+    size_t state;       // Index into rollup_states
+    struct rollup_bucket open[ROLLUP_LEVELS];
+};
+
+static __thread struct topic_map rollup_map;           // Topic -> index into rollup_states
+static __thread struct rollup_state *rollup_states = NULL;
+static __thread size_t rollup_state_count = 0;
+static __thread size_t rollup_state_capacity = 0;
+static __thread struct rollup_closed *rollup_pending = NULL;   // Closed buckets not yet committed
+static __thread size_t rollup_pending_count = 0;
+static __thread size_t rollup_pending_capacity = 0;
+static __thread struct rollup_undo *rollup_undo_log = NULL;    // Undo log of the current batch
+static __thread size_t rollup_undo_count = 0;
+static __thread size_t rollup_undo_capacity = 0;
+static __thread size_t rollup_undo_pending = 0;                 // rollup_pending_count before the batch
+static __thread long long rollup_swept_minute = 0;
+static __thread time_t rollup_last_expire = 0;
+static __thread sqlite3_stmt *rollup_upsert_stmts[ROLLUP_LEVELS];
+static __thread sqlite3_stmt *rollup_expire_stmts[ROLLUP_LEVELS];
+
+// Queue a closed bucket for the next write transaction
+static void rollup_push(const char *topic, int level, const struct rollup_bucket *bucket) {
+    if (rollup_pending_count == rollup_pending_capacity) {
+        size_t capacity = rollup_pending_capacity ? rollup_pending_capacity * 2 : 256;
+        struct rollup_closed *grown = realloc(rollup_pending, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Dropping %s bucket of topic %s: out of memory",
+                                rollup_tables[level], topic);
+            return;
+        }
+        rollup_pending = grown;
+        rollup_pending_capacity = capacity;
+    }
+    struct rollup_closed *c = &rollup_pending[rollup_pending_count++];
+    c->topic = topic;
+    c->level = level;
+    c->bucket = *bucket;
+}
+
+static struct rollup_state *rollup_state_for(const char *topic) {
+    int64_t *index = topic_map_get(&rollup_map, topic);
+    if (index != NULL) {
+        return &rollup_states[*index];
+    }
+    if (rollup_state_count == rollup_state_capacity) {
+        size_t capacity = rollup_state_capacity ? rollup_state_capacity * 2 : 64;
+        struct rollup_state *grown = realloc(rollup_states, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        rollup_states = grown;
+        rollup_state_capacity = capacity;
+    }
+    if (topic_map_put(&rollup_map, topic, (int64_t)rollup_state_count) != 0) {
+        return NULL;
+    }
+    struct rollup_state *state = &rollup_states[rollup_state_count++];
+    memset(state, 0, sizeof(*state));
+    state->topic = topic_map_slot(&rollup_map, topic, hash_string(topic))->key;
+    return state;
+}
+
+static void rollup_bucket_add(struct rollup_bucket *b, long long start, unsigned long long ts_ms, double value) {
+    if (b->count == 0) {
+        b->start = start;
+        b->min = b->max = value;
+        b->sum = 0;
+        b->last_ms = 0;
+    }
+    b->count++;
+    b->sum += value;
+    if (value < b->min) {
+        b->min = value;
+    }
+    if (value > b->max) {
+        b->max = value;
+    }
+    if (ts_ms >= b->last_ms) {
+        b->last = value;
+        b->last_ms = ts_ms;
+    }
+}
+
+// Record a topic's open buckets before the batch changes them. Returns 0 on success.
+static int rollup_undo_push(const struct rollup_state *state) {
+    if (rollup_undo_count == rollup_undo_capacity) {
+        size_t capacity = rollup_undo_capacity ? rollup_undo_capacity * 2 : 256;
+        struct rollup_undo *grown = realloc(rollup_undo_log, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        rollup_undo_log = grown;
+        rollup_undo_capacity = capacity;
+    }
+    struct rollup_undo *u = &rollup_undo_log[rollup_undo_count++];
+    u->state = (size_t)(state - rollup_states);
+    memcpy(u->open, state->open, sizeof(u->open));
+    return 0;
+}
+
+// Add one value of a topic, published at ts_ms, to its open buckets
+static void rollup_add(const char *topic, unsigned long long ts_ms, double value) {
+    struct rollup_state *state = rollup_state_for(topic);
+    if (state == NULL || rollup_undo_push(state) != 0) {
+        return;
+    }
+    long long ts = (long long)(ts_ms / 1000);
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        struct rollup_bucket *b = &state->open[level];
+        long long start = ts - ts % rollup_widths[level];
+        if (b->count > 0 && start < b->start) {
+            // Late value for a bucket that is already closed: written on its own, merged
+            struct rollup_bucket late = { 0 };
+            rollup_bucket_add(&late, start, ts_ms, value);
+            rollup_push(state->topic, level, &late);
+            continue;
+        }
+        if (b->count > 0 && start > b->start) {
+            rollup_push(state->topic, level, b);
+            b->count = 0;
+        }
+        rollup_bucket_add(b, start, ts_ms, value);
+    }
+}
+
+// Add the numeric values of a batch's inserts to their topics' buckets. Runs before
+// compression, while the payloads are still the published bytes. The changes can be
+// undone with rollup_batch_undo until the next batch.
+static void rollup_batch(struct msg_entry **entries, int batch_count) {
+    if (rollup_upsert_stmts[0] == NULL) {
+        return;
+    }
+    rollup_undo_count = 0;
+    rollup_undo_pending = rollup_pending_count;
+    for (int i = 0; i < batch_count; i++) {
+        struct msg_entry *entry = entries[i];
+        uint64_t mask = entry->operation == OP_INSERT ? trie_match_fields(rollup_rules, entry->topic) : 0;
+        for (int r = 0; mask != 0 && r < rollup_rule_count; r++) {
+            if (!(mask & (1ULL << r))) {
+                continue;
+            }
+            struct extract_value v = { .type = SQLITE_NULL };
+            const char *value_end;
+            const char *value = json_find(entry->payload, entry->payload + entry->payload_len, rollup_paths[r],
+                                          &value_end);
+            if (value != NULL) {
+                extract_convert(value, value_end, EXTRACT_REAL, &v);
+            }
+            if (v.type == SQLITE_FLOAT) {
+                rollup_add(entry->topic, ulid_timestamp_ms(entry->ulid), v.r);
+                break;
+            }
+        }
+    }
+}
+
+// Take back the values of a batch whose transaction was rolled back, so that storing its
+// messages again does not count them twice: restore the open buckets in reverse order and
+// forget the buckets it closed. Buckets queued before the batch stay queued.
+static void rollup_batch_undo(void) {
+    if (rollup_upsert_stmts[0] == NULL) {
+        return;
+    }
+    while (rollup_undo_count > 0) {
+        const struct rollup_undo *u = &rollup_undo_log[--rollup_undo_count];
+        memcpy(rollup_states[u->state].open, u->open, sizeof(u->open));
+    }
+    if (rollup_pending_count > rollup_undo_pending) {
+        rollup_pending_count = rollup_undo_pending;
+    }
+}
+
+// Close the buckets that ended ROLLUP_GRACE_SEC or more ago (all of them if final).
+// Buckets are checked once per minute.
+static void rollup_sweep(time_t now, int final) {
+    long long minute = ((long long)now - ROLLUP_GRACE_SEC) / 60;
+    if (!final && minute == rollup_swept_minute) {
+        return;
+    }
+    rollup_swept_minute = minute;
+    for (size_t i = 0; i < rollup_state_count; i++) {
+        struct rollup_state *state = &rollup_states[i];
+        for (int level = 0; level < ROLLUP_LEVELS; level++) {
+            struct rollup_bucket *b = &state->open[level];
+            if (b->count > 0 && (final || b->start + rollup_widths[level] <= (long long)now - ROLLUP_GRACE_SEC)) {
+                rollup_push(state->topic, level, b);
+                b->count = 0;
+            }
+        }
+    }
+}
+
+// Write the closed buckets in the current transaction. They stay queued until the
+// COMMIT succeeds.
+static void rollup_write(void) {
+    for (size_t i = 0; i < rollup_pending_count; i++) {
+        const struct rollup_closed *c = &rollup_pending[i];
+        sqlite3_stmt *stmt = rollup_upsert_stmts[c->level];
+        sqlite3_bind_text(stmt, 1, c->topic, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, c->bucket.start);
+        sqlite3_bind_int64(stmt, 3, c->bucket.count);
+        sqlite3_bind_double(stmt, 4, c->bucket.min);
+        sqlite3_bind_double(stmt, 5, c->bucket.max);
+        sqlite3_bind_double(stmt, 6, c->bucket.sum / (double)c->bucket.count);
+        sqlite3_bind_double(stmt, 7, c->bucket.last);
+        sqlite3_bind_int64(stmt, 8, (sqlite3_int64)c->bucket.last_ms);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to write %s for topic %s: %s",
+                                rollup_tables[c->level], c->topic, sqlite3_errmsg(msg_db));
+        }
+        sqlite3_reset(stmt);
+    }
+}
+
+// Worker cycle: close ended buckets, expire old rollup rows every retention_interval_sec,
+// and write both in their own transaction (final: at shutdown, all open buckets too)
+static void rollup_maintain(int final) {
+    if (rollup_upsert_stmts[0] == NULL) {
+        return;
+    }
+    time_t now = time(NULL);
+    rollup_sweep(now, final);
+    int expire = !final && now - rollup_last_expire >= retention_interval_sec &&
+                 (rollup_retention_days[0] > 0 || rollup_retention_days[1] > 0);
+    if (rollup_pending_count == 0 && !expire) {
+        return;
+    }
+    
+    sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    rollup_write();
+    for (int level = 0; expire && level < ROLLUP_LEVELS; level++) {
+        if (rollup_retention_days[level] > 0) {
+            sqlite3_bind_int64(rollup_expire_stmts[level], 1, (long long)now - rollup_retention_days[level] * 86400LL);
+            if (sqlite3_step(rollup_expire_stmts[level]) != SQLITE_DONE) {
+                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to expire %s: %s", rollup_tables[level], sqlite3_errmsg(msg_db));
+            }
+            sqlite3_reset(rollup_expire_stmts[level]);
+        }
+    }
+    if (expire) {
+        rollup_last_expire = now;
+    }
+    if (sqlite3_exec(msg_db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK) {
+        rollup_pending_count = 0;
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Rollup commit failed: %s", sqlite3_errmsg(msg_db));
+        sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+    }
+}
+
+// Create the rollup tables and prepare their statements
+static void prepare_rollups(void) {
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        const char *table = rollup_tables[level];
+        char sql[1024];
+        char *err_msg = NULL;
+        snprintf(sql, sizeof(sql),
+            "CREATE TABLE IF NOT EXISTS %s (topic TEXT NOT NULL, bucket INTEGER NOT NULL, "
+            "count INTEGER NOT NULL, min REAL NOT NULL, max REAL NOT NULL, avg REAL NOT NULL, "
+            "last REAL NOT NULL, last_ms INTEGER NOT NULL, PRIMARY KEY (topic, bucket)) WITHOUT ROWID;"
+            "CREATE INDEX IF NOT EXISTS idx_%s_bucket ON %s (bucket);",
+            table, table, table);
+        if (sqlite3_exec(msg_db, sql, NULL, 0, &err_msg) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create %s table: %s", table, err_msg);
+            sqlite3_free(err_msg);
+            break;
+        }
+        snprintf(sql, sizeof(sql),
+            "INSERT INTO %s (topic, bucket, count, min, max, avg, last, last_ms) "
+            "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8) ON CONFLICT (topic, bucket) DO UPDATE SET "
+            "count = count + excluded.count, min = min(min, excluded.min), max = max(max, excluded.max), "
+            "avg = (avg * count + excluded.avg * excluded.count) / (count + excluded.count), "
+            "last = CASE WHEN excluded.last_ms >= last_ms THEN excluded.last ELSE last END, "
+            "last_ms = max(last_ms, excluded.last_ms)",
+            table);
+        if (sqlite3_prepare_v2(msg_db, sql, -1, &rollup_upsert_stmts[level], 0) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare %s upsert: %s", table, sqlite3_errmsg(msg_db));
+            break;
+        }
+        snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE bucket < ?1", table);
+        if (sqlite3_prepare_v2(msg_db, sql, -1, &rollup_expire_stmts[level], 0) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare %s expiry: %s", table, sqlite3_errmsg(msg_db));
+            break;
+        }
+    }
+    if (rollup_upsert_stmts[ROLLUP_LEVELS - 1] == NULL || rollup_expire_stmts[ROLLUP_LEVELS - 1] == NULL) {
+        // All levels or none, so the worker can test rollup_upsert_stmts[0]
+        for (int level = 0; level < ROLLUP_LEVELS; level++) {
+            sqlite3_finalize(rollup_upsert_stmts[level]);
+            sqlite3_finalize(rollup_expire_stmts[level]);
+            rollup_upsert_stmts[level] = rollup_expire_stmts[level] = NULL;
+        }
+        return;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Rollups enabled%s: %d rules, keeping 1m buckets %d days and 1h buckets %d days (0 = forever)",
+                        shard_label(), rollup_rule_count, rollup_retention_days[0], rollup_retention_days[1]);
+}
+
+static void rollup_cleanup(void) {
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        sqlite3_finalize(rollup_upsert_stmts[level]);
+        sqlite3_finalize(rollup_expire_stmts[level]);
+        rollup_upsert_stmts[level] = rollup_expire_stmts[level] = NULL;
+    }
+    topic_map_clear(&rollup_map);
+    free(rollup_states);
+    free(rollup_pending);
+    free(rollup_undo_log);
+    rollup_states = NULL;
+    rollup_pending = NULL;
+    rollup_undo_log = NULL;
+    rollup_state_count = rollup_state_capacity = 0;
+    rollup_pending_count = rollup_pending_capacity = 0;
+    rollup_undo_count = rollup_undo_capacity = rollup_undo_pending = 0;
+}
+
+static double clamp_double(double v, double lo, double hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void batch_controller_init(void) {
+    memset(&batch_ctl, 0, sizeof(batch_ctl));
+    batch_ctl.interval_ms = flush_interval_ms;
+    batch_ctl.last_flush_us = platform_utime(0);
+    batch_ctl.last_report = time(NULL);
+    atomic_store(&shard_self->effective_batch, batch_size);
+}
+
+// Flush interval the worker should wait for the next batch
+static int batch_controller_interval(void) {
+    return adaptive_batch ? (int)batch_ctl.interval_ms : flush_interval_ms;
+}
+
+// Feed one flush cycle into the controller: rows written, BEGIN..COMMIT duration and the
+// persistence delay of the oldest row. The interval is cut multiplicatively when the
+// delay misses the target and grows additively otherwise (capped so that waiting plus
+// committing stays within the target); the flush threshold follows the arrival rate so
+// a size-triggered flush happens about when the interval would have expired.
+static void batch_controller_update(int rows, double commit_ms, double delay_ms) {
+    struct batch_controller *c = &batch_ctl;
+    unsigned long long now_us = platform_utime(0);
+    double elapsed_ms = (now_us - c->last_flush_us) / 1000.0;
+    c->last_flush_us = now_us;
+    
+    c->rate_per_ms = 0.8 * c->rate_per_ms + 0.2 * (rows / (elapsed_ms > 1.0 ? elapsed_ms : 1.0));
+    if (rows > 0) {
+        c->commit_ms = 0.8 * c->commit_ms + 0.2 * commit_ms;
+        int b = 0;
+        while (b < DELAY_BUCKETS - 1 && delay_ms > delay_bucket_ms[b]) {
+            b++;
+        }
+        c->delays[b]++;
+        c->batches++;
+        c->rows += rows;
+    }
+    
+    if (adaptive_batch) {
+        if (rows > 0 && delay_ms > target_latency_ms) {
+            c->interval_ms *= 0.5;
+        } else {
+            c->interval_ms += c->interval_ms / 8 > 1.0 ? c->interval_ms / 8 : 1.0;
+        }
+        double max_interval = flush_interval_ms;
+        if (target_latency_ms - c->commit_ms < max_interval) {
+            max_interval = target_latency_ms - c->commit_ms;
+        }
+        c->interval_ms = clamp_double(c->interval_ms, flush_interval_min_ms,
+                                      max_interval > flush_interval_min_ms ? max_interval : flush_interval_min_ms);
+        
+        double threshold = clamp_double(c->rate_per_ms * c->interval_ms, batch_size_min, batch_size);
+        atomic_store_explicit(&shard_self->effective_batch, (int)threshold, memory_order_relaxed);
+    }
+}
+
+// Delay percentile (bucket upper bound in ms, -1 for the unbounded bucket)
+static int batch_delay_percentile(const unsigned long long *delays, unsigned long long total, double pct) {
+    unsigned long long rank = (unsigned long long)(total * pct / 100.0);
+    unsigned long long seen = 0;
+    for (int b = 0; b < DELAY_BUCKETS - 1; b++) {
+        seen += delays[b];
+        if (seen > rank) {
+            return delay_bucket_ms[b];
+        }
+    }
+    return -1;
+}
+
+// Log controller state and the persistence delay distribution once per report interval
+static void log_batch_controller(int force) {
+    struct batch_controller *c = &batch_ctl;
+    time_t now = time(NULL);
+    if ((!force && now - c->last_report < BATCH_REPORT_INTERVAL_SEC) || c->batches == 0) {
+        return;
+    }
+    
+    int p50 = batch_delay_percentile(c->delays, c->batches, 50);
+    int p99 = batch_delay_percentile(c->delays, c->batches, 99);
+    char p99_buf[16];
+    snprintf(p99_buf, sizeof(p99_buf), p99 < 0 ? ">%d" : "<=%d", p99 < 0 ? delay_bucket_ms[DELAY_BUCKETS - 2] : p99);
+    mosquitto_log_printf(MOSQ_LOG_INFO,
+        "Batching%s: %llu rows in %llu batches, threshold=%d interval=%.0fms rate=%.0f/s commit=%.1fms, "
+        "max delay p50<=%dms p99%sms (target %dms)",
+        shard_label(), c->rows, c->batches, atomic_load(&shard_self->effective_batch), adaptive_batch ? c->interval_ms : flush_interval_ms,
+        c->rate_per_ms * 1000.0, c->commit_ms, p50 < 0 ? delay_bucket_ms[DELAY_BUCKETS - 2] : p50, p99_buf,
+        target_latency_ms);
+    
+    memset(c->delays, 0, sizeof(c->delays));
+    c->batches = 0;
+    c->rows = 0;
+    c->last_report = now;
+}
+
+static int metric_hist_bucket(unsigned long long value) {
+    if (value >= 1ULL << METRIC_HIST_MAX_BITS) {
+        return METRIC_HIST_BUCKETS - 1;
+    }
+    if (value < 1ULL << METRIC_HIST_SUB_BITS) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - METRIC_HIST_SUB_BITS;
+    return ((shift + 1) << METRIC_HIST_SUB_BITS) + (int)((value >> shift) & ((1u << METRIC_HIST_SUB_BITS) - 1));
+}
+
+// Largest value counted in a bucket
+static unsigned long long metric_hist_upper(int bucket) {
+    if (bucket < 1 << METRIC_HIST_SUB_BITS) {
+        return (unsigned long long)bucket;
+    }
+    int shift = (bucket >> METRIC_HIST_SUB_BITS) - 1;
+    unsigned long long base = (1ULL << METRIC_HIST_SUB_BITS) + (bucket & ((1u << METRIC_HIST_SUB_BITS) - 1));
+    return ((base + 1) << shift) - 1;
+}
+
+static void metric_hist_record(struct metric_histogram *h, unsigned long long value) {
+    atomic_fetch_add_explicit(&h->counts[metric_hist_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+static struct coalesce_slot *coalesce_slot(struct msg_entry **entries, size_t mask, const char *topic) {
+    uint64_t hash = hash_string(topic);
+    size_t i = hash & mask;
+    while (coalesce_slots[i].first >= 0) {
+        if (coalesce_slots[i].hash == hash && strcmp(entries[coalesce_slots[i].first]->topic, topic) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    if (coalesce_slots[i].first < 0) {
+        coalesce_slots[i].hash = hash;
+        coalesce_slots[i].latest = -1;
+    }
+    return &coalesce_slots[i];
+}
+
+// Newest insert at or before index that has not been cancelled
+static int coalesce_live(struct msg_entry **entries, int index) {
+    while (index >= 0 && entries[index]->operation == OP_CANCELLED) {
+        index = coalesce_prev[index];
+    }
+    return index;
+}
+
+// Cancel deletes whose row is still in this batch together with the insert they delete.
+// Entries are in arrival order and ULIDs increase with arrival, so the newest live insert
+// for a topic in the batch is also the topic's latest row once the batch is written.
+// Returns the number of insert/delete pairs removed.
+static int coalesce_batch(struct msg_entry **entries, int batch_count) {
+    if (coalesce_slots == NULL) {
+        return 0;
+    }
+    
+    size_t slots = 2;
+    while (slots < (size_t)batch_count * 2) {
+        slots <<= 1;
+    }
+    size_t mask = slots - 1;
+    for (size_t i = 0; i < slots; i++) {
+        coalesce_slots[i].first = -1;
+    }
+    
+    int pairs = 0;
+    for (int i = 0; i < batch_count; i++) {
+        struct msg_entry *entry = entries[i];
+        struct coalesce_slot *slot = coalesce_slot(entries, mask, entry->topic);
+        if (slot->first < 0) {
+            slot->first = i;
+        }
+        
+        if (entry->operation == OP_INSERT) {
+            coalesce_prev[i] = slot->latest;
+            slot->latest = i;
+            continue;
+        }
+        
+        slot->latest = coalesce_live(entries, slot->latest);
+        int match = slot->latest;
+        if (entry->operation == OP_DELETE) {
+            while (match >= 0 && strcasecmp(entries[match]->ulid, entry->ulid) != 0) {
+                match = coalesce_live(entries, coalesce_prev[match]);
+            }
+        }
+        if (match < 0) {
+            continue;
+        }
+        
+        LOG_DEBUG("Coalesced insert and delete for topic: %s (ulid: %s)", entry->topic, entries[match]->ulid);
+        entries[match]->operation = OP_CANCELLED;
+        entry->operation = OP_CANCELLED;
+        pairs++;
+    }
+    return pairs;
+}
+
+// Newest live insert of each topic in a batch coalesced by coalesce_batch.
+// Returns the number of entries stored in out.
+static int coalesce_latest(struct msg_entry **entries, int batch_count, struct msg_entry **out) {
+    int count = 0;
+    if (coalesce_slots == NULL) {
+        for (int i = 0; i < batch_count; i++) {
+            if (entries[i]->operation == OP_INSERT) {
+                out[count++] = entries[i];
+            }
+        }
+        return count;
+    }
+    
+    size_t slots = 2;
+    while (slots < (size_t)batch_count * 2) {
+        slots <<= 1;
+    }
+    for (size_t i = 0; i < slots; i++) {
+        if (coalesce_slots[i].first < 0) {
+            continue;
+        }
+        int live = coalesce_live(entries, coalesce_slots[i].latest);
+        if (live >= 0) {
+            out[count++] = entries[live];
+        }
+    }
+    return count;
+}
+
+static void latest_forget_payload(struct latest_topic *t) {
+    free(t->payload);
+    t->payload = NULL;
+    t->payload_len = 0;
+    t->payload_hash = 0;
+}
+
+// store_on_change: cancel inserts whose payload equals the last one stored for their
+// topic, unless the topic's heartbeat has passed since. The hash only rules out changes
+// quickly; a payload counts as unchanged once its bytes match the stored copy. Runs in
+// batch order, so repeats within a batch are skipped too; a delete of the topic forgets
+// its payload, so the next insert is stored. Returns the number of inserts skipped.
+static int skip_unchanged(struct msg_entry **entries, int batch_count) {
+    if (change_rules == NULL) {
+        return 0;
+    }
+    int skipped = 0;
+    for (int i = 0; i < batch_count; i++) {
+        struct msg_entry *entry = entries[i];
+        if (entry->operation == OP_DELETE || entry->operation == OP_DELETE_FALLBACK) {
+            struct latest_topic *t = latest_topic_for(entry->topic, 0);
+            if (t != NULL) {
+                latest_forget_payload(t);
+            }
+            continue;
+        }
+        int heartbeat_min = entry->operation == OP_INSERT ? trie_match_change(change_rules, entry->topic) : -1;
+        struct latest_topic *t = heartbeat_min >= 0 ? latest_topic_for(entry->topic, 1) : NULL;
+        if (t == NULL) {
+            continue;
+        }
+        uint64_t hash = hash_bytes(entry->payload, entry->payload_len);
+        unsigned long long ts_ms = ulid_timestamp_ms(entry->ulid);
+        if (t->payload != NULL && t->payload_hash == hash && t->payload_len == entry->payload_len &&
+            (entry->payload_len == 0 || memcmp(t->payload, entry->payload, entry->payload_len) == 0) &&
+            (heartbeat_min == INT_MAX || ts_ms < t->stored_ms + (unsigned long long)heartbeat_min * 60000ULL)) {
+            entry->operation = OP_CANCELLED;
+            skipped++;
+            continue;
+        }
+        latest_forget_payload(t);
+        if (entry->payload_len <= CHANGE_PAYLOAD_MAX) {
+            t->payload = malloc(entry->payload_len ? entry->payload_len : 1);
+            if (t->payload != NULL) {
+                memcpy(t->payload, entry->payload, entry->payload_len);
+                t->payload_len = entry->payload_len;
+                t->payload_hash = hash;
+            }
+        }
+        t->stored_ms = ts_ms;
+    }
+    return skipped;
+}
+
+#ifdef WITH_ZSTD
+// Per-prefix compression dictionary. Until a dictionary is trained the slot collects
+// payload samples and its topics are compressed without one.
+struct compression_dict {
+    char *prefix;
+    size_t prefix_len;
+    ZSTD_CDict *cdict;      // NULL until trained or loaded
+    char *samples;          // Concatenated training samples
+    size_t *sample_sizes;
+    size_t samples_len;
+    size_t samples_capacity;
+    int sample_count;
+};
+
+// Dictionaries needed to read rows back, by id (all stored dictionaries)
+struct compression_ddict {
+    unsigned id;
+    ZSTD_DDict *ddict;
+};
+
+// Per shard: every database trains and stores its own dictionaries
+static __thread struct compression_dict compression_dicts[MAX_COMPRESSION_DICTS];
+static __thread int compression_dict_count = 0;
+static __thread struct compression_ddict *compression_ddicts = NULL;
+static __thread int compression_ddict_count = 0;
+static __thread ZSTD_CCtx *compression_cctx = NULL;      // Batch worker only
+static __thread ZSTD_DCtx *compression_dctx = NULL;      // decompress() on msg_db
+static __thread char *compression_buf = NULL;            // Compressed payload scratch buffer
+static __thread size_t compression_buf_capacity = 0;
+static __thread unsigned long long compression_bytes_in = 0;    // Since the last report
+static __thread unsigned long long compression_bytes_out = 0;
+static __thread unsigned long long compression_rows = 0;
+static __thread unsigned long long compression_skipped = 0;     // Too small or did not shrink
+static __thread time_t last_compression_report = 0;
+
+// Parse plugin_opt_compression_dicts into dictionary slots
+static void parse_compression_dicts(const char *prefixes_str) {
+    char *copy = strdup(prefixes_str);
+    char *saveptr = NULL;
+    if (copy == NULL) {
+        return;
+    }
+    for (char *token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        while (*token == ' ') {
+            token++;
+        }
+        size_t len = strlen(token);
+        while (len > 0 && token[len - 1] == ' ') {
+            token[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (compression_dict_count == MAX_COMPRESSION_DICTS) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Too many compression dictionaries, ignoring '%s'", token);
+            continue;
+        }
+        struct compression_dict *d = &compression_dicts[compression_dict_count];
+        memset(d, 0, sizeof(*d));
+        d->prefix = strdup(token);
+        if (d->prefix == NULL) {
+            break;
+        }
+        d->prefix_len = len;
+        compression_dict_count++;
+    }
+    free(copy);
+}
+
+// Longest configured prefix of topic, or NULL
+static struct compression_dict *compression_dict_for(const char *topic) {
+    struct compression_dict *best = NULL;
+    for (int i = 0; i < compression_dict_count; i++) {
+        struct compression_dict *d = &compression_dicts[i];
+        if (strncmp(topic, d->prefix, d->prefix_len) == 0 && (best == NULL || d->prefix_len > best->prefix_len)) {
+            best = d;
+        }
+    }
+    return best;
+}
+
+static int compression_add_ddict(unsigned id, const void *dict, size_t size) {
+    for (int i = 0; i < compression_ddict_count; i++) {
+        if (compression_ddicts[i].id == id) {
+            return 0;
+        }
+    }
+    struct compression_ddict *grown = realloc(compression_ddicts,
+                                              (compression_ddict_count + 1) * sizeof(*compression_ddicts));
+    if (grown == NULL) {
+        return -1;
+    }
+    compression_ddicts = grown;
+    compression_ddicts[compression_ddict_count].ddict = ZSTD_createDDict(dict, size);
+    if (compression_ddicts[compression_ddict_count].ddict == NULL) {
+        return -1;
+    }
+    compression_ddicts[compression_ddict_count].id = id;
+    compression_ddict_count++;
+    return 0;
+}
+
+static ZSTD_DDict *compression_find_ddict(unsigned id) {
+    for (int i = 0; i < compression_ddict_count; i++) {
+        if (compression_ddicts[i].id == id) {
+            return compression_ddicts[i].ddict;
+        }
+    }
+    return NULL;
+}
+
+// Load the stored dictionaries: every one can decompress, the newest per configured
+// prefix compresses
+static void compression_load_dicts(void) {
+    char *err_msg = NULL;
+    if (sqlite3_exec(msg_db,
+                     "create table if not exists compression_dict(id integer primary key, prefix text not null, "
+                     "dict blob not null, created integer not null);", NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create compression_dict table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(msg_db, "SELECT id, prefix, dict FROM compression_dict ORDER BY created, id",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        return;
+    }
+    int loaded = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        unsigned id = (unsigned)sqlite3_column_int64(stmt, 0);
+        const char *prefix = (const char *)sqlite3_column_text(stmt, 1);
+        const void *dict = sqlite3_column_blob(stmt, 2);
+        size_t size = (size_t)sqlite3_column_bytes(stmt, 2);
+        if (compression_add_ddict(id, dict, size) != 0) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to load compression dictionary %u", id);
+            continue;
+        }
+        loaded++;
+        for (int i = 0; i < compression_dict_count && prefix != NULL; i++) {
+            struct compression_dict *d = &compression_dicts[i];
+            if (strcmp(d->prefix, prefix) == 0) {
+                ZSTD_freeCDict(d->cdict);
+                d->cdict = ZSTD_createCDict(dict, size, compression_level);
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (loaded > 0) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Loaded %d compression dictionaries", loaded);
+    }
+}
+
+// Train the slot's dictionary from its samples and store it. The samples are released
+// either way; after a failed training the slot starts sampling again.
+static void compression_train(struct compression_dict *d) {
+    void *dict = malloc((size_t)compression_dict_size);
+    size_t size = dict != NULL ? ZDICT_trainFromBuffer(dict, (size_t)compression_dict_size, d->samples,
+                                                       d->sample_sizes, (unsigned)d->sample_count) : 0;
+    unsigned id = dict != NULL && !ZDICT_isError(size) ? ZDICT_getDictID(dict, size) : 0;
+    
+    if (id == 0) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Compression dictionary training failed for '%s' (%d samples): %s",
+                            d->prefix, d->sample_count, dict != NULL ? ZDICT_getErrorName(size) : "out of memory");
+    } else {
+        sqlite3_stmt *stmt = NULL;
+        int rc = sqlite3_prepare_v2(msg_db, "INSERT INTO compression_dict (id, prefix, dict, created) VALUES (?1, ?2, ?3, ?4)",
+                                    -1, &stmt, 0);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, id);
+            sqlite3_bind_text(stmt, 2, d->prefix, -1, SQLITE_STATIC);
+            sqlite3_bind_blob64(stmt, 3, dict, size, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 4, (sqlite3_int64)time(NULL));
+            rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+        }
+        if (rc != SQLITE_OK) {
+            // Only stored dictionaries may be used: rows must stay readable after a restart
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to store compression dictionary for '%s': %s",
+                                d->prefix, sqlite3_errmsg(msg_db));
+        } else if (compression_add_ddict(id, dict, size) == 0) {
+            d->cdict = ZSTD_createCDict(dict, size, compression_level);
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Trained compression dictionary %u for '%s' (%zu bytes, %d samples)",
+                                id, d->prefix, size, d->sample_count);
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    free(dict);
+    free(d->samples);
+    free(d->sample_sizes);
+    d->samples = NULL;
+    d->sample_sizes = NULL;
+    d->samples_len = 0;
+    d->samples_capacity = 0;
+    d->sample_count = 0;
+}
+
+// Keep a payload as a training sample. Returns 1 once the slot has enough samples.
+static int compression_sample(struct compression_dict *d, const struct msg_entry *entry) {
+    if (entry->payload_len > COMPRESSION_SAMPLE_MAX) {
+        return 0;
+    }
+    // About 100 times the dictionary size in samples is enough for training
+    size_t limit = (size_t)compression_dict_size * 100;
+    if (d->samples == NULL) {
+        d->samples_capacity = limit;
+        d->samples = malloc(d->samples_capacity);
+        d->sample_sizes = malloc((size_t)compression_train_samples * sizeof(size_t));
+        if (d->samples == NULL || d->sample_sizes == NULL) {
+            free(d->samples);
+            free(d->sample_sizes);
+            d->samples = NULL;
+            d->sample_sizes = NULL;
+            return 0;
+        }
+    }
+    if (d->samples_len + entry->payload_len <= d->samples_capacity) {
+        memcpy(d->samples + d->samples_len, entry->payload, entry->payload_len);
+        d->samples_len += entry->payload_len;
+        d->sample_sizes[d->sample_count++] = entry->payload_len;
+    }
+    return d->sample_count >= compression_train_samples || d->samples_len + COMPRESSION_SAMPLE_MAX > limit;
+}
+
+// Compress the batch's insert payloads in place. A payload is replaced only when its
+// zstd frame is smaller, so the frame always fits in the entry's inline payload.
+static void compress_batch(struct msg_entry **entries, int batch_count) {
+    if (!compression_enabled || compression_cctx == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < batch_count; i++) {
+        struct msg_entry *entry = entries[i];
+        if (entry->operation != OP_INSERT || entry->codec != CODEC_NONE) {
+            continue;
+        }
+        if (entry->payload_len < (size_t)compression_min_bytes) {
+            compression_skipped++;
+            continue;
+        }
+        
+        struct compression_dict *d = compression_dict_for(entry->topic);
+        if (d != NULL && d->cdict == NULL && compression_sample(d, entry)) {
+            compression_train(d);
+        }
+        
+        size_t bound = ZSTD_compressBound(entry->payload_len);
+        if (bound > compression_buf_capacity) {
+            char *grown = realloc(compression_buf, bound);
+            if (grown == NULL) {
+                compression_skipped++;
+                continue;
+            }
+            compression_buf = grown;
+            compression_buf_capacity = bound;
+        }
+        
+        size_t size;
+        if (d != NULL && d->cdict != NULL) {
+            size = ZSTD_compress_usingCDict(compression_cctx, compression_buf, bound,
+                                            entry->payload, entry->payload_len, d->cdict);
+        } else {
+            size = ZSTD_compressCCtx(compression_cctx, compression_buf, bound,
+                                     entry->payload, entry->payload_len, compression_level);
+        }
+        if (ZSTD_isError(size) || size >= entry->payload_len) {
+            compression_skipped++;
+            continue;
+        }
+        
+        compression_bytes_in += entry->payload_len;
+        compression_bytes_out += size;
+        compression_rows++;
+        memcpy(entry->payload, compression_buf, size);
+        entry->payload_len = size;
+        entry->codec = (int)ZSTD_getDictID_fromFrame(compression_buf, size);
+    }
+}
+
+// SQL function decompress(payload [, codec]): returns a compressed payload decoded, and
+// any other value unchanged. The codec column, when given, marks rows stored as-is (NULL)
+// so their BLOB payloads are never taken for zstd frames.
+static void sql_decompress(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || (argc > 1 && sqlite3_value_type(argv[1]) == SQLITE_NULL)) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+    const void *src = sqlite3_value_blob(argv[0]);
+    size_t src_len = (size_t)sqlite3_value_bytes(argv[0]);
+    unsigned long long size = ZSTD_getFrameContentSize(src, src_len);
+    if (size == ZSTD_CONTENTSIZE_ERROR) {
+        if (argc > 1) {
+            sqlite3_result_error(ctx, "decompress: payload is not a zstd frame", -1);
+        } else {
+            sqlite3_result_value(ctx, argv[0]);
+        }
+        return;
+    }
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN ||
+        size > (unsigned long long)sqlite3_limit(sqlite3_context_db_handle(ctx), SQLITE_LIMIT_LENGTH, -1)) {
+        sqlite3_result_error_toobig(ctx);
+        return;
+    }
+    
+    unsigned id = argc > 1 ? (unsigned)sqlite3_value_int64(argv[1]) : ZSTD_getDictID_fromFrame(src, src_len);
+    ZSTD_DDict *ddict = id != 0 ? compression_find_ddict(id) : NULL;
+    if (id != 0 && ddict == NULL) {
+        sqlite3_result_error(ctx, "decompress: unknown compression dictionary", -1);
+        return;
+    }
+    if (compression_dctx == NULL && (compression_dctx = ZSTD_createDCtx()) == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    char *out = sqlite3_malloc64(size > 0 ? size : 1);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    size_t len = ddict != NULL ? ZSTD_decompress_usingDDict(compression_dctx, out, size, src, src_len, ddict)
+                               : ZSTD_decompressDCtx(compression_dctx, out, size, src, src_len);
+    if (ZSTD_isError(len)) {
+        sqlite3_free(out);
+        sqlite3_result_error(ctx, ZSTD_getErrorName(len), -1);
+        return;
+    }
+    
+    // Same TEXT/BLOB choice bind_payload makes for uncompressed payloads
+    if (payload_format == PAYLOAD_FORMAT_BLOB ||
+        (payload_format == PAYLOAD_FORMAT_AUTO && !payload_is_text((const unsigned char *)out, len))) {
+        sqlite3_result_blob64(ctx, out, len, sqlite3_free);
+    } else {
+        sqlite3_result_text64(ctx, out, len, sqlite3_free, SQLITE_UTF8);
+    }
+}
+
+// Register decompress() and load the dictionaries; compression stays off if zstd
+// cannot be set up
+static void compression_init(void) {
+    sqlite3_create_function(msg_db, "decompress", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_decompress, NULL, NULL);
+    sqlite3_create_function(msg_db, "decompress", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_decompress, NULL, NULL);
+    if (!compression_enabled) {
+        return;
+    }
+    
+    if (compression_dict_prefixes != NULL) {
+        parse_compression_dicts(compression_dict_prefixes);
+    }
+    compression_load_dicts();
+    compression_cctx = ZSTD_createCCtx();
+    last_compression_report = time(NULL);
+    if (compression_cctx == NULL) {
+        // compression_enabled is shared by the shards and keeps the codec column in use;
+        // this shard just stores its payloads as-is
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create zstd context%s, storing payloads as-is", shard_label());
+        return;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Payload compression enabled%s: zstd level %d, payloads >= %d bytes, %d dictionary prefixes",
+                        shard_label(), compression_level, compression_min_bytes, compression_dict_count);
+}
+
+// Log the compression ratio once per report interval
+static void log_compression(int force) {
+    time_t now = time(NULL);
+    if ((!force && now - last_compression_report < BATCH_REPORT_INTERVAL_SEC) ||
+        compression_rows + compression_skipped == 0) {
+        return;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO,
+        "Compression%s: %llu payloads compressed (%llu stored as-is), %llu -> %llu bytes, ratio %.2f",
+        shard_label(), compression_rows, compression_skipped, compression_bytes_in, compression_bytes_out,
+        compression_bytes_out > 0 ? (double)compression_bytes_in / compression_bytes_out : 1.0);
+    compression_rows = compression_skipped = 0;
+    compression_bytes_in = compression_bytes_out = 0;
+    last_compression_report = now;
+}
+
+static void compression_cleanup(void) {
+    for (int i = 0; i < compression_dict_count; i++) {
+        struct compression_dict *d = &compression_dicts[i];
+        ZSTD_freeCDict(d->cdict);
+        free(d->prefix);
+        free(d->samples);
+        free(d->sample_sizes);
+        memset(d, 0, sizeof(*d));
+    }
+    compression_dict_count = 0;
+    for (int i = 0; i < compression_ddict_count; i++) {
+        ZSTD_freeDDict(compression_ddicts[i].ddict);
+    }
+    free(compression_ddicts);
+    compression_ddicts = NULL;
+    compression_ddict_count = 0;
+    ZSTD_freeCCtx(compression_cctx);
+    ZSTD_freeDCtx(compression_dctx);
+    compression_cctx = NULL;
+    compression_dctx = NULL;
+    free(compression_buf);
+    compression_buf = NULL;
+    compression_buf_capacity = 0;
+}
+#else
+static void compression_init(void) {
+}
+
+static void compress_batch(struct msg_entry **entries, int batch_count) {
+    UNUSED(entries);
+    UNUSED(batch_count);
+}
+
+static void log_compression(int force) {
+    UNUSED(force);
+}
+
+static void compression_cleanup(void) {
+}
+#endif
+
+// Record in the batch transaction that the database has every journaled entry up to position
+static void journal_store(unsigned long long position) {
+    if (position == 0 || journal_position_stmt == NULL) {
+        return;
+    }
+    sqlite3_bind_int64(journal_position_stmt, 1, (sqlite3_int64)position);
+    if (sqlite3_step(journal_position_stmt) != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to store journal position: %s", sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(journal_position_stmt);
+}
+
+// Remove the journal segments that only hold committed entries. The segment with the last
+// committed record stays, so segment numbers keep growing across restarts.
+static void journal_release(unsigned long long position) {
+    struct shard *s = shard_self;
+    if (position == 0 || s->journal_dir == NULL) {
+        return;
+    }
+    unsigned long long seg_size = s->journal_segment_bytes;
+    unsigned long long first = atomic_load(&s->journal_first_pos) / seg_size;
+    unsigned long long keep = (position - 1) / seg_size;
+    for (unsigned long long seg = first; seg < keep; seg++) {
+        char path[PATH_MAX];
+        journal_segment_path(s, seg, path, sizeof(path));
+        if (unlink(path) != 0 && errno != ENOENT) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to remove journal segment %s: %s", path, strerror(errno));
+        }
+    }
+    if (keep > first) {
+        atomic_store(&s->journal_first_pos, keep * seg_size);
+        if (s->journal_read_fd >= 0 && s->journal_read_segment < keep) {
+            close(s->journal_read_fd);
+            s->journal_read_fd = -1;
+        }
+    }
+}
+
+// Read the journal again from the last committed record after a batch failed to commit.
+// The failed entries, and every journaled entry queued after them, come back through the
+// backlog in journal order; flush_batch drops the queued copies.
+static void journal_rewind(void) {
+    struct shard *s = shard_self;
+    if (s->journal_dir == NULL || journal_position_stmt == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&s->journal_mutex);
+    s->journal_backlog_pos = s->journal_committed_pos;
+    s->journal_reading = 0;
+    atomic_store(&s->journal_backlog, true);
+    pthread_mutex_unlock(&s->journal_mutex);
+    s->journal_rewound = 1;
+    // Give the database the worker's wait before the batch is tried again
+    journal_retry_us = platform_utime(1) + JOURNAL_RETRY_MS * 1000ULL;
+    mosquitto_log_printf(MOSQ_LOG_WARNING, "Re-reading the ingest journal%s from position %llu after the failed commit",
+                        shard_label(), s->journal_committed_pos);
+}
+
+// Write a batch of entries to the database in one transaction and free them
+static void process_batch(struct msg_entry **entries, int batch_count) {
+    struct msg_entry *entry;
+    
+    if (msg_db == NULL) {
+        for (int i = 0; i < batch_count; i++) {
+            free_msg_entry(entries[i]);
+        }
+        return;
+    }
+    
+    // Journaled entries are in journal order, also those coalesced away below
+    unsigned long long journal_end = 0;
+    for (int i = 0; i < batch_count; i++) {
+        if (entries[i]->journal_end > journal_end) {
+            journal_end = entries[i]->journal_end;
+        }
+    }
+    
+    int coalesced = coalesce_batch(entries, batch_count);
+    int unchanged = skip_unchanged(entries, batch_count);
+    int latest_count = latest_entries != NULL ? coalesce_latest(entries, batch_count, latest_entries) : 0;
+    extract_batch(entries, batch_count);
+    rollup_batch(entries, batch_count);
+    compress_batch(entries, batch_count);
+    
+    // Begin transaction for batch operations
+    unsigned long long begin_us = platform_utime(0);
+    char *err_msg = NULL;
+    int rc = sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, &err_msg);
+    int began = rc == SQLITE_OK;
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to begin transaction: %s", err_msg);
+        sqlite3_free(err_msg);
+        // Fall through and try individual operations anyway
+    }
+    
+    // Process all entries in batch
+    int insert_count = 0;
+    int delete_count = 0;
+    for (int i = 0; i < batch_count; i++) {
+        entry = entries[i];
+        if (entry->operation == OP_DELETE_FALLBACK && latest_upsert_stmt != NULL &&
+            latest_lookup(entry->topic, entry->ulid)) {
+            // msg_latest knows the topic's newest row, so delete it by key
+            entry->operation = OP_DELETE;
+        }
+        if (entry->operation == OP_INSERT) {
+            // Insert the whole run of consecutive inserts starting here; cancelled entries
+            // are packed out of the run so they do not split multi-row chunks
+            int run = 0;
+            int j = i;
+            for (; j < batch_count && (entries[j]->operation == OP_INSERT ||
+                                       entries[j]->operation == OP_CANCELLED); j++) {
+                if (entries[j]->operation == OP_INSERT) {
+                    struct msg_entry *tmp = entries[i + run];
+                    entries[i + run] = entries[j];
+                    entries[j] = tmp;
+                    run++;
+                }
+            }
+            if (partition_mode == PARTITION_NONE) {
+                insert_count += insert_entries(&entries[i], run);
+            } else {
+                // Split the run where the ULID timestamps cross into the next partition
+                for (int k = 0; k < run;) {
+                    int part_run = 1;
+                    if (partition_select(entries[i + k]->ulid, 1) == 0) {
+                        struct msg_partition *part = active_partition;
+                        while (k + part_run < run && partition_select(entries[i + k + part_run]->ulid, 1) == 0 &&
+                               active_partition == part) {
+                            part_run++;
+                        }
+                        partition_activate(part);
+                        insert_count += insert_entries(&entries[i + k], part_run);
+                    } else {
+                        mosquitto_log_printf(MOSQ_LOG_ERR, "Batch insert failed for topic %s: no partition for ulid %s",
+                                            entries[i + k]->topic, entries[i + k]->ulid);
+                        atomic_fetch_add_explicit(&metrics.insert_errors, 1, memory_order_relaxed);
+                    }
+                    k += part_run;
+                }
+            }
+            i = j - 1;
+        } else if (entry->operation == OP_DELETE) {
+            // Delete with specific ULID (in the partition its timestamp falls in)
+            if (partition_mode != PARTITION_NONE && partition_select(entry->ulid, 0) != 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "No message found to delete for topic: %s", entry->topic);
+                continue;
+            }
+            if (delete_stmt != NULL) {
+                if (bind_topic(delete_stmt, 1, entry->topic, 0) != SQLITE_OK) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "No message found to delete for topic: %s", entry->topic);
+                    continue;
+                }
+                if (bind_ulid(delete_stmt, 2, entry->ulid) != SQLITE_OK) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring delete with invalid ULID for topic %s: %s",
+                                        entry->topic, entry->ulid);
+                    sqlite3_reset(delete_stmt);
+                    continue;
+                }
+                
+                rc = stats_step_delete(delete_stmt, entry->topic);
+                if (rc == SQLITE_DONE && sqlite3_changes(msg_db) == 0 && partition_count > 1 &&
+                    partitions[0]->day == 0 && active_partition != partitions[0]) {
+                    // Rows adopted from an unpartitioned table can have any timestamp
+                    sqlite3_reset(delete_stmt);
+                    partition_activate(partitions[0]);
+                    if (delete_stmt != NULL && bind_topic(delete_stmt, 1, entry->topic, 0) == SQLITE_OK &&
+                        bind_ulid(delete_stmt, 2, entry->ulid) == SQLITE_OK) {
+                        rc = stats_step_delete(delete_stmt, entry->topic);
+                    }
+                }
+                if (rc == SQLITE_DONE) {
+                    int changes = sqlite3_changes(msg_db);
+                    if (changes > 0) {
+                        delete_count++;
+                        mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted message for topic: %s (ulid: %s)", 
+                                            entry->topic, entry->ulid);
+                    }
+                    // Also when the row is already gone (retention), so msg_latest does not keep it
+                    latest_forget(entry->topic, entry->ulid);
+                    fields_forget(entry->topic, entry->ulid);
+                } else {
+                    mosquitto_log_printf(MOSQ_LOG_ERR, "Delete failed for topic %s: %s", 
+                                       entry->topic, sqlite3_errmsg(msg_db));
+                    atomic_fetch_add_explicit(&metrics.delete_errors, 1, memory_order_relaxed);
+                }
+                sqlite3_reset(delete_stmt);
+            }
+        } else if (entry->operation == OP_DELETE_FALLBACK) {
+            // Delete most recent message for topic (fallback when no ULID provided).
+            // Partitions are searched newest first until one holds a message for the topic.
+            char found_ulid[27] = "";
+            int part = partition_mode != PARTITION_NONE ? partition_count - 1 : 0;
+            rc = SQLITE_DONE;
+            for (; part >= 0 && found_ulid[0] == '\0' && rc == SQLITE_DONE; part--) {
+                if (partition_mode != PARTITION_NONE) {
+                    partition_activate(partitions[part]);
+                }
+                if (delete_latest_stmt == NULL || bind_topic(delete_latest_stmt, 1, entry->topic, 0) != SQLITE_OK) {
+                    break;
+                }
+                rc = sqlite3_step(delete_latest_stmt);
+                if (rc == SQLITE_ROW) {
+                    column_ulid_text(delete_latest_stmt, 0, found_ulid);
+                    if (stats_upsert_stmt != NULL) {
+                        stats_count(entry->topic, -1, -sqlite3_column_int64(delete_latest_stmt, 1), NULL, NULL);
+                    }
+                    rc = SQLITE_DONE;
+                }
+                sqlite3_reset(delete_latest_stmt);
+            }
+            
+            if (found_ulid[0] != '\0') {
+                delete_count++;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted most recent message for topic: %s (ulid: %s)", 
+                                    entry->topic, found_ulid);
+                latest_forget(entry->topic, found_ulid);
+                fields_forget(entry->topic, found_ulid);
+            } else if (rc != SQLITE_DONE) {
+                mosquitto_log_printf(MOSQ_LOG_ERR, "Delete failed for topic %s: %s", 
+                                   entry->topic, sqlite3_errmsg(msg_db));
+                atomic_fetch_add_explicit(&metrics.delete_errors, 1, memory_order_relaxed);
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "No message found to delete for topic: %s", entry->topic);
+            }
+        }
+    }
+    
+    // Write the newest insert of each topic through to msg_latest
+    for (int i = 0; i < latest_count; i++) {
+        if (latest_entries[i]->operation == OP_INSERT) {
+            latest_store(latest_entries[i]);
+        }
+    }
+    stats_write();
+    rollup_write();
+    journal_store(journal_end);
+    
+    // Commit transaction
+    rc = sqlite3_exec(msg_db, "COMMIT", NULL, NULL, &err_msg);
+    unsigned long long commit_us = platform_utime(0);
+    metric_hist_record(&metrics.commit_us, commit_us - begin_us);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to commit transaction: %s", err_msg);
+        sqlite3_free(err_msg);
+        atomic_fetch_add_explicit(&metrics.commit_errors, 1, memory_order_relaxed);
+        // Topic ids added in this transaction may not persist, nor may partitions created in it
+        // or msg_latest changes
+        topic_map_clear(&topic_ids);
+        latest_clear();
+        if (partition_mode != PARTITION_NONE) {
+            partition_reload();
+        }
+        if (began) {
+            // A COMMIT that failed busy leaves the transaction open: none of it may stay.
+            // The journaled entries are then stored again from the journal.
+            if (!sqlite3_get_autocommit(msg_db)) {
+                sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+            }
+            rollup_batch_undo();
+            if (journal_end > 0) {
+                journal_rewind();
+            }
+        } else {
+            // Without a transaction each bucket was written on its own
+            rollup_pending_count = 0;
+        }
+    }
+    
+    if (insert_count > 0 || delete_count > 0 || coalesced > 0 || unchanged > 0) {
+        LOG_DEBUG("Batch: %d inserts, %d deletes committed, %d insert/delete pairs coalesced, %d unchanged skipped", 
+                  insert_count, delete_count, coalesced, unchanged);
+    }
+    if (rc == SQLITE_OK) {
+        atomic_fetch_add_explicit(&metrics.rows_inserted, insert_count, memory_order_relaxed);
+        atomic_fetch_add_explicit(&metrics.rows_deleted, delete_count, memory_order_relaxed);
+        atomic_fetch_add_explicit(&metrics.rows_unchanged, unchanged, memory_order_relaxed);
+        rollup_pending_count = 0;
+        if (journal_end > 0) {
+            shard_self->journal_committed_pos = journal_end;
+            journal_release(journal_end);
+        }
+    }
+    
+    // Record persistence latency for committed inserts, then free batch entries
+    unsigned long long commit_ms = commit_us / 1000;
+    for (int i = 0; i < batch_count; i++) {
+        if (rc == SQLITE_OK && entries[i]->operation == OP_INSERT) {
+            unsigned long long arrived_ms = ulid_timestamp_ms(entries[i]->ulid);
+            metric_hist_record(&metrics.latency_us, commit_ms > arrived_ms ? (commit_ms - arrived_ms) * 1000 : 0);
+        }
+        free_msg_entry(entries[i]);
+    }
+}
+
+// Flush queued messages to database as a batch
+static void flush_batch(void) {
+    int batch_count = 0;
+    struct msg_entry *entry;
+    
+    // Drain everything currently in the ring. After a failed commit, journaled entries are
+    // stored from the journal instead (journal_rewind).
+    while ((size_t)batch_count < batch_capacity && (entry = queue_pop(shard_self)) != NULL) {
+        if (shard_self->journal_rewound && entry->journal_end > shard_self->journal_committed_pos) {
+            free_msg_entry(entry);
+            continue;
+        }
+        batch_entries[batch_count++] = entry;
+    }
+    
+    if (batch_count == 0) {
+        batch_controller_update(0, 0, 0);
+        return;
+    }
+    size_t depth = (size_t)batch_count + (size_t)atomic_load_explicit(&shard_self->queue.size, memory_order_relaxed);
+    if (depth > atomic_load_explicit(&metrics.queue_high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&metrics.queue_high_water, depth, memory_order_relaxed);
+    }
+    metric_hist_record(&metrics.batch_rows, (unsigned long long)batch_count);
+    
+    // The oldest insert's ULID timestamp is its arrival time (delete ULIDs come from the
+    // message being deleted)
+    unsigned long long arrived_ms = 0;
+    for (int i = 0; i < batch_count && arrived_ms == 0; i++) {
+        if (batch_entries[i]->operation == OP_INSERT) {
+            arrived_ms = ulid_timestamp_ms(batch_entries[i]->ulid);
+        }
+    }
+    unsigned long long start_us = platform_utime(0);
+    process_batch(batch_entries, batch_count);
+    unsigned long long end_us = platform_utime(0);
+    
+    double delay_ms = arrived_ms > 0 && end_us / 1000 > arrived_ms ? (double)(end_us / 1000 - arrived_ms) : 0;
+    batch_controller_update(batch_count, (end_us - start_us) / 1000.0, delay_ms);
+}
+
+// Open a shard's spill journal. An existing non-empty journal (left over from a previous
+// run) is replayed before any new entries. With create unset, only an existing journal is opened.
+static void spill_open(struct shard *s, int create) {
+    int fd = open(s->spill_path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (fd < 0) {
+        if (create || errno != ENOENT) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to open spill journal %s: %s", s->spill_path, strerror(errno));
+        }
+        return;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return;
+    }
+    s->spill_fd = fd;
+    s->spill_write_offset = st.st_size;
+    s->spill_read_offset = 0;
+    if (st.st_size > 0) {
+        atomic_store(&s->spill_active, true);
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Replaying spill journal %s (%lld bytes)", s->spill_path, (long long)st.st_size);
+    }
+}
+
+// Allocate an entry for a spill or journal record with the inline layout of enqueue_message
+// (NUL-terminated topic, payload, headers) and point iov at where the record's topic,
+// payload and headers go. Returns NULL if out of memory.
+static struct msg_entry *record_entry_alloc(const struct spill_record *rec, struct iovec iov[3]) {
+    size_t data_len = rec->topic_len + 1 + rec->payload_len + 1 + (rec->has_headers ? rec->headers_len + 1 : 0);
+    struct msg_entry *entry = entry_alloc(data_len);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->operation = rec->operation;
+    entry->retain = rec->retain;
+    entry->qos = rec->qos;
+    entry->codec = CODEC_NONE;
+    entry->data_len = data_len;
+    entry->journal_end = 0;
+    memcpy(entry->ulid, rec->ulid, sizeof(entry->ulid));
+    entry->ulid[sizeof(entry->ulid) - 1] = '\0';
+    
+    char *data = (char *)(entry + 1);
+    entry->topic = data;
+    entry->payload = data + rec->topic_len + 1;
+    entry->payload_len = rec->payload_len;
+    entry->headers = rec->has_headers ? entry->payload + rec->payload_len + 1 : NULL;
+    entry->headers_len = rec->has_headers ? rec->headers_len : 0;
+    
+    iov[0] = (struct iovec){ entry->topic, rec->topic_len };
+    iov[1] = (struct iovec){ entry->payload, rec->payload_len };
+    iov[2] = (struct iovec){ entry->headers, entry->headers_len };
+    return entry;
+}
+
+// Terminate the strings of an entry read through record_entry_alloc's iov
+static void record_entry_finish(struct msg_entry *entry, const struct spill_record *rec) {
+    entry->topic[rec->topic_len] = '\0';
+    entry->payload[rec->payload_len] = '\0';
+    if (entry->headers != NULL) {
+        entry->headers[entry->headers_len] = '\0';
+    }
+    if (entry->operation == OP_DELETE_FALLBACK || entry->operation == OP_DELETE) {
+        entry->payload = NULL;
+    }
+}
+
+// Replay up to one batch of spilled entries into the database. Truncates the journal and
+// leaves spill mode once every record has been replayed.
+static void spill_drain(void) {
+    struct shard *s = shard_self;
+    if (!atomic_load(&s->spill_active)) {
+        return;
+    }
+    
+    pthread_mutex_lock(&s->spill_mutex);
+    off_t end = s->spill_write_offset;
+    pthread_mutex_unlock(&s->spill_mutex);
+    
+    int count = 0;
+    while ((size_t)count < batch_capacity && count < batch_size * 10 && s->spill_read_offset < end) {
+        struct spill_record rec;
+        off_t offset = s->spill_read_offset;
+        if (pread(s->spill_fd, &rec, sizeof(rec), offset) != (ssize_t)sizeof(rec) ||
+            rec.magic != SPILL_RECORD_MAGIC ||
+            offset + (off_t)(sizeof(rec) + rec.topic_len + rec.payload_len + rec.headers_len) > end) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Discarding corrupt spill journal tail (%lld bytes)",
+                                (long long)(end - offset));
+            s->spill_read_offset = end;
+            break;
+        }
+        
+        struct iovec iov[3];
+        struct msg_entry *entry = record_entry_alloc(&rec, iov);
+        if (entry == NULL) {
+            break;
+        }
+        ssize_t want = (ssize_t)(rec.topic_len + rec.payload_len + entry->headers_len);
+        if (preadv(s->spill_fd, iov, 3, offset + sizeof(rec)) != want) {
+            free_msg_entry(entry);
+            s->spill_read_offset = end;
+            break;
+        }
+        record_entry_finish(entry, &rec);
+        
+        batch_entries[count++] = entry;
+        s->spill_read_offset = offset + sizeof(rec) + rec.topic_len + rec.payload_len + rec.headers_len;
+    }
+    
+    if (count > 0) {
+        process_batch(batch_entries, count);
+    }
+    
+    if (s->spill_read_offset >= end) {
+        pthread_mutex_lock(&s->spill_mutex);
+        if (s->spill_read_offset >= s->spill_write_offset) {
+            if (ftruncate(s->spill_fd, 0) != 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to truncate spill journal: %s", strerror(errno));
+            }
+            s->spill_write_offset = 0;
+            s->spill_read_offset = 0;
+            atomic_store(&s->spill_active, false);
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Spill journal replayed");
+        }
+        pthread_mutex_unlock(&s->spill_mutex);
+    }
+}
+
+// Open a shard's ingest journal and map its tail segment. Segments left over from a previous
+// run become the backlog: the batch worker replays them, from the position msg_journal
+// records, before any new entry. On failure the shard runs without a journal.
+static void journal_open(struct shard *s) {
+    if (mkdir(s->journal_dir, 0700) != 0 && errno != EEXIST) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create journal directory %s: %s", s->journal_dir, strerror(errno));
+        free(s->journal_dir);
+        s->journal_dir = NULL;
+        return;
+    }
+    DIR *dir = opendir(s->journal_dir);
+    if (dir == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to open journal directory %s: %s", s->journal_dir, strerror(errno));
+        free(s->journal_dir);
+        s->journal_dir = NULL;
+        return;
+    }
+    unsigned long long first = ULLONG_MAX;
+    unsigned long long last = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        char *end = NULL;
+        unsigned long long seg = strtoull(de->d_name, &end, 16);
+        if (end == de->d_name + 16 && strcmp(end, ".seg") == 0) {
+            first = seg < first ? seg : first;
+            last = seg > last ? seg : last;
+        }
+    }
+    closedir(dir);
+    int found = first != ULLONG_MAX;
+    
+    // Existing segments keep the size they were created with
+    s->journal_segment_bytes = journal_segment_size;
+    if (found) {
+        char path[PATH_MAX];
+        struct stat st;
+        journal_segment_path(s, last, path, sizeof(path));
+        if (stat(path, &st) == 0 && (unsigned long long)st.st_size > sizeof(struct spill_record)) {
+            s->journal_segment_bytes = (unsigned long long)st.st_size;
+        }
+    }
+    if (journal_map_segment(s, found ? last : 0) != 0) {
+        free(s->journal_dir);
+        s->journal_dir = NULL;
+        return;
+    }
+    
+    // The tail segment ends before the first slot without a complete record. A record torn
+    // by a crash is zeroed, so that new records shorter than it cannot be followed by its rest.
+    unsigned long long seg_size = s->journal_segment_bytes;
+    unsigned long long off = 0;
+    while (off + sizeof(struct spill_record) <= seg_size) {
+        struct spill_record rec;
+        memcpy(&rec, s->journal_map + off, sizeof(rec));
+        unsigned long long size = journal_record_size((unsigned long long)rec.topic_len + rec.payload_len + rec.headers_len);
+        if (rec.magic != JOURNAL_RECORD_MAGIC || off + size > seg_size) {
+            if (rec.magic != JOURNAL_RECORD_MAGIC && rec.topic_len > 0) {
+                memset(s->journal_map + off, 0, off + size <= seg_size ? size : seg_size - off);
+            }
+            break;
+        }
+        off += size;
+    }
+    s->journal_write_pos = (found ? last : 0) * seg_size + off;
+    atomic_store(&s->journal_first_pos, (found ? first : 0) * seg_size);
+    s->journal_read_fd = -1;
+    if (s->journal_write_pos > atomic_load(&s->journal_first_pos)) {
+        s->journal_backlog_pos = atomic_load(&s->journal_first_pos);
+        atomic_store(&s->journal_backlog, true);
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Ingest journal %s: segments %llx-%llx left by the previous run",
+                            s->journal_dir, first, last);
+    }
+}
+
+// Create msg_journal and prepare the position update, then start the backlog where the
+// database left off: records before that position are already stored
+static void prepare_journal(struct shard *s) {
+    char *err_msg = NULL;
+    if (sqlite3_exec(msg_db,
+            "CREATE TABLE IF NOT EXISTS msg_journal (id INTEGER PRIMARY KEY CHECK (id = 0), position INTEGER NOT NULL)",
+            NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg_journal table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+    if (sqlite3_prepare_v2(msg_db,
+            "INSERT INTO msg_journal (id, position) VALUES (0, ?1) ON CONFLICT (id) DO UPDATE SET position = excluded.position",
+            -1, &journal_position_stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare msg_journal statement: %s", sqlite3_errmsg(msg_db));
+        return;
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    int known = 0;
+    unsigned long long position = 0;
+    if (sqlite3_prepare_v2(msg_db, "SELECT position FROM msg_journal WHERE id = 0", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            position = (unsigned long long)sqlite3_column_int64(stmt, 0);
+            known = 1;
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    pthread_mutex_lock(&s->journal_mutex);
+    if (atomic_load(&s->journal_backlog)) {
+        unsigned long long first = atomic_load(&s->journal_first_pos);
+        if (known && position >= first && position <= s->journal_write_pos) {
+            s->journal_backlog_pos = position;
+        } else if (known) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING,
+                "Journal position %llu is outside the journal (%llu-%llu), replaying all of it",
+                position, first, s->journal_write_pos);
+        }
+        if (s->journal_backlog_pos < s->journal_write_pos) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Replaying %llu bytes of the ingest journal%s",
+                                s->journal_write_pos - s->journal_backlog_pos, shard_label());
+        } else {
+            atomic_store(&s->journal_backlog, false);
+        }
+    }
+    s->journal_committed_pos = atomic_load(&s->journal_backlog) ? s->journal_backlog_pos : s->journal_write_pos;
+    pthread_mutex_unlock(&s->journal_mutex);
+}
+
+// Keep a read descriptor on journal segment seg. Returns 0 on success.
+static int journal_read_open(struct shard *s, unsigned long long seg) {
+    if (s->journal_read_fd >= 0 && s->journal_read_segment == seg) {
+        return 0;
+    }
+    if (s->journal_read_fd >= 0) {
+        close(s->journal_read_fd);
+    }
+    char path[PATH_MAX];
+    journal_segment_path(s, seg, path, sizeof(path));
+    s->journal_read_fd = open(path, O_RDONLY | O_CLOEXEC);
+    s->journal_read_segment = seg;
+    if (s->journal_read_fd < 0) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Skipping unreadable journal segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Read up to one batch of backlog records back from the journal into the database. Only
+// once the queue is empty: everything queued was journaled before the backlog started.
+static void journal_drain(void) {
+    struct shard *s = shard_self;
+    if (s->journal_dir == NULL || !atomic_load(&s->journal_backlog) || msg_db == NULL ||
+        platform_utime(1) < journal_retry_us) {
+        return;
+    }
+    
+    pthread_mutex_lock(&s->journal_mutex);
+    unsigned long long end = s->journal_write_pos;
+    if (!s->journal_reading) {
+        s->journal_read_pos = s->journal_backlog_pos;
+        s->journal_reading = 1;
+    }
+    pthread_mutex_unlock(&s->journal_mutex);
+    // Entries are queued under journal_mutex, so none queued before the backlog is missed here
+    if (atomic_load(&s->queue.size) > 0) {
+        return;
+    }
+    
+    unsigned long long seg_size = s->journal_segment_bytes;
+    int count = 0;
+    while ((size_t)count < batch_capacity && count < batch_size * 10 && s->journal_read_pos < end) {
+        unsigned long long pos = s->journal_read_pos;
+        unsigned long long seg = pos / seg_size;
+        unsigned long long off = pos % seg_size;
+        struct spill_record rec;
+        
+        // Past the last record of a segment, continue with the next one
+        s->journal_read_pos = (seg + 1) * seg_size;
+        if (off + sizeof(rec) > seg_size || journal_read_open(s, seg) != 0) {
+            continue;
+        }
+        if (pread(s->journal_read_fd, &rec, sizeof(rec), (off_t)off) != (ssize_t)sizeof(rec) || rec.magic == 0) {
+            continue;
+        }
+        unsigned long long size = journal_record_size((unsigned long long)rec.topic_len + rec.payload_len + rec.headers_len);
+        if (rec.magic != JOURNAL_RECORD_MAGIC || off + size > seg_size) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Discarding corrupt journal records (segment %llx from offset %llu)",
+                                seg, off);
+            continue;
+        }
+        
+        struct iovec iov[3];
+        struct msg_entry *entry = record_entry_alloc(&rec, iov);
+        if (entry == NULL) {
+            s->journal_read_pos = pos;
+            if (count == 0) {
+                // Nothing to store that would free memory: retry after the worker's wait
+                // instead of spinning on the allocation
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Out of memory reading the ingest journal%s, retrying in %d ms",
+                                    shard_label(), JOURNAL_RETRY_MS);
+                journal_retry_us = platform_utime(1) + JOURNAL_RETRY_MS * 1000ULL;
+            }
+            break;
+        }
+        ssize_t want = (ssize_t)(rec.topic_len + rec.payload_len + entry->headers_len);
+        if (preadv(s->journal_read_fd, iov, 3, (off_t)(off + sizeof(rec))) != want) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Discarding unreadable journal records (segment %llx from offset %llu)",
+                                seg, off);
+            free_msg_entry(entry);
+            continue;
+        }
+        record_entry_finish(entry, &rec);
+        entry->journal_end = pos + size;
+        batch_entries[count++] = entry;
+        s->journal_read_pos = pos + size;
+    }
+    
+    if (count > 0) {
+        process_batch(batch_entries, count);
+    }
+    
+    // A failed commit in process_batch has rewound the backlog (journal_reading is reset)
+    if (s->journal_reading && s->journal_read_pos >= end) {
+        pthread_mutex_lock(&s->journal_mutex);
+        if (s->journal_reading && s->journal_read_pos >= s->journal_write_pos) {
+            s->journal_reading = 0;
+            s->journal_rewound = 0;
+            atomic_store(&s->journal_backlog, false);
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Ingest journal backlog replayed%s", shard_label());
+        }
+        pthread_mutex_unlock(&s->journal_mutex);
+    }
+}
+
+// Generate ULID prefix (first 10 chars) from timestamp in milliseconds
+// Used for time-based queries since ULIDs are lexicographically sortable by time
+static void timestamp_to_ulid_prefix(unsigned long long ts_ms, char prefix[11]) {
+    // ULID timestamp is stored in first 6 bytes (48 bits), encoded as 10 base32 chars
+    ulid_encode_timestamp(prefix, ts_ms);
+    prefix[10] = '\0';
+}
+
+// Bind the exclusive upper key bound for rows older than cutoff_ms
+static void bind_ulid_cutoff(sqlite3_stmt *stmt, int idx, unsigned long long cutoff_ms) {
+    if (ulid_format == ULID_FORMAT_BINARY) {
+        // Binary keys compare bytewise, so the 6-byte timestamp is the lower bound
+        unsigned char cutoff_bin[6];
+        for (int i = 0; i < 6; i++) {
+            cutoff_bin[i] = cutoff_ms >> (40 - 8 * i);
+        }
+        sqlite3_bind_blob(stmt, idx, cutoff_bin, sizeof(cutoff_bin), SQLITE_TRANSIENT);
+    } else {
+        char cutoff_prefix[11];
+        timestamp_to_ulid_prefix(cutoff_ms, cutoff_prefix);
+        sqlite3_bind_text(stmt, idx, cutoff_prefix, -1, SQLITE_TRANSIENT);
+    }
+}
+
+// Bind the exclusive lower key bound after cursor; an empty cursor binds an empty key of
+// the column's type, which sorts before every key
+static void bind_ulid_after(sqlite3_stmt *stmt, int idx, const char *cursor) {
+    if (cursor[0] != '\0') {
+        bind_ulid(stmt, idx, cursor);
+    } else if (ulid_format == ULID_FORMAT_BINARY) {
+        sqlite3_bind_zeroblob(stmt, idx, 0);
+    } else {
+        sqlite3_bind_text(stmt, idx, "", 0, SQLITE_STATIC);
+    }
+}
+
+// Archive of expiring rows (plugin_opt_archive_path). Before retention deletes rows or
+// drops a partition, the rows are copied into SQLite files in the archive directory: one
+// per UTC day and shard, or per partition (named after its first day), so shards never
+// wait on each other's archive writes. Each file holds a msg table (text ULIDs and topics)
+// clustered by (topic, ulid), so a topic's history is read contiguously. Payloads keep
+// their compression: the codec column is copied along, and the dictionaries with it into
+// the file's compression_dict table. Rows are deleted only after the archive copy has
+// committed; a crash in between copies them again, which INSERT OR IGNORE absorbs.
+
+// INSERT ... SELECT from a table of the layout into the attached archive; the caller
+// appends the WHERE clause over m
+static void archive_insert_sql(char *buf, size_t size, const char *table) {
+    snprintf(buf, size,
+        "INSERT OR IGNORE INTO archive.msg (topic, ulid, payload, retain, qos, headers, codec) "
+        "SELECT %s, %s, m.payload, m.retain, m.qos, m.headers, %s FROM %s m%s",
+        topic_dictionary ? "t.name" : "m.topic",
+        ulid_format == ULID_FORMAT_BINARY ? "ulid_text(m.ulid)" : "m.ulid",
+        compression_enabled ? "m.codec" : "NULL",
+        table, topic_dictionary ? " JOIN topic t ON t.id = m.topic_id" : "");
+}
+
+static void archive_detach(void) {
+    sqlite3_finalize(archive_chunk_stmt);
+    sqlite3_finalize(archive_row_stmt);
+    archive_chunk_stmt = archive_row_stmt = NULL;
+    if (archive_day >= 0) {
+        sqlite3_exec(msg_db, "DETACH DATABASE archive", NULL, NULL, NULL);
+        archive_day = -1;
+    }
+}
+
+// Attach this shard's archive file of a day (days since the epoch) as "archive", creating
+// it if needed: msg-YYYY-MM-DD.db for shard 0, msg-YYYY-MM-DD-shard<k>.db for the others.
+// The stored dictionaries are copied in on every attach; the rows archived under it are
+// past retention, so their dictionaries were stored before. Must run outside a
+// transaction. Returns 0 on success, -1 on error.
+static int archive_attach(int day) {
+    if (archive_day == day) {
+        return 0;
+    }
+    archive_detach();
+    
+    time_t start = (time_t)day * 86400;
+    struct tm tm;
+    gmtime_r(&start, &tm);
+    char suffix[24] = "";
+    if (shard_self != NULL && shard_self->index > 0) {
+        snprintf(suffix, sizeof(suffix), "-shard%d", shard_self->index);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/msg-%04d-%02d-%02d%s.db", archive_path, tm.tm_year + 1900, tm.tm_mon + 1,
+             tm.tm_mday, suffix);
+    char *sql = sqlite3_mprintf(
+        "ATTACH DATABASE %Q AS archive; "
+        "CREATE TABLE IF NOT EXISTS archive.msg (topic TEXT NOT NULL, ulid TEXT NOT NULL, payload, "
+        "retain INTEGER, qos INTEGER, headers, codec INTEGER, PRIMARY KEY (topic, ulid)) WITHOUT ROWID; "
+        "CREATE TABLE IF NOT EXISTS archive.compression_dict(id integer primary key, prefix text not null, "
+        "dict blob not null, created integer not null);", path);
+    char *err_msg = NULL;
+    int rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, &err_msg) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc == SQLITE_OK) {
+        // Files written before payloads stayed compressed have no codec column: their
+        // rows read as NULL, stored as-is
+        sqlite3_stmt *stmt = NULL;
+        int has_codec = 0;
+        if (sqlite3_prepare_v2(msg_db, "SELECT 1 FROM pragma_table_info('msg', 'archive') WHERE name = 'codec'",
+                               -1, &stmt, 0) == SQLITE_OK) {
+            has_codec = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+        sqlite3_finalize(stmt);
+        if (!has_codec) {
+            rc = sqlite3_exec(msg_db, "ALTER TABLE archive.msg ADD COLUMN codec INTEGER", NULL, 0, &err_msg);
+        }
+    }
+    if (rc == SQLITE_OK && compression_enabled) {
+        rc = sqlite3_exec(msg_db,
+                          "INSERT OR IGNORE INTO archive.compression_dict (id, prefix, dict, created) "
+                          "SELECT id, prefix, dict, created FROM main.compression_dict", NULL, 0, &err_msg);
+    }
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to open archive %s: %s", path,
+                            err_msg ? err_msg : sqlite3_errstr(rc));
+        sqlite3_free(err_msg);
+        sqlite3_exec(msg_db, "DETACH DATABASE archive", NULL, NULL, NULL);
+        return -1;
+    }
+    archive_day = day;
+    
+    if (partition_mode == PARTITION_NONE) {
+        char buf[640];
+        size_t len;
+        archive_insert_sql(buf, sizeof(buf), msg_table);
+        len = strlen(buf);
+        snprintf(buf + len, sizeof(buf) - len, " WHERE m.ulid < ?1 ORDER BY m.ulid LIMIT ?2");
+        rc = sqlite3_prepare_v2(msg_db, buf, -1, &archive_chunk_stmt, 0);
+        if (rc == SQLITE_OK) {
+            buf[len] = '\0';
+            snprintf(buf + len, sizeof(buf) - len, " WHERE m.ulid = ?1");
+            rc = sqlite3_prepare_v2(msg_db, buf, -1, &archive_row_stmt, 0);
+        }
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare archive statements: %s", sqlite3_errmsg(msg_db));
+            archive_detach();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copy the oldest chunk of rows below cutoff_ms into the archive file of the oldest row's
+// day, for retention_delete_chunk. Returns the cutoff the delete must use, the end of that
+// day if it comes first, or 0 if the rows could not be archived and must stay.
+static unsigned long long archive_expired_chunk(unsigned long long cutoff_ms) {
+    if (archive_oldest_stmt == NULL) {
+        char sql[160];
+        snprintf(sql, sizeof(sql), "SELECT ulid FROM %s WHERE ulid < ?1 ORDER BY ulid LIMIT 1", msg_table);
+        if (sqlite3_prepare_v2(msg_db, sql, -1, &archive_oldest_stmt, 0) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare archive statements: %s", sqlite3_errmsg(msg_db));
+            return 0;
+        }
+    }
+    char oldest[27] = "";
+    bind_ulid_cutoff(archive_oldest_stmt, 1, cutoff_ms);
+    if (sqlite3_step(archive_oldest_stmt) == SQLITE_ROW) {
+        column_ulid_text(archive_oldest_stmt, 0, oldest);
+    }
+    sqlite3_reset(archive_oldest_stmt);
+    if (oldest[0] == '\0') {
+        return cutoff_ms;
+    }
+    
+    unsigned long long day = ulid_timestamp_ms(oldest) / 86400000ULL;
+    if ((day + 1) * 86400000ULL < cutoff_ms) {
+        cutoff_ms = (day + 1) * 86400000ULL;
+    }
+    if (archive_attach((int)day) != 0) {
+        return 0;
+    }
+    bind_ulid_cutoff(archive_chunk_stmt, 1, cutoff_ms);
+    sqlite3_bind_int(archive_chunk_stmt, 2, retention_chunk);
+    int rc = sqlite3_step(archive_chunk_stmt);
+    sqlite3_reset(archive_chunk_stmt);
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to archive expired messages: %s", sqlite3_errmsg(msg_db));
+        return 0;
+    }
+    retention.archived += sqlite3_changes(msg_db);
+    return cutoff_ms;
+}
+
+// Copy the given expired keys (in key order) into their days' archive files, one
+// transaction per day, for retention_scan_chunk. Returns 0 on success, -1 on error.
+static int archive_expired_rows(char (*keys)[27], int count) {
+    int i = 0;
+    while (i < count) {
+        int day = (int)(ulid_timestamp_ms(keys[i]) / 86400000ULL);
+        if (archive_attach(day) != 0) {
+            return -1;
+        }
+        sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+        long long archived = 0;
+        int failed = 0;
+        for (; i < count && (int)(ulid_timestamp_ms(keys[i]) / 86400000ULL) == day; i++) {
+            int rc = bind_ulid(archive_row_stmt, 1, keys[i]);
+            if (rc == SQLITE_OK) {
+                rc = sqlite3_step(archive_row_stmt);
+            }
+            sqlite3_reset(archive_row_stmt);
+            if (rc != SQLITE_DONE) {
+                failed = 1;
+                break;
+            }
+            archived += sqlite3_changes(msg_db);
+        }
+        if (failed || sqlite3_exec(msg_db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to archive expired messages: %s", sqlite3_errmsg(msg_db));
+            sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+            return -1;
+        }
+        retention.archived += archived;
+    }
+    return 0;
+}
+
+// Copy a partition into its archive file ahead of its drop, a chunk of keys per
+// transaction, within the retention budget. Progress is kept across calls. Returns 1 once
+// every row is archived, 0 if the budget ran out first, -1 on error.
+static int archive_partition(const struct msg_partition *p) {
+    if (archive_partition_day != p->day) {
+        archive_partition_day = p->day;
+        archive_cursor[0] = '\0';
+    }
+    if (archive_attach(p->day) != 0) {
+        return -1;
+    }
+    
+    char sql[640];
+    sqlite3_stmt *bound_stmt = NULL;
+    sqlite3_stmt *copy_stmt = NULL;
+    snprintf(sql, sizeof(sql), "SELECT max(ulid) FROM (SELECT ulid FROM %s WHERE ulid > ?1 ORDER BY ulid LIMIT ?2)",
+             p->name);
+    int rc = sqlite3_prepare_v2(msg_db, sql, -1, &bound_stmt, 0);
+    if (rc == SQLITE_OK) {
+        archive_insert_sql(sql, sizeof(sql), p->name);
+        snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " WHERE m.ulid > ?1 AND m.ulid <= ?2");
+        rc = sqlite3_prepare_v2(msg_db, sql, -1, &copy_stmt, 0);
+    }
+    
+    unsigned long long start_us = platform_utime(0);
+    unsigned long long budget_us = (unsigned long long)retention_budget_ms * 1000ULL;
+    long long archived = 0;
+    int result = rc == SQLITE_OK ? 0 : -1;
+    while (result == 0) {
+        // The chunk ends retention_chunk keys after the cursor
+        char bound[27] = "";
+        bind_ulid_after(bound_stmt, 1, archive_cursor);
+        sqlite3_bind_int(bound_stmt, 2, retention_chunk);
+        rc = sqlite3_step(bound_stmt);
+        if (rc == SQLITE_ROW && sqlite3_column_type(bound_stmt, 0) != SQLITE_NULL) {
+            column_ulid_text(bound_stmt, 0, bound);
+        }
+        sqlite3_reset(bound_stmt);
+        if (rc != SQLITE_ROW) {
+            result = -1;
+            break;
+        }
+        if (bound[0] == '\0') {
+            result = 1;
+            break;
+        }
+        bind_ulid_after(copy_stmt, 1, archive_cursor);
+        bind_ulid(copy_stmt, 2, bound);
+        rc = sqlite3_step(copy_stmt);
+        sqlite3_reset(copy_stmt);
+        if (rc != SQLITE_DONE) {
+            result = -1;
+            break;
+        }
+        archived += sqlite3_changes(msg_db);
+        memcpy(archive_cursor, bound, sizeof(archive_cursor));
+        if (platform_utime(0) - start_us >= budget_us) {
+            break;
+        }
+    }
+    if (result < 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to archive partition %s: %s", p->name, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_finalize(bound_stmt);
+    sqlite3_finalize(copy_stmt);
+    
+    atomic_fetch_add_explicit(&metrics.retention_archived, (unsigned long long)archived, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.retention_us, platform_utime(0) - start_us, memory_order_relaxed);
+    return result;
+}
+
+// Delete the oldest chunk of rows below the pass cutoff (no retention rules).
+// Returns the number of rows deleted, or -1 on error.
+static int retention_delete_chunk(void) {
+    if (retention_delete_stmt == NULL) {
+        return -1;
+    }
+    // With an archive the chunk is copied first, in its own transaction, and stops at the
+    // end of its oldest row's day so that it fits one archive file
+    unsigned long long cutoff_ms = retention.cutoff_ms;
+    retention.split = 0;
+    if (archive_path != NULL) {
+        cutoff_ms = archive_expired_chunk(cutoff_ms);
+        if (cutoff_ms == 0) {
+            return -1;
+        }
+        retention.split = cutoff_ms < retention.cutoff_ms;
+    }
+    
+    // With stats or extracted fields the chunk and its side tables share a transaction
+    int transaction = stats_upsert_stmt != NULL || fields_expire_stmt != NULL;
+    if (transaction) {
+        sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    }
+    bind_ulid_cutoff(retention_delete_stmt, 1, cutoff_ms);
+    sqlite3_bind_int(retention_delete_stmt, 2, retention_chunk);
+    int rc = stats_step_delete(retention_delete_stmt, NULL);
+    int deleted = rc == SQLITE_DONE ? sqlite3_changes(msg_db) : -1;
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Retention cleanup failed: %s", sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(retention_delete_stmt);
+    if (deleted > 0) {
+        fields_expire(cutoff_ms, retention_chunk);
+    }
+    if (transaction) {
+        stats_write();
+        if (sqlite3_exec(msg_db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Retention commit failed: %s", sqlite3_errmsg(msg_db));
+            sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+            deleted = -1;
+        }
+    }
+    retention.scanned += deleted > 0 ? deleted : 0;
+    return deleted;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+// Walk the next topics after the cursor and delete the rows past each topic's retention,
+// at most retention_chunk topics or keys per chunk. A topic's expired keys are read from
+// the (topic, ulid) index, so a pass costs a seek per topic plus the expired rows, not a
+// scan of the history. The cursor is stored in msg_retention with the deletes, so a pass
+// cut short by a restart resumes where it stopped. Returns the number of topics walked,
+// or -1 on error.
+static int retention_scan_chunk(unsigned long long now_ms) {
+    if (retention_topic_stmt == NULL || retention_scan_stmt == NULL || retention_row_stmt == NULL) {
+        return -1;
+    }
+    
+    char (*expired)[27] = malloc((size_t)retention_chunk * sizeof(*expired));
+    if (expired == NULL) {
+        return -1;
+    }
+    int topics = 0;
+    int expired_count = 0;
+    int rc = SQLITE_DONE;
+    retention.split = 0;
+    while (topics < retention_chunk && !retention.split) {
+        sqlite3_bind_text(retention_topic_stmt, 1, retention.topic ? retention.topic : "", -1, SQLITE_TRANSIENT);
+        rc = sqlite3_step(retention_topic_stmt);
+        if (rc != SQLITE_ROW) {
+            sqlite3_reset(retention_topic_stmt);
+            break;
+        }
+        const char *topic = (const char *)sqlite3_column_text(retention_topic_stmt, 0);
+        int days = topic ? topic_retention_days(topic) : retention_days;
+        rc = SQLITE_DONE;
+        if (days > 0) {
+            // Column 1 is the topic's key in the message table: its name, or its id
+            sqlite3_bind_value(retention_scan_stmt, 1, sqlite3_column_value(retention_topic_stmt, 1));
+            bind_ulid_cutoff(retention_scan_stmt, 2, now_ms - days * 86400000ULL);
+            sqlite3_bind_int(retention_scan_stmt, 3, retention_chunk - expired_count);
+            while ((rc = sqlite3_step(retention_scan_stmt)) == SQLITE_ROW) {
+                column_ulid_text(retention_scan_stmt, 0, expired[expired_count++]);
+            }
+            sqlite3_reset(retention_scan_stmt);
+            // A topic that filled the chunk may have more: the next chunk walks it again
+            retention.split = rc == SQLITE_DONE && expired_count == retention_chunk;
+        }
+        if (rc == SQLITE_DONE && !retention.split) {
+            char *next = topic ? strdup(topic) : NULL;
+            if (next != NULL) {
+                free(retention.topic);
+                retention.topic = next;
+            } else {
+                rc = SQLITE_NOMEM;
+            }
+        }
+        sqlite3_reset(retention_topic_stmt);
+        if (rc != SQLITE_DONE) {
+            break;
+        }
+        topics += !retention.split;
+    }
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Retention scan failed: %s", sqlite3_errmsg(msg_db));
+        topics = -1;
+    }
+    
+    // Archive in key order, so that each day's file is attached once per chunk
+    qsort(expired, (size_t)expired_count, sizeof(*expired), compare_keys);
+    if (expired_count > 0 && archive_path != NULL && archive_expired_rows(expired, expired_count) != 0) {
+        // Kept until a later pass has archived them
+        expired_count = 0;
+        topics = -1;
+    }
+    if (expired_count > 0) {
+        sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+        for (int i = 0; i < expired_count; i++) {
+            if (bind_ulid(retention_row_stmt, 1, expired[i]) == SQLITE_OK &&
+                stats_step_delete(retention_row_stmt, NULL) == SQLITE_DONE) {
+                retention.deleted += sqlite3_changes(msg_db);
+            }
+            sqlite3_reset(retention_row_stmt);
+            if (fields_row_stmt != NULL) {
+                sqlite3_bind_text(fields_row_stmt, 1, expired[i], -1, SQLITE_STATIC);
+                sqlite3_step(fields_row_stmt);
+                sqlite3_reset(fields_row_stmt);
+            }
+        }
+        if (retention_cursor_stmt != NULL && retention.topic != NULL) {
+            sqlite3_bind_text(retention_cursor_stmt, 1, retention.topic, -1, SQLITE_STATIC);
+            sqlite3_step(retention_cursor_stmt);
+            sqlite3_reset(retention_cursor_stmt);
+        }
+        stats_write();
+        if (sqlite3_exec(msg_db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Retention commit failed: %s", sqlite3_errmsg(msg_db));
+            sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+            topics = -1;
+        }
+    }
+    free(expired);
+    retention.scanned += expired_count;
+    retention.topics += topics > 0 ? topics : 0;
+    return topics;
+}
+
+// Start a rules pass after the topic stored in msg_retention, if the last one was cut
+// short, and clear it again once a pass ends
+static void retention_load_cursor(void) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(msg_db, "SELECT topic FROM msg_retention WHERE id = 0", -1, &stmt, 0) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *topic = (const char *)sqlite3_column_text(stmt, 0);
+        retention.topic = topic ? strdup(topic) : NULL;
+        if (retention.topic != NULL) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Retention pass resumes after topic %s%s", retention.topic,
+                                shard_label());
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+// Delete expired messages incrementally: a pass starts every retention_interval_sec and
+// runs in chunks of retention_chunk rows, at most retention_budget_ms per worker cycle,
+// so ingest is never stalled behind one huge DELETE.
+// Without rules the oldest keys below the cutoff are deleted directly. With rules the
+// topics are walked in order and each one's rows past its retention are deleted.
+static void cleanup_old_messages(void) {
+    // Partitioned storage expires whole partitions instead (partition_maintain)
+    if (retention_min_days <= 0 || msg_db == NULL || partition_mode != PARTITION_NONE) {
+        return;
+    }
+    
+    time_t now = time(NULL);
+    unsigned long long now_ms = (unsigned long long)now * 1000ULL;
+    if (!retention.active) {
+        if (last_retention_pass != 0 && now - last_retention_pass < retention_interval_sec) {
+            return;
+        }
+        memset(&retention, 0, sizeof(retention));
+        retention.active = 1;
+        retention.cutoff_ms = now_ms - retention_min_days * 86400000ULL;
+        if (retention_rules != NULL) {
+            retention_load_cursor();
+        }
+        retention.started = now;
+        retention.last_progress = now;
+        retention.started_us = platform_utime(0);
+        last_retention_pass = now;
+    }
+    
+    unsigned long long start_us = platform_utime(0);
+    unsigned long long budget_us = (unsigned long long)retention_budget_ms * 1000ULL;
+    long long deleted_before = retention.deleted;
+    long long archived_before = retention.archived;
+    int done = 0;
+    do {
+        int n;
+        if (retention_rules == NULL) {
+            n = retention_delete_chunk();
+            if (n > 0) {
+                retention.deleted += n;
+            }
+        } else {
+            n = retention_scan_chunk(now_ms);
+        }
+        done = n < 0 || (n < retention_chunk && !retention.split);
+    } while (!done && platform_utime(0) - start_us < budget_us);
+    unsigned long long spent_us = platform_utime(0) - start_us;
+    retention.busy_us += spent_us;
+    atomic_fetch_add_explicit(&metrics.retention_us, spent_us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.retention_deleted, (unsigned long long)(retention.deleted - deleted_before),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.retention_archived, (unsigned long long)(retention.archived - archived_before),
+                              memory_order_relaxed);
+    
+    if (done) {
+        if (retention_rules != NULL) {
+            mosquitto_log_printf(MOSQ_LOG_INFO,
+                "Retention pass complete: deleted %lld messages over %lld topics in %.1fs (%.0fms of deletes)",
+                retention.deleted, retention.topics, (platform_utime(0) - retention.started_us) / 1e6,
+                retention.busy_us / 1000.0);
+            sqlite3_exec(msg_db, "DELETE FROM msg_retention", NULL, NULL, NULL);
+            free(retention.topic);
+            retention.topic = NULL;
+        } else if (retention.deleted > 0) {
+            mosquitto_log_printf(MOSQ_LOG_INFO,
+                "Retention pass complete: deleted %lld of %lld messages scanned in %.1fs (%.0fms of deletes)",
+                retention.deleted, retention.scanned, (platform_utime(0) - retention.started_us) / 1e6,
+                retention.busy_us / 1000.0);
+        }
+        if (retention.archived > 0) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Retention archived %lld messages to %s", retention.archived,
+                                archive_path);
+        }
+        archive_detach();
+        retention.active = 0;
+    } else if (now - retention.last_progress >= RETENTION_PROGRESS_INTERVAL_SEC) {
+        if (retention_rules != NULL) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Retention pass in progress: deleted %lld messages over %lld topics so far",
+                                retention.deleted, retention.topics);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Retention pass in progress: deleted %lld of %lld messages scanned so far",
+                                retention.deleted, retention.scanned);
+        }
+        retention.last_progress = now;
+    }
+}
+
+// Background worker thread for batch processing
+static void *batch_worker(void *arg) {
+    struct shard *s = arg;
+    
+    shard_open(s);
+    atomic_store(&s->ready, msg_db != NULL ? 1 : -1);
+    struct pollfd pfd = { .fd = s->event_fd, .events = POLLIN };
+    
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread started%s", shard_label());
+    
+    while (atomic_load(&s->running)) {
+        // Wait for either: queue size threshold, delete wakeup or timeout
+        // (no wait while spilled or journaled entries are waiting to be replayed)
+        if (atomic_load(&s->queue.size) < atomic_load(&s->effective_batch) && !atomic_load(&s->spill_active) &&
+            !(atomic_load(&s->journal_backlog) && msg_db != NULL && platform_utime(1) >= journal_retry_us)) {
+            int rc = poll(&pfd, 1, batch_controller_interval());
+            if (rc > 0) {
+                uint64_t count;
+                if (read(s->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "Batch worker eventfd read failed: %s", strerror(errno));
+                }
+            }
+        }
+        atomic_store(&s->wakeup_pending, false);
+        
+        // Flush accumulated messages, then replay spilled and journaled ones behind them
+        flush_batch();
+        spill_drain();
+        journal_drain();
+        
+        // Periodically cleanup old messages (if retention is enabled)
+        if (atomic_load(&s->running)) {
+            cleanup_old_messages();
+            rollup_maintain(0);
+            partition_maintain(0);
+            log_batch_controller(0);
+            log_compression(0);
+            // Slab and backpressure counters are shared by all shards
+            if (s->index == 0) {
+                log_slab_usage(0);
+                log_queue_drops(0);
+            }
+        }
+    }
+    
+    // Final flush on shutdown. A spill journal or journal backlog that is not yet replayed
+    // stays on disk and is replayed on the next start.
+    flush_batch();
+    rollup_maintain(1);
+    log_batch_controller(1);
+    log_compression(1);
+    if (s->index == 0) {
+        log_slab_usage(1);
+        log_queue_drops(1);
+    }
+    if (atomic_load(&s->spill_active)) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Spill journal %s kept for next start (%lld bytes)",
+                            s->spill_path, (long long)(s->spill_write_offset - s->spill_read_offset));
+    }
+    if (atomic_load(&s->journal_backlog)) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Ingest journal %s kept for next start (%llu bytes not stored yet)",
+                            s->journal_dir, s->journal_write_pos - (s->journal_reading ? s->journal_read_pos : s->journal_backlog_pos));
+    }
+    
+    shard_close();
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread stopped%s", shard_label());
+    return NULL;
+}
+
+// Called by SQLite on the shard's writer connection after each commit in WAL mode
+static int wal_commit_hook(void *arg, sqlite3 *db, const char *name, int frames) {
+    (void)db;
+    (void)name;
+    struct shard *s = arg;
+    atomic_store_explicit(&s->wal_frames, frames, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->wal_commits, 1, memory_order_relaxed);
+    if (frames >= checkpoint_pages && checkpoint_event_fd >= 0 &&
+        !atomic_exchange_explicit(&s->checkpoint_pending, true, memory_order_acq_rel)) {
+        uint64_t one = 1;
+        if (write(checkpoint_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Checkpoint eventfd write failed: %s", strerror(errno));
+        }
+    }
+    return SQLITE_OK;
+}
+
+static const char *checkpoint_mode_name(int mode) {
+    switch (mode) {
+    case SQLITE_CHECKPOINT_RESTART: return "RESTART";
+    case SQLITE_CHECKPOINT_TRUNCATE: return "TRUNCATE";
+    default: return "PASSIVE";
+    }
+}
+
+// Checkpoint one shard if its WAL is due. PASSIVE copies back what readers allow and never
+// blocks the writer. When the log itself outgrows checkpoint_wal_limit (readers keep it from
+// being reset) RESTART waits briefly for them, and a WAL file left large by an earlier burst
+// is truncated once everything in it has been copied back.
+static void checkpoint_shard(struct shard *s, unsigned long long now_us) {
+    if (atomic_load(&s->ready) != 1 || s->wal_path == NULL) {
+        return;
+    }
+    unsigned int commits = atomic_load_explicit(&s->wal_commits, memory_order_relaxed);
+    int frames = atomic_load_explicit(&s->wal_frames, memory_order_relaxed);
+    int frames_left = atomic_load_explicit(&s->checkpoint_frames_left, memory_order_relaxed);
+    int changed = commits != s->checkpoint_commits || frames_left > 0;
+    int due = changed && (frames >= checkpoint_pages ||
+                          now_us - s->last_checkpoint_us >= (unsigned long long)checkpoint_interval_ms * 1000);
+    
+    struct stat st;
+    long long wal_size = stat(s->wal_path, &st) == 0 ? (long long)st.st_size : 0;
+    int oversized = (unsigned long long)wal_size > checkpoint_wal_limit && now_us >= s->escalate_after_us;
+    if (!due && !oversized) {
+        return;
+    }
+    
+    if (s->checkpoint_db == NULL) {
+        if (sqlite3_open_v2(s->db_path, &s->checkpoint_db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Checkpoint connection to %s failed: %s",
+                                s->db_path, sqlite3_errmsg(s->checkpoint_db));
+            sqlite3_close(s->checkpoint_db);
+            s->checkpoint_db = NULL;
+            s->last_checkpoint_us = now_us;
+            return;
+        }
+        sqlite3_busy_timeout(s->checkpoint_db, CHECKPOINT_BUSY_MS);
+        // Reading the schema opens the WAL on this connection; until then checkpoints are no-ops
+        sqlite3_exec(s->checkpoint_db, "SELECT 1 FROM sqlite_master LIMIT 1", NULL, NULL, NULL);
+        sqlite3_stmt *stmt = NULL;
+        s->checkpoint_page_size = 4096;
+        if (sqlite3_prepare_v2(s->checkpoint_db, "PRAGMA page_size", -1, &stmt, 0) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+            s->checkpoint_page_size = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    int mode = SQLITE_CHECKPOINT_PASSIVE;
+    if (oversized) {
+        // Frames not yet copied back: the whole log after new commits, otherwise what the last
+        // checkpoint left. A WAL frame is a 24-byte header plus one page.
+        int pending = commits != s->checkpoint_commits ? frames : frames_left;
+        unsigned long long log_bytes = (unsigned long long)pending * (unsigned long long)(s->checkpoint_page_size + 24);
+        mode = log_bytes > checkpoint_wal_limit ? SQLITE_CHECKPOINT_RESTART : SQLITE_CHECKPOINT_TRUNCATE;
+    }
+    
+    int log_frames = -1, copied = -1;
+    unsigned long long start_us = platform_utime(0);
+    int rc = sqlite3_wal_checkpoint_v2(s->checkpoint_db, NULL, mode, &log_frames, &copied);
+    unsigned long long end_us = platform_utime(0);
+    atomic_store(&s->checkpoint_pending, false);
+    s->checkpoint_commits = commits;
+    s->last_checkpoint_us = end_us;
+    
+    metric_hist_record(&metrics.checkpoint_us, end_us - start_us);
+    atomic_fetch_add_explicit(&metrics.checkpoints, 1, memory_order_relaxed);
+    if (log_frames >= 0 && copied >= 0) {
+        atomic_store_explicit(&s->checkpoint_frames_left, log_frames - copied, memory_order_relaxed);
+    }
+    if (mode != SQLITE_CHECKPOINT_PASSIVE) {
+        atomic_fetch_add_explicit(&metrics.checkpoint_escalations, 1, memory_order_relaxed);
+    }
+    
+    if (rc == SQLITE_BUSY) {
+        atomic_fetch_add_explicit(&metrics.checkpoint_busy, 1, memory_order_relaxed);
+        if (mode != SQLITE_CHECKPOINT_PASSIVE) {
+            s->escalate_after_us = end_us + (unsigned long long)checkpoint_interval_ms * 1000 * CHECKPOINT_BACKOFF_INTERVALS;
+        }
+    } else if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "WAL checkpoint of %s failed: %s", s->db_path, sqlite3_errmsg(s->checkpoint_db));
+    }
+    if (mode != SQLITE_CHECKPOINT_PASSIVE) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "WAL checkpoint %s of %s (%lld bytes): %d of %d frames in %.1fms%s",
+                            checkpoint_mode_name(mode), s->db_path, wal_size, copied, log_frames,
+                            (end_us - start_us) / 1000.0, rc == SQLITE_BUSY ? ", readers still active" : "");
+    }
+}
+
+// Checkpoint thread: wakes on the wal hook's eventfd or every checkpoint interval
+static void *checkpoint_worker(void *arg) {
+    (void)arg;
+    struct pollfd pfd = { .fd = checkpoint_event_fd, .events = POLLIN };
+    
+    while (atomic_load(&checkpoint_running)) {
+        if (poll(&pfd, 1, checkpoint_interval_ms) > 0) {
+            uint64_t count;
+            if (read(checkpoint_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Checkpoint eventfd read failed: %s", strerror(errno));
+            }
+        }
+        unsigned long long now_us = platform_utime(0);
+        for (int k = 0; k < shard_count && atomic_load(&checkpoint_running); k++) {
+            checkpoint_shard(&shards[k], now_us);
+        }
+    }
+    
+    // The writer connections checkpoint the rest as they close
+    for (int k = 0; k < shard_count; k++) {
+        sqlite3_close(shards[k].checkpoint_db);
+        shards[k].checkpoint_db = NULL;
+    }
+    return NULL;
+}
+
+// A user property name/value pair. The strings are not NUL-terminated.
+struct user_property {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+};
+
+// Read the first user property at (or, with skip_first, after) prop. The list is walked
+// with mosquitto_property_next/identifier, so only user properties are read out; the
+// copies mosquitto_property_read_string_pair allocates go into a per-thread scratch
+// buffer, so callers see borrowed pointers valid until the next call on the thread.
+// Returns the property read, or NULL if there are no more user properties.
+static const mosquitto_property *read_user_property(const mosquitto_property *prop,
+                                                    struct user_property *out, bool skip_first) {
+    static __thread char *scratch = NULL;
+    static __thread size_t scratch_capacity = 0;
+    char *name = NULL;
+    char *value = NULL;
+    
+    if (prop != NULL && skip_first) {
+        prop = mosquitto_property_next(prop);
+    }
+    while (prop != NULL && mosquitto_property_identifier(prop) != MQTT_PROP_USER_PROPERTY) {
+        prop = mosquitto_property_next(prop);
+    }
+    if (prop == NULL || mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, &name, &value, false) == NULL) {
+        return NULL;
+    }
+    
+    size_t name_len = name ? strlen(name) : 0;
+    size_t value_len = value ? strlen(value) : 0;
+    if (name_len + value_len > scratch_capacity) {
+        char *new_scratch = realloc(scratch, name_len + value_len);
+        if (new_scratch == NULL) {
+            mosquitto_free(name);
+            mosquitto_free(value);
+            return NULL;
+        }
+        scratch = new_scratch;
+        scratch_capacity = name_len + value_len;
+    }
+    memcpy(scratch, name, name_len);
+    memcpy(scratch + name_len, value, value_len);
+    mosquitto_free(name);
+    mosquitto_free(value);
+    
+    out->name = scratch;
+    out->name_len = name_len;
+    out->value = scratch + name_len;
+    out->value_len = value_len;
+    return prop;
+}
+
+// Extract user properties from message, excluding headers in the exclude_headers set.
+// Text format: semicolon-separated name=value. Binary format: each pair as a 2-byte
+// big-endian name length, name, 2-byte big-endian value length, value (as in MQTT).
+// Returns a pointer into a per-thread buffer (valid until the next call on the same
+// thread) and sets *out_len, or NULL if no headers. The caller must not free it.
+static const char *extract_headers(const mosquitto_property *properties, size_t *out_len) {
+    static __thread char *headers = NULL;
+    static __thread size_t capacity = 0;
+    
+    // If header storage is completely disabled, return NULL
+    if (headers_disabled) {
+        return NULL;
+    }
+    
+    if (properties == NULL) {
+        return NULL;
+    }
+    
+    size_t len = 0;
+    int header_count = 0;
+    struct user_property up;
+    
+    // Single pass over the property list, growing the thread buffer only when needed
+    for (const mosquitto_property *prop = read_user_property(properties, &up, false);
+         prop != NULL;
+         prop = read_user_property(prop, &up, true)) {
+        if (up.name == NULL || up.value == NULL || is_header_excluded(up.name, up.name_len)) {
+            continue;
+        }
+        
+        // Text: [';'] name '=' value, binary: 2 + name + 2 + value
+        size_t needed = up.name_len + up.value_len + 4;
+        
+        // Grow buffer if needed (one extra byte for the NUL terminator)
+        if (len + needed + 1 > capacity) {
+            size_t new_capacity = (len + needed + 1) * 2;
+            if (new_capacity < 256) {
+                new_capacity = 256;
+            }
+            char *new_headers = realloc(headers, new_capacity);
+            if (new_headers == NULL) {
+                return NULL;
+            }
+            headers = new_headers;
+            capacity = new_capacity;
+        }
+        
+        if (headers_format == HEADERS_FORMAT_BINARY) {
+            headers[len++] = (char)(up.name_len >> 8);
+            headers[len++] = (char)up.name_len;
+            memcpy(headers + len, up.name, up.name_len);
+            len += up.name_len;
+            headers[len++] = (char)(up.value_len >> 8);
+            headers[len++] = (char)up.value_len;
+            memcpy(headers + len, up.value, up.value_len);
+            len += up.value_len;
+        } else {
+            // Append separator if not first
+            if (header_count > 0) {
+                headers[len++] = ';';
+            }
+            memcpy(headers + len, up.name, up.name_len);
+            len += up.name_len;
+            headers[len++] = '=';
+            memcpy(headers + len, up.value, up.value_len);
+            len += up.value_len;
+        }
+        headers[len] = '\0';
+        header_count++;
+    }
+    
+    if (header_count == 0) {
+        return NULL;
+    }
+    
+    *out_len = len;
+    return headers;
+}
+
+// History replay (plugin_opt_history). A client publishes a request to $history/<topic>,
+// or with a filter user property for wildcard filters (PUBLISH topics cannot carry them),
+// plus optional since (exclusive ULID or Unix milliseconds) and limit properties and a
+// Response Topic. The broker thread queues it; the history thread answers it from its own
+// read-only connection to each shard with a range scan over the filter's literal prefix,
+// and the tick publishes the rows to the requesting client at plugin_opt_history_rate.
+struct history_request {
+    struct history_request *next;
+    atomic_int refs;            // The request queue/worker plus one per queued reply
+    char *client_id;            // Replies go to this client only
+    char *response_topic;
+    void *correlation;          // Correlation Data, echoed in every reply
+    uint16_t correlation_len;
+    int qos;
+    char *filter;
+    char since[27];             // Exclusive lower bound, "" = from the oldest row
+    int limit;
+    char **grants;              // Filters of the history_acl grants for this client
+    int grant_count;
+};
+
+#define HISTORY_REPLY_ROW 0
+#define HISTORY_REPLY_END 1     // After the last row: count and the next since
+#define HISTORY_REPLY_ERROR 2   // Request refused, reason in text
+
+struct history_reply {
+    struct history_reply *next;
+    struct history_request *request;
+    int kind;
+    char ulid[27];              // Row key, or for the end marker the last key sent
+    unsigned long count;        // End marker: rows sent
+    const char *text;           // Row topic or error reason
+    const void *payload;
+    size_t payload_len;
+    char data[];                // Topic and payload of a row
+};
+
+// History thread state for one shard. Topic streams read the physical message tables
+// (every partition, oldest first) on their (topic, ulid) index; the scan statements read
+// the msg view for filters whose topics are too many to merge.
+struct history_source {
+    struct shard *shard;
+    sqlite3 *db;
+    int schema_version;         // Of the statements below, -1 = not prepared yet
+    sqlite3_stmt *topic_stmt;   // First topic >= ?1 and < ?2, with its dictionary id
+    sqlite3_stmt **table_stmts; // Per table: rows after key ?1 of topic ?2, LIMIT ?3
+    int *table_days;            // First day each table covers
+    int table_count;
+    sqlite3_stmt *range_stmt;   // Scan: filters with a literal prefix
+    sqlite3_stmt *scan_stmt;    // Scan: filters starting with a wildcard, key order only
+    int skip;                   // The filter cannot match this shard
+#ifdef WITH_ZSTD
+    struct compression_ddict *ddicts;   // This database's dictionaries
+    int ddict_count;
+    sqlite3_int64 dict_max_id;
+#endif
+};
+
+// One key-ordered run of rows to merge: a topic on one shard, or the shard's scan
+struct history_stream {
+    struct history_source *src;
+    char *topic;                // NULL = the scan statements
+    sqlite3_int64 topic_id;     // With the topic dictionary
+    int table;                  // Index into table_stmts being read
+    struct history_reply **rows;    // Current page
+    int count;
+    int pos;
+    int done;                   // Last page read
+    char cursor[27];            // Key of the last row read
+};
+
+static int history_enabled = 0;
+static int history_max_limit = DEFAULT_HISTORY_MAX_LIMIT;
+static int history_rate = DEFAULT_HISTORY_RATE;
+static pthread_t history_thread;
+static atomic_int history_running = 0;
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t history_cond = PTHREAD_COND_INITIALIZER;    // Request queued or outbox drained
+static struct history_request *history_queue_head = NULL;
+static struct history_request *history_queue_tail = NULL;
+static int history_pending = 0;
+static struct history_reply *history_outbox_head = NULL;
+static struct history_reply *history_outbox_tail = NULL;
+static int history_outbox_count = 0;
+static double history_tokens = 0;                   // Tick only
+static unsigned long long history_refill_us = 0;    // Tick only
+
+// plugin_opt_history_acl: the topics each client may replay. Replies are published
+// straight to the requester and bypass the broker's ACL, so without a grant covering a
+// row's topic the row is never sent (and with no grants at all every request is refused).
+struct history_grant {
+    char *user;                 // NULL = any client ("*")
+    char *filter;               // May contain %u (username) and %c (client id)
+};
+static struct history_grant *history_acl = NULL;
+static int history_acl_count = 0;
+
+static void history_request_release(struct history_request *req) {
+    if (atomic_fetch_sub(&req->refs, 1) != 1) {
+        return;
+    }
+    free(req->client_id);
+    free(req->response_topic);
+    free(req->correlation);
+    free(req->filter);
+    for (int i = 0; i < req->grant_count; i++) {
+        free(req->grants[i]);
+    }
+    free(req->grants);
+    free(req);
+}
+
+// Parse comma-separated user=filter grants, appending to history_acl
+static void parse_history_acl(const char *acl_str) {
+    char *acl_copy = strdup(acl_str);
+    if (acl_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    for (char *token = strtok_r(acl_copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        while (*token == ' ') token++;
+        char *end = token + strlen(token);
+        while (end > token && end[-1] == ' ') {
+            *--end = '\0';
+        }
+        char *filter = strchr(token, '=');
+        if (filter == NULL || filter == token || filter[1] == '\0' || mosquitto_sub_topic_check(filter + 1) != MOSQ_ERR_SUCCESS) {
+            if (*token != '\0') {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid history_acl grant: %s", token);
+            }
+            continue;
+        }
+        *filter++ = '\0';
+        
+        struct history_grant *grants = realloc(history_acl, (size_t)(history_acl_count + 1) * sizeof(*grants));
+        if (grants == NULL) {
+            break;
+        }
+        history_acl = grants;
+        struct history_grant *grant = &history_acl[history_acl_count];
+        grant->user = strcmp(token, "*") == 0 ? NULL : strdup(token);
+        grant->filter = strdup(filter);
+        if (grant->filter == NULL || (grant->user == NULL && strcmp(token, "*") != 0)) {
+            free(grant->user);
+            free(grant->filter);
+            break;
+        }
+        history_acl_count++;
+        LOG_DEBUG("History grant: %s may read %s", token, filter);
+    }
+    free(acl_copy);
+}
+
+static void free_history_acl(void) {
+    for (int i = 0; i < history_acl_count; i++) {
+        free(history_acl[i].user);
+        free(history_acl[i].filter);
+    }
+    free(history_acl);
+    history_acl = NULL;
+    history_acl_count = 0;
+}
+
+// Substitute %u and %c in a grant filter. Returns NULL (no grant) if the client lacks
+// the identity the filter needs or has one that would widen it (+, # or /).
+static char *history_grant_resolve(const char *filter, const char *username, const char *client_id) {
+    size_t len = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        char *out = pass == 1 ? malloc(len + 1) : NULL;
+        if (pass == 1 && out == NULL) {
+            return NULL;
+        }
+        size_t n = 0;
+        for (const char *c = filter; *c != '\0'; c++) {
+            const char *value = NULL;
+            if (c[0] == '%' && (c[1] == 'u' || c[1] == 'c')) {
+                value = c[1] == 'u' ? username : client_id;
+                if (value == NULL || value[0] == '\0' || strpbrk(value, "+#/") != NULL) {
+                    free(out);
+                    return NULL;
+                }
+                c++;
+            }
+            size_t vlen = value != NULL ? strlen(value) : 1;
+            if (out != NULL) {
+                memcpy(out + n, value != NULL ? value : c, vlen);
+            }
+            n += vlen;
+        }
+        if (out != NULL) {
+            out[n] = '\0';
+            return out;
+        }
+        len = n;
+    }
+    return NULL;
+}
+
+// Resolve the grants applying to the requesting client into req->grants. Returns -1 if
+// out of memory.
+static int history_request_grants(struct history_request *req, const struct mosquitto *client) {
+    const char *username = mosquitto_client_username(client);
+    req->grants = history_acl_count > 0 ? calloc((size_t)history_acl_count, sizeof(*req->grants)) : NULL;
+    if (history_acl_count > 0 && req->grants == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < history_acl_count; i++) {
+        const struct history_grant *grant = &history_acl[i];
+        if (grant->user != NULL && (username == NULL || strcmp(grant->user, username) != 0)) {
+            continue;
+        }
+        char *filter = history_grant_resolve(grant->filter, username, req->client_id);
+        if (filter != NULL) {
+            req->grants[req->grant_count++] = filter;
+        }
+    }
+    return 0;
+}
+
+// Whether a history_acl grant of the requester covers topic
+static int history_allowed(const struct history_request *req, const char *topic) {
+    for (int i = 0; i < req->grant_count; i++) {
+        bool result = false;
+        if (mosquitto_topic_matches_sub(req->grants[i], topic, &result) == MOSQ_ERR_SUCCESS && result) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct history_reply *history_reply_new(struct history_request *req, int kind, size_t data_size) {
+    struct history_reply *reply = malloc(sizeof(*reply) + data_size);
+    if (reply == NULL) {
+        return NULL;
+    }
+    memset(reply, 0, sizeof(*reply));
+    reply->request = req;
+    reply->kind = kind;
+    atomic_fetch_add(&req->refs, 1);
+    return reply;
+}
+
+static void history_reply_free(struct history_reply *reply) {
+    history_request_release(reply->request);
+    free(reply);
+}
+
+// Append a reply for the tick. The history thread waits while the outbox is full (wait);
+// the broker thread never does. Returns -1 (reply freed) once the thread is stopping.
+static int history_outbox_push(struct history_reply *reply, int wait) {
+    pthread_mutex_lock(&history_mutex);
+    while (wait && history_outbox_count >= HISTORY_OUTBOX_LIMIT && atomic_load(&history_running)) {
+        pthread_cond_wait(&history_cond, &history_mutex);
+    }
+    if (wait && !atomic_load(&history_running)) {
+        pthread_mutex_unlock(&history_mutex);
+        history_reply_free(reply);
+        return -1;
+    }
+    if (history_outbox_tail != NULL) {
+        history_outbox_tail->next = reply;
+    } else {
+        history_outbox_head = reply;
+    }
+    history_outbox_tail = reply;
+    history_outbox_count++;
+    pthread_mutex_unlock(&history_mutex);
+    return 0;
+}
+
+static void history_reply_error(struct history_request *req, const char *reason, int wait) {
+    struct history_reply *reply = history_reply_new(req, HISTORY_REPLY_ERROR, 0);
+    if (reply != NULL) {
+        reply->text = reason;
+        history_outbox_push(reply, wait);
+    }
+}
+
+// SQL function topic_matches(filter, topic): MQTT filter matching for the residual of
+// a range scan (levels after the first wildcard)
+static void sql_topic_matches(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    UNUSED(argc);
+    const char *filter = (const char *)sqlite3_value_text(argv[0]);
+    const char *topic = (const char *)sqlite3_value_text(argv[1]);
+    bool result = false;
+    if (filter != NULL && topic != NULL && mosquitto_topic_matches_sub(filter, topic, &result) != MOSQ_ERR_SUCCESS) {
+        result = false;
+    }
+    sqlite3_result_int(ctx, result);
+}
+
+#ifdef WITH_ZSTD
+// decompress() on the history thread resolves dictionary ids through the thread's
+// ddict list, which is switched to the shard being read (ids are per database)
+static void history_use_dicts(struct history_source *src) {
+    compression_ddicts = src->ddicts;
+    compression_ddict_count = src->ddict_count;
+}
+
+static void history_save_dicts(struct history_source *src) {
+    src->ddicts = compression_ddicts;
+    src->ddict_count = compression_ddict_count;
+}
+
+// Load dictionaries stored since the last request
+static void history_load_dicts(struct history_source *src) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(src->db, "SELECT id, dict FROM compression_dict WHERE id > ?1 ORDER BY id",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        return;     // No dictionary stored yet
+    }
+    sqlite3_bind_int64(stmt, 1, src->dict_max_id);
+    history_use_dicts(src);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+        if (compression_add_ddict((unsigned)id, sqlite3_column_blob(stmt, 1), (size_t)sqlite3_column_bytes(stmt, 1)) == 0) {
+            src->dict_max_id = id;
+        }
+    }
+    history_save_dicts(src);
+    sqlite3_finalize(stmt);
+}
+#endif
+
+// Open the shard's read-only connection and prepare the scan statements (key > ?1,
+// residual filter ?2, LIMIT ?3 and for range scans topic >= ?4 AND topic < ?5). Returns
+// 0 on success.
+static int history_source_open(struct history_source *src) {
+    if (src->db != NULL) {
+        return 0;
+    }
+    if (atomic_load(&src->shard->ready) != 1) {
+        return -1;
+    }
+    if (sqlite3_open_v2(src->shard->db_path, &src->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "History connection to %s failed: %s",
+                            src->shard->db_path, sqlite3_errmsg(src->db));
+        sqlite3_close(src->db);
+        src->db = NULL;
+        return -1;
+    }
+    sqlite3_busy_timeout(src->db, 1000);
+    sqlite3_create_function(src->db, "topic_matches", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_topic_matches, NULL, NULL);
+#ifdef WITH_ZSTD
+    sqlite3_create_function(src->db, "decompress", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_decompress, NULL, NULL);
+#endif
+    src->schema_version = -1;
+    
+    // Binary layouts compare the raw key column of the msg view
+    const char *key = ulid_format == ULID_FORMAT_BINARY ? "ulid_bin" : "ulid";
+    const char *payload = compression_enabled ? "decompress(payload, codec)" : "payload";
+    char sql[512];
+    snprintf(sql, sizeof(sql),
+             "SELECT ulid, topic, %s FROM msg WHERE %s > ?1 AND topic >= ?4 AND topic < ?5 "
+             "AND topic_matches(?2, topic) ORDER BY %s LIMIT ?3", payload, key, key);
+    int rc = sqlite3_prepare_v2(src->db, sql, -1, &src->range_stmt, 0);
+    if (rc == SQLITE_OK) {
+        snprintf(sql, sizeof(sql),
+                 "SELECT ulid, topic, %s FROM msg WHERE %s > ?1 AND topic_matches(?2, topic) ORDER BY %s LIMIT ?3",
+                 payload, key, key);
+        rc = sqlite3_prepare_v2(src->db, sql, -1, &src->scan_stmt, 0);
+    }
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare history queries on %s: %s",
+                            src->shard->db_path, sqlite3_errmsg(src->db));
+        sqlite3_finalize(src->range_stmt);
+        sqlite3_finalize(src->scan_stmt);
+        sqlite3_close(src->db);
+        src->range_stmt = src->scan_stmt = NULL;
+        src->db = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void history_source_tables_free(struct history_source *src) {
+    for (int i = 0; i < src->table_count; i++) {
+        sqlite3_finalize(src->table_stmts[i]);
+    }
+    sqlite3_finalize(src->topic_stmt);
+    free(src->table_stmts);
+    free(src->table_days);
+    src->topic_stmt = NULL;
+    src->table_stmts = NULL;
+    src->table_days = NULL;
+    src->table_count = 0;
+    src->schema_version = -1;
+}
+
+// Add one message table's stream statement and its arm of the topic query. Returns 0
+// on success.
+static int history_source_add_table(struct history_source *src, const char *table, int day, sqlite3_str *topics) {
+    sqlite3_stmt **stmts = realloc(src->table_stmts, (size_t)(src->table_count + 1) * sizeof(*stmts));
+    if (stmts == NULL) {
+        return -1;
+    }
+    src->table_stmts = stmts;
+    int *days = realloc(src->table_days, (size_t)(src->table_count + 1) * sizeof(*days));
+    if (days == NULL) {
+        return -1;
+    }
+    src->table_days = days;
+    
+    char sql[512];
+    snprintf(sql, sizeof(sql), "SELECT ulid, %s FROM %s WHERE ulid > ?1 AND %s = ?2 ORDER BY ulid LIMIT ?3",
+             compression_enabled ? "decompress(payload, codec)" : "payload", table, topic_column);
+    if (sqlite3_prepare_v2(src->db, sql, -1, &src->table_stmts[src->table_count], 0) != SQLITE_OK) {
+        return -1;
+    }
+    if (!topic_dictionary) {
+        sqlite3_str_appendf(topics, "%sSELECT (SELECT topic FROM %s WHERE topic >= ?1 AND topic < ?2 "
+                            "ORDER BY topic LIMIT 1) AS t", src->table_count > 0 ? " UNION ALL " : "", table);
+    }
+    src->table_days[src->table_count++] = day;
+    return 0;
+}
+
+// (Re)prepare the topic and per-table statements when the schema changed, e.g. when a
+// partition was created or dropped. Returns 0 on success.
+static int history_source_tables(struct history_source *src) {
+    sqlite3_stmt *stmt = NULL;
+    int version = -1;
+    if (sqlite3_prepare_v2(src->db, "PRAGMA schema_version", -1, &stmt, 0) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (version >= 0 && version == src->schema_version) {
+        return 0;
+    }
+    history_source_tables_free(src);
+    
+    // Skip scan over the distinct topics: one index seek per topic. Without the dictionary
+    // the smallest of every table's first topic in the range is the next one.
+    sqlite3_str *topics = sqlite3_str_new(src->db);
+    sqlite3_str_appendall(topics, topic_dictionary ?
+                          "SELECT name, id FROM topic WHERE name >= ?1 AND name < ?2 ORDER BY name LIMIT 1" :
+                          "SELECT min(t), 0 FROM (");
+    int rc = 0;
+    if (partition_mode != PARTITION_NONE) {
+        // Partition names sort by their first day
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "%s_p", msg_table);
+        stmt = NULL;
+        rc = sqlite3_prepare_v2(src->db, "SELECT name FROM sqlite_master WHERE type = 'table' AND substr(name, 1, ?2) = ?1 "
+                                "ORDER BY name", -1, &stmt, 0) == SQLITE_OK ? 0 : -1;
+        if (rc == 0) {
+            sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 2, (int)strlen(prefix));
+        }
+        int step = SQLITE_DONE;
+        while (rc == 0 && (step = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char *name = (const char *)sqlite3_column_text(stmt, 0);
+            int day = partition_name_day(name + strlen(prefix));
+            if (day >= 0) {
+                rc = history_source_add_table(src, name, day, topics);
+            }
+        }
+        // Partitions missed by a failed listing would silently drop their rows from replies
+        if (rc == 0 && step != SQLITE_DONE) {
+            rc = -1;
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        rc = history_source_add_table(src, msg_table, 0, topics);
+    }
+    if (!topic_dictionary) {
+        sqlite3_str_appendall(topics, ")");
+    }
+    
+    char *topic_sql = sqlite3_str_finish(topics);
+    if (rc == 0 && src->table_count > 0 &&
+        (topic_sql == NULL || sqlite3_prepare_v2(src->db, topic_sql, -1, &src->topic_stmt, 0) != SQLITE_OK)) {
+        rc = -1;
+    }
+    sqlite3_free(topic_sql);
+    if (rc != 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare history topic queries on %s: %s",
+                            src->shard->db_path, sqlite3_errmsg(src->db));
+        history_source_tables_free(src);
+        return -1;
+    }
+    src->schema_version = version;
+    return 0;
+}
+
+static void history_source_close(struct history_source *src) {
+    history_source_tables_free(src);
+    sqlite3_finalize(src->range_stmt);
+    sqlite3_finalize(src->scan_stmt);
+    sqlite3_close(src->db);
+#ifdef WITH_ZSTD
+    history_use_dicts(src);
+    compression_cleanup();
+#endif
+    memset(src, 0, sizeof(*src));
+}
+
+// Table a topic stream starts in: the last one beginning on or before the cursor's day
+static int history_first_table(const struct history_source *src, const char *cursor) {
+    if (cursor[0] == '\0') {
+        return 0;
+    }
+    int day = ulid_day(cursor);
+    int lo = 0, hi = src->table_count - 1, found = 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (src->table_days[mid] <= day) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+static void history_streams_free(struct history_stream *streams, int count) {
+    for (int i = 0; i < count; i++) {
+        struct history_stream *s = &streams[i];
+        while (s->pos < s->count) {
+            history_reply_free(s->rows[s->pos++]);
+        }
+        free(s->topic);
+        free(s->rows);
+    }
+    free(streams);
+}
+
+// Append a stream reading from the request's since. Returns NULL if out of memory.
+static struct history_stream *history_stream_add(struct history_stream **streams, int *count, int *capacity,
+                                                 struct history_source *src, const struct history_request *req) {
+    if (*count == *capacity) {
+        int grown = *capacity > 0 ? *capacity * 2 : 16;
+        struct history_stream *resized = realloc(*streams, (size_t)grown * sizeof(*resized));
+        if (resized == NULL) {
+            return NULL;
+        }
+        *streams = resized;
+        *capacity = grown;
+    }
+    struct history_stream *s = &(*streams)[(*count)++];
+    memset(s, 0, sizeof(*s));
+    s->src = src;
+    memcpy(s->cursor, req->since, sizeof(s->cursor));
+    return s;
+}
+
+// Add a stream per topic in [lo, hi) of each shard that matches the filter and the
+// requester's grants, found with one index seek per distinct topic (the bound after a
+// topic is the topic plus a NUL byte, the smallest string sorting after it). Returns 0,
+// 1 if the range holds too many topics to merge (the caller scans instead), or -1 on error.
+static int history_topic_streams(struct history_source *sources, struct history_request *req,
+                                 const char *lo, const char *hi, size_t range_len,
+                                 struct history_stream **streams, int *count) {
+    int capacity = 0;
+    int probes = 0;
+    size_t from_size = strlen(lo) + 1;
+    char *from = malloc(from_size);
+    if (from == NULL) {
+        return -1;
+    }
+    int result = 0;
+    for (int k = 0; k < shard_count && result == 0; k++) {
+        struct history_source *src = &sources[k];
+        if (src->skip || src->topic_stmt == NULL) {
+            continue;
+        }
+        sqlite3_stmt *stmt = src->topic_stmt;
+        size_t from_len = strlen(lo);
+        memcpy(from, lo, from_len);
+        while (result == 0) {
+            if (++probes > HISTORY_MAX_PROBES) {
+                result = 1;
+                break;
+            }
+            sqlite3_bind_text(stmt, 1, from, (int)from_len, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, hi, (int)range_len, SQLITE_STATIC);
+            int rc = sqlite3_step(stmt);
+            const char *topic = rc == SQLITE_ROW ? (const char *)sqlite3_column_text(stmt, 0) : NULL;
+            if (topic == NULL) {
+                if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "History topic query on %s failed: %s",
+                                        src->shard->db_path, sqlite3_errmsg(src->db));
+                    result = -1;
+                }
+                sqlite3_reset(stmt);
+                break;
+            }
+            size_t len = (size_t)sqlite3_column_bytes(stmt, 0);
+            bool match = false;
+            if (mosquitto_topic_matches_sub(req->filter, topic, &match) == MOSQ_ERR_SUCCESS && match &&
+                history_allowed(req, topic)) {
+                struct history_stream *s = NULL;
+                if (*count >= HISTORY_MAX_STREAMS) {
+                    result = 1;
+                } else if ((s = history_stream_add(streams, count, &capacity, src, req)) == NULL ||
+                           (s->topic = strndup(topic, len)) == NULL) {
+                    result = -1;
+                } else {
+                    s->topic_id = sqlite3_column_int64(stmt, 1);
+                    s->table = history_first_table(src, req->since);
+                }
+            }
+            if (len + 1 > from_size) {
+                char *grown = realloc(from, len + 1);
+                if (grown == NULL) {
+                    result = -1;
+                } else {
+                    from = grown;
+                    from_size = len + 1;
+                }
+            }
+            if (result == 0) {
+                memcpy(from, topic, len);
+                from[len] = '\0';
+                from_len = len + 1;
+            }
+            sqlite3_reset(stmt);
+        }
+    }
+    free(from);
+    return result;
+}
+
+// Read the stream's next page after its cursor into rows. The statement is reset before
+// the rows are published, so a slow subscriber never holds a read snapshot (and with it
+// the WAL) open. Returns 0 on success, -1 on error.
+static int history_fetch(struct history_stream *s, struct history_request *req,
+                         const char *lo, const char *hi, size_t range_len, int page) {
+    struct history_source *src = s->src;
+    sqlite3_stmt *stmt;
+    if (s->topic != NULL) {
+        stmt = src->table_stmts[s->table];
+        if (topic_dictionary) {
+            sqlite3_bind_int64(stmt, 2, s->topic_id);
+        } else {
+            sqlite3_bind_text(stmt, 2, s->topic, -1, SQLITE_STATIC);
+        }
+    } else {
+        stmt = lo != NULL ? src->range_stmt : src->scan_stmt;
+        sqlite3_bind_text(stmt, 2, req->filter, -1, SQLITE_STATIC);
+        if (lo != NULL) {
+            sqlite3_bind_text(stmt, 4, lo, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 5, hi, (int)range_len, SQLITE_STATIC);
+        }
+    }
+    unsigned char bin[16];
+    if (ulid_format == ULID_FORMAT_BINARY) {
+        // Every key sorts after the empty blob
+        if (s->cursor[0] != '\0' && ulid_decode(bin, s->cursor) == 0) {
+            sqlite3_bind_blob(stmt, 1, bin, sizeof(bin), SQLITE_STATIC);
+        } else {
+            sqlite3_bind_blob(stmt, 1, "", 0, SQLITE_STATIC);
+        }
+    } else {
+        sqlite3_bind_text(stmt, 1, s->cursor, -1, SQLITE_STATIC);
+    }
+    sqlite3_bind_int(stmt, 3, page);
+#ifdef WITH_ZSTD
+    history_use_dicts(src);
+#endif
+    
+    // Topic streams select (key, payload), scans (ulid, topic, payload)
+    int payload_col = s->topic != NULL ? 1 : 2;
+    int rc;
+    int read = 0;
+    s->count = s->pos = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        char ulid[27];
+        column_ulid_text(stmt, 0, ulid);
+        read++;
+        if (strlen(ulid) != 26) {
+            continue;
+        }
+        memcpy(s->cursor, ulid, sizeof(s->cursor));
+        const char *topic = s->topic != NULL ? s->topic : (const char *)sqlite3_column_text(stmt, 1);
+        if (topic == NULL || (s->topic == NULL && !history_allowed(req, topic))) {
+            continue;
+        }
+        const void *payload = sqlite3_column_blob(stmt, payload_col);
+        size_t payload_len = (size_t)sqlite3_column_bytes(stmt, payload_col);
+        size_t topic_len = strlen(topic);
+        struct history_reply *reply = history_reply_new(req, HISTORY_REPLY_ROW, topic_len + 1 + payload_len);
+        if (reply == NULL) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        memcpy(reply->ulid, ulid, sizeof(reply->ulid));
+        memcpy(reply->data, topic, topic_len + 1);
+        if (payload_len > 0) {
+            memcpy(reply->data + topic_len + 1, payload, payload_len);
+        }
+        reply->text = reply->data;
+        reply->payload = reply->data + topic_len + 1;
+        reply->payload_len = payload_len;
+        s->rows[s->count++] = reply;
+    }
+#ifdef WITH_ZSTD
+    history_save_dicts(src);
+#endif
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "History query on %s failed: %s",
+                            src->shard->db_path, sqlite3_errmsg(src->db));
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        s->done = 1;
+    } else if (read < page) {
+        // A topic stream goes on with the next (later) partition
+        s->done = s->topic == NULL || ++s->table >= src->table_count;
+    }
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// Read pages until the stream has a row or is done (a page may hold only rows the
+// requester may not read, or a partition none of the topic's rows)
+static int history_fill(struct history_stream *s, struct history_request *req,
+                        const char *lo, const char *hi, size_t range_len, int page) {
+    while (s->pos == s->count && !s->done) {
+        if (history_fetch(s, req, lo, hi, range_len, page) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Min-heap of the streams holding a row, ordered by that row's key
+static int history_stream_before(const struct history_stream *a, const struct history_stream *b) {
+    return strcmp(a->rows[a->pos]->ulid, b->rows[b->pos]->ulid) < 0;
+}
+
+static void history_heap_down(struct history_stream **heap, int count, int i) {
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < count && history_stream_before(heap[left], heap[least])) {
+            least = left;
+        }
+        if (right < count && history_stream_before(heap[right], heap[least])) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        struct history_stream *swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+// Answer one request: the matching topics of each shard are read as separate streams on
+// the (topic, ulid) index and merged in key order until limit rows have been queued, then
+// the end marker tells the client where the next page starts
+static void history_serve(struct history_source *sources, struct history_request *req) {
+    // Range of topics sharing the literal prefix. "a/b/#" also matches "a/b", so its range
+    // starts at the parent; an exact topic's range is the topic alone.
+    size_t prefix = strcspn(req->filter, "+#");
+    int wildcard = req->filter[prefix] != '\0';
+    char *lo = NULL, *hi = NULL;
+    size_t range_len = 0;
+    if (prefix > 0) {
+        lo = strndup(req->filter, prefix);
+        hi = malloc(prefix + 2);
+        if (lo == NULL || hi == NULL) {
+            free(lo);
+            free(hi);
+            history_reply_error(req, "out of memory", 1);
+            return;
+        }
+        if (wildcard && strcmp(req->filter + prefix, "#") == 0 && lo[prefix - 1] == '/') {
+            lo[prefix - 1] = '\0';
+        }
+        // UTF-8 never contains 0xff, so the last byte can always be incremented
+        memcpy(hi, req->filter, prefix);
+        if (wildcard) {
+            hi[prefix - 1]++;
+            range_len = prefix;
+        } else {
+            hi[prefix] = '\x01';
+            range_len = prefix + 1;
+        }
+        hi[range_len] = '\0';
+    }
+    
+    // A topic, or a filter fixing the hashed levels, lives on one shard
+    int only = -1;
+    if (shard_count > 1) {
+        int levels = 0;
+        for (size_t i = 0; i < prefix; i++) {
+            levels += req->filter[i] == '/';
+        }
+        if (!wildcard || (shard_levels > 0 && levels >= shard_levels)) {
+            only = shard_for_topic(req->filter)->index;
+        }
+    }
+    
+    int failed = 0;
+    for (int k = 0; k < shard_count; k++) {
+        struct history_source *src = &sources[k];
+        src->skip = only >= 0 && k != only;
+        if (!src->skip && (history_source_open(src) != 0 || history_source_tables(src) != 0)) {
+            failed = 1;
+        }
+#ifdef WITH_ZSTD
+        if (!src->skip && !failed && compression_enabled) {
+            history_load_dicts(src);
+        }
+#endif
+    }
+    
+    // A filter starting with a wildcard enumerates every topic ("" to 0xff)
+    struct history_stream *streams = NULL;
+    int stream_count = 0;
+    if (!failed) {
+        int rc = history_topic_streams(sources, req, lo != NULL ? lo : "", hi != NULL ? hi : "\xff",
+                                       hi != NULL ? range_len : 1, &streams, &stream_count);
+        if (rc == 1) {
+            // Too many topics: scan the range of each shard in key order instead
+            history_streams_free(streams, stream_count);
+            streams = NULL;
+            stream_count = 0;
+            int capacity = 0;
+            for (int k = 0; k < shard_count && !failed; k++) {
+                if (!sources[k].skip && history_stream_add(&streams, &stream_count, &capacity, &sources[k], req) == NULL) {
+                    failed = 1;
+                }
+            }
+        } else if (rc != 0) {
+            failed = 1;
+        }
+    }
+    
+    // Each stream reads a share of the page, at least HISTORY_STREAM_ROWS
+    int page = req->limit < HISTORY_PAGE_ROWS ? req->limit : HISTORY_PAGE_ROWS;
+    if (stream_count > 1) {
+        int share = page / stream_count;
+        page = share > HISTORY_STREAM_ROWS ? share : (page < HISTORY_STREAM_ROWS ? page : HISTORY_STREAM_ROWS);
+    }
+    struct history_stream **heap = stream_count > 0 ? malloc((size_t)stream_count * sizeof(*heap)) : NULL;
+    int heap_count = 0;
+    if (stream_count > 0 && heap == NULL) {
+        failed = 1;
+    }
+    for (int i = 0; i < stream_count && !failed; i++) {
+        struct history_stream *s = &streams[i];
+        s->rows = malloc((size_t)page * sizeof(*s->rows));
+        if (s->rows == NULL || history_fill(s, req, lo, hi, range_len, page) != 0) {
+            failed = 1;
+        } else if (s->pos < s->count) {
+            heap[heap_count++] = s;
+        }
+    }
+    for (int i = heap_count / 2 - 1; i >= 0; i--) {
+        history_heap_down(heap, heap_count, i);
+    }
+    
+    unsigned long sent = 0;
+    char last[27];
+    memcpy(last, req->since, sizeof(last));
+    while (!failed && heap_count > 0 && sent < (unsigned long)req->limit && atomic_load(&history_running)) {
+        struct history_stream *best = heap[0];
+        struct history_reply *reply = best->rows[best->pos++];
+        memcpy(last, reply->ulid, sizeof(last));
+        if (history_outbox_push(reply, 1) != 0) {
+            failed = 1;
+            break;
+        }
+        sent++;
+        if (sent < (unsigned long)req->limit && history_fill(best, req, lo, hi, range_len, page) != 0) {
+            failed = 1;
+            break;
+        }
+        if (best->pos == best->count) {
+            heap[0] = heap[--heap_count];
+        }
+        history_heap_down(heap, heap_count, 0);
+    }
+    
+    // Rows read past the limit are read again by the next page
+    history_streams_free(streams, stream_count);
+    free(heap);
+    free(lo);
+    free(hi);
+    
+    if (failed) {
+        history_reply_error(req, "history unavailable", 1);
+        return;
+    }
+    struct history_reply *end = history_reply_new(req, HISTORY_REPLY_END, 0);
+    if (end != NULL) {
+        end->count = sent;
+        memcpy(end->ulid, last, sizeof(end->ulid));
+        history_outbox_push(end, 1);
+    }
+}
+
+// History thread: one request at a time, in arrival order
+static void *history_worker(void *arg) {
+    (void)arg;
+    struct history_source *sources = calloc((size_t)shard_count, sizeof(*sources));
+    if (sources == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate history sources");
+        return NULL;
+    }
+    for (int k = 0; k < shard_count; k++) {
+        sources[k].shard = &shards[k];
+    }
+    
+    while (1) {
+        pthread_mutex_lock(&history_mutex);
+        while (history_queue_head == NULL && atomic_load(&history_running)) {
+            pthread_cond_wait(&history_cond, &history_mutex);
+        }
+        struct history_request *req = history_queue_head;
+        if (!atomic_load(&history_running)) {
+            pthread_mutex_unlock(&history_mutex);
+            break;
+        }
+        history_queue_head = req->next;
+        if (history_queue_head == NULL) {
+            history_queue_tail = NULL;
+        }
+        history_pending--;
+        pthread_mutex_unlock(&history_mutex);
+        
+        history_serve(sources, req);
+        history_request_release(req);
+    }
+    
+    for (int k = 0; k < shard_count; k++) {
+        history_source_close(&sources[k]);
+    }
+    free(sources);
+    return NULL;
+}
+
+// Parse a request on the broker thread and queue it. Requests without a Response Topic
+// cannot be answered and are dropped; malformed ones get an error reply.
+static void history_request_received(const struct mosquitto_evt_message *ed) {
+    char *response_topic = NULL;
+    if (mosquitto_property_read_string(ed->properties, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false) == NULL ||
+        response_topic == NULL) {
+        LOG_DEBUG("History request on %s without a response topic ignored", ed->topic);
+        return;
+    }
+    struct history_request *req = calloc(1, sizeof(*req));
+    if (req == NULL) {
+        free(response_topic);
+        return;
+    }
+    const char *client_id = mosquitto_client_id(ed->client);
+    atomic_init(&req->refs, 1);
+    req->response_topic = response_topic;
+    req->client_id = client_id != NULL ? strdup(client_id) : NULL;
+    req->qos = ed->qos;
+    req->limit = DEFAULT_HISTORY_LIMIT;
+    mosquitto_property_read_binary(ed->properties, MQTT_PROP_CORRELATION_DATA, &req->correlation, &req->correlation_len, false);
+    
+    const char *error = NULL;
+    struct user_property up;
+    for (const mosquitto_property *prop = read_user_property(ed->properties, &up, false);
+         prop != NULL && error == NULL;
+         prop = read_user_property(prop, &up, true)) {
+        if (up.name == NULL || up.value == NULL) {
+            continue;
+        }
+        if (up.name_len == 6 && memcmp(up.name, "filter", 6) == 0) {
+            free(req->filter);
+            req->filter = strndup(up.value, up.value_len);
+        } else if (up.name_len == 5 && memcmp(up.name, "since", 5) == 0) {
+            unsigned char bin[16];
+            char value[27];
+            snprintf(value, sizeof(value), "%.*s", (int)up.value_len, up.value);
+            if (up.value_len == 26 && ulid_decode(bin, value) == 0) {
+                memcpy(req->since, value, sizeof(req->since));
+            } else if (up.value_len > 0 && up.value_len <= 15 && strspn(value, "0123456789") == up.value_len) {
+                // Unix milliseconds: the lowest key of that millisecond
+                timestamp_to_ulid_prefix(strtoull(value, NULL, 10), req->since);
+                memset(req->since + 10, '0', 16);
+                req->since[26] = '\0';
+            } else {
+                error = "invalid since";
+            }
+        } else if (up.name_len == 5 && memcmp(up.name, "limit", 5) == 0) {
+            char value[16];
+            snprintf(value, sizeof(value), "%.*s", (int)up.value_len, up.value);
+            char *end = NULL;
+            long limit = strtol(value, &end, 10);
+            if (up.value_len == 0 || up.value_len >= sizeof(value) || *end != '\0' || limit <= 0) {
+                error = "invalid limit";
+            } else {
+                req->limit = limit < history_max_limit ? (int)limit : history_max_limit;
+            }
+        }
+    }
+    if (error == NULL && req->filter == NULL) {
+        req->filter = strdup(ed->topic + strlen(HISTORY_PREFIX));
+    }
+    if (error == NULL && (req->filter == NULL || (client_id != NULL && req->client_id == NULL))) {
+        error = "out of memory";
+    }
+    if (error == NULL && (req->filter[0] == '\0' || mosquitto_sub_topic_check(req->filter) != MOSQ_ERR_SUCCESS)) {
+        error = "invalid filter";
+    }
+    if (error == NULL && history_request_grants(req, ed->client) != 0) {
+        error = "out of memory";
+    }
+    // Fail closed: no grant, or an exact topic outside them. Wildcard filters are checked
+    // row by row on the history thread.
+    if (error == NULL && (req->grant_count == 0 ||
+                          (strpbrk(req->filter, "+#") == NULL && !history_allowed(req, req->filter)))) {
+        error = "not authorized";
+    }
+    
+    if (error == NULL) {
+        pthread_mutex_lock(&history_mutex);
+        if (history_pending < HISTORY_MAX_PENDING) {
+            if (history_queue_tail != NULL) {
+                history_queue_tail->next = req;
+            } else {
+                history_queue_head = req;
+            }
+            history_queue_tail = req;
+            history_pending++;
+            req = NULL;
+            pthread_cond_broadcast(&history_cond);
+        }
+        pthread_mutex_unlock(&history_mutex);
+        if (req != NULL) {
+            error = "busy";
+        }
+    }
+    if (error != NULL) {
+        LOG_DEBUG("History request on %s refused: %s", ed->topic, error);
+        history_reply_error(req, error, 0);
+        history_request_release(req);
+    }
+}
+
+// Publish queued replies from the tick, within the token bucket of history_rate replies
+// per second (at most one second of burst)
+static void history_publish(void) {
+    unsigned long long now_us = platform_utime(1);
+    int budget = INT_MAX;
+    if (history_rate > 0) {
+        history_tokens += (double)(now_us - history_refill_us) * history_rate / 1000000.0;
+        if (history_refill_us == 0 || history_tokens > history_rate) {
+            history_tokens = history_rate;
+        }
+        budget = (int)history_tokens;
+    }
+    history_refill_us = now_us;
+    if (budget <= 0 || history_outbox_head == NULL) {
+        return;
+    }
+    
+    // Detach up to budget replies, then publish without holding the lock
+    pthread_mutex_lock(&history_mutex);
+    struct history_reply *batch = history_outbox_head;
+    struct history_reply *last = NULL;
+    int taken = 0;
+    for (struct history_reply *r = batch; r != NULL && taken < budget; r = r->next) {
+        last = r;
+        taken++;
+    }
+    if (last != NULL) {
+        history_outbox_head = last->next;
+        if (history_outbox_head == NULL) {
+            history_outbox_tail = NULL;
+        }
+        last->next = NULL;
+        history_outbox_count -= taken;
+        pthread_cond_broadcast(&history_cond);
+    }
+    pthread_mutex_unlock(&history_mutex);
+    if (history_rate > 0) {
+        history_tokens -= taken;
+    }
+    
+    char count[24];
+    while (batch != NULL) {
+        struct history_reply *reply = batch;
+        struct history_request *req = reply->request;
+        batch = reply->next;
+        
+        mosquitto_property *props = NULL;
+        if (req->correlation != NULL) {
+            mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, req->correlation, req->correlation_len);
+        }
+        if (reply->kind == HISTORY_REPLY_ROW) {
+            mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "topic", reply->text);
+            mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "ulid", reply->ulid);
+        } else if (reply->kind == HISTORY_REPLY_END) {
+            snprintf(count, sizeof(count), "%lu", reply->count);
+            mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "history", "end");
+            mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "count", count);
+            if (reply->ulid[0] != '\0') {
+                mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "next", reply->ulid);
+            }
+        } else {
+            mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "history", "error");
+            mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "reason", reply->text);
+        }
+        mosquitto_broker_publish_copy(req->client_id, req->response_topic, (int)reply->payload_len,
+                                      reply->payload, req->qos, false, props);
+        history_reply_free(reply);
+    }
+}
+
+// Stop the history thread and drop the requests and replies still queued
+static void history_stop(void) {
+    if (atomic_load(&history_running)) {
+        pthread_mutex_lock(&history_mutex);
+        atomic_store(&history_running, 0);
+        pthread_cond_broadcast(&history_cond);
+        pthread_mutex_unlock(&history_mutex);
+        pthread_join(history_thread, NULL);
+    }
+    while (history_queue_head != NULL) {
+        struct history_request *req = history_queue_head;
+        history_queue_head = req->next;
+        history_request_release(req);
+    }
+    while (history_outbox_head != NULL) {
+        struct history_reply *reply = history_outbox_head;
+        history_outbox_head = reply->next;
+        history_reply_free(reply);
+    }
+    history_queue_tail = NULL;
+    history_outbox_tail = NULL;
+    history_pending = history_outbox_count = 0;
+}
+
+static void metrics_publish(const char *name, const char *value) {
+    char topic[128];
+    snprintf(topic, sizeof(topic), METRICS_TOPIC_PREFIX "%s", name);
+    mosquitto_broker_publish_copy(NULL, topic, (int)strlen(value), value, 0, true, NULL);
+}
+
+static void metrics_publish_ull(const char *name, unsigned long long value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu", value);
+    metrics_publish(name, buf);
+}
+
+// Publish a histogram: cumulative count and sum, percentiles and max of the values recorded
+// since the last publish, and the cumulative non-empty buckets as [[upper bound, count], ...]
+static void metrics_publish_histogram(const char *name, struct metric_histogram *h) {
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    static const char *const percentile_names[] = { "p50", "p90", "p99", "p999" };
+    unsigned long long delta[METRIC_HIST_BUCKETS];
+    unsigned long long total = 0;
+    unsigned long long interval = 0;
+    char sub[96];
+    
+    sqlite3_str *buckets = sqlite3_str_new(NULL);
+    sqlite3_str_appendchar(buckets, 1, '[');
+    for (int b = 0; b < METRIC_HIST_BUCKETS; b++) {
+        unsigned long long count = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+        delta[b] = count - h->published[b];
+        h->published[b] = count;
+        interval += delta[b];
+        if (count > 0) {
+            total += count;
+            sqlite3_str_appendf(buckets, "%s[%llu,%llu]", sqlite3_str_length(buckets) > 1 ? "," : "",
+                                metric_hist_upper(b), total);
+        }
+    }
+    sqlite3_str_appendchar(buckets, 1, ']');
+    char *json = sqlite3_str_finish(buckets);
+    
+    snprintf(sub, sizeof(sub), "%s/count", name);
+    metrics_publish_ull(sub, total);
+    snprintf(sub, sizeof(sub), "%s/sum", name);
+    metrics_publish_ull(sub, atomic_load_explicit(&h->sum, memory_order_relaxed));
+    if (json != NULL) {
+        snprintf(sub, sizeof(sub), "%s/buckets", name);
+        metrics_publish(sub, json);
+        sqlite3_free(json);
+    }
+    if (interval == 0) {
+        return;
+    }
+    
+    unsigned long long seen = 0;
+    int p = 0;
+    int max_bucket = 0;
+    for (int b = 0; b < METRIC_HIST_BUCKETS; b++) {
+        if (delta[b] == 0) {
+            continue;
+        }
+        seen += delta[b];
+        max_bucket = b;
+        while (p < 4 && seen * 100.0 >= interval * percentiles[p]) {
+            snprintf(sub, sizeof(sub), "%s/%s", name, percentile_names[p]);
+            metrics_publish_ull(sub, metric_hist_upper(b));
+            p++;
+        }
+    }
+    snprintf(sub, sizeof(sub), "%s/max", name);
+    metrics_publish_ull(sub, metric_hist_upper(max_bucket));
+}
+
+// Publish the hot-path metrics under $SYS/broker/mqbase/. Runs on the broker thread
+// (MOSQ_EVT_TICK), the only thread allowed to publish.
+static void publish_metrics(time_t now) {
+    double elapsed = (double)(now - metrics.last_publish);
+    metrics.last_publish = now;
+    
+    // Queue gauges are totals over the shards, with per-shard depth when sharded
+    size_t enqueued = 0, depth = 0, bytes = 0;
+    char name[64];
+    for (int k = 0; k < shard_count; k++) {
+        size_t shard_depth = (size_t)atomic_load(&shards[k].queue.size);
+        enqueued += atomic_load_explicit(&shards[k].queue.tail, memory_order_relaxed);
+        depth += shard_depth;
+        bytes += atomic_load(&shards[k].queue_bytes);
+        if (shard_count > 1) {
+            snprintf(name, sizeof(name), "shard/%d/depth", k);
+            metrics_publish_ull(name, (unsigned long long)shard_depth);
+        }
+    }
+    char rate[32];
+    snprintf(rate, sizeof(rate), "%.1f", elapsed > 0 ? (enqueued - metrics.published_enqueued) / elapsed : 0.0);
+    metrics.published_enqueued = enqueued;
+    
+    metrics_publish_ull("queue/depth", (unsigned long long)depth);
+    metrics_publish_ull("queue/bytes", (unsigned long long)bytes);
+    metrics_publish_ull("queue/high_water", (unsigned long long)atomic_exchange(&metrics.queue_high_water, 0));
+    metrics_publish_ull("queue/enqueued", (unsigned long long)enqueued);
+    metrics_publish("queue/enqueue_rate", rate);
+    
+    const atomic_ullong *drops = (const atomic_ullong *)&queue_drops;
+    for (size_t i = 0; i < QUEUE_DROP_COUNTERS; i++) {
+        snprintf(name, sizeof(name), "queue/%s", queue_drop_names[i]);
+        metrics_publish_ull(name, atomic_load(&drops[i]));
+    }
+    
+    metrics_publish_histogram("batch/rows", &metrics.batch_rows);
+    metrics_publish_histogram("batch/commit_us", &metrics.commit_us);
+    metrics_publish_histogram("latency_us", &metrics.latency_us);
+    metrics_publish_histogram("checkpoint/duration_us", &metrics.checkpoint_us);
+    metrics_publish_ull("checkpoint/count", atomic_load(&metrics.checkpoints));
+    metrics_publish_ull("checkpoint/escalations", atomic_load(&metrics.checkpoint_escalations));
+    metrics_publish_ull("checkpoint/busy", atomic_load(&metrics.checkpoint_busy));
+    unsigned long long wal_frames = 0, frames_left = 0;
+    for (int k = 0; k < shard_count; k++) {
+        wal_frames += (unsigned long long)atomic_load(&shards[k].wal_frames);
+        frames_left += (unsigned long long)atomic_load(&shards[k].checkpoint_frames_left);
+    }
+    metrics_publish_ull("checkpoint/wal_frames", wal_frames);
+    metrics_publish_ull("checkpoint/frames_left", frames_left);
+    metrics_publish_ull("rows/inserted", atomic_load(&metrics.rows_inserted));
+    metrics_publish_ull("rows/deleted", atomic_load(&metrics.rows_deleted));
+    metrics_publish_ull("rows/unchanged", atomic_load(&metrics.rows_unchanged));
+    metrics_publish_ull("errors/insert", atomic_load(&metrics.insert_errors));
+    metrics_publish_ull("errors/delete", atomic_load(&metrics.delete_errors));
+    metrics_publish_ull("errors/commit", atomic_load(&metrics.commit_errors));
+    metrics_publish_ull("retention/deleted", atomic_load(&metrics.retention_deleted));
+    metrics_publish_ull("retention/archived", atomic_load(&metrics.retention_archived));
+    metrics_publish_ull("retention/time_ms", atomic_load(&metrics.retention_us) / 1000);
+    metrics_publish_ull("retention/partitions_dropped", atomic_load(&metrics.partitions_dropped));
+}
+
+static int on_tick_callback(int event, void *event_data, void *userdata) {
+    UNUSED(event);
+    UNUSED(event_data);
+    UNUSED(userdata);
+    
+    time_t now = time(NULL);
+    if (metrics_interval_sec > 0 && now - metrics.last_publish >= metrics_interval_sec) {
+        publish_metrics(now);
+    }
+    if (history_enabled) {
+        history_publish();
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+static int on_message_callback(int event, void *event_data, void *userdata) {
+	struct mosquitto_evt_message *ed = event_data;
+
+	UNUSED(event);
+	UNUSED(userdata);
+
+	char ulid[27];
+    
+    // History requests are answered, not stored
+    if (history_enabled && strncmp(ed->topic, HISTORY_PREFIX, sizeof(HISTORY_PREFIX) - 1) == 0) {
+        history_request_received(ed);
+        return MOSQ_ERR_SUCCESS;
+    }
+    
+    ulid_generate(ulid_thread_generator(), ulid);
+
+    // Check if topic should be excluded from persistence
+    if (is_topic_excluded(ed->topic)) {
+        LOG_DEBUG("Excluded topic from persistence: %s", ed->topic);
+        // Still add ULID property but don't store in database
+        return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
+    }
+
+    // Check if this is a delete operation (empty retained message)
+    if (ed->retain && ed->payloadlen == 0) {
+        // Try to extract ULID from incoming message properties
+        char target_buf[27];
+        char *target_ulid = NULL;
+        struct user_property up;
+        
+        // Iterate through user properties to find "ulid"
+        for (const mosquitto_property *prop = read_user_property(ed->properties, &up, false);
+             prop != NULL;
+             prop = read_user_property(prop, &up, true)) {
+            if (up.name != NULL && up.value != NULL &&
+                up.name_len == 4 && memcmp(up.name, "ulid", 4) == 0) {
+                // Longer values are truncated here and rejected as invalid ULIDs later
+                snprintf(target_buf, sizeof(target_buf), "%.*s", (int)up.value_len, up.value);
+                target_ulid = target_buf;
+                LOG_DEBUG("Found ULID in properties: %s", target_ulid);
+                break;  // Found what we need
+            }
+        }
+        
+        // Queue the delete operation (thread-safe, processed by batch worker)
+        struct shard *s = shard_for_topic(ed->topic);
+        if (atomic_load(&s->running)) {
+            if (target_ulid != NULL) {
+                enqueue_delete(s, ed->topic, target_ulid);
+                LOG_DEBUG("Enqueued delete: topic=%s ulid=%s", ed->topic, target_ulid);
+            } else {
+                // No ULID provided, queue fallback delete (most recent)
+                enqueue_delete(s, ed->topic, NULL);
+                LOG_DEBUG("Enqueued fallback delete: topic=%s", ed->topic);
+            }
+        }
+        
+        // Still add ULID property for consistency
+        return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
+    }
+
+    // Extract headers from message properties (excludes configured headers)
+    size_t headers_len = 0;
+    const char *headers = extract_headers(ed->properties, &headers_len);
+
+    // Enqueue message for batch insert (non-blocking)
+    struct shard *s = shard_for_topic(ed->topic);
+    if (atomic_load(&s->running)) {
+        enqueue_message(s, ulid, ed->topic, (char *)ed->payload, ed->payloadlen,
+                        headers, headers_len, ed->retain ? 1 : 0, ed->qos);
+        LOG_DEBUG("Enqueued: topic=%s retain=%d qos=%d headers=%s", 
+                  ed->topic, ed->retain, ed->qos,
+                  headers == NULL ? "(none)" : headers_format == HEADERS_FORMAT_BINARY ? "(binary)" : headers);
+    }
+
+    return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
+}
+
+// -------------------------------------------------------------------------
+// Storage layouts
+// -------------------------------------------------------------------------
+// With ulid_format=binary the raw 16 ULID bytes are the key of a WITHOUT ROWID table
+// clustered on it. With topic_dictionary the table stores topic_id, a reference into
+// the topic table. Either option moves the data out of msg into msg_bin, msg_tid or
+// msg_bin_tid, and a msg view keeps the original columns for sqld clients (plus
+// ulid_bin, the raw indexed key, for binary layouts).
+
+// Physical table name for the configured layout
+static const char *layout_table_name(void) {
+    if (ulid_format == ULID_FORMAT_BINARY) {
+        return topic_dictionary ? "msg_bin_tid" : "msg_bin";
+    }
+    return topic_dictionary ? "msg_tid" : "msg";
+}
+
+// CREATE TABLE statement for a table of the configured layout
+static void build_table_sql(char *buf, size_t size, const char *table) {
+    snprintf(buf, size,
+             "create table if not exists %s(ulid %s primary key, %s not null, payload text not null, "
+             "retain integer not null default 0, qos integer not null default 0, headers text)%s;",
+             table, ulid_format == ULID_FORMAT_BINARY ? "blob" : "text",
+             topic_dictionary ? "topic_id integer" : "topic text",
+             ulid_format == ULID_FORMAT_BINARY ? " without rowid" : "");
+}
+
+// Add the codec column to a message table that predates compression. The column is
+// appended, so existing rows read it as NULL (stored as-is) without being rewritten.
+static void ensure_codec_column(const char *table) {
+    sqlite3_stmt *stmt = NULL;
+    int present = 0;
+    if (sqlite3_prepare_v2(msg_db, "SELECT 1 FROM pragma_table_info(?1) WHERE name = 'codec'", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+        present = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    if (present) {
+        return;
+    }
+    
+    char sql[128];
+    char *err_msg = NULL;
+    snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN codec integer", table);
+    if (sqlite3_exec(msg_db, sql, NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to add codec column to %s: %s", table, err_msg);
+        sqlite3_free(err_msg);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Added codec column to %s", table);
+    }
+}
+
+// Create a message table of the configured layout with its "find latest by topic" index.
+// Returns 0 on success, -1 if the table could not be created.
+static int create_msg_table(const char *table) {
+    char stmt_sql[1024];
+    char *err_msg = NULL;
+    build_table_sql(stmt_sql, sizeof(stmt_sql), table);
+    int rc = sqlite3_exec(msg_db, stmt_sql, NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "SQL error creating table %s (rc=%d): %s", table, rc, err_msg ? err_msg : "unknown");
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    
+    // Create compound index for efficient "find latest by topic" queries (ORDER BY ulid DESC)
+    snprintf(stmt_sql, sizeof(stmt_sql), "CREATE INDEX IF NOT EXISTS idx_%s_topic_ulid ON %s(%s, ulid DESC);",
+             table, table, topic_column);
+    rc = sqlite3_exec(msg_db, stmt_sql, NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create topic_ulid index: %s", err_msg);
+        sqlite3_free(err_msg);
+    }
+    if (compression_enabled) {
+        ensure_codec_column(table);
+    }
+    return 0;
+}
+
+// Prepare the insert and delete statements that write to a message table
+static void prepare_write_statements(const char *table, sqlite3_stmt **insert, sqlite3_stmt **chunks,
+                                     sqlite3_stmt **del, sqlite3_stmt **del_latest) {
+    char stmt_sql[1024];
+    snprintf(stmt_sql, sizeof(stmt_sql),
+        "insert into %s (ulid, %s, payload, retain, qos, headers%s) values (?1, ?2, ?3, ?4, ?5, ?6%s)",
+        table, topic_column, insert_columns > 6 ? ", codec" : "", insert_columns > 6 ? ", ?7" : "");
+    if (sqlite3_prepare_v2(msg_db, stmt_sql, -1, insert, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare insert data statement: %s", sqlite3_errmsg(msg_db));
+    }
+    if (bulk_insert) {
+        prepare_insert_chunks(table, chunks);
+    }
+    
+    // Prepare delete statement for clearing retained messages
+    // Deletes by topic AND ulid when ULID is known from message properties
+    // (with plugin_opt_stats, deletes also return the bytes they free)
+    snprintf(stmt_sql, sizeof(stmt_sql), "DELETE FROM %s WHERE %s = ?1 AND ulid = ?2%s", table, topic_column,
+             stats_enabled ? " RETURNING " STATS_ROW_BYTES : "");
+    if (sqlite3_prepare_v2(msg_db, stmt_sql, -1, del, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare delete statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    // Prepare statement for fallback delete: one statement that deletes the latest
+    // message for the topic and returns its ULID (RETURNING needs SQLite 3.35)
+    snprintf(stmt_sql, sizeof(stmt_sql),
+        "DELETE FROM %s WHERE %s = ?1 AND ulid = (SELECT ulid FROM %s WHERE %s = ?1 ORDER BY ulid DESC LIMIT 1) "
+        "RETURNING ulid%s",
+        table, topic_column, table, topic_column, stats_enabled ? ", " STATS_ROW_BYTES : "");
+    if (sqlite3_prepare_v2(msg_db, stmt_sql, -1, del_latest, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare delete_latest statement: %s", sqlite3_errmsg(msg_db));
+    }
+}
+
+// SQL function ulid_text(blob): 16-byte ULID -> 26-char Crockford text
+static void sql_ulid_text(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    UNUSED(argc);
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB && sqlite3_value_bytes(argv[0]) == 16) {
+        char str[27];
+        ulid_encode(str, sqlite3_value_blob(argv[0]));
+        sqlite3_result_text(ctx, str, 26, SQLITE_TRANSIENT);
+    } else if (sqlite3_value_type(argv[0]) == SQLITE_TEXT) {
+        sqlite3_result_value(ctx, argv[0]);
+    } else {
+        sqlite3_result_null(ctx);
+    }
+}
+
+// SQL function ulid_blob(text): 26-char Crockford text -> 16-byte ULID (NULL if invalid)
+static void sql_ulid_blob(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    UNUSED(argc);
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB && sqlite3_value_bytes(argv[0]) == 16) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    unsigned char bin[16];
+    if (text != NULL && sqlite3_value_bytes(argv[0]) == 26 && ulid_decode(bin, text) == 0) {
+        sqlite3_result_blob(ctx, bin, sizeof(bin), SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_null(ctx);
+    }
+}
+
+// Build a plain-SQL expression that Crockford-encodes the 16-byte blob in column col.
+// sqld cannot call the plugin's C functions, so the msg view uses this instead.
+// Each output character is a 5-bit window over two hex digits of '0' || hex(col).
+static void build_ulid_text_expr(char *buf, size_t size, const char *col) {
+    static const char digit[] = "(instr('0123456789ABCDEF', substr('0' || hex(%s), %d, 1)) - 1)";
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int k = 0; k < 26 && len < size; k++) {
+        int bit = 2 + 5 * k;        // Bit offset of this character in the 132-bit string
+        int nibble = bit / 4;
+        int shift = 3 - bit % 4;
+        char hi[128], lo[128];
+        snprintf(hi, sizeof(hi), digit, col, nibble + 1);
+        snprintf(lo, sizeof(lo), digit, col, nibble + 2);
+        len += snprintf(buf + len, size - len,
+                        "%ssubstr('0123456789ABCDEFGHJKMNPQRSTVWXYZ', ((((%s << 4) | %s) >> %d) & 31) + 1, 1)",
+                        k > 0 ? " || " : "", hi, lo, shift);
+    }
+}
+
+// (Re)create the msg view over the layout's physical table, or over every partition
+static void create_msg_view(void) {
+    size_t expr_size = 8192;
+    char *expr = malloc(expr_size);
+    if (expr == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate msg view definition");
+        return;
+    }
+    if (ulid_format == ULID_FORMAT_BINARY) {
+        size_t len = 0;
+        build_ulid_text_expr(expr, expr_size - 32, "m.ulid");
+        len = strlen(expr);
+        snprintf(expr + len, expr_size - len, " AS ulid, m.ulid AS ulid_bin");
+    } else {
+        snprintf(expr, expr_size, "m.ulid AS ulid");
+    }
+    
+    sqlite3_str *sql = sqlite3_str_new(msg_db);
+    sqlite3_str_appendf(sql,
+             "DROP VIEW IF EXISTS msg; "
+             "CREATE VIEW msg AS SELECT %s, %s AS topic, m.payload AS payload, m.retain AS retain, "
+             "m.qos AS qos, m.headers AS headers%s FROM ",
+             expr, topic_dictionary ? "t.name" : "m.topic", compression_enabled ? ", m.codec AS codec" : "");
+    if (partition_mode != PARTITION_NONE) {
+        // The layout conversions are applied once, outside the UNION ALL, so the view
+        // definition grows by one short SELECT per partition
+        sqlite3_str_appendall(sql, "(");
+        for (int i = 0; i < partition_count; i++) {
+            sqlite3_str_appendf(sql, "%sSELECT ulid, %s, payload, retain, qos, headers%s FROM %s",
+                                i > 0 ? " UNION ALL " : "", topic_column,
+                                compression_enabled ? ", codec" : "", partitions[i]->name);
+        }
+        sqlite3_str_appendall(sql, ") m");
+    } else {
+        sqlite3_str_appendf(sql, "%s m", msg_table);
     }
+    sqlite3_str_appendf(sql, "%s;", topic_dictionary ? " JOIN topic t ON t.id = m.topic_id" : "");
+    free(expr);
     
-    // Commit transaction
-    rc = sqlite3_exec(msg_db, "COMMIT", NULL, NULL, &err_msg);
-    if (rc != SQLITE_OK) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to commit transaction: %s", err_msg);
+    char *view_sql = sqlite3_str_finish(sql);
+    char *err_msg = NULL;
+    if (view_sql == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate msg view definition");
+    } else if (sqlite3_exec(msg_db, view_sql, NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg view: %s", err_msg);
         sqlite3_free(err_msg);
+    } else if (partition_mode != PARTITION_NONE) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "msg view over %d partitions ensured", partition_count);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "msg view over %s ensured", msg_table);
+    }
+    sqlite3_free(view_sql);
+}
+
+// First day of the partition that holds the given day
+static int partition_start(int day) {
+    if (partition_mode == PARTITION_WEEK) {
+        // Weeks start on Monday; day 0 (1970-01-01) was a Thursday
+        return day - (day + 3) % 7;
+    }
+    return day;
+}
+
+static int ulid_day(const char *ulid) {
+    return (int)(ulid_timestamp_ms(ulid) / 86400000ULL);
+}
+
+// Index of the partition covering day (the last one starting on or before it), -1 if none
+static int partition_index(int day) {
+    int lo = 0, hi = partition_count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (partitions[mid]->day <= day) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+static void partition_finalize(struct msg_partition *p) {
+    if (active_partition == p) {
+        insert_stmt = NULL;
+        memset(insert_chunk_stmts, 0, sizeof(insert_chunk_stmts));
+        delete_stmt = NULL;
+        delete_latest_stmt = NULL;
+        active_partition = NULL;
+    }
+    sqlite3_finalize(p->insert_stmt);
+    for (int c = 0; c < INSERT_CHUNK_COUNT; c++) {
+        sqlite3_finalize(p->insert_chunk_stmts[c]);
+    }
+    sqlite3_finalize(p->delete_stmt);
+    sqlite3_finalize(p->delete_latest_stmt);
+    free(p);
+}
+
+static void partition_free_all(void) {
+    for (int i = 0; i < partition_count; i++) {
+        partition_finalize(partitions[i]);
     }
+    free(partitions);
+    partitions = NULL;
+    partition_count = 0;
+    partition_capacity = 0;
+}
+
+// Track an existing partition table. Returns the new entry or NULL on allocation failure.
+static struct msg_partition *partition_add(int day, const char *name) {
+    if (partition_count == partition_capacity) {
+        int capacity = partition_capacity ? partition_capacity * 2 : 16;
+        struct msg_partition **grown = realloc(partitions, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        partitions = grown;
+        partition_capacity = capacity;
+    }
+    struct msg_partition *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->day = day;
+    snprintf(p->name, sizeof(p->name), "%s", name);
     
-    if (insert_count > 0 || delete_count > 0) {
-        LOG_DEBUG("Batch: %d inserts, %d deletes committed", 
-                  insert_count, delete_count);
+    int pos = partition_index(day) + 1;
+    memmove(&partitions[pos + 1], &partitions[pos], (partition_count - pos) * sizeof(*partitions));
+    partitions[pos] = p;
+    partition_count++;
+    return p;
+}
+
+// Create the partition starting on day and rebuild the msg view
+static struct msg_partition *partition_create(int day) {
+    if (partition_count >= MAX_PARTITIONS) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Partition limit (%d) reached; use weekly partitions or a shorter retention",
+                            MAX_PARTITIONS);
+        return NULL;
     }
     
-    // Free batch entries
-    entry = batch_head;
-    while (entry != NULL) {
-        struct msg_entry *next = entry->next;
-        free(entry->topic);
-        free(entry->payload);
-        free(entry->headers);
-        free(entry);
-        entry = next;
+    char name[64];
+    time_t start = (time_t)day * 86400;
+    struct tm tm;
+    gmtime_r(&start, &tm);
+    snprintf(name, sizeof(name), "%s_p%04d%02d%02d", msg_table, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    if (create_msg_table(name) != 0) {
+        return NULL;
+    }
+    struct msg_partition *p = partition_add(day, name);
+    if (p != NULL) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Created partition %s", name);
+        create_msg_view();
     }
+    return p;
 }
 
-// Generate ULID prefix (first 10 chars) from timestamp in milliseconds
-// Used for time-based queries since ULIDs are lexicographically sortable by time
-static void timestamp_to_ulid_prefix(unsigned long long ts_ms, char prefix[11]) {
-    static const char set[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
-    
-    // ULID timestamp is stored in first 6 bytes (48 bits), encoded as 10 base32 chars
-    unsigned char bytes[6];
-    bytes[0] = ts_ms >> 40;
-    bytes[1] = ts_ms >> 32;
-    bytes[2] = ts_ms >> 24;
-    bytes[3] = ts_ms >> 16;
-    bytes[4] = ts_ms >> 8;
-    bytes[5] = ts_ms >> 0;
-    
-    // Encode to base32 (same as ulid_encode but only first 10 chars)
-    prefix[0] = set[bytes[0] >> 5];
-    prefix[1] = set[bytes[0] & 0x1f];
-    prefix[2] = set[bytes[1] >> 3];
-    prefix[3] = set[(bytes[1] << 2 | bytes[2] >> 6) & 0x1f];
-    prefix[4] = set[(bytes[2] >> 1) & 0x1f];
-    prefix[5] = set[(bytes[2] << 4 | bytes[3] >> 4) & 0x1f];
-    prefix[6] = set[(bytes[3] << 1 | bytes[4] >> 7) & 0x1f];
-    prefix[7] = set[(bytes[4] >> 2) & 0x1f];
-    prefix[8] = set[(bytes[4] << 3 | bytes[5] >> 5) & 0x1f];
-    prefix[9] = set[bytes[5] & 0x1f];
-    prefix[10] = '\0';
+// Point the write statement globals at a partition, preparing its statements on first use
+static void partition_activate(struct msg_partition *p) {
+    if (p == active_partition) {
+        return;
+    }
+    if (!p->prepared) {
+        prepare_write_statements(p->name, &p->insert_stmt, p->insert_chunk_stmts, &p->delete_stmt,
+                                 &p->delete_latest_stmt);
+        p->prepared = 1;
+    }
+    insert_stmt = p->insert_stmt;
+    memcpy(insert_chunk_stmts, p->insert_chunk_stmts, sizeof(insert_chunk_stmts));
+    delete_stmt = p->delete_stmt;
+    delete_latest_stmt = p->delete_latest_stmt;
+    active_partition = p;
 }
 
-// Delete messages older than retention_days
-// Uses ULID prefix comparison for efficient deletion (ULIDs are lexicographically sortable)
-static void cleanup_old_messages(void) {
-    if (retention_days <= 0 || msg_db == NULL) {
+// Activate the partition a ULID belongs to. For writes (create) that is the partition
+// of its period, created if needed; for deletes the existing partition covering it.
+// Returns 0 if a partition is active, -1 otherwise.
+static int partition_select(const char *ulid, int create) {
+    int day = ulid_day(ulid);
+    int idx = partition_index(create ? partition_start(day) : day);
+    struct msg_partition *p = idx >= 0 ? partitions[idx] : NULL;
+    if (create && (p == NULL || p->day != partition_start(day))) {
+        p = partition_create(partition_start(day));
+    }
+    if (p == NULL) {
+        return -1;
+    }
+    partition_activate(p);
+    return 0;
+}
+
+// First day of the partition whose name ends in date (YYYYMMDD), -1 if not a date
+static int partition_name_day(const char *date) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (strlen(date) != 8 || strspn(date, "0123456789") != 8 ||
+        sscanf(date, "%4d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    int day = (int)(timegm(&tm) / 86400);
+    return day < 0 ? 0 : day;
+}
+
+// Load the partition tables present in the database
+static void partition_load(void) {
+    sqlite3_stmt *stmt = NULL;
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%s_p", msg_table);
+    if (sqlite3_prepare_v2(msg_db, "SELECT name FROM sqlite_master WHERE type = 'table' AND substr(name, 1, ?2) = ?1",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to list partitions: %s", sqlite3_errmsg(msg_db));
         return;
     }
-    
+    sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, (int)strlen(prefix));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+        int day = partition_name_day(name + strlen(prefix));
+        if (day < 0) {
+            continue;
+        }
+        if (partition_add(day, name) == NULL) {
+            break;
+        }
+        if (compression_enabled) {
+            ensure_codec_column(name);
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+// Forget cached partitions and statements and reload the list from the database
+static void partition_reload(void) {
+    partition_free_all();
+    partition_load();
+}
+
+// Longest finite retention over the default and all rules, 0 if anything is kept forever
+static int collect_retention_max(const struct topic_trie_node *node, int max_days) {
+    if (node == NULL || max_days == 0) {
+        return max_days;
+    }
+    if (node->flags & TOPIC_RULE_RETENTION) {
+        if (node->retention_days == 0) {
+            return 0;
+        }
+        if (node->retention_days > max_days) {
+            max_days = node->retention_days;
+        }
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        max_days = collect_retention_max(node->children[i], max_days);
+    }
+    max_days = collect_retention_max(node->plus, max_days);
+    return collect_retention_max(node->hash, max_days);
+}
+
+// Day of the newest row in a partition, -1 if it is empty
+static long long partition_newest_day(const struct msg_partition *p) {
+    char sql[128];
+    sqlite3_stmt *stmt = NULL;
+    long long day = -1;
+    snprintf(sql, sizeof(sql), "SELECT max(ulid) FROM %s", p->name);
+    if (sqlite3_prepare_v2(msg_db, sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW &&
+        sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        char ulid[27];
+        column_ulid_text(stmt, 0, ulid);
+        day = ulid_day(ulid);
+    }
+    sqlite3_finalize(stmt);
+    return day;
+}
+
+// Create the current and the next partition ahead of time and drop partitions whose
+// rows are all older than the longest retention. Runs once per check interval unless forced.
+static void partition_maintain(int force) {
     time_t now = time(NULL);
-    
-    // Only run cleanup periodically (every RETENTION_CHECK_INTERVAL_SEC)
-    if (now - last_retention_check < RETENTION_CHECK_INTERVAL_SEC) {
+    if (partition_mode == PARTITION_NONE || msg_db == NULL ||
+        (!force && now - last_partition_check < PARTITION_CHECK_INTERVAL_SEC)) {
         return;
     }
-    last_retention_check = now;
-    
-    // Calculate cutoff timestamp in milliseconds
-    unsigned long long cutoff_ms = ((unsigned long long)now - (retention_days * 24 * 60 * 60)) * 1000ULL;
+    last_partition_check = now;
     
-    // Generate ULID prefix for cutoff time
-    char cutoff_prefix[11];
-    timestamp_to_ulid_prefix(cutoff_ms, cutoff_prefix);
+    int today = partition_start((int)(now / 86400));
+    int next = partition_start(today + (partition_mode == PARTITION_WEEK ? 7 : 1));
+    int days[2] = { today, next };
+    for (int i = 0; i < 2; i++) {
+        int idx = partition_index(days[i]);
+        if (idx < 0 || partitions[idx]->day != days[i]) {
+            partition_create(days[i]);
+        }
+    }
     
-    // Use prepared statement for safe deletion
-    if (retention_delete_stmt != NULL) {
-        sqlite3_bind_text(retention_delete_stmt, 1, cutoff_prefix, -1, SQLITE_STATIC);
-        int rc = sqlite3_step(retention_delete_stmt);
-        if (rc != SQLITE_DONE) {
-            mosquitto_log_printf(MOSQ_LOG_ERR, "Retention cleanup failed: %s", sqlite3_errmsg(msg_db));
-        } else {
-            int deleted = sqlite3_changes(msg_db);
-            if (deleted > 0) {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Retention cleanup: deleted %d messages older than %d days", 
-                                    deleted, retention_days);
+    int keep_days = collect_retention_max(retention_rules, retention_days);
+    if (keep_days <= 0) {
+        return;
+    }
+    // A partition ends where the next one starts, so it expires once that start is past the
+    // cutoff. The adopted unpartitioned table (day 0) can hold rows of any age and expires
+    // when its newest row does.
+    long long cutoff_day = (long long)now / 86400 - keep_days;
+    int dropped = 0;
+    int i = 0;
+    while (i + 1 < partition_count && partitions[i + 1]->day <= cutoff_day) {
+        struct msg_partition *p = partitions[i];
+        if (p->day == 0 && partition_newest_day(p) > cutoff_day) {
+            i++;
+            continue;
+        }
+        if (archive_path != NULL) {
+            // Dropped once every row is archived; the copy goes on in the next worker cycles
+            int archived = archive_partition(p);
+            if (archived <= 0) {
+                if (archived == 0) {
+                    last_partition_check = 0;
+                }
+                break;
+            }
+        }
+        char sql[160];
+        char *err_msg = NULL;
+        int transaction = stats_upsert_stmt != NULL || fields_insert_stmt != NULL;
+        int rc = SQLITE_OK;
+        if (transaction) {
+            // Count the partition's rows out of msg_stats, and delete their extracted
+            // fields, in the transaction that drops it
+            sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+            if (stats_upsert_stmt != NULL) {
+                stats_scan(p->name, -1);
             }
+            if (fields_insert_stmt != NULL) {
+                snprintf(sql, sizeof(sql), "DELETE FROM msg_fields WHERE ulid IN (SELECT %s FROM %s)",
+                         ulid_format == ULID_FORMAT_BINARY ? "ulid_text(ulid)" : "ulid", p->name);
+                rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
+            }
+        }
+        if (rc == SQLITE_OK) {
+            snprintf(sql, sizeof(sql), "DROP TABLE IF EXISTS %s", p->name);
+            rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
+        }
+        if (rc == SQLITE_OK && transaction) {
+            stats_write();
+            rc = sqlite3_exec(msg_db, "COMMIT", NULL, 0, &err_msg);
+        }
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to drop partition %s: %s", p->name, err_msg);
+            sqlite3_free(err_msg);
+            if (transaction) {
+                sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+                stats_reset();
+            }
+            break;
         }
-        sqlite3_reset(retention_delete_stmt);
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Retention: %s partition %s (older than %d days)",
+                            archive_path != NULL ? "archived and dropped" : "dropped", p->name, keep_days);
+        partition_finalize(p);
+        memmove(&partitions[i], &partitions[i + 1], (partition_count - i - 1) * sizeof(*partitions));
+        partition_count--;
+        dropped++;
+        atomic_fetch_add_explicit(&metrics.partitions_dropped, 1, memory_order_relaxed);
+    }
+    if (dropped > 0) {
+        create_msg_view();
+    }
+    if (last_partition_check != 0) {
+        archive_detach();
     }
 }
 
-// Background worker thread for batch processing
-static void *batch_worker(void *arg) {
-    UNUSED(arg);
-    
-    struct timespec timeout;
-    
-    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread started");
-    
-    while (atomic_load(&batch_thread_running)) {
-        pthread_mutex_lock(&queue_mutex);
-        
-        // Wait for either: queue size threshold or timeout
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_nsec += flush_interval_ms * 1000000L;
-        if (timeout.tv_nsec >= 1000000000L) {
-            timeout.tv_sec++;
-            timeout.tv_nsec -= 1000000000L;
-        }
-        
-        // Wait with timeout - will wake up on signal or timeout
-        while (msg_queue_size < batch_size && atomic_load(&batch_thread_running)) {
-            int rc = pthread_cond_timedwait(&queue_cond, &queue_mutex, &timeout);
-            if (rc == ETIMEDOUT) {
-                break;  // Timeout - flush whatever we have
-            }
+// Set up partitioned storage. An existing unpartitioned table of the layout (or the
+// original msg table) is kept, renamed as the oldest partition, so its rows stay visible
+// and expire with retention like any other partition.
+static void partition_init(void) {
+    const char *legacy[2] = { msg_table, "msg" };
+    for (int i = 0; i < 2; i++) {
+        sqlite3_stmt *stmt = NULL;
+        int is_table = 0;
+        if (sqlite3_prepare_v2(msg_db, "SELECT 1 FROM sqlite_master WHERE name = ?1 AND type = 'table'",
+                               -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, legacy[i], -1, SQLITE_STATIC);
+            is_table = sqlite3_step(stmt) == SQLITE_ROW;
+            sqlite3_finalize(stmt);
         }
-        
-        pthread_mutex_unlock(&queue_mutex);
-        
-        // Flush accumulated messages
-        if (atomic_load(&batch_thread_running) || msg_queue_size > 0) {
-            flush_batch();
+        if (!is_table || (i == 1 && strcmp(msg_table, "msg") != 0)) {
+            // An original-layout msg table next to a different layout is init_layout's job
+            continue;
         }
-        
-        // Periodically cleanup old messages (if retention is enabled)
-        if (atomic_load(&batch_thread_running)) {
-            cleanup_old_messages();
+        char sql[256];
+        char *err_msg = NULL;
+        snprintf(sql, sizeof(sql), "ALTER TABLE %s RENAME TO %s_p19700101;",
+                 legacy[i], msg_table);
+        if (sqlite3_exec(msg_db, sql, NULL, 0, &err_msg) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to adopt %s as a partition: %s", legacy[i], err_msg);
+            sqlite3_free(err_msg);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Partitioning: kept existing %s as partition %s_p19700101",
+                                legacy[i], msg_table);
         }
+        break;
     }
     
-    // Final flush on shutdown
-    flush_batch();
+    partition_load();
+    // Before the first maintenance, which may already drop partitions
+    if (stats_enabled) {
+        prepare_stats();
+    }
+    if (extract_column_count > 0) {
+        prepare_fields();
+    }
+    last_partition_check = 0;
+    partition_maintain(1);
     
-    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread stopped");
-    return NULL;
+    int keep_days = collect_retention_max(retention_rules, retention_days);
+    if (retention_rules != NULL && keep_days != retention_min_days) {
+        char keep[32];
+        snprintf(keep, sizeof(keep), keep_days > 0 ? "%d days" : "forever", keep_days);
+        mosquitto_log_printf(MOSQ_LOG_WARNING,
+            "Partitioned storage expires whole partitions: all rows are kept for the longest retention (%s), "
+            "shorter retention rules are not applied row by row", keep);
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Partitioned storage: %s partitions of %s, %d present",
+                        partition_mode == PARTITION_WEEK ? "weekly" : "daily", msg_table, partition_count);
 }
 
-// Extract user properties from message and format as semicolon-separated key=value string
-// Excludes headers in the exclude_headers list
-// Returns allocated string or NULL if no headers. Caller must free.
-// Optimized: single-pass with dynamic buffer growth
-static char *extract_headers(const mosquitto_property *properties) {
-    // If header storage is completely disabled, return NULL
-    if (headers_disabled) {
-        return NULL;
+// Copy rows from an original-layout msg table into the layout's table in ULID order,
+// one chunk per transaction, then drop the old table. Resumes from the highest key
+// already copied.
+static int migrate_msg_table(void) {
+    sqlite3_stmt *resume_stmt = NULL;
+    sqlite3_stmt *end_stmt = NULL;
+    sqlite3_stmt *topics_stmt = NULL;
+    sqlite3_stmt *copy_stmt = NULL;
+    char sql[1024];
+    char *err_msg = NULL;
+    char start[27] = "";
+    long long total = 0;
+    int chunks = 0;
+    int rc;
+    
+    build_table_sql(sql, sizeof(sql), msg_table);
+    if (sqlite3_exec(msg_db, sql, NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Migration: failed to create %s: %s", msg_table, err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    if (compression_enabled) {
+        // Compressed rows keep their codec
+        ensure_codec_column("msg");
+        ensure_codec_column(msg_table);
     }
     
-    if (properties == NULL) {
-        return NULL;
+    snprintf(sql, sizeof(sql), "SELECT ulid_text(max(ulid)) FROM %s", msg_table);
+    rc = sqlite3_prepare_v2(msg_db, sql, -1, &resume_stmt, 0);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(msg_db, "SELECT ulid FROM msg WHERE ulid > ?1 ORDER BY ulid LIMIT 1 OFFSET ?2",
+                                -1, &end_stmt, 0);
+    }
+    if (rc == SQLITE_OK && topic_dictionary) {
+        rc = sqlite3_prepare_v2(msg_db,
+            "INSERT OR IGNORE INTO topic (name) SELECT DISTINCT topic FROM msg WHERE ulid > ?1 AND ulid <= ?2",
+            -1, &topics_stmt, 0);
+    }
+    if (rc == SQLITE_OK) {
+        snprintf(sql, sizeof(sql),
+            "INSERT OR IGNORE INTO %s (ulid, %s, payload, retain, qos, headers%s) "
+            "SELECT %s, %s, payload, retain, qos, headers%s FROM msg "
+            "WHERE ulid > ?1 AND ulid <= ?2%s",
+            msg_table, topic_column, compression_enabled ? ", codec" : "",
+            ulid_format == ULID_FORMAT_BINARY ? "ulid_blob(ulid)" : "ulid",
+            topic_dictionary ? "(SELECT id FROM topic WHERE name = msg.topic)" : "topic",
+            compression_enabled ? ", codec" : "",
+            ulid_format == ULID_FORMAT_BINARY ? " AND ulid_blob(ulid) IS NOT NULL" : "");
+        rc = sqlite3_prepare_v2(msg_db, sql, -1, &copy_stmt, 0);
+    }
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Migration: failed to prepare statements: %s", sqlite3_errmsg(msg_db));
+        goto out;
     }
     
-    // Start with reasonable initial capacity
-    size_t capacity = 256;
-    size_t len = 0;
-    char *headers = malloc(capacity);
-    if (headers == NULL) {
-        return NULL;
+    if (sqlite3_step(resume_stmt) == SQLITE_ROW && sqlite3_column_type(resume_stmt, 0) == SQLITE_TEXT) {
+        snprintf(start, sizeof(start), "%s", (const char *)sqlite3_column_text(resume_stmt, 0));
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Migration: resuming after %s", start);
     }
-    headers[0] = '\0';
+    sqlite3_reset(resume_stmt);
     
-    // Single pass: build header string with dynamic buffer growth
-    const mosquitto_property *prop = properties;
-    char *prop_name = NULL;
-    char *prop_value = NULL;
-    bool skip_first = false;
-    int header_count = 0;
+    for (;;) {
+        // Find the last key of the next chunk (or the table end for the final chunk)
+        char end[27];
+        sqlite3_bind_text(end_stmt, 1, start, -1, SQLITE_STATIC);
+        sqlite3_bind_int(end_stmt, 2, MIGRATE_CHUNK_ROWS - 1);
+        if (sqlite3_step(end_stmt) == SQLITE_ROW) {
+            snprintf(end, sizeof(end), "%s", (const char *)sqlite3_column_text(end_stmt, 0));
+        } else {
+            snprintf(end, sizeof(end), "%s", "~");  // Sorts after every Crockford string
+        }
+        sqlite3_reset(end_stmt);
+        
+        sqlite3_exec(msg_db, "BEGIN", NULL, NULL, NULL);
+        rc = SQLITE_DONE;
+        if (topics_stmt != NULL) {
+            sqlite3_bind_text(topics_stmt, 1, start, -1, SQLITE_STATIC);
+            sqlite3_bind_text(topics_stmt, 2, end, -1, SQLITE_STATIC);
+            rc = sqlite3_step(topics_stmt);
+            sqlite3_reset(topics_stmt);
+        }
+        int copied = 0;
+        if (rc == SQLITE_DONE) {
+            sqlite3_bind_text(copy_stmt, 1, start, -1, SQLITE_STATIC);
+            sqlite3_bind_text(copy_stmt, 2, end, -1, SQLITE_STATIC);
+            rc = sqlite3_step(copy_stmt);
+            copied = sqlite3_changes(msg_db);
+            sqlite3_reset(copy_stmt);
+        }
+        if (rc != SQLITE_DONE || sqlite3_exec(msg_db, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Migration: copy failed after %lld rows: %s",
+                                 total, err_msg ? err_msg : sqlite3_errmsg(msg_db));
+            sqlite3_free(err_msg);
+            sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+            rc = SQLITE_ERROR;
+            goto out;
+        }
+        total += copied;
+        if (++chunks % 20 == 0) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Migration: %lld rows copied (up to %s)", total, end);
+        }
+        if (strcmp(end, "~") == 0) {
+            break;
+        }
+        memcpy(start, end, sizeof(start));
+    }
     
-    while ((prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, 
-                                                       &prop_name, &prop_value, skip_first)) != NULL) {
-        if (prop_name != NULL && prop_value != NULL && !is_header_excluded(prop_name)) {
-            size_t name_len = strlen(prop_name);
-            size_t value_len = strlen(prop_value);
-            // Need: name + '=' + value + ';' (or '\0' for last)
-            size_t needed = name_len + value_len + 2;
-            
-            // Grow buffer if needed
-            if (len + needed + 1 > capacity) {
-                capacity = (len + needed + 1) * 2;
-                char *new_headers = realloc(headers, capacity);
-                if (new_headers == NULL) {
-                    free(headers);
-                    free(prop_name);
-                    free(prop_value);
-                    return NULL;
-                }
-                headers = new_headers;
+    // All statements must be finalized before the source table can be dropped
+    sqlite3_finalize(resume_stmt);
+    sqlite3_finalize(end_stmt);
+    sqlite3_finalize(topics_stmt);
+    sqlite3_finalize(copy_stmt);
+    resume_stmt = end_stmt = topics_stmt = copy_stmt = NULL;
+    
+    rc = sqlite3_exec(msg_db, "DROP TABLE msg", NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Migration: failed to drop old msg table: %s", err_msg);
+        sqlite3_free(err_msg);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Migration complete: %lld rows copied to %s", total, msg_table);
+    }
+    
+out:
+    sqlite3_finalize(resume_stmt);
+    sqlite3_finalize(end_stmt);
+    sqlite3_finalize(topics_stmt);
+    sqlite3_finalize(copy_stmt);
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+// Check that the message tables in the database belong to the configured layout. Only
+// the conversions the plugin performs are accepted: an original msg table (migrated by
+// init_layout) and an unpartitioned table of the layout (adopted by partition_init).
+// Anything else, such as a msg view left by another layout, would hide the stored rows
+// behind a rebuilt view or leave inserts aimed at a view. Returns 0 if the layout fits.
+static int layout_check(void) {
+    static const char *bases[] = { "msg", "msg_bin", "msg_tid", "msg_bin_tid" };
+    sqlite3_stmt *stmt = NULL;
+    int partitioned = partition_mode != PARTITION_NONE;
+    int rc = 0;
+    
+    if (sqlite3_prepare_v2(msg_db, "SELECT name, type FROM sqlite_master WHERE type IN ('table', 'view') "
+                           "AND name GLOB 'msg*' ORDER BY name", -1, &stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to list message tables: %s", sqlite3_errmsg(msg_db));
+        return -1;
+    }
+    int step = SQLITE_DONE;
+    while (rc == 0 && (step = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+        const char *type = (const char *)sqlite3_column_text(stmt, 1);
+        size_t len = strlen(name);
+        if (strcmp(type, "view") == 0) {
+            // The plugin's own view, unless the configured layout writes a msg table
+            if (strcmp(name, "msg") == 0 && strcmp(msg_table, "msg") == 0 && !partitioned) {
+                mosquitto_log_printf(MOSQ_LOG_ERR,
+                    "Database has a msg view from another layout, but the configured layout stores rows in a "
+                    "msg table; restore the ulid_format, topic_dictionary and partition settings that created it");
+                rc = -1;
             }
-            
-            // Append separator if not first
-            if (header_count > 0) {
-                headers[len++] = ';';
+            continue;
+        }
+        
+        // Split off a partition suffix (_pYYYYMMDD)
+        int part = len > 10 && strncmp(name + len - 10, "_p", 2) == 0 &&
+                   partition_name_day(name + len - 8) >= 0;
+        size_t base_len = part ? len - 10 : len;
+        const char *base = NULL;
+        for (size_t k = 0; k < sizeof(bases) / sizeof(bases[0]); k++) {
+            if (strlen(bases[k]) == base_len && strncmp(name, bases[k], base_len) == 0) {
+                base = bases[k];
             }
-            
-            // Append name=value using memcpy (faster than strcat)
-            memcpy(headers + len, prop_name, name_len);
-            len += name_len;
-            headers[len++] = '=';
-            memcpy(headers + len, prop_value, value_len);
-            len += value_len;
-            headers[len] = '\0';
-            
-            header_count++;
         }
-        if (prop_name) { free(prop_name); prop_name = NULL; }
-        if (prop_value) { free(prop_value); prop_value = NULL; }
-        skip_first = true;
+        if (base == NULL) {
+            continue;   // msg_latest, msg_stats, ...
+        }
+        int fits = strcmp(base, msg_table) == 0 ? !part || partitioned : !part && strcmp(base, "msg") == 0;
+        if (!fits) {
+            mosquitto_log_printf(MOSQ_LOG_ERR,
+                "Database table %s belongs to another layout than the configured %s%s; restore the ulid_format, "
+                "topic_dictionary and partition settings that created it, or move its rows and drop it",
+                name, msg_table, partitioned ? " with partitions" : " without partitions");
+            rc = -1;
+        }
     }
+    // A listing cut short by an error must not pass for a database without foreign tables
+    if (rc == 0 && step != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to list message tables: %s", sqlite3_errmsg(msg_db));
+        rc = -1;
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+// Prepare a non-original layout: SQL helpers, topic table and one-time migration of
+// an original-layout msg table. Returns 0 if the layout can be used.
+static int init_layout(void) {
+    char *err_msg = NULL;
+    sqlite3_create_function(msg_db, "ulid_text", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_ulid_text, NULL, NULL);
+    sqlite3_create_function(msg_db, "ulid_blob", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_ulid_blob, NULL, NULL);
     
-    if (header_count == 0) {
-        free(headers);
-        return NULL;
+    if (topic_dictionary &&
+        sqlite3_exec(msg_db, "create table if not exists topic(id integer primary key, name text not null unique);",
+                     NULL, 0, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create topic table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
     }
     
-    return headers;
+    sqlite3_stmt *stmt = NULL;
+    int is_table = 0;
+    if (sqlite3_prepare_v2(msg_db, "SELECT 1 FROM sqlite_master WHERE name = 'msg' AND type = 'table'",
+                           -1, &stmt, 0) == SQLITE_OK) {
+        is_table = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    if (!is_table) {
+        return 0;
+    }
+    
+    if (!layout_migrate) {
+        mosquitto_log_printf(MOSQ_LOG_ERR,
+            "Existing msg table uses the original layout; set plugin_opt_migrate true to convert it to %s", msg_table);
+        return -1;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Migration: converting msg to %s", msg_table);
+    return migrate_msg_table();
 }
 
-static int on_message_callback(int event, void *event_data, void *userdata) {
-	struct mosquitto_evt_message *ed = event_data;
-
-	UNUSED(event);
-	UNUSED(userdata);
+// Wait until the database can be read. On a warm restart sqld may still be recovering
+// a large WAL, which can take longer than the busy timeout; the first statements would
+// then fail and the shard refuse to open. Returns the result of the last attempt.
+static int shard_wait_readable(const char *path) {
+    unsigned long long deadline = platform_utime(0) + OPEN_BUSY_TIMEOUT_MS * 1000ULL;
+    int waiting = 0;
+    int rc;
+    while ((rc = sqlite3_exec(msg_db, "SELECT count(*) FROM sqlite_master", NULL, NULL, NULL)) != SQLITE_OK &&
+           (rc & 0xff) == SQLITE_BUSY && platform_utime(0) < deadline) {
+        if (!waiting) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Database %s is busy, waiting up to %d s for recovery",
+                                path, OPEN_BUSY_TIMEOUT_MS / 1000);
+            waiting = 1;
+        }
+        sqlite3_sleep(OPEN_BUSY_RETRY_MS);
+    }
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Database %s cannot be read: %s", path, sqlite3_errmsg(msg_db));
+    } else if (waiting) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Database %s is readable", path);
+    }
+    return rc;
+}
 
-	char ulid[27];
+// Open a shard's database and allocate its worker state. Runs on the shard's batch
+// worker, so the connection, statements and buffers are that thread's own.
+static void shard_open(struct shard *s) {
+    shard_self = s;
+    memset(&retention, 0, sizeof(retention));
+    last_retention_pass = 0;
     
-    // Thread-safe ULID generation
-    pthread_mutex_lock(&ulid_mutex);
-    ulid_generate(&ulid_gen, ulid);
-    pthread_mutex_unlock(&ulid_mutex);
+    int rc = sqlite3_open(s->db_path, &msg_db);
+    if (rc) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't open database: %s\n", sqlite3_errmsg(msg_db));
+		sqlite3_close(msg_db);
+		msg_db = NULL;
+	} else {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Opened database: %s", s->db_path);
 
-    // Check if topic should be excluded from persistence
-    if (is_topic_excluded(ed->topic)) {
-        LOG_DEBUG("Excluded topic from persistence: %s", ed->topic);
-        // Still add ULID property but don't store in database
-        return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
-    }
+        // Set busy timeout to wait for locks (3 seconds)
+        sqlite3_busy_timeout(msg_db, 3000);
+        if (shard_wait_readable(s->db_path) != SQLITE_OK) {
+            sqlite3_close(msg_db);
+            msg_db = NULL;
+            s->unreadable = 1;
+            goto buffers;
+        }
 
-    // Check if this is a delete operation (empty retained message)
-    if (ed->retain && ed->payloadlen == 0) {
-        // Try to extract ULID from incoming message properties
-        char *prop_name = NULL;
-        char *prop_value = NULL;
-        char *target_ulid = NULL;
-        const mosquitto_property *prop = ed->properties;
-        bool skip_first = false;
+        // Enable WAL mode for better concurrent read/write performance
+        char *err_msg = 0;
+        rc = sqlite3_exec(msg_db, "PRAGMA journal_mode=WAL", NULL, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to enable WAL mode: %s (rc=%d)", err_msg, rc);
+            sqlite3_free(err_msg);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "SQLite WAL mode enabled");
+        }
         
-        // Iterate through user properties to find "ulid"
-        while ((prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, 
-                                                           &prop_name, &prop_value, skip_first)) != NULL) {
-            if (prop_name != NULL && strcmp(prop_name, "ulid") == 0 && prop_value != NULL) {
-                target_ulid = strdup(prop_value);
-                LOG_DEBUG("Found ULID in properties: %s", target_ulid);
+        // Managed checkpoints: the hook replaces SQLite's auto-checkpoint (which is a wal hook
+        // too), so COMMIT only records the WAL size for the checkpoint thread
+        if (checkpoint_mode == CHECKPOINT_MANAGED) {
+            sqlite3_wal_hook(msg_db, wal_commit_hook, s);
+        }
+        
+        // Set synchronous=NORMAL for better performance (safe with WAL)
+        rc = sqlite3_exec(msg_db, "PRAGMA synchronous=NORMAL", NULL, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to set synchronous=NORMAL: %s (rc=%d)", err_msg, rc);
+            sqlite3_free(err_msg);
+        }
+
+        // Non-original layouts: register helpers, migrate an old msg table if requested.
+        // The layout was chosen once for all shards; one that cannot use it does not open.
+        if (layout_check() != 0 || (strcmp(msg_table, "msg") != 0 && init_layout() != 0)) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Database %s cannot use the %s layout", s->db_path, msg_table);
+            sqlite3_close(msg_db);
+            msg_db = NULL;
+            s->layout_refused = 1;
+            goto buffers;
+        }
+
+        // decompress() is always available; with compression on, rows carry a codec column
+        compression_init();
+
+        // The single-column topic index is redundant: the compound topic_ulid index has
+        // topic as its leading column and serves the same lookups
+        rc = sqlite3_exec(msg_db, "DROP INDEX IF EXISTS idx_msg_topic;", NULL, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to drop redundant topic index: %s", err_msg);
+            sqlite3_free(err_msg);
+        }
+        
+        char stmt_sql[1024];
+        if (partition_mode != PARTITION_NONE) {
+            // Partitioned storage: partition tables are created and prepared on demand
+            partition_init();
+            if (topic_dictionary) {
+                prepare_topic_dictionary();
+            }
+        } else if (create_msg_table(msg_table) == 0) {
+            prepare_write_statements(msg_table, &insert_stmt, insert_chunk_stmts, &delete_stmt, &delete_latest_stmt);
+            
+            // Prepare statements for incremental retention cleanup: the oldest chunk of keys
+            // below a cutoff, and for retention rules a walk over the topics, each one's
+            // oldest keys below a cutoff, a delete by key and the stored topic cursor
+            snprintf(stmt_sql, sizeof(stmt_sql),
+                "DELETE FROM %s WHERE ulid IN (SELECT ulid FROM %s WHERE ulid < ?1 ORDER BY ulid LIMIT ?2)%s%s%s",
+                msg_table, msg_table, stats_enabled ? " RETURNING " : "", stats_enabled ? topic_column : "",
+                stats_enabled ? ", " STATS_ROW_BYTES : "");
+            rc = sqlite3_prepare_v2(msg_db, stmt_sql, -1, &retention_delete_stmt, 0);
+            if (rc != SQLITE_OK) {
+                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retention_delete statement: %s", sqlite3_errmsg(msg_db));
+            }
+            if (retention_rules != NULL) {
+                // The (topic, ulid) index serves both the topic walk and a topic's keys
+                if (topic_dictionary) {
+                    snprintf(stmt_sql, sizeof(stmt_sql),
+                             "SELECT name, id FROM topic WHERE name > ?1 ORDER BY name LIMIT 1");
+                } else {
+                    snprintf(stmt_sql, sizeof(stmt_sql),
+                             "SELECT topic, topic FROM %s WHERE topic > ?1 ORDER BY topic LIMIT 1", msg_table);
+                }
+                rc = sqlite3_prepare_v2(msg_db, stmt_sql, -1, &retention_topic_stmt, 0);
+                if (rc == SQLITE_OK) {
+                    snprintf(stmt_sql, sizeof(stmt_sql),
+                             "SELECT ulid FROM %s WHERE %s = ?1 AND ulid < ?2 ORDER BY ulid LIMIT ?3",
+                             msg_table, topic_column);
+                    rc = sqlite3_prepare_v2(msg_db, stmt_sql, -1, &retention_scan_stmt, 0);
+                }
+                if (rc != SQLITE_OK) {
+                    mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retention_scan statement: %s", sqlite3_errmsg(msg_db));
+                }
+                rc = sqlite3_exec(msg_db,
+                    "CREATE TABLE IF NOT EXISTS msg_retention (id INTEGER PRIMARY KEY CHECK (id = 0), topic TEXT NOT NULL)",
+                    NULL, 0, NULL);
+                if (rc == SQLITE_OK) {
+                    rc = sqlite3_prepare_v2(msg_db,
+                        "INSERT INTO msg_retention (id, topic) VALUES (0, ?1) ON CONFLICT (id) DO UPDATE SET topic = excluded.topic",
+                        -1, &retention_cursor_stmt, 0);
+                }
+                if (rc != SQLITE_OK) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to prepare msg_retention statement: %s", sqlite3_errmsg(msg_db));
+                }
+                snprintf(stmt_sql, sizeof(stmt_sql), "DELETE FROM %s WHERE ulid = ?1%s%s%s", msg_table,
+                         stats_enabled ? " RETURNING " : "", stats_enabled ? topic_column : "",
+                         stats_enabled ? ", " STATS_ROW_BYTES : "");
+                rc = sqlite3_prepare_v2(msg_db, stmt_sql, -1, &retention_row_stmt, 0);
+                if (rc != SQLITE_OK) {
+                    mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retention_row statement: %s", sqlite3_errmsg(msg_db));
+                }
             }
-            // Free the strings allocated by mosquitto_property_read_string_pair
-            if (prop_name) { free(prop_name); prop_name = NULL; }
-            if (prop_value) { free(prop_value); prop_value = NULL; }
-            
-            if (target_ulid != NULL) break;  // Found what we need
             
-            // For next iteration, skip the property we just read
-            skip_first = true;
-        }
-        
-        // Queue the delete operation (thread-safe, processed by batch worker)
-        if (atomic_load(&batch_thread_running)) {
-            if (target_ulid != NULL) {
-                enqueue_delete(ed->topic, target_ulid);
-                LOG_DEBUG("Enqueued delete: topic=%s ulid=%s", ed->topic, target_ulid);
-                free(target_ulid);
-            } else {
-                // No ULID provided, queue fallback delete (most recent)
-                enqueue_delete(ed->topic, NULL);
-                LOG_DEBUG("Enqueued fallback delete: topic=%s", ed->topic);
+            if (topic_dictionary) {
+                prepare_topic_dictionary();
+            }
+            if (strcmp(msg_table, "msg") != 0) {
+                create_msg_view();
             }
         }
-        
-        // Still add ULID property for consistency
-        return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
+        if (latest_enabled) {
+            prepare_latest();
+        }
+        if (stats_enabled && partition_mode == PARTITION_NONE) {
+            prepare_stats();
+        }
+        if (extract_column_count > 0 && partition_mode == PARTITION_NONE) {
+            prepare_fields();
+        }
+        if (rollup_rule_count > 0) {
+            prepare_rollups();
+        }
+        if (s->journal_dir != NULL) {
+            prepare_journal(s);
+        }
+	}
+
+buffers:
+    // Drain buffer and coalescing map for up to a full ring. With the journal the ring can
+    // be small, so they also hold a full journal replay batch.
+    size_t capacity = s->queue.mask + 1;
+    while (s->journal_dir != NULL && capacity < (size_t)batch_size * 10) {
+        capacity <<= 1;
+    }
+    batch_entries = malloc(capacity * sizeof(struct msg_entry *));
+    coalesce_slots = malloc(capacity * 2 * sizeof(struct coalesce_slot));
+    coalesce_prev = malloc(capacity * sizeof(int));
+    if (latest_enabled) {
+        latest_entries = malloc(capacity * sizeof(struct msg_entry *));
     }
+    if (batch_entries == NULL || coalesce_slots == NULL || coalesce_prev == NULL || (latest_enabled && latest_entries == NULL)) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate batch buffers%s (%zu entries)", shard_label(), capacity);
+        shard_close();
+        return;
+    }
+    batch_capacity = capacity;
+    batch_controller_init();
+}
 
-    // Extract headers from message properties (excludes configured headers)
-    char *headers = extract_headers(ed->properties);
+// Release what shard_open set up on this thread
+static void shard_close(void) {
+    // Partition statements are owned by their partitions; this also clears the globals
+    partition_free_all();
 
-    // Enqueue message for batch insert (non-blocking)
-    if (atomic_load(&batch_thread_running)) {
-        enqueue_message(ulid, ed->topic, (char *)ed->payload, ed->payloadlen,
-                        headers, ed->retain ? 1 : 0, ed->qos);
-        LOG_DEBUG("Enqueued: topic=%s retain=%d qos=%d headers=%s", 
-                  ed->topic, ed->retain, ed->qos, headers ? headers : "(none)");
+	if (insert_stmt != NULL) {
+		sqlite3_finalize(insert_stmt);
+		insert_stmt = NULL;
+	}
+    for (int c = 0; c < INSERT_CHUNK_COUNT; c++) {
+        sqlite3_finalize(insert_chunk_stmts[c]);
+        insert_chunk_stmts[c] = NULL;
     }
 
-    free(headers);
+    if (delete_stmt != NULL) {
+        sqlite3_finalize(delete_stmt);
+        delete_stmt = NULL;
+    }
+    
+    if (delete_latest_stmt != NULL) {
+        sqlite3_finalize(delete_latest_stmt);
+        delete_latest_stmt = NULL;
+    }
+    
+    if (retention_delete_stmt != NULL) {
+        sqlite3_finalize(retention_delete_stmt);
+        retention_delete_stmt = NULL;
+    }
+    
+    if (retention_scan_stmt != NULL) {
+        sqlite3_finalize(retention_scan_stmt);
+        retention_scan_stmt = NULL;
+    }
+    sqlite3_finalize(retention_topic_stmt);
+    sqlite3_finalize(retention_cursor_stmt);
+    retention_topic_stmt = retention_cursor_stmt = NULL;
+    free(retention.topic);
+    retention.topic = NULL;
+    
+    if (retention_row_stmt != NULL) {
+        sqlite3_finalize(retention_row_stmt);
+        retention_row_stmt = NULL;
+    }
+    sqlite3_finalize(archive_oldest_stmt);
+    archive_oldest_stmt = NULL;
+    archive_detach();
+    archive_partition_day = -1;
+    
+    sqlite3_finalize(topic_find_stmt);
+    sqlite3_finalize(topic_insert_stmt);
+    topic_find_stmt = topic_insert_stmt = NULL;
+    topic_map_clear(&topic_ids);
+    sqlite3_finalize(latest_upsert_stmt);
+    sqlite3_finalize(latest_find_stmt);
+    sqlite3_finalize(latest_delete_stmt);
+    latest_upsert_stmt = latest_find_stmt = latest_delete_stmt = NULL;
+    latest_clear();
+    sqlite3_finalize(stats_upsert_stmt);
+    sqlite3_finalize(stats_empty_stmt);
+    sqlite3_finalize(stats_bounds_stmt);
+    sqlite3_finalize(stats_minute_stmt);
+    sqlite3_finalize(topic_name_stmt);
+    stats_upsert_stmt = stats_empty_stmt = stats_bounds_stmt = stats_minute_stmt = topic_name_stmt = NULL;
+    stats_clear();
+    sqlite3_finalize(journal_position_stmt);
+    journal_position_stmt = NULL;
+    fields_cleanup();
+    rollup_cleanup();
+    compression_cleanup();
 
-    return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
+	if (msg_db != NULL) {
+		sqlite3_close(msg_db);
+		msg_db = NULL;
+	}
+    
+    free(batch_entries);
+    batch_entries = NULL;
+    batch_capacity = 0;
+    free(coalesce_slots);
+    free(coalesce_prev);
+    free(latest_entries);
+    coalesce_slots = NULL;
+    coalesce_prev = NULL;
+    latest_entries = NULL;
 }
 
 int mosquitto_plugin_version(int supported_version_count, const int *supported_versions) {
@@ -1047,19 +8796,200 @@ int mosquitto_plugin_version(int supported_version_count, const int *supported_v
 	return -1;
 }
 
+// Parse a byte size with an optional K, M or G suffix (powers of 1024)
+static unsigned long long parse_byte_size(const char *str) {
+    char *end = NULL;
+    unsigned long long val = strtoull(str, &end, 10);
+    switch (end != NULL ? *end : '\0') {
+    case 'k': case 'K': return val << 10;
+    case 'm': case 'M': return val << 20;
+    case 'g': case 'G': return val << 30;
+    default: return val;
+    }
+}
+
+// Database file of shard k. Shard 0 uses db_path itself. Other shards use a sibling
+// directory when db_path is the <dir>/data layout of the mqbase images (so each shard
+// keeps its WAL files next to it), and db_path-shard<k> otherwise.
+static char *shard_db_path(int k) {
+    if (k == 0 || strcmp(db_path, ":memory:") == 0) {
+        return strdup(db_path);
+    }
+    
+    char buf[PATH_MAX];
+    const char *slash = strrchr(db_path, '/');
+    if (slash != NULL && slash > db_path && strcmp(slash + 1, "data") == 0) {
+        snprintf(buf, sizeof(buf), "%.*s-shard%d", (int)(slash - db_path), db_path, k);
+        if (mkdir(buf, 0777) != 0 && errno != EEXIST) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create shard directory %s: %s", buf, strerror(errno));
+        }
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "/data");
+    } else {
+        snprintf(buf, sizeof(buf), "%s-shard%d", db_path, k);
+    }
+    return strdup(buf);
+}
+
+// Stop the batch workers (each flushes and closes its own database) and free the shards
+static void shards_stop(void) {
+    for (int k = 0; k < shard_count && shards != NULL; k++) {
+        struct shard *s = &shards[k];
+        if (atomic_load(&s->running)) {
+            atomic_store(&s->running, 0);
+            atomic_store(&s->wakeup_pending, false);
+            queue_wakeup(s);  // Wake up the thread
+            pthread_join(s->thread, NULL);
+        }
+        
+        if (s->event_fd >= 0) {
+            close(s->event_fd);
+        }
+        if (s->spill_fd >= 0) {
+            close(s->spill_fd);
+        }
+        pthread_mutex_destroy(&s->spill_mutex);
+        free(s->spill_path);
+        if (s->journal_map != NULL) {
+            munmap(s->journal_map, s->journal_segment_bytes);
+        }
+        if (s->journal_read_fd >= 0) {
+            close(s->journal_read_fd);
+        }
+        pthread_mutex_destroy(&s->journal_mutex);
+        free(s->journal_dir);
+        free(s->wal_path);
+        free(s->db_path);
+        free(s->queue.slots);
+    }
+    free(shards);
+    shards = NULL;
+}
+
 int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, struct mosquitto_opt *opts, int opt_count) {
 	UNUSED(user_data);
 
     // Parse plugin options
     for (int i = 0; i < opt_count; i++) {
         if (strcmp(opts[i].key, "exclude_topics") == 0) {
-            parse_exclude_patterns(opts[i].value);
+            parse_topic_patterns(opts[i].value, TOPIC_RULE_EXCLUDE);
+        } else if (strcmp(opts[i].key, "include_topics") == 0) {
+            parse_topic_patterns(opts[i].value, TOPIC_RULE_INCLUDE);
         } else if (strcmp(opts[i].key, "batch_size") == 0) {
             int val = atoi(opts[i].value);
             if (val > 0 && val <= MAX_QUEUE_SIZE) {
                 batch_size = val;
                 mosquitto_log_printf(MOSQ_LOG_INFO, "Batch size set to: %d", batch_size);
             }
+        } else if (strcmp(opts[i].key, "batch_size_min") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= MAX_QUEUE_SIZE) {
+                batch_size_min = val;
+            }
+        } else if (strcmp(opts[i].key, "flush_interval_min") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= 10000) {
+                flush_interval_min_ms = val;
+            }
+        } else if (strcmp(opts[i].key, "target_latency") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= 60000) {
+                target_latency_ms = val;
+            }
+        } else if (strcmp(opts[i].key, "adaptive_batch") == 0) {
+            adaptive_batch = strcmp(opts[i].value, "false") != 0 && strcmp(opts[i].value, "0") != 0;
+        } else if (strcmp(opts[i].key, "bulk_insert") == 0) {
+            bulk_insert = strcmp(opts[i].value, "false") != 0 && strcmp(opts[i].value, "0") != 0;
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Multi-row inserts %s", bulk_insert ? "enabled" : "disabled");
+        } else if (strcmp(opts[i].key, "db_path") == 0) {
+            free(db_path);
+            db_path = strdup(opts[i].value);
+        } else if (strcmp(opts[i].key, "shards") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 1 && val <= MAX_SHARDS) {
+                shard_count = val;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "shards must be 1-%d, using %d", MAX_SHARDS, shard_count);
+            }
+        } else if (strcmp(opts[i].key, "shard_levels") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0 && val <= 32) {
+                shard_levels = val;
+            }
+        } else if (strcmp(opts[i].key, "checkpoint") == 0) {
+            if (strcmp(opts[i].value, "managed") == 0) {
+                checkpoint_mode = CHECKPOINT_MANAGED;
+            } else if (strcmp(opts[i].value, "auto") == 0) {
+                checkpoint_mode = CHECKPOINT_AUTO;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown checkpoint mode '%s', using managed", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "checkpoint_pages") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0) {
+                checkpoint_pages = val;
+            }
+        } else if (strcmp(opts[i].key, "checkpoint_interval") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= 3600000) {
+                checkpoint_interval_ms = val;
+            }
+        } else if (strcmp(opts[i].key, "checkpoint_wal_limit") == 0) {
+            unsigned long long val = parse_byte_size(opts[i].value);
+            if (val > 0) {
+                checkpoint_wal_limit = val;
+            }
+        } else if (strcmp(opts[i].key, "queue_size") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= MAX_QUEUE_SIZE) {
+                queue_limit = val;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Queue size set to: %d entries", queue_limit);
+            }
+        } else if (strcmp(opts[i].key, "queue_bytes") == 0) {
+            queue_max_bytes = (size_t)parse_byte_size(opts[i].value);
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Queue byte limit set to: %zu", queue_max_bytes);
+        } else if (strcmp(opts[i].key, "queue_policy") == 0) {
+            static const char *const policies[] = { "drop_oldest", "drop_newest", "block", "shed_qos0", "spill" };
+            int found = 0;
+            for (int p = 0; p < (int)(sizeof(policies) / sizeof(policies[0])); p++) {
+                if (strcmp(opts[i].value, policies[p]) == 0) {
+                    queue_policy = p;
+                    found = 1;
+                }
+            }
+            if (found) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Queue policy set to: %s", opts[i].value);
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown queue_policy '%s', using drop_oldest", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "queue_block_ms") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0 && val <= 10000) {
+                queue_block_ms = val;
+            }
+        } else if (strcmp(opts[i].key, "queue_qos0_watermark") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= 100) {
+                qos0_watermark = val;
+            }
+        } else if (strcmp(opts[i].key, "spill_path") == 0) {
+            free(spill_path);
+            spill_path = strdup(opts[i].value);
+        } else if (strcmp(opts[i].key, "spill_max_bytes") == 0) {
+            spill_max_bytes = parse_byte_size(opts[i].value);
+        } else if (strcmp(opts[i].key, "journal") == 0) {
+            journal_enabled = strcmp(opts[i].value, "true") == 0 || strcmp(opts[i].value, "1") == 0;
+        } else if (strcmp(opts[i].key, "journal_path") == 0) {
+            free(journal_path);
+            journal_path = strdup(opts[i].value);
+        } else if (strcmp(opts[i].key, "journal_segment_size") == 0) {
+            unsigned long long val = parse_byte_size(opts[i].value);
+            if (val >= (1ULL << 20) && val <= (1ULL << 30)) {
+                journal_segment_size = val;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring journal_segment_size '%s' (1M-1G)", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "journal_max_bytes") == 0) {
+            journal_max_bytes = parse_byte_size(opts[i].value);
         } else if (strcmp(opts[i].key, "flush_interval") == 0) {
             int val = atoi(opts[i].value);
             if (val > 0 && val <= 10000) {
@@ -1076,110 +9006,402 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, s
                     mosquitto_log_printf(MOSQ_LOG_INFO, "Data retention disabled (keeping all messages)");
                 }
             }
+        } else if (strcmp(opts[i].key, "retention_rules") == 0) {
+            parse_retention_rules(opts[i].value);
+        } else if (strcmp(opts[i].key, "extract") == 0) {
+            parse_extract_rules(opts[i].value);
+        } else if (strcmp(opts[i].key, "store_on_change") == 0) {
+            parse_change_rules(opts[i].value);
+        } else if (strcmp(opts[i].key, "rollup") == 0) {
+            parse_rollup_rules(opts[i].value);
+        } else if (strcmp(opts[i].key, "rollup_retention_1m") == 0 ||
+                   strcmp(opts[i].key, "rollup_retention_1h") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0 && val <= 36500) {
+                rollup_retention_days[strcmp(opts[i].key, "rollup_retention_1h") == 0] = val;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Invalid %s '%s', keeping rollups forever", opts[i].key, opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "retention_interval") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0) {
+                retention_interval_sec = val;
+            }
+        } else if (strcmp(opts[i].key, "retention_chunk") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= 100000) {
+                retention_chunk = val;
+            }
+        } else if (strcmp(opts[i].key, "retention_budget_ms") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= 10000) {
+                retention_budget_ms = val;
+            }
+        } else if (strcmp(opts[i].key, "archive_path") == 0) {
+            free(archive_path);
+            archive_path = opts[i].value[0] != '\0' ? strdup(opts[i].value) : NULL;
         } else if (strcmp(opts[i].key, "exclude_headers") == 0) {
             parse_exclude_headers(opts[i].value);
+        } else if (strcmp(opts[i].key, "headers_format") == 0) {
+            if (strcmp(opts[i].value, "binary") == 0) {
+                headers_format = HEADERS_FORMAT_BINARY;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Headers format set to: binary");
+            } else {
+                headers_format = HEADERS_FORMAT_TEXT;
+                if (strcmp(opts[i].value, "text") != 0) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown headers_format '%s', using text", opts[i].value);
+                }
+            }
+        } else if (strcmp(opts[i].key, "ulid_format") == 0) {
+            if (strcmp(opts[i].value, "binary") == 0) {
+                ulid_format = ULID_FORMAT_BINARY;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "ULID key format set to: binary (WITHOUT ROWID + msg view)");
+            } else if (strcmp(opts[i].value, "text") == 0) {
+                ulid_format = ULID_FORMAT_TEXT;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown ulid_format '%s', using text", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "topic_dictionary") == 0) {
+            topic_dictionary = strcmp(opts[i].value, "true") == 0 || strcmp(opts[i].value, "1") == 0;
+            if (topic_dictionary) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Topic dictionary enabled (topic ids + msg view)");
+            }
+        } else if (strcmp(opts[i].key, "latest") == 0) {
+            latest_enabled = strcmp(opts[i].value, "true") == 0 || strcmp(opts[i].value, "1") == 0;
+            if (latest_enabled) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Last-value cache enabled (msg_latest table)");
+            }
+        } else if (strcmp(opts[i].key, "stats") == 0) {
+            stats_enabled = strcmp(opts[i].value, "true") == 0 || strcmp(opts[i].value, "1") == 0;
+            if (stats_enabled) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Maintained counters enabled (msg_stats table)");
+            }
+        } else if (strcmp(opts[i].key, "stats_levels") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0 && val <= 16) {
+                stats_levels = val;
+            }
+        } else if (strcmp(opts[i].key, "history") == 0) {
+            history_enabled = strcmp(opts[i].value, "true") == 0 || strcmp(opts[i].value, "1") == 0;
+        } else if (strcmp(opts[i].key, "history_acl") == 0) {
+            parse_history_acl(opts[i].value);
+        } else if (strcmp(opts[i].key, "history_max_limit") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0 && val <= 100000) {
+                history_max_limit = val;
+            }
+        } else if (strcmp(opts[i].key, "history_rate") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0 && val <= 1000000) {
+                history_rate = val;
+            }
+        } else if (strcmp(opts[i].key, "partition") == 0) {
+            if (strcmp(opts[i].value, "day") == 0 || strcmp(opts[i].value, "daily") == 0) {
+                partition_mode = PARTITION_DAY;
+            } else if (strcmp(opts[i].value, "week") == 0 || strcmp(opts[i].value, "weekly") == 0) {
+                partition_mode = PARTITION_WEEK;
+            } else if (strcmp(opts[i].value, "none") == 0) {
+                partition_mode = PARTITION_NONE;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown partition mode '%s', using none", opts[i].value);
+                partition_mode = PARTITION_NONE;
+            }
+        } else if (strcmp(opts[i].key, "migrate") == 0 || strcmp(opts[i].key, "ulid_migrate") == 0) {
+            layout_migrate = strcmp(opts[i].value, "true") == 0 || strcmp(opts[i].value, "1") == 0;
+        } else if (strcmp(opts[i].key, "payload_format") == 0) {
+            if (strcmp(opts[i].value, "text") == 0) {
+                payload_format = PAYLOAD_FORMAT_TEXT;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Payload storage format set to: text");
+            } else if (strcmp(opts[i].value, "blob") == 0) {
+                payload_format = PAYLOAD_FORMAT_BLOB;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Payload storage format set to: blob");
+            } else if (strcmp(opts[i].value, "auto") == 0) {
+                payload_format = PAYLOAD_FORMAT_AUTO;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Payload storage format set to: auto");
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown payload_format '%s', using text", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "metrics_interval") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0 && val <= 3600) {
+                metrics_interval_sec = val;
+            }
+        } else if (strcmp(opts[i].key, "compression") == 0) {
+            if (strcmp(opts[i].value, "zstd") == 0) {
+#ifdef WITH_ZSTD
+                compression_enabled = 1;
+#else
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Payload compression requires a build with WITH_ZSTD=yes, storing payloads as-is");
+#endif
+            } else if (strcmp(opts[i].value, "none") == 0) {
+                compression_enabled = 0;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown compression '%s', using none", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "compression_level") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 1 && val <= 19) {
+                compression_level = val;
+            }
+        } else if (strcmp(opts[i].key, "compression_min_bytes") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0) {
+                compression_min_bytes = val;
+            }
+        } else if (strcmp(opts[i].key, "compression_dicts") == 0) {
+            free(compression_dict_prefixes);
+            compression_dict_prefixes = strdup(opts[i].value);
+        } else if (strcmp(opts[i].key, "compression_dict_size") == 0) {
+            int val = (int)parse_byte_size(opts[i].value);
+            if (val >= 1024 && val <= 1024 * 1024) {
+                compression_dict_size = val;
+            }
+        } else if (strcmp(opts[i].key, "compression_train_samples") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 10 && val <= 100000) {
+                compression_train_samples = val;
+            }
+        }
+    }
+    
+    if (topic_rules != NULL) {
+        // Invalidate decisions cached against a previous rule set
+        atomic_fetch_add(&topic_rules_generation, 1);
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Topic rules compiled: %d patterns", topic_rule_count);
+    }
+    
+    retention_min_days = collect_retention_min(retention_rules, retention_days);
+    if (retention_rules != NULL) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Retention rules compiled: %d patterns, default %d days, shortest %d days",
+                            retention_rule_count, retention_days, retention_min_days);
+    }
+    if (change_rule_count > 0) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Store-on-change rules compiled: %d patterns", change_rule_count);
+    }
+    if (extract_field_count > 0) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Extract rules compiled: %d fields into %d columns",
+                            extract_field_count, extract_column_count);
+    }
+    for (int level = 0; rollup_rule_count > 0 && level < ROLLUP_LEVELS; level++) {
+        if (rollup_retention_days[level] > 0 && retention_days > 0 && rollup_retention_days[level] < retention_days) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "%s is kept %d days, less than the %d days of raw messages",
+                                rollup_tables[level], rollup_retention_days[level], retention_days);
         }
     }
 
-    int rc = sqlite3_open("/mosquitto/data/dbs/default/data", &msg_db);
-    if (rc) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't open database: %s\n", sqlite3_errmsg(msg_db));
-		sqlite3_close(msg_db);
-	} else {
-        mosquitto_log_printf(MOSQ_LOG_INFO, "Opened database: /mosquitto/data/dbs/default/data");
-
-        // Set busy timeout to wait for locks (3 seconds)
-        sqlite3_busy_timeout(msg_db, 3000);
+    // Seed the broker thread's generator now rather than on the first message
+    ulid_thread_generator();
 
-        // Enable WAL mode for better concurrent read/write performance
-        char *err_msg = 0;
-        rc = sqlite3_exec(msg_db, "PRAGMA journal_mode=WAL", NULL, 0, &err_msg);
-        if (rc != SQLITE_OK) {
-            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to enable WAL mode: %s (rc=%d)", err_msg, rc);
-            sqlite3_free(err_msg);
-        } else {
-            mosquitto_log_printf(MOSQ_LOG_INFO, "SQLite WAL mode enabled");
-        }
-        
-        // Set synchronous=NORMAL for better performance (safe with WAL)
-        rc = sqlite3_exec(msg_db, "PRAGMA synchronous=NORMAL", NULL, 0, &err_msg);
-        if (rc != SQLITE_OK) {
-            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to set synchronous=NORMAL: %s (rc=%d)", err_msg, rc);
-            sqlite3_free(err_msg);
+    // Partitions are only dropped by retention, so the longest retention has to fit the
+    // view's table limit, with the current and next partition and an adopted old table
+    if (partition_mode != PARTITION_NONE) {
+        int keep_days = collect_retention_max(retention_rules, retention_days);
+        int period = partition_mode == PARTITION_WEEK ? 7 : 1;
+        if (keep_days <= 0 || keep_days / period + 4 > MAX_PARTITIONS) {
+            char keep[32];
+            snprintf(keep, sizeof(keep), keep_days <= 0 ? "forever" : "%d days", keep_days);
+            mosquitto_log_printf(MOSQ_LOG_ERR,
+                "Partitioned storage is limited to %d partitions: retention must be at most %d days, not %s; refusing to start",
+                MAX_PARTITIONS, (MAX_PARTITIONS - 4) * period, keep);
+            return MOSQ_ERR_UNKNOWN;
         }
+    }
+    
+    // Storage layout and row format, fixed before any shard opens: the workers share them
+    msg_table = layout_table_name();
+    topic_column = topic_dictionary ? "topic_id" : "topic";
+    insert_columns = compression_enabled ? 7 : 6;
 
-		const char *sql = "create table if not exists msg(ulid text primary key, topic text not null, payload text not null, retain integer not null default 0, qos integer not null default 0, headers text);";
-        err_msg = NULL;
-		rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
-		if (rc != SQLITE_OK) {
-            mosquitto_log_printf(MOSQ_LOG_ERR, "SQL error creating table (rc=%d): %s", rc, err_msg ? err_msg : "unknown");
-			sqlite3_free(err_msg);
-		} else {
-            // Create index on topic for faster topic-based queries
-            const char *idx_topic_sql = "CREATE INDEX IF NOT EXISTS idx_msg_topic ON msg(topic);";
-            rc = sqlite3_exec(msg_db, idx_topic_sql, NULL, 0, &err_msg);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create topic index: %s", err_msg);
-                sqlite3_free(err_msg);
-            } else {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Index on topic column ensured");
+    // Size the queue rings and the workers' drain buffers
+    if (batch_size > queue_limit) {
+        batch_size = queue_limit;
+    }
+    if (batch_size_min > batch_size) {
+        batch_size_min = batch_size;
+    }
+    if (flush_interval_min_ms > flush_interval_ms) {
+        flush_interval_min_ms = flush_interval_ms;
+    }
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.last_publish = time(NULL);
+    size_t ring_capacity = 1;
+    while (ring_capacity < (size_t)queue_limit) {
+        ring_capacity <<= 1;
+    }
+    if (db_path == NULL) {
+        db_path = strdup(DEFAULT_DB_PATH);
+    }
+    if (spill_path == NULL) {
+        spill_path = strdup(DEFAULT_SPILL_PATH);
+    }
+    if (journal_enabled && journal_path == NULL) {
+        journal_path = strdup(DEFAULT_JOURNAL_PATH);
+    }
+    if (journal_enabled && journal_max_bytes < 2 * journal_segment_size) {
+        // Room for the segment being read and the one being written
+        journal_max_bytes = 2 * journal_segment_size;
+    }
+    // Shared by all shards, each writing its own files
+    if (archive_path != NULL && mkdir(archive_path, 0777) != 0 && errno != EEXIST) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create archive directory %s: %s", archive_path, strerror(errno));
+    }
+    if (slab_init() != 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate entry slab free lists");
+    }
+    
+    shards = calloc((size_t)shard_count, sizeof(struct shard));
+    if (shards == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate %d shards", shard_count);
+        return MOSQ_ERR_NOMEM;
+    }
+    for (int k = 0; k < shard_count; k++) {
+        struct shard *s = &shards[k];
+        s->index = k;
+        s->event_fd = -1;
+        s->spill_fd = -1;
+        pthread_mutex_init(&s->spill_mutex, NULL);
+        s->journal_read_fd = -1;
+        pthread_mutex_init(&s->journal_mutex, NULL);
+        s->queue.slots = aligned_alloc(CACHE_LINE_SIZE, ring_capacity * sizeof(struct queue_slot));
+        if (s->queue.slots == NULL) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message queue (%zu entries)", ring_capacity);
+            shard_count = k + 1;
+            shards_stop();
+            return MOSQ_ERR_NOMEM;
+        }
+        s->queue.mask = ring_capacity - 1;
+        ring_init(&s->queue);
+        atomic_store(&s->effective_batch, batch_size);
+        s->db_path = shard_db_path(k);
+        if (s->db_path != NULL && strcmp(s->db_path, ":memory:") != 0) {
+            size_t len = strlen(s->db_path);
+            s->wal_path = malloc(len + 5);
+            if (s->wal_path != NULL) {
+                memcpy(s->wal_path, s->db_path, len);
+                memcpy(s->wal_path + len, "-wal", 5);
             }
-            
-            // Create compound index for efficient "find latest by topic" queries (ORDER BY ulid DESC)
-            const char *idx_topic_ulid_sql = "CREATE INDEX IF NOT EXISTS idx_msg_topic_ulid ON msg(topic, ulid DESC);";
-            rc = sqlite3_exec(msg_db, idx_topic_ulid_sql, NULL, 0, &err_msg);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create topic_ulid index: %s", err_msg);
-                sqlite3_free(err_msg);
+        }
+        
+        // Open (or pick up a leftover) spill journal
+        if (spill_path != NULL) {
+            char buf[PATH_MAX];
+            if (k > 0) {
+                snprintf(buf, sizeof(buf), "%s-shard%d", spill_path, k);
             }
-            
-    		rc = sqlite3_prepare_v2(msg_db, "insert into msg (ulid, topic, payload, retain, qos, headers) values (?1, ?2, ?3, ?4, ?5, ?6)", -1, &insert_stmt, 0);
-    		if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare insert data statement: %s", sqlite3_errmsg(msg_db));
-			}
-
-            // Prepare delete statement for clearing retained messages
-            // Deletes by topic AND ulid when ULID is known from message properties
-            rc = sqlite3_prepare_v2(msg_db, 
-                "DELETE FROM msg WHERE topic = ?1 AND ulid = ?2", 
-                -1, &delete_stmt, 0);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare delete statement: %s", sqlite3_errmsg(msg_db));
+            s->spill_path = strdup(k > 0 ? buf : spill_path);
+            if (s->spill_path != NULL) {
+                spill_open(s, queue_policy == QUEUE_POLICY_SPILL);
             }
-            
-            // Prepare statement for finding latest message ULID for fallback delete
-            rc = sqlite3_prepare_v2(msg_db, 
-                "SELECT ulid FROM msg WHERE topic = ?1 ORDER BY ulid DESC LIMIT 1", 
-                -1, &find_latest_stmt, 0);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare find_latest statement: %s", sqlite3_errmsg(msg_db));
+        }
+        
+        // Open the ingest journal, picking up segments left by the previous run
+        if (journal_enabled) {
+            char buf[PATH_MAX];
+            if (k > 0) {
+                snprintf(buf, sizeof(buf), "%s-shard%d", journal_path, k);
             }
-            
-            // Prepare statement for retention cleanup (delete messages older than cutoff)
-            rc = sqlite3_prepare_v2(msg_db, 
-                "DELETE FROM msg WHERE ulid < ?1", 
-                -1, &retention_delete_stmt, 0);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retention_delete statement: %s", sqlite3_errmsg(msg_db));
+            s->journal_dir = strdup(k > 0 ? buf : journal_path);
+            if (s->journal_dir != NULL) {
+                journal_open(s);
             }
-		}
-	}
-
-	if (ulid_generator_init(&ulid_gen, ULID_PARANOID) != 0) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to init ULID generator");
+        }
+        
+        // Start the shard's batch worker and let it open its database before the next one
+        s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (s->event_fd < 0) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create batch worker eventfd: %s", strerror(errno));
+        }
+        atomic_store(&s->running, 1);
+        if (pthread_create(&s->thread, NULL, batch_worker, s) != 0) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create batch worker thread for shard %d", k);
+            atomic_store(&s->running, 0);
+            continue;
+        }
+        struct timespec wait = { 0, 1000000 };
+        while (atomic_load(&s->ready) == 0) {
+            nanosleep(&wait, NULL);
+        }
+        if (s->layout_refused) {
+            // Shards already running keep writing the configured layout; a shard that
+            // cannot would silently diverge from it
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Storage layout %s cannot be used for shard %d, refusing to start",
+                                msg_table, k);
+            shard_count = k + 1;
+            shards_stop();
+            return MOSQ_ERR_UNKNOWN;
+        }
+        if (s->unreadable) {
+            // Setting up a database that another process still holds would fail statement
+            // by statement; better not to start than to run with a shard that drops writes
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Database %s of shard %d cannot be read, refusing to start",
+                                s->db_path, k);
+            shard_count = k + 1;
+            shards_stop();
+            return MOSQ_ERR_UNKNOWN;
+        }
     }
-
-    // Start batch worker thread
-    atomic_store(&batch_thread_running, 1);
-    if (pthread_create(&batch_thread, NULL, batch_worker, NULL) != 0) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create batch worker thread");
-        atomic_store(&batch_thread_running, 0);
+    if (adaptive_batch) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Batch insert enabled: adaptive size=%d-%d, interval=%d-%dms, target delay %dms",
+                            batch_size_min, batch_size, flush_interval_min_ms, flush_interval_ms, target_latency_ms);
     } else {
         mosquitto_log_printf(MOSQ_LOG_INFO, "Batch insert enabled: size=%d, interval=%dms", 
                             batch_size, flush_interval_ms);
     }
+    if (journal_enabled) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Ingest journal enabled: %s, %lluM segments, up to %lluM per shard",
+                            journal_path, journal_segment_size >> 20, journal_max_bytes >> 20);
+    }
+    if (archive_path != NULL) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Expired messages are archived to %s before retention deletes them",
+                            archive_path);
+    }
+    if (shard_count > 1) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Storage sharded over %d databases by %s", shard_count,
+                            shard_levels > 0 ? "leading topic levels" : "topic");
+    }
+    
+    // The hooks are installed by now, so the first commits already skip auto-checkpoints
+    if (checkpoint_mode == CHECKPOINT_MANAGED) {
+        checkpoint_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        atomic_store(&checkpoint_running, 1);
+        if (checkpoint_event_fd < 0 || pthread_create(&checkpoint_thread, NULL, checkpoint_worker, NULL) != 0) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to start WAL checkpoint thread, the WAL is only checkpointed at shutdown");
+            atomic_store(&checkpoint_running, 0);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "WAL checkpoints managed: PASSIVE at %d pages or every %dms, escalating above %llu bytes",
+                                checkpoint_pages, checkpoint_interval_ms, checkpoint_wal_limit);
+        }
+    }
+
+    // History replay reads the shard files from its own connections
+    if (history_enabled) {
+        for (int k = 0; k < shard_count && history_enabled; k++) {
+            if (shards[k].db_path == NULL || strcmp(shards[k].db_path, ":memory:") == 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "History replay needs an on-disk database, disabled");
+                history_enabled = 0;
+            }
+        }
+    }
+    if (history_enabled) {
+        atomic_store(&history_running, 1);
+        if (pthread_create(&history_thread, NULL, history_worker, NULL) != 0) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to start history thread, history replay disabled");
+            atomic_store(&history_running, 0);
+            history_enabled = 0;
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "History replay enabled on " HISTORY_PREFIX "#: up to %d rows per request, %d replies/s",
+                                history_max_limit, history_rate);
+            if (history_acl_count == 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "History replay has no plugin_opt_history_acl grants, every request is refused");
+            }
+        }
+    }
 
 	mosq_pid = identifier;
+    if ((metrics_interval_sec > 0 || history_enabled) &&
+        mosquitto_callback_register(mosq_pid, MOSQ_EVT_TICK, on_tick_callback, NULL, NULL) != MOSQ_ERR_SUCCESS) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to register tick callback, metrics and history replies will not be published");
+    }
 	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_MESSAGE, on_message_callback, NULL, NULL);
 }
 
@@ -1188,36 +9410,41 @@ int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *opts, int op
 	UNUSED(opts);
 	UNUSED(opt_count);
 
-    // Stop batch worker thread
-    if (atomic_load(&batch_thread_running)) {
-        atomic_store(&batch_thread_running, 0);
-        pthread_cond_signal(&queue_cond);  // Wake up the thread
-        pthread_join(batch_thread, NULL);
+    // Stop the checkpoint thread first; the writers' last close then checkpoints the WAL
+    if (atomic_load(&checkpoint_running)) {
+        atomic_store(&checkpoint_running, 0);
+        uint64_t one = 1;
+        if (write(checkpoint_event_fd, &one, sizeof(one)) < 0) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Checkpoint eventfd write failed: %s", strerror(errno));
+        }
+        pthread_join(checkpoint_thread, NULL);
+    }
+    history_stop();
+    shards_stop();
+    if (checkpoint_event_fd >= 0) {
+        close(checkpoint_event_fd);
+        checkpoint_event_fd = -1;
     }
+    free(spill_path);
+    spill_path = NULL;
+    free(journal_path);
+    journal_path = NULL;
+    free(archive_path);
+    archive_path = NULL;
+    slab_cleanup();
+    free(compression_dict_prefixes);
+    compression_dict_prefixes = NULL;
 
     // Free exclusion patterns
-    free_exclude_patterns();
+    free_topic_rules();
     free_exclude_headers();
-
-	if (insert_stmt != NULL) {
-		sqlite3_finalize(insert_stmt);
-	}
-
-    if (delete_stmt != NULL) {
-        sqlite3_finalize(delete_stmt);
-    }
-    
-    if (find_latest_stmt != NULL) {
-        sqlite3_finalize(find_latest_stmt);
-    }
+    free_history_acl();
     
-    if (retention_delete_stmt != NULL) {
-        sqlite3_finalize(retention_delete_stmt);
-    }
-
-	if (msg_db != NULL) {
-		sqlite3_close(msg_db);
-	}
+    free(db_path);
+    db_path = NULL;
 
+    if (metrics_interval_sec > 0 || history_enabled) {
+        mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_TICK, on_tick_callback, NULL);
+    }
 	return mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_MESSAGE, on_message_callback, NULL);
 }